@@ -0,0 +1,338 @@
+-- Buffers and cursors over the amf_codec core for hot loops.
+--
+-- On LuaJIT the methods call the flat ABI of src/amf_ffi.h through the ffi,
+-- which compiles into the trace instead of leaving it for a C function. On
+-- plain Lua they are Lua over amf_codec with the same results. Whole values
+-- still go through amf_codec.encode and decode, as they are Lua tables.
+--
+--   local amf_ffi = require 'amf_ffi'
+--   local b = amf_ffi.buffer()
+--   b:write_uchar(3); b:write_str('id'); b:encode(0, {1, 2})
+--   local c = amf_ffi.cursor(b:raw_string())
+--   c:read_uchar(), c:read_str(), c:decode(0)
+
+local amf = require 'amf_codec'
+
+local M = {}
+
+local has_ffi, ffi = pcall(require, 'ffi')
+
+local function encode_value(ver, v)
+    local s, err = amf.encode(ver, v)
+    if s == nil then
+        error(err or 'encode failed', 3)
+    end
+    return s
+end
+
+if has_ffi then
+    ffi.cdef[[
+    typedef struct amf_buf {
+        char *b;
+        size_t len, free;
+        void *(*alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
+    } amf_buf;
+
+    typedef struct amf_cursor {
+        const char *p;
+        size_t left;
+        int err;
+        const char *err_msg;
+        const char *base;
+        void *trace;
+        const void *limits;
+        uint32_t depth;
+        size_t elements, alloc;
+    } amf_cursor;
+
+    size_t      amf_ffi_cursor_size(void);
+
+    amf_buf    *amf_ffi_buf_new(void);
+    void        amf_ffi_buf_free(amf_buf *b);
+    void        amf_ffi_buf_reset(amf_buf *b);
+    void        amf_ffi_write_u8(amf_buf *b, uint8_t u);
+    void        amf_ffi_write_u16(amf_buf *b, uint16_t u);
+    void        amf_ffi_write_u32(amf_buf *b, uint32_t u);
+    void        amf_ffi_write_u29(amf_buf *b, int32_t i);
+    void        amf_ffi_write_double(amf_buf *b, double d);
+    void        amf_ffi_write_bytes(amf_buf *b, const char *p, size_t len);
+    void        amf_ffi_write_str(amf_buf *b, const char *p, size_t len);
+
+    void        amf_ffi_cursor_init(amf_cursor *c, const char *p, size_t len);
+    uint8_t     amf_ffi_read_u8(amf_cursor *c);
+    uint16_t    amf_ffi_read_u16(amf_cursor *c);
+    uint32_t    amf_ffi_read_u32(amf_cursor *c);
+    uint32_t    amf_ffi_read_u29(amf_cursor *c);
+    double      amf_ffi_read_double(amf_cursor *c);
+    const char *amf_ffi_read_bytes(amf_cursor *c, size_t len);
+    size_t      amf_ffi_skip(amf_cursor *c, int ver);
+    ]]
+
+    -- the module amf_codec was loaded from, or the process it is linked into
+    local path = package.searchpath('amf_codec', package.cpath)
+    local C = path and ffi.load(path) or ffi.C
+
+    -- the cdef above has to follow struct amf_cursor of src/amf_cursor.h
+    assert(ffi.sizeof('amf_cursor') == tonumber(C.amf_ffi_cursor_size()),
+           'amf_cursor of amf_ffi.lua does not match the library')
+
+    local buffer = {}
+    buffer.__index = buffer
+
+    function buffer:write_uchar(n)  C.amf_ffi_write_u8(self, n) end
+    function buffer:write_ushort(n) C.amf_ffi_write_u16(self, n) end
+    function buffer:write_int32(n)  C.amf_ffi_write_u32(self, n % 4294967296) end
+    function buffer:write_u29(n)    C.amf_ffi_write_u29(self, n) end
+    function buffer:write_double(d) C.amf_ffi_write_double(self, d) end
+    function buffer:write_str(s)    C.amf_ffi_write_str(self, s, #s) end
+    function buffer:write_raw(s)    C.amf_ffi_write_bytes(self, s, #s) end
+
+    function buffer:encode(ver, v)
+        local s = encode_value(ver, v)
+        C.amf_ffi_write_bytes(self, s, #s)
+    end
+
+    -- the fields of the struct come before its methods, hence length
+    function buffer:length()     return tonumber(self.len) end
+    function buffer:reset()      C.amf_ffi_buf_reset(self) end
+    function buffer:raw_string() return self.len > 0 and ffi.string(self.b, self.len) or '' end
+
+    ffi.metatype('amf_buf', buffer)
+
+    function M.buffer()
+        return ffi.gc(C.amf_ffi_buf_new(), C.amf_ffi_buf_free)
+    end
+
+    -- the cursor keeps the string it reads alive
+    local cursor = {}
+    cursor.__index = cursor
+
+    local function checked(self, v)
+        if self.c.err ~= 0 then
+            return nil, ffi.string(self.c.err_msg)
+        end
+        return v
+    end
+
+    function cursor:read_uchar()  return checked(self, C.amf_ffi_read_u8(self.c)) end
+    function cursor:read_ushort() return checked(self, C.amf_ffi_read_u16(self.c)) end
+    function cursor:read_uint32() return checked(self, tonumber(C.amf_ffi_read_u32(self.c))) end
+    function cursor:read_u29()    return checked(self, tonumber(C.amf_ffi_read_u29(self.c))) end
+    function cursor:read_double() return checked(self, C.amf_ffi_read_double(self.c)) end
+
+    function cursor:read_int32()
+        return checked(self, tonumber(ffi.cast('int32_t', C.amf_ffi_read_u32(self.c))))
+    end
+
+    function cursor:read_bytes(n)
+        local p = C.amf_ffi_read_bytes(self.c, n)
+        return checked(self, p ~= nil and ffi.string(p, n))
+    end
+
+    function cursor:read_str()
+        local n = C.amf_ffi_read_u16(self.c)
+        local p = C.amf_ffi_read_bytes(self.c, n)
+        return checked(self, p ~= nil and ffi.string(p, n))
+    end
+
+    function cursor:skip(ver)
+        return checked(self, tonumber(C.amf_ffi_skip(self.c, ver)))
+    end
+
+    function cursor:pos()  return tonumber(self.c.p - self.c.base) end
+    function cursor:left() return tonumber(self.c.left) end
+
+    function cursor:decode(ver)
+        if self.c.err ~= 0 then return checked(self) end
+        local v, err, pos = amf.decode(ver, self.s, self:pos())
+        if err then
+            return nil, err
+        end
+        self.c.p = self.c.base + pos
+        self.c.left = #self.s - pos
+        return v
+    end
+
+    function M.cursor(s, pos)
+        pos = pos or 0
+        assert(pos >= 0 and pos <= #s, 'position out of range')
+        local self = setmetatable({s = s, c = ffi.new('amf_cursor')}, cursor)
+        C.amf_ffi_cursor_init(self.c, s, #s)
+        self.c.p = self.c.p + pos
+        self.c.left = self.c.left - pos
+        return self
+    end
+
+    M.ffi = true
+
+    return M
+end
+
+local char, byte, floor = string.char, string.byte, math.floor
+
+local buffer = {}
+buffer.__index = buffer
+
+local function put(self, s)
+    self.n = self.n + 1
+    self[self.n] = s
+    self.size = self.size + #s
+end
+
+function buffer:write_uchar(n)  put(self, char(n % 256)) end
+function buffer:write_ushort(n) put(self, char(floor(n / 256) % 256, n % 256)) end
+function buffer:write_double(d) put(self, encode_value(0, d):sub(2)) end
+function buffer:write_str(s)    self:write_ushort(#s); put(self, s) end
+function buffer:write_raw(s)    put(self, s) end
+function buffer:encode(ver, v)  put(self, encode_value(ver, v)) end
+
+function buffer:write_int32(n)
+    n = n % 4294967296
+    put(self, char(floor(n / 16777216), floor(n / 65536) % 256, floor(n / 256) % 256, n % 256))
+end
+
+function buffer:write_u29(n)
+    n = n % 536870912
+    if n < 128 then
+        put(self, char(n))
+    elseif n < 16384 then
+        put(self, char(128 + floor(n / 128), n % 128))
+    elseif n < 2097152 then
+        put(self, char(128 + floor(n / 16384), 128 + floor(n / 128) % 128, n % 128))
+    else
+        put(self, char(128 + floor(n / 4194304), 128 + floor(n / 32768) % 128, 128 + floor(n / 256) % 128, n % 256))
+    end
+end
+
+function buffer:length() return self.size end
+
+function buffer:reset()
+    for i = 1, self.n do
+        self[i] = nil
+    end
+    self.n, self.size = 0, 0
+end
+
+function buffer:raw_string()
+    local s = table.concat(self, '', 1, self.n)
+    self:reset()
+    put(self, s)
+    return s
+end
+
+function M.buffer()
+    return setmetatable({n = 0, size = 0}, buffer)
+end
+
+local cursor = {}
+cursor.__index = cursor
+
+-- n bytes or the eof error, which sticks like the one of the C cursor
+local function take(self, n)
+    if self.err or #self.s - self.p < n then
+        self.err = self.err or 'eof'
+        return nil
+    end
+    self.p = self.p + n
+    return self.p - n + 1
+end
+
+local function checked(self, v)
+    if self.err then
+        return nil, self.err
+    end
+    return v
+end
+
+function cursor:read_uchar()
+    local i = take(self, 1)
+    return checked(self, i and byte(self.s, i))
+end
+
+function cursor:read_ushort()
+    local i = take(self, 2)
+    if not i then return checked(self) end
+    local a, b = byte(self.s, i, i + 1)
+    return a * 256 + b
+end
+
+function cursor:read_uint32()
+    local i = take(self, 4)
+    if not i then return checked(self) end
+    local a, b, c, d = byte(self.s, i, i + 3)
+    return ((a * 256 + b) * 256 + c) * 256 + d
+end
+
+function cursor:read_int32()
+    local n, err = self:read_uint32()
+    if n and n >= 2147483648 then
+        n = n - 4294967296
+    end
+    return n, err
+end
+
+function cursor:read_u29()
+    local n = 0
+    for k = 1, 4 do
+        local b = self:read_uchar()
+        if not b then return checked(self) end
+        if k == 4 then
+            return n * 256 + b
+        end
+        n = n * 128 + b % 128
+        if b < 128 then
+            return n
+        end
+    end
+end
+
+function cursor:read_double()
+    local i = take(self, 8)
+    if not i then return checked(self) end
+    return (amf.decode(0, '\0' .. self.s:sub(i, i + 7)))
+end
+
+function cursor:read_bytes(n)
+    local i = take(self, n)
+    return checked(self, i and self.s:sub(i, i + n - 1))
+end
+
+function cursor:read_str()
+    local n = self:read_ushort()
+    if not n then return checked(self) end
+    return self:read_bytes(n)
+end
+
+function cursor:decode(ver)
+    if self.err then return checked(self) end
+    local v, err, pos = amf.decode(ver, self.s, self.p)
+    if err then
+        return nil, err
+    end
+    self.p = pos
+    return v
+end
+
+-- without a walk past values in lua the value is decoded and dropped
+function cursor:skip(ver)
+    local p = self.p
+    local _, err = self:decode(ver)
+    if err then
+        self.err = err
+        return checked(self)
+    end
+    return self.p - p
+end
+
+function cursor:pos()  return self.p end
+function cursor:left() return #self.s - self.p end
+
+function M.cursor(s, pos)
+    pos = pos or 0
+    assert(pos >= 0 and pos <= #s, 'position out of range')
+    return setmetatable({s = s, p = pos}, cursor)
+end
+
+M.ffi = false
+
+return M
@@ -0,0 +1,559 @@
+#define _POSIX_C_SOURCE 200809L
+
+/*
+ * throughput of the lua api over the fixture corpus.
+ *
+ * every file of test/fixtures/objects is run through decode, encode with
+ * and without references, a decode + encode round trip and the
+ * transcoders to json, messagepack and the other amf version with the amf
+ * version of its name, every file of test/fixtures/request through
+ * decode_msg, encode_msg and convert_msg to amf3. with -g, the shapes of
+ * bench/gen.lua made from that seed go through the object ops too, in both
+ * amf versions. a case runs for at least -t ms, doubling its iterations
+ * until then.
+ *
+ *   amf_bench [-d fixtures] [-t ms] [-f filter] [-g seed] [-o out.json]
+ *             [-c baseline.json] [-r percent]
+ *
+ * the results are written as json, one case a line. with -c, each case is
+ * compared to the same case of an earlier output, and the exit status is 1
+ * if any of them got slower by more than -r percent (10 by default).
+ */
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_NAME_MAX      128
+#define BENCH_MAX_CASES     1024
+
+LUALIB_API int luaopen_amf_codec(lua_State *L);
+
+typedef struct bench_result {
+    char        name[BENCH_NAME_MAX];
+    uint64_t    iters;
+    size_t      bytes;
+    double      ns_per_op;
+    double      mb_per_s;
+    double      allocs_per_op;
+} bench_result;
+
+typedef struct bench {
+    const char     *dir;
+    const char     *filter;
+    uint64_t        min_ns;
+    long            seed;           /* of the generated payloads, 0 for none */
+
+    uint64_t        allocs;         /* blocks allocated by the lua state */
+
+    bench_result    results[BENCH_MAX_CASES];
+    int             nresults;
+
+    /* totals by op: a pass over its fixtures, iters counts the fixtures */
+    bench_result    totals[BENCH_MAX_CASES];
+    int             ntotals;
+} bench;
+
+/* the op functions, called as f(ver, buf, value) */
+static const char *bench_ops =
+    "local amf = ...\n"
+    "local decode, encode = amf.decode, amf.encode\n"
+    "local decode_msg, encode_msg = amf.decode_msg, amf.encode_msg\n"
+    "local to_json, to_msgpack = amf.to_json, amf.to_msgpack\n"
+    "local convert, convert_msg = amf.convert, amf.convert_msg\n"
+    "local norefs = {object_refs = false, string_refs = false}\n"
+    "return {\n"
+    "    decode = function(ver, buf) return decode(ver, buf) end,\n"
+    "    encode = function(ver, buf, v) return encode(ver, v) end,\n"
+    "    encode_norefs = function(ver, buf, v) return encode(ver, v, norefs) end,\n"
+    "    roundtrip = function(ver, buf) return encode(ver, (decode(ver, buf))) end,\n"
+    "    to_json = function(ver, buf) return to_json(ver, buf) end,\n"
+    "    to_msgpack = function(ver, buf) return to_msgpack(ver, buf) end,\n"
+    "    convert = function(ver, buf) return convert(ver, 3 - ver, buf) end,\n"
+    "    decode_msg = function(ver, buf) return decode_msg(buf) end,\n"
+    "    encode_msg = function(ver, buf, v) return encode_msg(v) end,\n"
+    "    convert_msg = function(ver, buf) return convert_msg(buf, 3) end,\n"
+    "}\n";
+
+static const char *object_ops[] = { "decode", "encode", "encode_norefs", "roundtrip", "to_json", "to_msgpack", "convert", NULL };
+static const char *request_ops[] = { "decode_msg", "encode_msg", "convert_msg", NULL };
+
+static void *
+bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    bench *b = ud;
+
+    (void)osize;
+
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    if (ptr == NULL) {
+        b->allocs++;
+    }
+
+    return realloc(ptr, nsize);
+}
+
+static uint64_t
+bench_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+    FILE   *f = fopen(path, "rb");
+    char   *data;
+    long    n;
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(n > 0 ? n : 1);
+    if (data == NULL || fread(data, 1, n, f) != (size_t)n) {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *len = n;
+
+    return data;
+}
+
+/* call the op at op_idx with the 3 arguments above the stack top n times */
+static int
+bench_run(lua_State *L, int op_idx, uint64_t n)
+{
+    int top = lua_gettop(L);
+
+    for (uint64_t i = 0; i < n; i++) {
+        lua_pushvalue(L, op_idx);
+        lua_pushvalue(L, top - 2);
+        lua_pushvalue(L, top - 1);
+        lua_pushvalue(L, top);
+
+        if (lua_pcall(L, 3, 0, 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static bench_result *
+bench_total(bench *b, const char *op)
+{
+    for (int i = 0; i < b->ntotals; i++) {
+        if (strcmp(b->totals[i].name, op) == 0) {
+            return &b->totals[i];
+        }
+    }
+
+    bench_result *t = &b->totals[b->ntotals++];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", op);
+
+    return t;
+}
+
+static void
+bench_case(lua_State *L, bench *b, int ops_idx, const char *op,
+           const char *file, size_t bytes)
+{
+    bench_result   *r;
+    uint64_t        n = 1, start, elapsed, allocs;
+    int             op_idx;
+
+    if (b->nresults == BENCH_MAX_CASES) {
+        return;
+    }
+
+    lua_getfield(L, ops_idx, op);
+    op_idx = lua_gettop(L);
+
+    /* value arguments: ver, buf and the decoded value */
+    lua_pushvalue(L, op_idx - 3);
+    lua_pushvalue(L, op_idx - 2);
+    lua_pushvalue(L, op_idx - 1);
+
+    if (bench_run(L, op_idx, 1)) {
+        fprintf(stderr, "skip %s/%s: %s\n", op, file, lua_tostring(L, -1));
+        lua_settop(L, op_idx - 1);
+        return;
+    }
+
+    for ( ;; ) {
+        lua_gc(L, LUA_GCCOLLECT, 0);
+
+        allocs = b->allocs;
+        start = bench_clock();
+        bench_run(L, op_idx, n);
+        elapsed = bench_clock() - start;
+        allocs = b->allocs - allocs;
+
+        if (elapsed >= b->min_ns) {
+            break;
+        }
+
+        n *= 2;
+    }
+
+    lua_settop(L, op_idx - 1);
+
+    r = &b->results[b->nresults++];
+    snprintf(r->name, sizeof(r->name), "%s/%s", op, file);
+    r->iters = n;
+    r->bytes = bytes;
+    r->ns_per_op = (double)elapsed / n;
+    r->mb_per_s = (double)bytes * n / 1e6 / (elapsed / 1e9);
+    r->allocs_per_op = (double)allocs / n;
+
+    bench_result *t = bench_total(b, op);
+    t->iters++;
+    t->bytes += bytes;
+    t->ns_per_op += r->ns_per_op;
+    t->allocs_per_op += r->allocs_per_op;
+    t->mb_per_s = t->bytes / t->ns_per_op * 1e3;
+}
+
+/*
+ * decode a fixture once: the fixtures the codec can not read in full are
+ * left out, the decoded value is kept for the encode ops
+ */
+static int
+bench_prepare(lua_State *L, int amf_idx, int ver, int msg, const char *data,
+              size_t len)
+{
+    lua_pushinteger(L, ver);
+    lua_pushlstring(L, data, len);
+
+    if (msg) {
+        lua_getfield(L, amf_idx, "decode_msg");
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+
+        return !lua_isnil(L, -1);
+    }
+
+    lua_getfield(L, amf_idx, "decode");
+    lua_pushinteger(L, ver);
+    lua_pushvalue(L, -3);
+    lua_call(L, 2, 3);
+
+    if (!lua_isnil(L, -2) || (size_t)lua_tointeger(L, -1) != len) {
+        lua_pop(L, 3);
+        lua_pushnil(L);
+        return 0;
+    }
+
+    lua_pop(L, 2);
+
+    return 1;
+}
+
+static int
+bench_file(const struct dirent *ent)
+{
+    return ent->d_name[0] != '.';
+}
+
+static void
+bench_dir(lua_State *L, bench *b, int amf_idx, int ops_idx, const char *sub,
+          const char **ops)
+{
+    char            path[1024];
+    struct dirent **ents;
+    int             n, msg = strcmp(sub, "request") == 0;
+
+    snprintf(path, sizeof(path), "%s/%s", b->dir, sub);
+
+    /* in name order, so that outputs line up */
+    n = scandir(path, &ents, bench_file, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "can not open %s\n", path);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *name = ents[i]->d_name;
+        size_t      len;
+        char       *data;
+        int         ver;
+
+        if (b->filter && strstr(name, b->filter) == NULL) {
+            free(ents[i]);
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s/%s", b->dir, sub, name);
+        data = read_file(path, &len);
+        if (data == NULL) {
+            fprintf(stderr, "can not read %s\n", path);
+            free(ents[i]);
+            continue;
+        }
+
+        ver = strncmp(name, "amf3", 4) == 0 ? 3 : 0;
+
+        if (bench_prepare(L, amf_idx, ver, msg, data, len)) {
+            for (const char **op = ops; *op; op++) {
+                bench_case(L, b, ops_idx, *op, name, len);
+            }
+        } else {
+            fprintf(stderr, "skip %s: not decoded in full\n", name);
+        }
+
+        lua_settop(L, ops_idx);
+        free(data);
+        free(ents[i]);
+    }
+
+    free(ents);
+}
+
+/* the generated shapes, named gen-<shape>-amf<ver> */
+static void
+bench_gen(lua_State *L, bench *b, int ops_idx, const char **ops)
+{
+    char    name[BENCH_NAME_MAX];
+    size_t  len;
+    int     gen_idx, nshapes;
+
+    lua_getglobal(L, "require");
+    lua_pushliteral(L, "bench.gen");
+    if (lua_pcall(L, 1, 1, 0)) {
+        fprintf(stderr, "can not load bench.gen: %s\n", lua_tostring(L, -1));
+        lua_settop(L, ops_idx);
+        return;
+    }
+    gen_idx = lua_gettop(L);
+
+    lua_getfield(L, gen_idx, "shapes");
+    nshapes = lua_objlen(L, -1);
+
+    for (int i = 1; i <= nshapes; i++) {
+        lua_rawgeti(L, gen_idx + 1, i);
+        const char *shape = lua_tostring(L, -1);
+
+        for (int ver = 0; ver <= 3; ver += 3) {
+            if (b->filter && strstr(shape, b->filter) == NULL) {
+                continue;
+            }
+
+            snprintf(name, sizeof(name), "gen-%s-amf%d", shape, ver);
+
+            /* ver, buf, value */
+            lua_pushinteger(L, ver);
+            lua_getfield(L, gen_idx, "payload");
+            lua_pushinteger(L, ver);
+            lua_pushvalue(L, gen_idx + 2);
+            lua_pushnumber(L, b->seed);
+            lua_call(L, 3, 2);
+            lua_tolstring(L, -2, &len);
+
+            for (const char **op = ops; *op; op++) {
+                bench_case(L, b, ops_idx, *op, name, len);
+            }
+
+            lua_settop(L, gen_idx + 2);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, ops_idx);
+}
+
+static void
+print_result(FILE *f, const bench_result *r, const char *sep)
+{
+    fprintf(f, "  {\"name\": \"%s\", \"iters\": %llu, \"bytes\": %lu, "
+            "\"ns_per_op\": %.1f, \"mb_per_s\": %.2f, \"allocs_per_op\": %.2f}%s\n",
+            r->name, (unsigned long long)r->iters, (unsigned long)r->bytes,
+            r->ns_per_op, r->mb_per_s, r->allocs_per_op, sep);
+}
+
+static void
+print_results(FILE *f, bench *b)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(f, "{\"peak_rss_kb\": %ld, \"min_ms\": %llu, \"results\": [\n",
+            ru.ru_maxrss, (unsigned long long)(b->min_ns / 1000000));
+
+    for (int i = 0; i < b->ntotals; i++) {
+        print_result(f, &b->totals[i], ",");
+    }
+
+    for (int i = 0; i < b->nresults; i++) {
+        print_result(f, &b->results[i], i + 1 < b->nresults ? "," : "");
+    }
+
+    fprintf(f, "]}\n");
+}
+
+/* ns_per_op of the case name in an earlier output, < 0 if it is not there */
+static double
+baseline_ns(const char *baseline, const char *name)
+{
+    char        key[BENCH_NAME_MAX + 16];
+    const char *p;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+    p = strstr(baseline, key);
+    if (p == NULL || (p = strstr(p, "\"ns_per_op\": ")) == NULL) {
+        return -1;
+    }
+
+    return strtod(p + sizeof("\"ns_per_op\": ") - 1, NULL);
+}
+
+static int
+compare(bench *b, const char *path, double threshold)
+{
+    size_t  len;
+    char   *baseline = read_file(path, &len);
+    int     regressed = 0;
+
+    if (baseline == NULL) {
+        fprintf(stderr, "can not read %s\n", path);
+        return 1;
+    }
+
+    char *p = realloc(baseline, len + 1);
+    if (p == NULL) {
+        free(baseline);
+        return 1;
+    }
+
+    baseline = p;
+    baseline[len] = '\0';
+
+    for (int i = 0; i < b->ntotals + b->nresults; i++) {
+        bench_result   *r = i < b->ntotals ? &b->totals[i] : &b->results[i - b->ntotals];
+        double          base = baseline_ns(baseline, r->name);
+        double          delta;
+
+        if (base <= 0) {
+            fprintf(stderr, "%-56s %12s %12.1f\n", r->name, "-", r->ns_per_op);
+            continue;
+        }
+
+        delta = (r->ns_per_op - base) * 100 / base;
+        fprintf(stderr, "%-56s %12.1f %12.1f %+7.1f%%%s\n", r->name, base,
+                r->ns_per_op, delta, delta > threshold ? "  REGRESSED" : "");
+
+        if (delta > threshold) {
+            regressed = 1;
+        }
+    }
+
+    free(baseline);
+
+    return regressed;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d fixtures] [-t ms] [-f filter] [-o out.json] "
+            "[-g seed] [-c baseline.json] [-r percent]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    static bench    b;
+    const char     *out = NULL, *baseline = NULL;
+    double          threshold = 10;
+    lua_State      *L;
+    FILE           *f = stdout;
+    int             opt, ret = 0;
+
+    b.dir = "test/fixtures";
+    b.min_ns = 50 * 1000000ULL;
+
+    while ((opt = getopt(argc, argv, "d:t:f:g:o:c:r:h")) != -1) {
+        switch (opt) {
+        case 'd': b.dir = optarg; break;
+        case 't': b.min_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+        case 'f': b.filter = optarg; break;
+        case 'g': b.seed = strtol(optarg, NULL, 10); break;
+        case 'o': out = optarg; break;
+        case 'c': baseline = optarg; break;
+        case 'r': threshold = strtod(optarg, NULL); break;
+        default:  usage(argv[0]);
+        }
+    }
+
+    L = lua_newstate(bench_alloc, &b);
+    if (L == NULL) {
+        fprintf(stderr, "can not create a lua state\n");
+        return 1;
+    }
+
+    luaL_openlibs(L);
+
+    lua_pushcfunction(L, luaopen_amf_codec);
+    lua_call(L, 0, 1);
+
+    if (luaL_loadstring(L, bench_ops)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+
+    bench_dir(L, &b, 1, 2, "objects", object_ops);
+    bench_dir(L, &b, 1, 2, "request", request_ops);
+
+    if (b.seed) {
+        bench_gen(L, &b, 2, object_ops);
+    }
+
+    if (out && (f = fopen(out, "w")) == NULL) {
+        fprintf(stderr, "can not write %s\n", out);
+        return 1;
+    }
+
+    print_results(f, &b);
+
+    if (f != stdout) {
+        fclose(f);
+    }
+
+    if (baseline) {
+        ret = compare(&b, baseline, threshold);
+    }
+
+    lua_close(L);
+
+    return ret;
+}
@@ -0,0 +1,168 @@
+--[[
+deterministic payloads for scale and worst case benchmarks.
+
+    local gen = require 'bench.gen'
+    local value = gen.value('traits', seed, 2000)
+    local buf, value = gen.payload(3, 'traits', seed, 2000)
+
+or from the shell, writing the encoded payload to stdout:
+
+    lua bench/gen.lua <shape> <ver> [seed] [size] > payload.bin
+
+the same shape, seed and size always give the same value, on any lua.
+size is the shape's own scale, see gen.sizes for the defaults:
+
+    array       an array of size numbers, integers and doubles
+    deep        size levels of nested objects, each with a small array
+    wide        one object with size keys
+    traits      an array of size objects with distinct member sets
+    strings     an array of size strings out of sqrt(size) distinct ones
+    objects     an array of size references to sqrt(size) distinct objects
+    bigstring   a single string of size bytes
+]]
+
+local M = {}
+
+M.shapes = { 'array', 'deep', 'wide', 'traits', 'strings', 'objects', 'bigstring' }
+
+M.sizes = {
+    array     = 100000,
+    deep      = 10,
+    wide      = 500,
+    traits    = 2000,
+    strings   = 10000,
+    objects   = 10000,
+    bigstring = 4 * 1024 * 1024,
+}
+
+-- park-miller minimal standard, exact in doubles
+local function rng(seed)
+    local x = seed % 2147483646 + 1
+    return function(n)
+        x = x * 16807 % 2147483647
+        return x % n
+    end
+end
+
+local letters = 'abcdefghijklmnopqrstuvwxyz0123456789'
+
+local function word(rand, len)
+    local t = {}
+    for i = 1, len do
+        local c = rand(#letters) + 1
+        t[i] = letters:sub(c, c)
+    end
+    return table.concat(t)
+end
+
+local function number(rand)
+    if rand(2) == 0 then
+        return rand(1000000) - 500000
+    end
+    return (rand(2000000) - 1000000) / 64
+end
+
+local function scalar(rand)
+    local kind = rand(4)
+    if kind == 0 then
+        return number(rand)
+    elseif kind == 1 then
+        return word(rand, 4 + rand(12))
+    elseif kind == 2 then
+        return rand(2) == 1
+    end
+    return rand(100000)
+end
+
+local build = {}
+
+function build.array(rand, n)
+    local t = {}
+    for i = 1, n do
+        t[i] = number(rand)
+    end
+    return t
+end
+
+function build.deep(rand, n)
+    local node
+    for i = n, 1, -1 do
+        node = {
+            level = i,
+            name  = word(rand, 8),
+            items = { scalar(rand), scalar(rand), scalar(rand) },
+            child = node,
+        }
+    end
+    return node
+end
+
+function build.wide(rand, n)
+    local t = {}
+    for i = 1, n do
+        t['k' .. i .. word(rand, 4)] = scalar(rand)
+    end
+    return t
+end
+
+function build.traits(rand, n)
+    local t = {}
+    for i = 1, n do
+        t[i] = { id = i, ['f' .. i] = scalar(rand), [word(rand, 6)] = scalar(rand) }
+    end
+    return t
+end
+
+function build.strings(rand, n)
+    local pool, t = {}, {}
+    for i = 1, math.max(1, math.floor(math.sqrt(n))) do
+        pool[i] = word(rand, 8 + rand(24))
+    end
+    for i = 1, n do
+        t[i] = pool[rand(#pool) + 1]
+    end
+    return t
+end
+
+function build.objects(rand, n)
+    local pool, t = {}, {}
+    for i = 1, math.max(1, math.floor(math.sqrt(n))) do
+        pool[i] = { id = i, name = word(rand, 8), value = number(rand) }
+    end
+    for i = 1, n do
+        t[i] = pool[rand(#pool) + 1]
+    end
+    return t
+end
+
+function build.bigstring(rand, n)
+    -- repeat a random block, building n random bytes one by one is slow
+    local block = word(rand, 4096)
+    return block:rep(math.floor(n / #block)) .. block:sub(1, n % #block)
+end
+
+function M.value(shape, seed, size)
+    local f = build[shape]
+    if f == nil then
+        error('unknown shape: ' .. tostring(shape))
+    end
+    return f(rng(seed or 1), size or M.sizes[shape])
+end
+
+-- the encoded payload and the value it was encoded from
+function M.payload(ver, shape, seed, size)
+    local amf = require 'amf_codec'
+    local value = M.value(shape, seed, size)
+    return amf.encode(ver, value), value
+end
+
+if arg and arg[0] and arg[0]:find('gen.lua', 1, true) then
+    local shape, ver = arg[1], tonumber(arg[2])
+    if shape == nil or (ver ~= 0 and ver ~= 3) then
+        io.stderr:write('usage: lua bench/gen.lua <shape> <0|3> [seed] [size]\n')
+        os.exit(2)
+    end
+    io.write((M.payload(ver, shape, tonumber(arg[3]), tonumber(arg[4]))))
+end
+
+return M
@@ -0,0 +1,213 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "amf_batch.h"
+#include "amf_dom.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define AMF_BATCH_MAX_THREADS   256
+
+typedef struct batch_pool batch_pool;
+
+/* lo, hi: the items still left to this worker, taken from lo, stolen from hi */
+typedef struct batch_worker {
+    pthread_mutex_t     lock;
+    size_t              lo, hi;
+
+    batch_pool         *pool;
+    int                 id;
+    pthread_t           tid;
+    int                 started;
+    size_t              failed;
+} batch_worker;
+
+struct batch_pool {
+    amf_batch_item         *items;
+    const amf_batch_opts   *opts;
+    batch_worker           *workers;
+    int                     nworkers;
+};
+
+int
+amf_batch_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n > AMF_BATCH_MAX_THREADS ? AMF_BATCH_MAX_THREADS : (int)n;
+}
+
+/*
+ * the next item of w, or the first of the upper half w stole from the
+ * next worker that has any left. a thief's range is reset to the half it
+ * stole, but stealing only moves items nobody has taken yet, so when w
+ * finds every range empty the rest is held by workers that finish it.
+ * returns 0 then.
+ */
+static int
+batch_next(batch_worker *w, size_t *i)
+{
+    batch_pool *pool = w->pool;
+    size_t      lo, hi;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->lo < w->hi) {
+        *i = w->lo++;
+        pthread_mutex_unlock(&w->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (int k = 1; k < pool->nworkers; k++) {
+        batch_worker *v = &pool->workers[(w->id + k) % pool->nworkers];
+
+        pthread_mutex_lock(&v->lock);
+        hi = v->hi;
+        lo = v->hi - (v->hi - v->lo + 1) / 2;
+        v->hi = lo;
+        pthread_mutex_unlock(&v->lock);
+
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            w->lo = lo + 1;
+            w->hi = hi;
+            pthread_mutex_unlock(&w->lock);
+
+            *i = lo;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+batch_one(batch_pool *pool, amf_doc *doc, amf_buf *buf, amf_batch_item *item)
+{
+    const amf_batch_opts   *opts = pool->opts;
+    const char             *err_msg = NULL;
+    amf_dom_msg            *m;
+    amf_dom_value          *v;
+
+    amf_buf_reset(buf);
+
+    if (opts->flags & AMF_BATCH_MSG) {
+        if ((m = amf_dom_decode_msg(doc, item->in, item->len)) == NULL) {
+            err_msg = doc->err_msg;
+        } else {
+            amf_dom_encode_msg(buf, opts->to, m, &err_msg);
+        }
+
+    } else {
+        if ((v = amf_dom_decode(doc, opts->from, item->in, item->len)) == NULL) {
+            err_msg = doc->err_msg;
+        } else {
+            amf_dom_encode(buf, opts->to, v, &err_msg);
+        }
+    }
+
+    if (err_msg == NULL && (item->out = malloc(buf->len ? buf->len : 1)) == NULL) {
+        err_msg = "out of memory";
+    }
+
+    if (err_msg) {
+        item->out = NULL;
+        item->out_len = 0;
+        item->err_msg = err_msg;
+        return;
+    }
+
+    memcpy(item->out, buf->b, buf->len);
+    item->out_len = buf->len;
+    item->err_msg = NULL;
+}
+
+static void *
+batch_work(void *arg)
+{
+    batch_worker   *w = arg;
+    amf_doc         doc;
+    amf_buf         buf;
+    size_t          i;
+
+    amf_doc_init(&doc);
+    amf_buf_init(&buf);
+
+    while (batch_next(w, &i)) {
+        batch_one(w->pool, &doc, &buf, &w->pool->items[i]);
+        w->failed += w->pool->items[i].err_msg != NULL;
+    }
+
+    amf_doc_free(&doc);
+    free(buf.b);
+
+    return NULL;
+}
+
+size_t
+amf_batch_run(amf_batch_item *items, size_t n, const amf_batch_opts *opts)
+{
+    batch_pool      pool;
+    batch_worker    one, *workers = &one;
+    size_t          failed = 0;
+    int             nworkers;
+
+    nworkers = opts->threads > 0 ? opts->threads : amf_batch_cpus();
+    if (nworkers > AMF_BATCH_MAX_THREADS) {
+        nworkers = AMF_BATCH_MAX_THREADS;
+    }
+    if ((size_t)nworkers > n) {
+        nworkers = n ? (int)n : 1;
+    }
+
+    if (nworkers > 1 && (workers = calloc(nworkers, sizeof(*workers))) == NULL) {
+        workers = &one;
+        nworkers = 1;
+    }
+
+    pool.items = items;
+    pool.opts = opts;
+    pool.workers = workers;
+    pool.nworkers = nworkers;
+
+    for (int k = 0; k < nworkers; k++) {
+        batch_worker *w = &workers[k];
+
+        pthread_mutex_init(&w->lock, NULL);
+        w->lo = n * k / nworkers;
+        w->hi = n * (k + 1) / nworkers;
+        w->pool = &pool;
+        w->id = k;
+        w->started = 0;
+        w->failed = 0;
+    }
+
+    /*
+     * the calling thread is worker 0, the items of a worker that failed
+     * to start are stolen by the others
+     */
+    for (int k = 1; k < nworkers; k++) {
+        workers[k].started = pthread_create(&workers[k].tid, NULL,
+                                            batch_work, &workers[k]) == 0;
+    }
+
+    batch_work(&workers[0]);
+
+    for (int k = 1; k < nworkers; k++) {
+        if (workers[k].started) {
+            pthread_join(workers[k].tid, NULL);
+        }
+    }
+
+    for (int k = 0; k < nworkers; k++) {
+        failed += workers[k].failed;
+        pthread_mutex_destroy(&workers[k].lock);
+    }
+
+    if (workers != &one) {
+        free(workers);
+    }
+
+    return failed;
+}
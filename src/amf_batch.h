@@ -0,0 +1,46 @@
+#ifndef AMF_BATCH_H
+
+#define AMF_BATCH_H
+
+#include <stddef.h>
+
+/*
+ * decode and re-encode many inputs on a pool of threads, without lua.
+ * each thread keeps a document arena and an output buffer for all the
+ * inputs it takes, idle threads steal from the others.
+ */
+
+/* the inputs are remoting messages, not single values */
+#define AMF_BATCH_MSG   0x01
+
+/*
+ * in, len:         the input, left alone
+ * out, out_len:    the encoded result, malloc'd for the caller to free
+ * err_msg:         NULL, or why the input failed, then out is NULL
+ */
+typedef struct amf_batch_item {
+    const char     *in;
+    size_t          len;
+
+    char           *out;
+    size_t          out_len;
+    const char     *err_msg;
+} amf_batch_item;
+
+/*
+ * threads:     0 for one per online cpu
+ * from, to:    amf versions of the values, messages only use to
+ */
+typedef struct amf_batch_opts {
+    int             threads;
+    int             from, to;
+    int             flags;
+} amf_batch_opts;
+
+/* returns the number of failed items, results are in the items */
+size_t amf_batch_run(amf_batch_item *items, size_t n, const amf_batch_opts *opts);
+
+/* the threads a run with opts->threads = 0 uses */
+int amf_batch_cpus(void);
+
+#endif /* end of include guard: AMF_BATCH_H */
@@ -1,4 +1,5 @@
 #include "amf_buf.h"
+#include "amf_stats.h"
 
 #include "endiness.h"
 
@@ -22,14 +23,21 @@ amf_buf_init(amf_buf *b)
 }
 
 void
-amf_buf_append(amf_buf *buf, const char *b, size_t len)
+amf_buf_reserve(amf_buf *buf, size_t len)
 {
     if (buf->free < len) {
         size_t nlen = buf->len + len;
         //buf->b = realloc(buf->b, nlen * 2);
         buf->b = realloc(buf->b, nlen * 2);
         buf->free = nlen;
+        amf_stats_alloc(nlen * 2);
     }
+}
+
+void
+amf_buf_append(amf_buf *buf, const char *b, size_t len)
+{
+    amf_buf_reserve(buf, len);
 
     memcpy(buf->b + buf->len, b, len);
     buf->len += len;
@@ -43,6 +51,13 @@ amf_buf_free(amf_buf *buf)
     free(buf);
 }
 
+void
+amf_buf_reset(amf_buf *buf)
+{
+    buf->free += buf->len;
+    buf->len = 0;
+}
+
 static void
 _append_be(amf_buf *buf, char *p, size_t len)
 {
@@ -72,6 +87,12 @@ void amf_buf_append_u32(amf_buf *buf, uint32_t u)
     _append_be(buf, (char *)&u, 4);
 }
 
+void amf_buf_put_u32(amf_buf *buf, size_t pos, uint32_t u)
+{
+    reverse_if_little_endian((char *)&u, 4);
+    memcpy(buf->b + pos, &u, 4);
+}
+
 void amf_buf_append_u29(amf_buf *buf, int val)
 {
     char b[4];
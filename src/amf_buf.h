@@ -18,6 +18,12 @@ typedef struct amf_buf {
 amf_buf *amf_buf_init(amf_buf *buf);
 void amf_buf_free(amf_buf *buf);
 
+/* drop the content, keeping the allocation */
+void amf_buf_reset(amf_buf *buf);
+
+/* make room for len more bytes, b may move */
+void amf_buf_reserve(amf_buf *buf, size_t len);
+
 void amf_buf_append(amf_buf *buf, const char *b, size_t len);
 void amf_buf_append_char(amf_buf *buf, char c);
 void amf_buf_append_double(amf_buf *buf, double d);
@@ -25,4 +31,7 @@ void amf_buf_append_u16(amf_buf *buf, uint16_t u);
 void amf_buf_append_u32(amf_buf *buf, uint32_t u);
 void amf_buf_append_u29(amf_buf *buf, int i);
 
+/* overwrite already appended bytes */
+void amf_buf_put_u32(amf_buf *buf, size_t pos, uint32_t u);
+
 #endif /* end of include guard: AMF_BUF_H */
@@ -1,4 +1,8 @@
 #include "amf_codec.h"
+#include "amf_flex.h"
+#include "amf_template.h"
+#include "amf_stats.h"
+#include "amf_trace.h"
 
 #include "endiness.h"
 
@@ -12,8 +16,97 @@
 
 #define abs_idx(L, i) do { if(idx < 0) idx = lua_gettop(L) + idx + 1; } while(0)
 
+#ifndef AMF_NO_TRACE
+/* whether the value at p is written as a reference */
+static int
+amf_value_is_ref(int flags, const char *p, size_t n)
+{
+    size_t i;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (!(flags & AMF_TRACE_AMF3)) {
+        return p[0] == AMF0_REFERENCE;
+    }
+
+    switch (p[0]) {
+    case AMF3_STRING:
+    case AMF3_XMLDOC:
+    case AMF3_DATE:
+    case AMF3_ARRAY:
+    case AMF3_OBJECT:
+    case AMF3_XML:
+    case AMF3_BYTEARRAY:
+        /* the reference bit is the lowest bit of the last u29 byte */
+        for (i = 1; i < n && i < 4 && (p[i] & 0x80); i++);
+        return i < n && (p[i] & 1) == 0;
+    }
+
+    return 0;
+}
+
+static void
+amf_trace_value(amf_trace *t, int flags, const char *p, size_t n, size_t offset)
+{
+    if (amf_value_is_ref(flags, p, n)) {
+        flags |= AMF_TRACE_REF;
+    }
+
+    amf_trace_record(t, flags, n ? (unsigned char)p[0] : 0, offset, n);
+}
+#else
+#define amf_trace_value(t, flags, p, n, offset) ((void)(flags), (void)(p))
+#endif
+
+/*
+ * the engines walk nested tables with a work stack of frames, one for each
+ * table being read or written, instead of recursing. the first AMF_FRAMES
+ * frames are on the c stack, more go to a userdata in the lua stack slot
+ * idx, which an error raised by lua frees as well.
+ */
+#define AMF_FRAMES 32
+
+typedef struct amf_frames {
+    void               *f;
+    uint32_t            n, cap;
+    int                 idx;
+} amf_frames;
+
+static void
+amf_frames_init(lua_State *L, amf_frames *w, void *inl)
+{
+    lua_pushnil(L);
+
+    w->f = inl;
+    w->n = 0;
+    w->cap = AMF_FRAMES;
+    w->idx = lua_gettop(L);
+}
+
+/* a new frame on top, the frames below it may have moved */
+static void *
+amf_frames_push(lua_State *L, amf_frames *w, size_t size)
+{
+    void *f;
+
+    if (w->n == w->cap) {
+        f = lua_newuserdata(L, 2 * (size_t)w->cap * size);
+        memcpy(f, w->f, w->n * size);
+        lua_replace(L, w->idx);
+
+        w->f = f;
+        w->cap *= 2;
+    }
+
+    return (char *)w->f + w->n++ * size;
+}
+
+#define amf_frames_top(w, type) ((type *)(w)->f + (w)->n - 1)
+
 static inline void
-save_ref(lua_State *L, int idx, int ridx)
+save_ref(lua_State *L, int idx, int ridx, int remember)
 {
     int ref;
 
@@ -23,9 +116,11 @@ save_ref(lua_State *L, int idx, int ridx)
     lua_pop(L, 1);
 
     /* save object to the ref table */
-    lua_pushvalue(L, idx);
-    lua_pushinteger(L, ref);
-    lua_rawset(L, ridx);
+    if (remember) {
+        lua_pushvalue(L, idx);
+        lua_pushinteger(L, ref);
+        lua_rawset(L, ridx);
+    }
 
     /* increase the ref count */
     lua_pushinteger(L, ref + 1);
@@ -55,6 +150,38 @@ strict_array_length(lua_State *L, int idx)
     return len;
 }
 
+void
+amf_enc_init(amf_enc *e, amf_buf *buf)
+{
+    e->buf = buf;
+    e->ridx = 0;
+    e->sidx = e->oidx = e->tidx = 0;
+    e->kidx = 0;
+    e->warm = 0;
+    e->traits_base = 0;
+    e->slots = NULL;
+    e->trace = NULL;
+    e->flags = 0;
+    e->depth = e->max_depth = 0;
+}
+
+/* one table deeper, which a cycle without object references runs into */
+static void
+amf_enc_enter(lua_State *L, amf_enc *e)
+{
+    if (e->max_depth && ++e->depth > e->max_depth) {
+        luaL_error(L, "nested too deep");
+    }
+}
+
+static void
+amf_enc_leave(amf_enc *e)
+{
+    if (e->max_depth) {
+        e->depth--;
+    }
+}
+
 static void
 amf0_encode_string(amf_buf *b, const char *s, size_t len)
 {
@@ -87,159 +214,378 @@ amf0_encode_number(amf_buf *buf, lua_Number d)
 }
 
 static int
-amf0_encode_ref(amf_buf *buf, lua_State *L, int idx, int ridx)
+amf0_encode_ref(lua_State *L, amf_enc *e, int idx)
 {
     int ref;
 
     /* lookup in the ref table */
     lua_pushvalue(L, idx);
-    lua_rawget(L, ridx);
+    lua_rawget(L, e->ridx);
     ref = (lua_isnumber(L, -1) ? lua_tonumber(L, -1) : -1);
     lua_pop(L, 1);
 
+    amf_stats_ref(obj_refs, ref >= 0);
+
     if (ref >= 0) {
-        amf_buf_append_char(buf, AMF0_REFERENCE);
+        amf_buf_append_char(e->buf, AMF0_REFERENCE);
         if (ref > UINT16_MAX) {
             luaL_error(L, "amf0 reference overflow");
         }
-        amf_buf_append_u16(buf, ref);
+        amf_buf_append_u16(e->buf, ref);
 
     } else {
-        save_ref(L, idx, ridx);
+        save_ref(L, idx, e->ridx, !amf_enc_frozen(e, AMF_VER0));
 
     }
 
     return ref;
 }
 
+/*
+ * a table being encoded, at idx of the lua stack with the key and value
+ * being written above it
+ *
+ * type:    the marker of the table, 0 for a value written whole
+ * i, n:    values written and the length of an array
+ * assoc:   the associative part of an amf3 array is being written
+ */
+typedef struct amf_enc_frame {
+    size_t              start;
+    int                 idx;
+    uint32_t            i, n;
+    uint8_t             type;
+    uint8_t             assoc;
+} amf_enc_frame;
+
+/* the stats and trace of the value written since start */
 static void
-amf0_encode_table_as_array(amf_buf *buf, lua_State *L, int idx, int ridx, int len)
+amf_enc_record(amf_enc *e, int amf3, size_t start)
 {
-    amf_buf_append_char(buf, AMF0_STRICT_ARRAY);
-    amf_buf_append_u32(buf, (uint32_t)len); // array count
-
-
-    for (int i = 1; i <= len; i++) {
-        lua_pushinteger(L, i);
-        lua_gettable(L, idx);
+    if (e->buf->len > start) {
+        amf_stats_marker(encoded, amf3, e->buf->b[start]);
 
-        amf0_encode(L, buf, 0, -1, ridx);
-        lua_pop(L, 1);
+        if (amf_trace_on(e->trace)) {
+            amf_trace_value(e->trace, AMF_TRACE_ENCODE | (amf3 ? AMF_TRACE_AMF3 : 0),
+                            e->buf->b + start, e->buf->len - start, start);
+        }
     }
-
 }
 
-/* TODO: typed object support */
+/* a table written as it goes on the work stack */
 static void
-amf0_encode_table_as_object(amf_buf *buf, lua_State *L, int idx, int ridx)
+amf_enc_open(lua_State *L, amf_enc_frame *f, int type, int idx, uint32_t n)
+{
+    luaL_checkstack(L, 4, "nested too deep");
+
+    f->type = type;
+    f->idx = idx;
+    f->i = 0;
+    f->n = n;
+    f->assoc = 0;
+}
+
+/*
+ * the next value of the table of f on top of the stack, after the key of
+ * an object, or 0 at its end. the value before is popped.
+ */
+static int
+amf0_encode_next(lua_State *L, amf_enc *e, amf_enc_frame *f)
 {
     size_t key_len;
     const char *key;
-    amf_buf_append_char(buf, AMF0_OBJECT);
 
-    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+    if (f->type == AMF0_STRICT_ARRAY) {
+        if (f->i > 0) {
+            lua_pop(L, 1);
+        }
+
+        if (f->i == f->n) {
+            return 0;
+        }
+
+        lua_pushinteger(L, ++f->i);
+        lua_gettable(L, f->idx);
+
+        return 1;
+    }
+
+    /* TODO: typed object support */
+    if (f->i++ == 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    while (lua_next(L, f->idx)) {
         switch (lua_type(L, -2)) {
         case LUA_TNUMBER:
             lua_pushvalue(L, -2);
             key = lua_tolstring(L, -1, &key_len);
-            amf_buf_append_u16(buf, (uint16_t)key_len);
-            amf_buf_append(buf, key, key_len);
+            amf_buf_append_u16(e->buf, (uint16_t)key_len);
+            amf_buf_append(e->buf, key, key_len);
             lua_pop(L, 1);
 
             break;
 
         case LUA_TSTRING:
             key = lua_tolstring(L, -2, &key_len);
-            amf_buf_append_u16(buf, (uint16_t)key_len);
-            amf_buf_append(buf, key, key_len);
+            amf_buf_append_u16(e->buf, (uint16_t)key_len);
+            amf_buf_append(e->buf, key, key_len);
 
             break;
 
-        default: continue;
+        default:
+            lua_pop(L, 1);
+            continue;
         }
-        amf0_encode(L, buf, 0, -1, ridx);
+
+        return 1;
     }
 
-    amf_buf_append_u16(buf, (uint16_t)0);
-    amf_buf_append_char(buf, AMF0_END_OF_OBJECT);
+    return 0;
+}
+
+static void
+amf0_encode_close(amf_enc *e, amf_enc_frame *f)
+{
+    if (f->type == AMF0_OBJECT) {
+        amf_buf_append_u16(e->buf, (uint16_t)0);
+        amf_buf_append_char(e->buf, AMF0_END_OF_OBJECT);
+    }
 
+    amf_enc_leave(e);
 }
 
-void
-amf0_encode(lua_State *L, amf_buf *buf, int avmplus, int idx, int ridx)
+/* a value written whole, or the start of a table into f */
+static void
+amf0_encode_value(lua_State *L, amf_enc *e, int avmplus, int idx, amf_enc_frame *f)
 {
-    int         array_len, old_top, ref;
+    int         array_len, ref;
     size_t      len;
     const char  *str;
 
-    abs_idx(L, idx);
-    abs_idx(L, ridx);
-
-    old_top = lua_gettop(L);
-
     switch (lua_type(L, idx)) {
     case LUA_TNIL:
-        amf_buf_append_char(buf, AMF0_NULL);
+        amf_buf_append_char(e->buf, AMF0_NULL);
         break;
 
     case LUA_TBOOLEAN:
-        amf_buf_append_char(buf, AMF0_BOOLEAN);
-        amf_buf_append_char(buf, lua_toboolean(L, idx) ? 1 : 0);
+        amf_buf_append_char(e->buf, AMF0_BOOLEAN);
+        amf_buf_append_char(e->buf, lua_toboolean(L, idx) ? 1 : 0);
         break;
 
     case LUA_TNUMBER:
-        amf_buf_append_char(buf, AMF0_NUMBER);
-        amf0_encode_number(buf, lua_tonumber(L, idx));
+        amf_buf_append_char(e->buf, AMF0_NUMBER);
+        amf0_encode_number(e->buf, lua_tonumber(L, idx));
         break;
 
     case LUA_TSTRING:
         str = lua_tolstring(L, idx, &len);
-        amf0_encode_string(buf, str, len);
+        amf0_encode_string(e->buf, str, len);
         break;
 
     case LUA_TTABLE: {
         if (avmplus) {
-            lua_newtable(L);
-            lua_newtable(L);
-            lua_newtable(L);
-
-            int top = lua_gettop(L);
-
-            amf3_encode(L, buf, idx, top-2, top-1, top);
-
-            lua_pop(L, 3);
+            amf_buf_append_char(e->buf, AMF0_AVMPLUS);
+            amf3_encode_scope(L, e, idx);
 
         } else {
-            ref = amf0_encode_ref(buf, L, idx, ridx);
-            if (ref >= 0) {
-                break;
+            if (!(e->flags & AMF_ENC_NO_OBJ_REFS)) {
+                ref = amf0_encode_ref(L, e, idx);
+                if (ref >= 0) {
+                    break;
+                }
             }
 
+            amf_enc_enter(L, e);
+
             array_len = strict_array_length(L, idx);
             if (array_len == 0) {
-                amf_buf_append_char(buf, AMF0_NULL);
+                amf_buf_append_char(e->buf, AMF0_NULL);
+                amf_enc_leave(e);
+
             } else if (array_len > 0) {
-                amf0_encode_table_as_array(buf, L, idx, ridx, array_len);
+                amf_buf_append_char(e->buf, AMF0_STRICT_ARRAY);
+                amf_buf_append_u32(e->buf, (uint32_t)array_len); // array count
+                amf_enc_open(L, f, AMF0_STRICT_ARRAY, idx, array_len);
+
             } else {
-                amf0_encode_table_as_object(buf, L, idx, ridx);
+                amf_buf_append_char(e->buf, AMF0_OBJECT);
+                amf_enc_open(L, f, AMF0_OBJECT, idx, 0);
             }
         }
         break;
     }
+
+    case LUA_TUSERDATA:
+        if (amf_template_slot(L, e, idx, AMF_VER0, avmplus)) {
+            break;
+        }
+        /* fall through */
+
+    default:
+        amf_buf_append_char(e->buf, AMF0_NULL);
+        break;
     }
+}
+
+/* tables are written on the work stack, see amf_frames */
+void
+amf0_encode(lua_State *L, amf_enc *e, int avmplus, int idx)
+{
+    amf_enc_frame   inl[AMF_FRAMES], *f;
+    amf_frames      w;
+    size_t          start;
+    int             old_top;
+
+    abs_idx(L, idx);
+
+    old_top = lua_gettop(L);
+    amf_frames_init(L, &w, inl);
+
+    do {
+        start = e->buf->len;
+        f = amf_frames_push(L, &w, sizeof(*f));
+        f->type = 0;
+
+        /* the values of a table are never in an avmplus marker of their own */
+        amf0_encode_value(L, e, avmplus, idx, f);
+        avmplus = 0;
+
+        if (f->type) {
+            f->start = start;
+        } else {
+            w.n--;
+            amf_enc_record(e, 0, start);
+        }
+
+        while (w.n > 0) {
+            f = amf_frames_top(&w, amf_enc_frame);
+            if (amf0_encode_next(L, e, f)) {
+                break;
+            }
+
+            amf0_encode_close(e, f);
+            amf_enc_record(e, 0, f->start);
+            w.n--;
+        }
+
+        idx = lua_gettop(L);
+    } while (w.n > 0);
+
+    lua_pop(L, 1); /* the work stack */
 
     assert(lua_gettop(L) == old_top);
 }
 
+/* a reference table of the scope, the one kept at warm or a new one */
+static void
+amf_enc_scope_table(lua_State *L, amf_enc *e, int n)
+{
+    if (e->warm) {
+        lua_rawgeti(L, e->warm, n);
+    } else {
+        lua_newtable(L);
+    }
+}
+
+/* drop the entries of the table at idx, which keeps its size */
+static void
+amf_enc_empty(lua_State *L, int idx)
+{
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+    }
+}
+
+void
+amf_enc_clear(lua_State *L, amf_enc *e)
+{
+    for (int n = AMF_WARM_REFS; n <= AMF_WARM_TRAITS; n++) {
+        lua_rawgeti(L, e->warm, n);
+        if (lua_istable(L, -1)) {
+            amf_enc_empty(L, lua_gettop(L));
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/* the scope table n at *idx unless the flag turns its references off, then 0 */
+static void
+amf_enc_scope_refs(lua_State *L, amf_enc *e, int n, int flag, int *idx)
+{
+    *idx = 0;
+
+    if (!(e->flags & flag)) {
+        amf_enc_scope_table(L, e, n);
+        *idx = lua_gettop(L);
+    }
+}
+
+void
+amf0_encode_scope(lua_State *L, amf_enc *e, int avmplus, int idx)
+{
+    int ridx = e->ridx, top = lua_gettop(L);
+
+    abs_idx(L, idx);
+
+    amf_enc_scope_refs(L, e, AMF_WARM_REFS, AMF_ENC_NO_OBJ_REFS, &e->ridx);
+    if (e->slots) {
+        amf_template_scope(e->slots, AMF_VER0);
+    }
+
+    amf0_encode(L, e, avmplus, idx);
+
+    if (e->warm && e->ridx) {
+        amf_enc_empty(L, e->ridx);
+    }
+
+    lua_settop(L, top);
+    e->ridx = ridx;
+}
+
+/*
+ * a table being decoded, which is on the lua stack with what it needs
+ * there: the alias below an amf0 typed object, the traits below an amf3
+ * object, and above it the key of the value being read into it.
+ *
+ * type:    the marker of the table, 0 for a value read whole
+ * i, n:    entries read and the count of an array or the sealed members
+ * dynamic: dynamic members follow, or the associative part of an array
+ */
+typedef struct amf_dec_frame {
+    const char         *start;
+    uint32_t            i, n;
+    uint8_t             type;
+    uint8_t             dynamic;
+} amf_dec_frame;
+
+/*
+ * a table of n items about to be made: the cursor limits, and room on the
+ * lua stack for the values inside it
+ */
+static void
+amf_decode_enter(lua_State *L, amf_cursor *c, size_t n)
+{
+    amf_cursor_enter(c, n, AMF_CUR_TABLE_SIZE + n * AMF_CUR_SLOT_SIZE);
+    amf_cursor_checkerr(c);
+
+    if (!lua_checkstack(L, 8)) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "nested too deep";
+    }
+}
+
 #define amf0_decode_string(L, c, bits) do {                 \
     uint##bits##_t len = 0;                                 \
-    int nbits = bits;                                       \
-    amf_cursor_need(c, bits/8);                             \
-    len = c->p[0] << 8 | c->p[1];                           \
-    for(int i = 0; nbits >= 0; nbits -= 8, i++) {           \
-        len |= (uint##bits##_t)c->p[i] << (nbits - 8);      \
-    }                                                       \
-    amf_cursor_consume(c, bits/8);                          \
+    amf_cursor_read_u##bits(c, &len);                       \
+    amf_cursor_checkerr(c);                                 \
+    amf_cursor_string(c, len);                              \
+    amf_cursor_checkerr(c);                                 \
     amf_cursor_need(c, len);                                \
     lua_pushlstring(L, c->p, len);                          \
     amf_cursor_consume(c, len);                             \
@@ -252,36 +598,80 @@ amf0_decode_remember_ref(lua_State *L, int idx, int ridx)
     luaL_ref(L, ridx);
 }
 
-void
-amf0_decode_to_lua_table(lua_State *L, amf_cursor *c, int ridx)
+/* an amf0 object, ecma array or typed object, the properties follow */
+static void
+amf0_decode_object(lua_State *L, amf_cursor *c, int ridx, amf_dec_frame *f)
 {
+    amf_decode_enter(L, c, 0);
+    amf_cursor_checkerr(c);
+
     lua_newtable(L);
     amf0_decode_remember_ref(L, -1, ridx);
 
-    for (;;) {
-        amf0_decode_string(L, c, 16);
-        amf_cursor_checkerr(c);
+    f->i = 0;
+}
+
+/* the key of the next property on the stack, or the end of the table */
+static void
+amf0_decode_next(lua_State *L, amf_cursor *c, amf_dec_frame *f, int *more)
+{
+    *more = 0;
 
+    if (f->type == AMF0_STRICT_ARRAY) {
+        *more = f->i < f->n;
+        return;
+    }
 
-        amf_cursor_need(c, 1);
-        if (c->p[0] == AMF0_END_OF_OBJECT || lua_objlen(L, -1) == 0) {
-            lua_pop(L, 1); // the empty string
-            amf_cursor_consume(c, 1);
-            break;
-        }
+    amf0_decode_string(L, c, 16);
+    amf_cursor_checkerr(c);
 
-        amf0_decode(L, c, ridx);
-        amf_cursor_checkerr(c);
+    amf_cursor_need(c, 1);
+    if (c->p[0] == AMF0_END_OF_OBJECT || lua_objlen(L, -1) == 0) {
+        lua_pop(L, 1); // the empty string
+        amf_cursor_consume(c, 1);
+        return;
+    }
+
+    f->i++;
+    amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+    amf_cursor_checkerr(c);
+
+    *more = 1;
+}
+
+/* the value on top into the table of f */
+static void
+amf0_decode_attach(lua_State *L, amf_dec_frame *f)
+{
+    if (f->type == AMF0_STRICT_ARRAY) {
+        lua_rawseti(L, -2, ++f->i);
+    } else {
+        lua_rawset(L, -3);
+    }
+}
 
+static void
+amf0_decode_close(lua_State *L, amf_cursor *c, amf_dec_frame *f)
+{
+    if (f->type == AMF0_TYPED_OBJECT) {
+        /* push alias name */
+        lua_pushstring(L, "__amf_alias__");
+        lua_pushvalue(L, -3);
         lua_rawset(L, -3);
+
+        /* remove alias from stack */
+        lua_remove(L, -2);
     }
 
+    amf_cursor_leave(c);
 }
 
-void
-amf0_decode(lua_State *L, amf_cursor *c, int ridx)
+/* a value read whole, or the start of a table into f */
+static void
+amf0_decode_value(lua_State *L, amf_cursor *c, int ridx, amf_dec_frame *f)
 {
     amf_cursor_need(c, 1);
+    amf_stats_marker(decoded, 0, c->p[0]);
 
     switch (c->p[0]) {
     case AMF0_BOOLEAN:
@@ -324,61 +714,58 @@ amf0_decode(lua_State *L, amf_cursor *c, int ridx)
 
     case AMF0_OBJECT:
         amf_cursor_consume(c, 1);
-        amf0_decode_to_lua_table(L, c, ridx);
+        amf0_decode_object(L, c, ridx, f);
+        amf_cursor_checkerr(c);
+        f->type = AMF0_OBJECT;
         break;
 
     case AMF0_ECMA_ARRAY:
         /* the property count, basicly 0 */
         amf_cursor_skip(c, 5);
-        amf0_decode_to_lua_table(L, c, ridx);
+        amf0_decode_object(L, c, ridx, f);
+        amf_cursor_checkerr(c);
+        f->type = AMF0_OBJECT;
         break;
 
     case AMF0_STRICT_ARRAY:
-        amf_cursor_need(c, 5);
-        uint32_t count = c->p[1] << 24
-                         | c->p[2] << 16
-                         | c->p[3] << 8
-                         | c->p[4];
-        amf_cursor_consume(c, 5);
-
-        assert(count <= INT_MAX);
+        amf_cursor_consume(c, 1);
+        uint32_t count;
+        amf_cursor_read_u32(c, &count);
+        amf_cursor_checkerr(c);
+
         if (count > INT_MAX) {
             c->err = AMF_CUR_ERR_BADFMT;
             c->err_msg = "strict array elements count overflow";
             return;
         }
 
+        amf_decode_enter(L, c, count);
+        amf_cursor_checkerr(c);
+
         lua_createtable(L, (int)count, 0);
         amf0_decode_remember_ref(L, -1, ridx);
 
-        for (int i = 1; i <= (int)count; i++) {
-            amf0_decode(L, c, ridx);
-            amf_cursor_checkerr(c);
-            lua_rawseti(L, -2, i);
-        }
+        f->type = AMF0_STRICT_ARRAY;
+        f->i = 0;
+        f->n = count;
         break;
 
     case AMF0_TYPED_OBJECT:
         amf_cursor_consume(c, 1);
 
+        /* the alias stays below the table until it is done */
         amf0_decode_string(L, c, 16);
 
-        amf0_decode_to_lua_table(L, c, ridx);
-
-        /* push alias name */
-        lua_pushstring(L, "__amf_alias__");
-        lua_pushvalue(L, -3);
-        lua_rawset(L, -3);
-
-        /* remove alias from stack */
-        lua_remove(L, -2);
-
+        amf0_decode_object(L, c, ridx, f);
+        amf_cursor_checkerr(c);
+        f->type = AMF0_TYPED_OBJECT;
         break;
 
     case AMF0_REFERENCE:
-        amf_cursor_need(c, 3);
-        uint16_t ref = c->p[1] << 8 | c->p[2];
-        amf_cursor_consume(c, 3);
+        amf_cursor_consume(c, 1);
+        uint16_t ref;
+        amf_cursor_read_u16(c, &ref);
+        amf_cursor_checkerr(c);
 
         lua_rawgeti(L, ridx, ref + 1);
         if (lua_isnil(L, -1)) {
@@ -390,22 +777,29 @@ amf0_decode(lua_State *L, amf_cursor *c, int ridx)
         break;
 
     case AMF0_AVMPLUS: {
+        amf_cursor_consume(c, 1);
+        /* amf3 values keep reference tables of their own */
+        lua_newtable(L);
         lua_newtable(L);
         lua_newtable(L);
-        int sidx = lua_gettop(L);
-        amf3_decode(L, c, sidx, ridx, sidx - 1);
+        int tidx = lua_gettop(L);
+        amf3_decode(L, c, tidx - 2, tidx - 1, tidx);
+        amf_cursor_checkerr(c);
+        lua_replace(L, tidx - 2);
+        lua_pop(L, 2);
         break;
     }
 
     default:
         c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported type";
 
     }
 
 }
 
 static int
-amf3_encode_ref(lua_State *L, amf_buf *buf, int idx, int ridx)
+amf3_encode_ref(lua_State *L, amf_enc *e, int idx, int ridx)
 {
     abs_idx(L, idx);
 
@@ -415,15 +809,21 @@ amf3_encode_ref(lua_State *L, amf_buf *buf, int idx, int ridx)
     int ref = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : -1;
     lua_pop(L, 1);
 
+    if (ridx == e->sidx) {
+        amf_stats_ref(str_refs, ref >= 0);
+    } else {
+        amf_stats_ref(obj_refs, ref >= 0);
+    }
+
     if (ref >= 0) {
         if (ref > AMF3_MAX_REFERENCES) {
             luaL_error(L, "amf reference count overflow");
         }
 
-        amf_buf_append_u29(buf, ref << 1);
+        amf_buf_append_u29(e->buf, ref << 1);
 
     } else {
-        save_ref(L, idx, ridx);
+        save_ref(L, idx, ridx, !amf_enc_frozen(e, AMF_VER3));
 
     }
 
@@ -431,7 +831,7 @@ amf3_encode_ref(lua_State *L, amf_buf *buf, int idx, int ridx)
 }
 
 static void
-amf3_encode_string(lua_State *L, amf_buf *buf, int idx, int sidx)
+amf3_encode_string(lua_State *L, amf_enc *e, int idx)
 {
     size_t len;
     const char *s = lua_tolstring(L, idx, &len);
@@ -439,33 +839,114 @@ amf3_encode_string(lua_State *L, amf_buf *buf, int idx, int sidx)
     if (len > AMF3_MAX_STR_LEN) len = AMF3_MAX_STR_LEN;
 
     if (len > 0) {
-        if (amf3_encode_ref(L, buf, idx, sidx) < 0) {
-            amf_buf_append_u29(buf, (len << 1 | 1));
-            amf_buf_append(buf, s, len);
+        if ((e->flags & AMF_ENC_NO_STR_REFS) || amf3_encode_ref(L, e, idx, e->sidx) < 0) {
+            amf_buf_append_u29(e->buf, (len << 1 | 1));
+            amf_buf_append(e->buf, s, len);
         }
 
     } else {
-        amf_buf_append_u29(buf, (0 << 1 | 1));
+        amf_buf_append_u29(e->buf, (0 << 1 | 1));
     }
 
 }
 
-/**
- * encode the traits info for a lua table.
+/*
+ * remember a traits table for later traits references, unless a template
+ * slot was already written to this scope
+ */
+static void
+amf3_remember_traits(lua_State *L, amf_enc *e, int traits_table_idx, int ref)
+{
+    if (amf_enc_frozen(e, AMF_VER3)) {
+        e->slots->unstored_traits++;
+        return;
+    }
+
+    lua_pushvalue(L, traits_table_idx);
+    lua_rawseti(L, e->tidx, ref);
+}
+
+/*
+ * encode the traits of an externalizable class, which have no members and
+ * are told apart by their alias only
+ */
+void
+amf3_encode_external_traits(lua_State *L, amf_enc *e, int alias_idx)
+{
+    int ref, ncached = lua_objlen(L, e->tidx);
+
+    if (alias_idx < 0) alias_idx = lua_gettop(L) + alias_idx + 1;
+
+    for (ref = 1; ref <= ncached; ref++) {
+        lua_rawgeti(L, e->tidx, ref);
+        lua_pushliteral(L, "alias");
+        lua_rawget(L, -2);
+
+        int match = lua_rawequal(L, -1, alias_idx);
+        lua_pop(L, 2);
+
+        if (match) {
+            amf_stats_ref(traits_refs, 1);
+            amf_buf_append_u29(e->buf, ((e->traits_base + ref-1) << 2 | 1));
+            return;
+        }
+    }
+
+    amf_stats_ref(traits_refs, 0);
+
+    /* remember the traits */
+    lua_createtable(L, 0, 2);
+    lua_pushliteral(L, "alias");
+    lua_pushvalue(L, alias_idx);
+    lua_rawset(L, -3);
+    lua_pushliteral(L, "external");
+    lua_pushinteger(L, 1);
+    lua_rawset(L, -3);
+    amf3_remember_traits(L, e, lua_gettop(L), ref);
+    lua_pop(L, 1);
+
+    amf_buf_append_u29(e->buf, 7);
+    amf3_encode_string(L, e, alias_idx);
+}
+
+void
+amf3_encode_bytearray(lua_State *L, amf_enc *e, const char *b, size_t len)
+{
+    int ref;
+
+    amf_buf_append_char(e->buf, AMF3_BYTEARRAY);
+    amf_buf_append_u29(e->buf, (len << 1 | 1));
+    amf_buf_append(e->buf, b, len);
+
+    /* the byte array takes an object reference nothing refers back to */
+    if (e->oidx == 0) {
+        return;
+    }
+
+    lua_rawgeti(L, e->oidx, 1);
+    ref = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushinteger(L, ref + 1);
+    lua_rawseti(L, e->oidx, 1);
+}
+
+/**
+ * encode the traits info for a lua table.
  * first iterate over the current traits ref table(ridx) to see if we should encode the traits info as reference.
  * if not, encode the whole traits info
  */
 static int
-amf3_encode_traits(lua_State *L, amf_buf *buf, int traits_table_idx, int sidx, int tidx)
+amf3_encode_traits(lua_State *L, amf_enc *e, int traits_table_idx)
 {
-    int ncached = lua_objlen(L, tidx);
+    int ncached = lua_objlen(L, e->tidx);
 
     int ref = 1;
     int traits_members = lua_objlen(L, traits_table_idx);
 
     for (; ref <= ncached; ref++) {
 
-        lua_rawgeti(L, tidx, ref);
+        lua_rawgeti(L, e->tidx, ref);
 
         int match = 1;
         int members = lua_objlen(L, -1);
@@ -475,6 +956,14 @@ amf3_encode_traits(lua_State *L, amf_buf *buf, int traits_table_idx, int sidx, i
             continue;
         }
 
+        if (members == 0) {
+            /* externalizable traits have no members either */
+            lua_pushliteral(L, "alias");
+            lua_rawget(L, -2);
+            match = lua_isnil(L, -1);
+            lua_pop(L, 1);
+        }
+
         for (int i = 1; i <= members; i++) {
             lua_rawgeti(L, traits_table_idx, i);
             lua_rawgeti(L, -2, i);
@@ -491,45 +980,169 @@ amf3_encode_traits(lua_State *L, amf_buf *buf, int traits_table_idx, int sidx, i
         lua_pop(L, 1); /* drop the cached traits table */
 
         if (match) {
-            amf_buf_append_u29(buf, ((ref-1) << 2 | 1));
+            amf_stats_ref(traits_refs, 1);
+            amf_buf_append_u29(e->buf, ((e->traits_base + ref-1) << 2 | 1));
             return ref;
         }
     }
 
+    amf_stats_ref(traits_refs, 0);
+
     /* remember the traits */
-    lua_pushvalue(L, traits_table_idx);
-    lua_rawseti(L, tidx, ref);
+    amf3_remember_traits(L, e, traits_table_idx, ref);
 
-    amf_buf_append_u29(buf, 3 | traits_members<<4);
-    amf_buf_append_u29(buf, 0<<1|1);
+    amf_buf_append_u29(e->buf, 3 | traits_members<<4);
+    amf_buf_append_u29(e->buf, 0<<1|1);
 
     for (int m = 1; m <= traits_members; m++) {
         lua_rawgeti(L, traits_table_idx, m);
-        amf3_encode_string(L, buf, -1, sidx);
+        amf3_encode_string(L, e, -1);
         lua_pop(L, 1);
     }
 
     return -1;
 }
 
+/* integer keys below it have their strings kept, see amf3_push_key_string */
+#define AMF3_KEY_STRINGS 65536
+
+/* a key of the dense part 1..n of an array */
+static int
+amf3_is_dense_key(lua_State *L, int idx, uint32_t n)
+{
+    lua_Number d;
+
+    if (lua_type(L, idx) != LUA_TNUMBER) {
+        return 0;
+    }
+
+    d = lua_tonumber(L, idx);
+
+    return d >= 1 && d <= n && floor(d) == d;
+}
+
+/*
+ * the string of the number key at idx pushed. the strings of small integers
+ * are kept in the table at e->kidx, so writing the same indices again does
+ * not format a new string for each.
+ */
 static void
-amf3_encode_table_as_object(lua_State *L, amf_buf *buf, int idx, int sidx, int oidx, int tidx)
+amf3_push_key_string(lua_State *L, amf_enc *e, int idx)
 {
-    abs_idx(L, idx);
+    lua_Number d;
+    int i;
 
-    amf_buf_append_char(buf, AMF3_OBJECT);
+    abs_idx(L, idx);
 
-    if (amf3_encode_ref(L, buf, idx, oidx) >= 0) {
+    d = lua_tonumber(L, idx);
+    if (e->kidx == 0 || d < 0 || d >= AMF3_KEY_STRINGS || floor(d) != d) {
+        lua_pushvalue(L, idx);
+        lua_tostring(L, -1);
         return;
     }
 
+    i = (int)d + 1;
+    lua_rawgeti(L, e->kidx, i);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, idx);
+        lua_tostring(L, -1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, e->kidx, i);
+    }
+}
+
+/*
+ * the length n of the table at idx when it is an amf3 array: its keys are
+ * 1..n, and the other ones numbers or non empty strings for the associative
+ * part, counted in nassoc. -1 when it has to be an object, with holes in
+ * 1..n, keys of other types, no dense part or an alias.
+ */
+static int
+amf3_array_length(lua_State *L, int idx, int *nassoc)
+{
+    size_t len;
+    int n, ndense = 0;
+
+    luaL_checkstack(L, 2, "No more extra lua stack");
+    abs_idx(L, idx);
+
+    n = lua_objlen(L, idx);
+    *nassoc = 0;
+
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+        switch (lua_type(L, -2)) {
+        case LUA_TNUMBER:
+            if (amf3_is_dense_key(L, -2, n)) {
+                ndense++;
+                continue;
+            }
+            break;
+
+        case LUA_TSTRING:
+            /* an empty key would end the associative part */
+            lua_tolstring(L, -2, &len);
+            if (len > 0) {
+                break;
+            }
+            /* fall through */
+
+        default:
+            lua_pop(L, 2);
+            return -1;
+        }
+
+        (*nassoc)++;
+    }
+
+    if (ndense != n || (n == 0 && *nassoc > 0)) {
+        return -1;
+    }
+
+    if (*nassoc > 0) {
+        lua_pushliteral(L, "__amf_alias__");
+        lua_rawget(L, idx);
+        if (!lua_isnil(L, -1)) {
+            n = -1;
+        }
+        lua_pop(L, 1);
+    }
+
+    return n;
+}
+
+/* the header of an object, 1 when its values are to be written */
+static int
+amf3_encode_table_as_object(lua_State *L, amf_enc *e, int idx)
+{
+    abs_idx(L, idx);
+
+    amf_buf_append_char(e->buf, AMF3_OBJECT);
+
+    if (!(e->flags & AMF_ENC_NO_OBJ_REFS) && amf3_encode_ref(L, e, idx, e->oidx) >= 0) {
+        return 0;
+    }
+
+    lua_pushliteral(L, "__amf_alias__");
+    lua_rawget(L, idx);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        size_t alias_len;
+        const char *alias = lua_tolstring(L, -1, &alias_len);
+
+        if (amf_flex_small_msg_kind(alias, alias_len)) {
+            amf_flex_encode_small_msg(L, e, idx, lua_gettop(L));
+            lua_pop(L, 1);
+            return 0;
+        }
+    }
+    lua_pop(L, 1);
+
     lua_newtable(L); /* traits table */
     int members = 1;
     for(lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
         switch (lua_type(L, -2)) {
             case LUA_TNUMBER:
-                lua_pushvalue(L, -2);
-                lua_tostring(L, -1);
+                amf3_push_key_string(L, e, -2);
                 break;
             case LUA_TSTRING:
                 lua_pushvalue(L, -2);
@@ -540,59 +1153,112 @@ amf3_encode_table_as_object(lua_State *L, amf_buf *buf, int idx, int sidx, int o
         lua_rawseti(L, -4, members++);
     }
 
-    amf3_encode_traits(L, buf, lua_gettop(L), sidx, tidx);
+    amf3_encode_traits(L, e, lua_gettop(L));
     lua_pop(L, 1); /* drop the traits table */
 
-    for(lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
-        amf3_encode(L, buf, -1, sidx, oidx, tidx);
-    }
+    return 1;
 }
 
-static void
-amf3_encode_table_as_array(lua_State *L, amf_buf *buf, int idx, int sidx, int oidx, int tidx, int array_len)
+/*
+ * the header of an array, 1 when its values are to be written. with an
+ * associative part its pairs come first and end it.
+ */
+static int
+amf3_encode_table_as_array(lua_State *L, amf_enc *e, int idx, int array_len, int assoc)
 {
     abs_idx(L, idx);
-    amf_buf_append_char(buf, AMF3_ARRAY);
-    if (amf3_encode_ref(L, buf, idx, oidx) >=0) {
-        return;
+    amf_buf_append_char(e->buf, AMF3_ARRAY);
+    if (!(e->flags & AMF_ENC_NO_OBJ_REFS) && amf3_encode_ref(L, e, idx, e->oidx) >= 0) {
+        return 0;
     }
 
-    amf_buf_append_u29(buf, (array_len << 1) | 1);
-    /*Send an empty string to imply no named keys*/
-    amf_buf_append_u29(buf, (0 << 1) | 1);
-
-    for (int i = 1; i <= array_len; i++) {
-        lua_rawgeti(L, idx, i);
-
-        amf3_encode(L, buf, -1, sidx, oidx, tidx);
-        lua_pop(L, 1);
+    amf_buf_append_u29(e->buf, (array_len << 1) | 1);
+    if (!assoc) {
+        /*Send an empty string to imply no named keys*/
+        amf_buf_append_u29(e->buf, (0 << 1) | 1);
     }
 
+    return 1;
 }
 
+/*
+ * the next value of the table of f on top of the stack, or 0 at its end.
+ * the value before is popped.
+ */
+static int
+amf3_encode_next(lua_State *L, amf_enc *e, amf_enc_frame *f)
+{
+    if (f->type == AMF3_ARRAY) {
+        /* the keys besides 1..n first, each written before its value */
+        if (f->assoc) {
+            if (f->i++ == 0) {
+                lua_pushnil(L);
+            } else {
+                lua_pop(L, 1);
+            }
+
+            while (lua_next(L, f->idx)) {
+                if (amf3_is_dense_key(L, -2, f->n)) {
+                    lua_pop(L, 1);
+                    continue;
+                }
 
+                if (lua_type(L, -2) == LUA_TNUMBER) {
+                    amf3_push_key_string(L, e, -2);
+                    amf3_encode_string(L, e, -1);
+                    lua_pop(L, 1);
+                } else {
+                    amf3_encode_string(L, e, -2);
+                }
 
+                return 1;
+            }
 
-void
-amf3_encode(lua_State *L, amf_buf *buf, int idx, int sidx, int oidx, int tidx)
-{
-    int          old_top, array_len;
-    const char  *str;
-    size_t       str_len;
+            amf_buf_append_u29(e->buf, (0 << 1) | 1);
+            f->assoc = 0;
+            f->i = 0;
+        }
 
-    old_top = lua_gettop(L);
+        if (f->i > 0) {
+            lua_pop(L, 1);
+        }
+
+        if (f->i == f->n) {
+            return 0;
+        }
+
+        lua_rawgeti(L, f->idx, ++f->i);
+
+        return 1;
+    }
+
+    /* the values in the order of the traits */
+    if (f->i++ == 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    return lua_next(L, f->idx);
+}
+
+/* a value written whole, or the start of a table into f */
+static void
+amf3_encode_value(lua_State *L, amf_enc *e, int idx, amf_enc_frame *f)
+{
+    int array_len, nassoc;
 
     switch (lua_type(L, idx)) {
     case LUA_TNIL: {
-        amf_buf_append_char(buf, AMF3_NULL);
+        amf_buf_append_char(e->buf, AMF3_NULL);
         break;
     }
 
     case LUA_TBOOLEAN: {
         if (lua_toboolean(L, idx)) {
-            amf_buf_append_char(buf, AMF3_TRUE);
+            amf_buf_append_char(e->buf, AMF3_TRUE);
         } else {
-            amf_buf_append_char(buf, AMF3_FALSE);
+            amf_buf_append_char(e->buf, AMF3_FALSE);
         }
         break;
     }
@@ -601,41 +1267,155 @@ amf3_encode(lua_State *L, amf_buf *buf, int idx, int sidx, int oidx, int tidx)
         lua_Number n = lua_tonumber(L, idx);
         /* encode as double */
         if (floor(n) != n || n < AMF3_MIN_INT || n > AMF3_MAX_INT) {
-            amf_buf_append_char(buf, AMF3_DOUBLE);
-            amf_buf_append_double(buf, n);
+            amf_buf_append_char(e->buf, AMF3_DOUBLE);
+            amf_buf_append_double(e->buf, n);
         } else {
-            amf_buf_append_char(buf, AMF3_INTEGER);
-            amf_buf_append_u29(buf, (int)n);
+            amf_buf_append_char(e->buf, AMF3_INTEGER);
+            amf_buf_append_u29(e->buf, (int)n);
         }
         break;
     }
 
     case LUA_TSTRING: {
-        str = lua_tolstring(L, idx, &str_len);
-        amf_buf_append_char(buf, AMF3_STRING);
-        amf3_encode_string(L, buf, idx, sidx);
+        amf_buf_append_char(e->buf, AMF3_STRING);
+        amf3_encode_string(L, e, idx);
         break;
     }
 
     case LUA_TTABLE:
-        array_len = strict_array_length(L, idx);
+        amf_enc_enter(L, e);
+        array_len = amf3_array_length(L, idx, &nassoc);
 
         if (array_len == 0) {
-            amf_buf_append_char(buf, AMF3_NULL);
+            amf_buf_append_char(e->buf, AMF3_NULL);
 
         } else if (array_len > 0) {
-            amf3_encode_table_as_array(L, buf, idx, sidx, oidx, tidx, array_len);
+            if (amf3_encode_table_as_array(L, e, idx, array_len, nassoc > 0)) {
+                amf_enc_open(L, f, AMF3_ARRAY, idx, array_len);
+                f->assoc = nassoc > 0;
+                break;
+            }
+
+        } else {
+            if (amf3_encode_table_as_object(L, e, idx)) {
+                amf_enc_open(L, f, AMF3_OBJECT, idx, 0);
+                break;
+            }
+
+        }
+        amf_enc_leave(e);
+        break;
+
+    case LUA_TUSERDATA:
+        if (amf_template_slot(L, e, idx, AMF_VER3, 0)) {
+            break;
+        }
+        /* fall through */
+
+    default:
+        amf_buf_append_char(e->buf, AMF3_NULL);
+        break;
+    }
+}
+
+/* tables are written on the work stack, see amf_frames */
+void
+amf3_encode(lua_State *L, amf_enc *e, int idx)
+{
+    amf_enc_frame   inl[AMF_FRAMES], *f;
+    amf_frames      w;
+    size_t          start;
+    int             old_top, kidx = e->kidx;
+
+    abs_idx(L, idx);
+
+    old_top = lua_gettop(L);
+
+    /* the key strings, for the tables of this value and the ones inside */
+    if (kidx == 0 && lua_istable(L, idx)) {
+        lua_getfield(L, LUA_REGISTRYINDEX, "amf_key_strings");
+        if (lua_istable(L, -1)) {
+            e->kidx = lua_gettop(L);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    amf_frames_init(L, &w, inl);
 
+    do {
+        start = e->buf->len;
+        f = amf_frames_push(L, &w, sizeof(*f));
+        f->type = 0;
+
+        amf3_encode_value(L, e, idx, f);
+
+        if (f->type) {
+            f->start = start;
         } else {
-            amf3_encode_table_as_object(L, buf, idx, sidx, oidx, tidx);
+            w.n--;
+            amf_enc_record(e, 1, start);
+        }
 
+        while (w.n > 0) {
+            f = amf_frames_top(&w, amf_enc_frame);
+            if (amf3_encode_next(L, e, f)) {
+                break;
+            }
+
+            amf_enc_leave(e);
+            amf_enc_record(e, 1, f->start);
+            w.n--;
         }
 
+        idx = lua_gettop(L);
+    } while (w.n > 0);
+
+    lua_pop(L, 1); /* the work stack */
+
+    if (e->kidx != kidx) {
+        lua_pop(L, 1);
+        e->kidx = kidx;
     }
 
     assert(lua_gettop(L) == old_top);
 }
 
+void
+amf3_encode_scope(lua_State *L, amf_enc *e, int idx)
+{
+    int sidx = e->sidx, oidx = e->oidx, tidx = e->tidx;
+    int traits_base = e->traits_base, top = lua_gettop(L);
+
+    abs_idx(L, idx);
+
+    amf_enc_scope_refs(L, e, AMF_WARM_STRS, AMF_ENC_NO_STR_REFS, &e->sidx);
+    amf_enc_scope_refs(L, e, AMF_WARM_OBJS, AMF_ENC_NO_OBJ_REFS, &e->oidx);
+    amf_enc_scope_refs(L, e, AMF_WARM_TRAITS, 0, &e->tidx);
+    e->traits_base = 0;
+    if (e->slots) {
+        amf_template_scope(e->slots, AMF_VER3);
+    }
+
+    amf3_encode(L, e, idx);
+
+    if (e->warm) {
+        if (e->sidx) {
+            amf_enc_empty(L, e->sidx);
+        }
+        if (e->oidx) {
+            amf_enc_empty(L, e->oidx);
+        }
+        amf_enc_empty(L, e->tidx);
+    }
+
+    lua_settop(L, top);
+    e->sidx = sidx;
+    e->oidx = oidx;
+    e->tidx = tidx;
+    e->traits_base = traits_base;
+}
+
 static void
 amf3_decode_u29(amf_cursor *c, uint32_t *v)
 {
@@ -659,7 +1439,7 @@ amf3_decode_u29(amf_cursor *c, uint32_t *v)
 #define amf3_is_ref(i) ((i) & 1) == 0
 #define remember_object(L, idx, ridx) lua_pushvalue(L, idx); luaL_ref(L, ridx)
 
-static void
+void
 amf3_decode_str(lua_State *L, amf_cursor *c, int sidx) {
     uint32_t ref, len;
     amf3_decode_u29(c, &ref);
@@ -668,6 +1448,8 @@ amf3_decode_str(lua_State *L, amf_cursor *c, int sidx) {
     if (!amf3_is_ref(ref)) {
         len = ref >> 1;
         if (len > 0) {
+            amf_cursor_string(c, len);
+            amf_cursor_checkerr(c);
             amf_cursor_need(c, len);
             lua_pushlstring(L, c->p, len);
             amf_cursor_consume(c, len);
@@ -678,6 +1460,13 @@ amf3_decode_str(lua_State *L, amf_cursor *c, int sidx) {
         }
     } else {
         amf3_decode_ref(L, c, ref >> 1, sidx);
+
+        /* a key or member name of nil would raise in lua_rawset */
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "string reference not found";
+        }
     }
 
 }
@@ -691,37 +1480,186 @@ amf3_decode_str(lua_State *L, amf_cursor *c, int sidx) {
     amf_cursor_consume(c, 8+n);\
 } while(0)
 
-void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
-{
-    amf_cursor_need(c, 1);
+static void amf3_decode_as(lua_State *L, amf_cursor *c, int sidx, int oidx, int tidx,
+                           int slot);
 
-    int top = lua_gettop(L);
+/*
+ * flex wrappers that serialize exactly one inner value, which is what the
+ * wrapper is unwrapped to, so its table takes the slot of the wrapper too
+ */
+static void
+amf3_read_wrapped_value(lua_State *L, amf_cursor *c, const char *alias,
+                        int sidx, int oidx, int tidx)
+{
+    (void)alias;
+    amf3_decode_as(L, c, sidx, oidx, tidx, lua_objlen(L, oidx));
+}
 
-    switch (c->p[0]) {
-        case AMF3_UNDEFINED:
-        case AMF3_NULL:
-            lua_pushnil(L);
-            amf_cursor_consume(c, 1);
-            break;
+static const struct {
+    const char      *alias;
+    amf3_ext_reader  reader;
+} amf3_externals[] = {
+    { "flex.messaging.io.ArrayCollection", amf3_read_wrapped_value },
+    { "flex.messaging.io.ArrayList",       amf3_read_wrapped_value },
+    { "flex.messaging.io.ObjectProxy",     amf3_read_wrapped_value },
+    { AMF_FLEX_ACKNOWLEDGE_EXT,            amf_flex_read_small_msg },
+    { AMF_FLEX_ASYNC_EXT,                  amf_flex_read_small_msg },
+    { AMF_FLEX_COMMAND_EXT,                amf_flex_read_small_msg },
+};
 
-        case AMF3_TRUE:
-            lua_pushboolean(L, 1);
-            amf_cursor_consume(c, 1);
-            break;
+/*
+ * the registered readers of a lua_State, a table in its registry from the
+ * alias, or 1 for the fallback, to a userdata of amf3_ext_entry
+ */
+#define AMF3_EXT_READERS    "amf_ext_readers"
 
-        case AMF3_FALSE:
-            lua_pushboolean(L, 0);
-            amf_cursor_consume(c, 1);
-            break;
+typedef struct amf3_ext_entry {
+    amf3_ext_reader  reader;
+} amf3_ext_entry;
 
-        case AMF3_INTEGER: {
-            amf_cursor_consume(c, 1);
-            int32_t i;
-            amf3_decode_u29(c, (uint32_t *)&i);
-            amf_cursor_checkerr(c);
-            i = (i << 3) >> 3;
-            lua_pushinteger(L, i);
-            break;
+int
+amf3_register_externalizable(lua_State *L, const char *alias, amf3_ext_reader reader)
+{
+    amf3_ext_entry *ent;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, AMF3_EXT_READERS);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, AMF3_EXT_READERS);
+    }
+
+    ent = lua_newuserdata(L, sizeof(*ent));
+    ent->reader = reader;
+
+    if (alias == NULL) {
+        lua_rawseti(L, -2, 1);
+    } else {
+        lua_pushstring(L, alias);
+        lua_insert(L, -2);
+        lua_rawset(L, -3);
+    }
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+/* the built-in reader of alias, what the skip of a value knows the body of */
+static amf3_ext_reader
+amf3_builtin_externalizable(const char *alias)
+{
+    for (size_t i = 0; i < sizeof(amf3_externals) / sizeof(amf3_externals[0]); i++) {
+        if (strcmp(amf3_externals[i].alias, alias) == 0) {
+            return amf3_externals[i].reader;
+        }
+    }
+
+    return NULL;
+}
+
+/* the registered reader of alias, else the built-in one, else the fallback */
+static amf3_ext_reader
+amf3_find_externalizable(lua_State *L, const char *alias)
+{
+    amf3_ext_entry  *ent = NULL;
+    amf3_ext_reader  reader;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, AMF3_EXT_READERS);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, alias);
+        ent = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+    }
+
+    reader = ent ? ent->reader : amf3_builtin_externalizable(alias);
+
+    if (reader == NULL && lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        ent = lua_touserdata(L, -1);
+        reader = ent ? ent->reader : NULL;
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    return reader;
+}
+
+/*
+ * decode an externalizable object body, the traits table at the stack top
+ * is replaced by the value the class reader produced
+ */
+static void
+amf3_decode_external(lua_State *L, amf_cursor *c, int sidx, int oidx, int tidx)
+{
+    const char      *alias;
+    amf3_ext_reader  reader;
+    int              ref;
+
+    lua_pushliteral(L, "alias");
+    lua_rawget(L, -2);
+    alias = lua_tostring(L, -1);
+    lua_pop(L, 1); /* the traits table keeps the alias alive */
+
+    reader = alias ? amf3_find_externalizable(L, alias) : NULL;
+    if (reader == NULL) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported externalizable class";
+        return;
+    }
+
+    /* the object owns its reference slot before the inner values, see amf3_ext_reader */
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    ref = luaL_ref(L, oidx);
+
+    reader(L, c, alias, sidx, oidx, tidx);
+    amf_cursor_checkerr(c);
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, oidx, ref);
+
+    lua_remove(L, -2); /* drop the object table */
+    lua_remove(L, -2); /* drop trait table */
+}
+
+/* a value read whole, or the start of a table into f */
+static void
+amf3_decode_value(lua_State *L, amf_cursor *c, int sidx, int oidx, int tidx,
+                  amf_dec_frame *f)
+{
+    amf_cursor_need(c, 1);
+    amf_stats_marker(decoded, 1, c->p[0]);
+
+    int top = lua_gettop(L);
+
+    switch (c->p[0]) {
+        case AMF3_UNDEFINED:
+        case AMF3_NULL:
+            lua_pushnil(L);
+            amf_cursor_consume(c, 1);
+            break;
+
+        case AMF3_TRUE:
+            lua_pushboolean(L, 1);
+            amf_cursor_consume(c, 1);
+            break;
+
+        case AMF3_FALSE:
+            lua_pushboolean(L, 0);
+            amf_cursor_consume(c, 1);
+            break;
+
+        case AMF3_INTEGER: {
+            amf_cursor_consume(c, 1);
+            int32_t i;
+            amf3_decode_u29(c, (uint32_t *)&i);
+            amf_cursor_checkerr(c);
+            i = (i << 3) >> 3;
+            lua_pushinteger(L, i);
+            break;
 
         }
 
@@ -764,17 +1702,19 @@ void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
 
             if (!amf3_is_ref(ref)) {
                 len = ref >> 1;
-                amf_cursor_skip(c, 1); // empty class name
+
+                amf_decode_enter(L, c, len);
+                amf_cursor_checkerr(c);
 
                 lua_createtable(L, len, 0);
 
                 remember_object(L, -1, oidx);
 
-                for (unsigned int i = 1; i <= len; i++) {
-                    amf3_decode(L, c, sidx, oidx, tidx);
-                    amf_cursor_checkerr(c);
-                    lua_rawseti(L, -2, i);
-                }
+                /* the associative part comes first, up to an empty key */
+                f->type = AMF3_ARRAY;
+                f->i = 0;
+                f->n = len;
+                f->dynamic = 1;
 
             } else {
                 amf3_decode_ref(L, c, ref >> 1, oidx);
@@ -798,7 +1738,6 @@ void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
 
             if (!amf3_is_ref(ref)) {
                 uint32_t traits_ext = ref;
-                const char *amf_type = NULL;
                 unsigned int members = 0, dynamic = 0, external = 0;
 
                 /*
@@ -810,44 +1749,46 @@ void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
                     dynamic = (traits_ext & 8) == 8;
                     external = (traits_ext & 4) == 4;
 
-                    amf3_decode_str(L, c, sidx);
-                    amf_cursor_checkerr(c);
-                    amf_type = lua_tostring(L, -1);
-                    lua_pop(L, 1); // TODO typed object support, ignore typename for now
-
                     if (external) {
-                        //TODO
-                        assert(0);
-
-                    } else {
-                        lua_createtable(L, members, 2);
+                        /* externalizable traits carry no sealed members */
+                        members = 0;
+                    }
 
-                        for (unsigned int i = 1; i <= members; i++) {
-                            amf3_decode_str(L, c, sidx);
-                            amf_cursor_checkerr(c);
-                            lua_rawseti(L, -2, i);
-                        }
+                    amf_decode_enter(L, c, members);
+                    amf_cursor_checkerr(c);
 
-                        lua_pushliteral(L, "dynamic");
-                        lua_pushinteger(L, dynamic);
-                        lua_rawset(L, -3);
+                    lua_createtable(L, members, 3);
 
-                        lua_pushliteral(L, "external");
-                        lua_pushinteger(L, external);
-                        lua_rawset(L, -3);
+                    lua_pushliteral(L, "alias");
+                    amf3_decode_str(L, c, sidx);
+                    amf_cursor_checkerr(c);
+                    lua_rawset(L, -3);
 
-                        /* remember the traits table */
-                        lua_pushvalue(L, -1);
-                        luaL_ref(L, tidx);
+                    for (unsigned int i = 1; i <= members; i++) {
+                        amf3_decode_str(L, c, sidx);
+                        amf_cursor_checkerr(c);
+                        lua_rawseti(L, -2, i);
                     }
 
+                    lua_pushliteral(L, "dynamic");
+                    lua_pushinteger(L, dynamic);
+                    lua_rawset(L, -3);
+
+                    lua_pushliteral(L, "external");
+                    lua_pushinteger(L, external);
+                    lua_rawset(L, -3);
+
+                    /* remember the traits table */
                     remember_object(L, -1, tidx);
 
                 } else {
                     amf3_decode_ref(L, c, traits_ext >> 2, tidx);
-                    amf_cursor_checkerr(c);
 
-                    assert(lua_istable(L, -1));
+                    if (!lua_istable(L, -1)) {
+                        c->err = AMF_CUR_ERR_BADFMT;
+                        c->err_msg = "traits reference not found";
+                        return;
+                    }
 
                     members = lua_objlen(L, -1);
 
@@ -858,45 +1799,27 @@ void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
 
                     lua_pushliteral(L, "dynamic");
                     lua_rawget(L, -2);
-                    external = lua_tointeger(L, -1);
+                    dynamic = lua_tointeger(L, -1);
                     lua_pop(L, 1);
 
+                    amf_decode_enter(L, c, members);
+                    amf_cursor_checkerr(c);
                 }
 
                 if (external) {
-                    //TODO external support
-                    assert(0);
+                    amf3_decode_external(L, c, sidx, oidx, tidx);
+                    amf_cursor_checkerr(c);
+                    amf_cursor_leave(c);
 
                 } else {
-
+                    /* the traits table stays below the object */
                     lua_createtable(L, 0, members);
                     remember_object(L, -1, oidx);
 
-                    for (unsigned int i = 1; i <= members; i++) {
-                        lua_rawgeti(L, -2, i);
-
-                        amf3_decode(L, c, sidx, oidx, tidx);
-                        amf_cursor_checkerr(c);
-
-                        lua_rawset(L, -3);
-                    }
-
-                    if (dynamic) {
-                        for (;;) {
-                            amf3_decode_str(L, c, sidx);
-                            amf_cursor_checkerr(c);
-
-                            if (lua_objlen(L, -1) == 0)  {
-                                lua_pop(L, 1);
-                                break;
-                            }
-                            amf3_decode(L, c, sidx, oidx, tidx);
-                            amf_cursor_checkerr(c);
-                            lua_rawset(L, -3);
-                        }
-                    }
-
-                    lua_remove(L, -2); /* drop trait table */
+                    f->type = AMF3_OBJECT;
+                    f->i = 0;
+                    f->n = members;
+                    f->dynamic = dynamic;
                 }
 
             } else {
@@ -906,9 +1829,718 @@ void amf3_decode(lua_State *L, amf_cursor *c,  int sidx, int oidx, int tidx)
             break;
         }
         default:
-            luaL_error(L, "unsupported type: %d", c->p[0]);
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "unsupported type";
+            return;
+    }
+
+    /* a value cut short leaves nothing behind */
+    amf_cursor_checkerr(c);
+
+    assert(lua_gettop(L) - top == (f->type == AMF3_OBJECT ? 2 : 1));
+}
+
+/*
+ * the key of the next member on the stack, sealed ones from the traits
+ * below the object, or the end of the table
+ */
+static void
+amf3_decode_next(lua_State *L, amf_cursor *c, int sidx, amf_dec_frame *f, int *more)
+{
+    *more = 0;
+
+    if (f->type == AMF3_ARRAY) {
+        if (f->dynamic) {
+            amf3_decode_str(L, c, sidx);
+            amf_cursor_checkerr(c);
+
+            if (lua_objlen(L, -1) > 0) {
+                f->i++;
+                amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+                amf_cursor_checkerr(c);
+
+                *more = 1;
+                return;
+            }
+
+            lua_pop(L, 1);
+            f->dynamic = 0;
+            f->i = 0;
+        }
+
+        *more = f->i < f->n;
+        return;
+    }
+
+    if (f->i < f->n) {
+        lua_rawgeti(L, -2, ++f->i);
+        *more = 1;
+        return;
+    }
+
+    if (!f->dynamic) {
+        return;
+    }
+
+    amf3_decode_str(L, c, sidx);
+    amf_cursor_checkerr(c);
+
+    if (lua_objlen(L, -1) == 0)  {
+        lua_pop(L, 1);
+        return;
+    }
+
+    f->i++;
+    amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+    amf_cursor_checkerr(c);
+
+    *more = 1;
+}
+
+static void
+amf3_decode_attach(lua_State *L, amf_dec_frame *f)
+{
+    if (f->type == AMF3_ARRAY && !f->dynamic) {
+        lua_rawseti(L, -2, ++f->i);
+    } else {
+        lua_rawset(L, -3);
+    }
+}
+
+static void
+amf3_decode_close(lua_State *L, amf_cursor *c, amf_dec_frame *f)
+{
+    if (f->type == AMF3_OBJECT) {
+        lua_remove(L, -2); /* drop trait table */
+    }
+
+    amf_cursor_leave(c);
+}
+
+
+static void
+amf_trace_decoded(amf_cursor *c, int flags, const char *start)
+{
+    if (c->err) {
+        flags |= AMF_TRACE_ERROR;
+    }
+
+    amf_trace_value(c->trace, flags, start, c->p - start, start - c->base);
+}
+
+/* the value cut short at start and the tables it was read into */
+static void
+amf_decode_unwind(lua_State *L, amf_cursor *c, int flags, const char *start,
+                  amf_frames *w, int base)
+{
+    if (amf_trace_on(c->trace)) {
+        if (start) {
+            amf_trace_decoded(c, flags, start);
+        }
+
+        while (w->n > 0) {
+            amf_trace_decoded(c, flags, amf_frames_top(w, amf_dec_frame)->start);
+            w->n--;
+        }
+    }
+
+    lua_settop(L, base);
+}
+
+/*
+ * the value at the cursor on the stack, or nothing and the error in the
+ * cursor. tables are read on the work stack, see amf_frames.
+ */
+void
+amf0_decode(lua_State *L, amf_cursor *c, int ridx)
+{
+    amf_dec_frame   inl[AMF_FRAMES], *f;
+    amf_frames      w;
+    const char     *start;
+    int             base = lua_gettop(L), fresh, more;
+
+    amf_frames_init(L, &w, inl);
+
+    do {
+        start = c->p;
+        f = amf_frames_push(L, &w, sizeof(*f));
+        f->type = 0;
+
+        amf0_decode_value(L, c, ridx, f);
+        if (c->err) {
+            w.n--;
+            amf_decode_unwind(L, c, 0, start, &w, base);
+            return;
+        }
+
+        /* a new table has nothing to take in yet */
+        fresh = f->type != 0;
+        if (fresh) {
+            f->start = start;
+        } else {
+            w.n--;
+            if (amf_trace_on(c->trace)) {
+                amf_trace_decoded(c, 0, start);
+            }
+        }
+
+        /* the tables done with their last value go into the ones below */
+        while (w.n > 0) {
+            f = amf_frames_top(&w, amf_dec_frame);
+            if (!fresh) {
+                amf0_decode_attach(L, f);
+            }
+            fresh = 0;
+
+            amf0_decode_next(L, c, f, &more);
+            if (c->err) {
+                amf_decode_unwind(L, c, 0, NULL, &w, base);
+                return;
+            }
+
+            if (more) {
+                break;
+            }
+
+            amf0_decode_close(L, c, f);
+            if (amf_trace_on(c->trace)) {
+                amf_trace_decoded(c, 0, f->start);
+            }
+            w.n--;
+        }
+    } while (w.n > 0);
+
+    /* the value takes the slot of the work stack */
+    lua_replace(L, base + 1);
+}
+
+void
+amf3_decode(lua_State *L, amf_cursor *c, int sidx, int oidx, int tidx)
+{
+    amf3_decode_as(L, c, sidx, oidx, tidx, 0);
+}
+
+/* amf3_decode, with the table of the value also taking the object reference slot */
+static void
+amf3_decode_as(lua_State *L, amf_cursor *c, int sidx, int oidx, int tidx, int slot)
+{
+    amf_dec_frame   inl[AMF_FRAMES], *f;
+    amf_frames      w;
+    const char     *start;
+    int             base = lua_gettop(L), fresh, more;
+
+    amf_frames_init(L, &w, inl);
+
+    do {
+        start = c->p;
+        f = amf_frames_push(L, &w, sizeof(*f));
+        f->type = 0;
+
+        amf3_decode_value(L, c, sidx, oidx, tidx, f);
+        if (c->err) {
+            w.n--;
+            amf_decode_unwind(L, c, AMF_TRACE_AMF3, start, &w, base);
+            return;
+        }
+
+        fresh = f->type != 0;
+        if (fresh) {
+            f->start = start;
+        } else {
+            w.n--;
+            if (amf_trace_on(c->trace)) {
+                amf_trace_decoded(c, AMF_TRACE_AMF3, start);
+            }
+        }
+
+        /* the table of a flex wrapper is there before what it holds */
+        if (slot) {
+            if (fresh) {
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, oidx, slot);
+            }
+            slot = 0;
+        }
+
+        while (w.n > 0) {
+            f = amf_frames_top(&w, amf_dec_frame);
+            if (!fresh) {
+                amf3_decode_attach(L, f);
+            }
+            fresh = 0;
+
+            amf3_decode_next(L, c, sidx, f, &more);
+            if (c->err) {
+                amf_decode_unwind(L, c, AMF_TRACE_AMF3, NULL, &w, base);
+                return;
+            }
+
+            if (more) {
+                break;
+            }
+
+            amf3_decode_close(L, c, f);
+            if (amf_trace_on(c->trace)) {
+                amf_trace_decoded(c, AMF_TRACE_AMF3, f->start);
+            }
+            w.n--;
+        }
+    } while (w.n > 0);
+
+    lua_replace(L, base + 1);
+}
+
+/*
+ * structural skip: walk past a value without building it. only the strings
+ * and traits needed to resolve later traits references are tracked, as
+ * pointers into the input.
+ */
+typedef struct amf3_skip_str {
+    const char      *s;
+    size_t           len;
+} amf3_skip_str;
+
+typedef struct amf3_skip_traits {
+    uint32_t         members;
+    int              dynamic, external;
+    amf3_skip_str    alias;
+} amf3_skip_traits;
+
+struct amf3_skip_ctx {
+    amf3_skip_str       *strs;
+    size_t               nstrs, cstrs;
+    amf3_skip_traits    *traits;
+    size_t               ntraits, ctraits;
+};
+
+/*
+ * a container of n items the skip walks into, counted against the limits
+ * as the decode would count the table. the skip recurses, so it stops at
+ * AMF_CUR_MAX_DEPTH even when the limits allow more.
+ */
+static void
+amf_skip_enter(amf_cursor *c, size_t n)
+{
+    amf_cursor_enter(c, n, AMF_CUR_TABLE_SIZE + n * AMF_CUR_SLOT_SIZE);
+    amf_cursor_checkerr(c);
+
+    if (c->depth > AMF_CUR_MAX_DEPTH) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "nested too deep";
+    }
+}
+
+#define amf_skip_grow(c, a, n, cap) do {                                \
+    if ((n) == (cap)) {                                                 \
+        size_t ncap = (cap) ? (cap) * 2 : 16;                           \
+        void *np = realloc((a), ncap * sizeof(*(a)));                   \
+        if (np == NULL) {                                               \
+            (c)->err = AMF_CUR_ERR_BADFMT;                              \
+            (c)->err_msg = "out of memory";                             \
+            return;                                                     \
+        }                                                               \
+        (a) = np;                                                       \
+        (cap) = ncap;                                                   \
+    }                                                                   \
+} while(0)
+
+static void
+amf3_skip_string(amf_cursor *c, amf3_skip_ctx *ctx, amf3_skip_str *out)
+{
+    uint32_t ref, len;
+
+    amf3_decode_u29(c, &ref);
+    amf_cursor_checkerr(c);
+
+    if (amf3_is_ref(ref)) {
+        if ((ref >> 1) >= ctx->nstrs) {
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "string reference not found";
+            return;
+        }
+        if (out) *out = ctx->strs[ref >> 1];
+        return;
+    }
+
+    len = ref >> 1;
+
+    if (len > 0) {
+        amf_cursor_string(c, len);
+        amf_cursor_checkerr(c);
+    }
+
+    amf_cursor_need(c, len);
+
+    if (len > 0) {
+        amf_skip_grow(c, ctx->strs, ctx->nstrs, ctx->cstrs);
+        ctx->strs[ctx->nstrs].s = c->p;
+        ctx->strs[ctx->nstrs].len = len;
+        ctx->nstrs++;
+    }
+
+    if (out) {
+        out->s = c->p;
+        out->len = len;
+    }
+
+    amf_cursor_consume(c, len);
+}
+
+/*
+ * an object reference or an inline length followed by len * size bytes,
+ * a string of len bytes for the limits when size is 1
+ */
+static void
+amf3_skip_sized(amf_cursor *c, size_t size)
+{
+    uint32_t ref;
+
+    amf3_decode_u29(c, &ref);
+    amf_cursor_checkerr(c);
+
+    if (amf3_is_ref(ref)) {
+        return;
+    }
+
+    if (size == 1) {
+        amf_cursor_string(c, ref >> 1);
+        amf_cursor_checkerr(c);
+    }
+
+    if ((ref >> 1) > c->left / size) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return;
+    }
+    amf_cursor_consume(c, (ref >> 1) * size);
+}
+
+static void
+amf3_skip_external(amf_cursor *c, amf3_skip_ctx *ctx, amf3_skip_str *alias)
+{
+    char             name[256];
+    amf3_ext_reader  reader;
+
+    if (alias->len >= sizeof(name)) {
+        reader = NULL;
+    } else {
+        memcpy(name, alias->s, alias->len);
+        name[alias->len] = '\0';
+        reader = amf3_builtin_externalizable(name);
+    }
+
+    if (reader == amf3_read_wrapped_value) {
+        amf3_skip_value(c, ctx);
+
+    } else if (reader == amf_flex_read_small_msg) {
+        amf_flex_skip_small_msg(c, name, ctx);
+
+    } else {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported externalizable class";
+    }
+}
+
+static void
+amf3_skip_object(amf_cursor *c, amf3_skip_ctx *ctx)
+{
+    uint32_t            ref;
+    amf3_skip_traits    t;
+    amf3_skip_str       key;
+
+    amf3_decode_u29(c, &ref);
+    amf_cursor_checkerr(c);
+
+    if (amf3_is_ref(ref)) {
+        return;
+    }
+
+    if ((ref & 3) == 1) {
+        if ((ref >> 2) >= ctx->ntraits) {
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "traits reference not found";
+            return;
+        }
+        t = ctx->traits[ref >> 2];
+
+    } else {
+        t.external = (ref & 4) == 4;
+        t.dynamic = (ref & 8) == 8;
+        t.members = t.external ? 0 : ref >> 4;
+
+        amf3_skip_string(c, ctx, &t.alias);
+        amf_cursor_checkerr(c);
+
+        for (uint32_t i = 0; i < t.members; i++) {
+            amf3_skip_string(c, ctx, NULL);
+            amf_cursor_checkerr(c);
+        }
+
+        amf_skip_grow(c, ctx->traits, ctx->ntraits, ctx->ctraits);
+        ctx->traits[ctx->ntraits++] = t;
+    }
+
+    amf_skip_enter(c, t.members);
+    amf_cursor_checkerr(c);
+
+    if (t.external) {
+        amf3_skip_external(c, ctx, &t.alias);
+        amf_cursor_checkerr(c);
+        amf_cursor_leave(c);
+        return;
+    }
+
+    for (uint32_t i = 0; i < t.members; i++) {
+        amf3_skip_value(c, ctx);
+        amf_cursor_checkerr(c);
+    }
+
+    while (t.dynamic) {
+        amf3_skip_string(c, ctx, &key);
+        amf_cursor_checkerr(c);
+
+        if (key.len == 0) {
+            break;
+        }
+
+        amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+        amf_cursor_checkerr(c);
+
+        amf3_skip_value(c, ctx);
+        amf_cursor_checkerr(c);
+    }
+
+    amf_cursor_leave(c);
+}
+
+static void
+amf3_skip_array(amf_cursor *c, amf3_skip_ctx *ctx)
+{
+    uint32_t        ref;
+    amf3_skip_str   key;
+
+    amf3_decode_u29(c, &ref);
+    amf_cursor_checkerr(c);
+
+    if (amf3_is_ref(ref)) {
+        return;
+    }
+
+    amf_skip_enter(c, ref >> 1);
+    amf_cursor_checkerr(c);
+
+    /* associative part */
+    for (;;) {
+        amf3_skip_string(c, ctx, &key);
+        amf_cursor_checkerr(c);
+
+        if (key.len == 0) {
+            break;
+        }
+
+        amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+        amf_cursor_checkerr(c);
+
+        amf3_skip_value(c, ctx);
+        amf_cursor_checkerr(c);
+    }
+
+    for (uint32_t i = 0; i < ref >> 1; i++) {
+        amf3_skip_value(c, ctx);
+        amf_cursor_checkerr(c);
     }
 
-    assert(lua_gettop(L) - top == 1);
+    amf_cursor_leave(c);
 }
 
+void
+amf3_skip_value(amf_cursor *c, amf3_skip_ctx *ctx)
+{
+    uint32_t ref;
+
+    amf_cursor_need(c, 1);
+
+    switch (c->p[0]) {
+    case AMF3_UNDEFINED:
+    case AMF3_NULL:
+    case AMF3_FALSE:
+    case AMF3_TRUE:
+        amf_cursor_consume(c, 1);
+        break;
+
+    case AMF3_INTEGER:
+        amf_cursor_consume(c, 1);
+        amf3_decode_u29(c, &ref);
+        break;
+
+    case AMF3_DOUBLE:
+        amf_cursor_skip(c, 9);
+        break;
+
+    case AMF3_STRING:
+        amf_cursor_consume(c, 1);
+        amf3_skip_string(c, ctx, NULL);
+        break;
+
+    case AMF3_DATE:
+        amf_cursor_consume(c, 1);
+        amf3_skip_sized(c, 8);
+        break;
+
+    case AMF3_XMLDOC:
+    case AMF3_XML:
+    case AMF3_BYTEARRAY:
+        amf_cursor_consume(c, 1);
+        amf3_skip_sized(c, 1);
+        break;
+
+    case AMF3_ARRAY:
+        amf_cursor_consume(c, 1);
+        amf3_skip_array(c, ctx);
+        break;
+
+    case AMF3_OBJECT:
+        amf_cursor_consume(c, 1);
+        amf3_skip_object(c, ctx);
+        break;
+
+    default:
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported type";
+    }
+}
+
+void
+amf3_skip(amf_cursor *c)
+{
+    amf3_skip_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    amf3_skip_value(c, &ctx);
+
+    free(ctx.strs);
+    free(ctx.traits);
+}
+
+static void
+amf0_skip_properties(amf_cursor *c)
+{
+    uint16_t len;
+
+    amf_skip_enter(c, 0);
+    amf_cursor_checkerr(c);
+
+    for (;;) {
+        amf_cursor_read_u16(c, &len);
+        amf_cursor_checkerr(c);
+
+        amf_cursor_need(c, 1);
+        if (len == 0 && c->p[0] == AMF0_END_OF_OBJECT) {
+            amf_cursor_consume(c, 1);
+            amf_cursor_leave(c);
+            return;
+        }
+
+        amf_cursor_string(c, len);
+        amf_cursor_checkerr(c);
+        amf_cursor_grow(c, AMF_CUR_SLOT_SIZE);
+        amf_cursor_checkerr(c);
+
+        amf_cursor_skip(c, len);
+
+        amf0_skip(c);
+        amf_cursor_checkerr(c);
+    }
+}
+
+void
+amf0_skip(amf_cursor *c)
+{
+    uint16_t    u16;
+    uint32_t    u32;
+
+    amf_cursor_need(c, 1);
+
+    switch (c->p[0]) {
+    case AMF0_NULL:
+    case AMF0_UNDEFINED:
+        amf_cursor_consume(c, 1);
+        break;
+
+    case AMF0_BOOLEAN:
+        amf_cursor_skip(c, 2);
+        break;
+
+    case AMF0_NUMBER:
+        amf_cursor_skip(c, 9);
+        break;
+
+    case AMF0_REFERENCE:
+        amf_cursor_skip(c, 3);
+        break;
+
+    case AMF0_STRING:
+        amf_cursor_consume(c, 1);
+        amf_cursor_read_u16(c, &u16);
+        amf_cursor_checkerr(c);
+        amf_cursor_string(c, u16);
+        amf_cursor_checkerr(c);
+        amf_cursor_skip(c, u16);
+        break;
+
+    case AMF0_L_STRING:
+        amf_cursor_consume(c, 1);
+        amf_cursor_read_u32(c, &u32);
+        amf_cursor_checkerr(c);
+        amf_cursor_string(c, u32);
+        amf_cursor_checkerr(c);
+        amf_cursor_skip(c, u32);
+        break;
+
+    case AMF0_OBJECT:
+        amf_cursor_consume(c, 1);
+        amf0_skip_properties(c);
+        break;
+
+    case AMF0_ECMA_ARRAY:
+        amf_cursor_skip(c, 5);
+        amf0_skip_properties(c);
+        break;
+
+    case AMF0_TYPED_OBJECT:
+        amf_cursor_consume(c, 1);
+        amf_cursor_read_u16(c, &u16);
+        amf_cursor_checkerr(c);
+        amf_cursor_string(c, u16);
+        amf_cursor_checkerr(c);
+        amf_cursor_skip(c, u16);
+        amf0_skip_properties(c);
+        break;
+
+    case AMF0_STRICT_ARRAY:
+        amf_cursor_consume(c, 1);
+        amf_cursor_read_u32(c, &u32);
+        amf_cursor_checkerr(c);
+
+        amf_skip_enter(c, u32);
+        amf_cursor_checkerr(c);
+
+        for (uint32_t i = 0; i < u32; i++) {
+            amf0_skip(c);
+            amf_cursor_checkerr(c);
+        }
+
+        amf_cursor_leave(c);
+        break;
+
+    case AMF0_AVMPLUS:
+        amf_cursor_consume(c, 1);
+        amf3_skip(c);
+        break;
+
+    default:
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported type";
+    }
+}
@@ -6,49 +6,100 @@
 
 #include "amf_buf.h"
 #include "amf_cursor.h"
+#include "amf_types.h"
 
-#define AMF_VER0            0
-#define AMF_VER3            3
-
-#define AMF0_NUMBER         0
-#define AMF0_BOOLEAN        1
-#define AMF0_STRING         2
-#define AMF0_OBJECT         3
-#define AMF0_NULL           5
-#define AMF0_UNDEFINED      6
-#define AMF0_REFERENCE      7
-#define AMF0_ECMA_ARRAY     8
-#define AMF0_END_OF_OBJECT  9
-#define AMF0_STRICT_ARRAY   10
-#define AMF0_L_STRING       12
-#define AMF0_TYPED_OBJECT   16
-#define AMF0_AVMPLUS        17
-
-#define AMF3_UNDEFINED      0x00
-#define AMF3_NULL           0x01
-#define AMF3_FALSE          0x02
-#define AMF3_TRUE           0x03
-#define AMF3_INTEGER        0x04
-#define AMF3_DOUBLE         0x05
-#define AMF3_STRING         0x06
-#define AMF3_XMLDOC         0x07
-#define AMF3_DATE           0x08
-#define AMF3_ARRAY          0x09
-#define AMF3_OBJECT         0x0a // no support
-#define AMF3_XML            0x0b
-#define AMF3_BYTEARRAY      0x0c
-
-#define AMF3_MAX_UINT    536870912
-#define AMF3_MAX_INT     268435455 //  (2^28)-1
-#define AMF3_MIN_INT    -268435456 // -(2^28)
-
-#define AMF3_MAX_STR_LEN    268435455
-#define AMF3_MAX_REFERENCES 268435455
-
-void amf0_encode(lua_State *L, amf_buf *buf, int avmplus, int index, int obj_ref_idx);
+/*
+ * encoder state, the ref indices point at lua tables on the stack
+ *
+ * ridx:        amf0 object references, 0 with AMF_ENC_NO_OBJ_REFS
+ * sidx, oidx:  amf3 string and object references, 0 with AMF_ENC_NO_STR_REFS
+ *              and AMF_ENC_NO_OBJ_REFS
+ * tidx:        amf3 traits references
+ * kidx:        strings of integer keys, 0 outside amf3_encode
+ * warm:        the reference tables kept by a session, 0 for new ones
+ * traits_base: traits references the reader already knows of
+ * slots:       template slot recorder, NULL unless building a template
+ * trace:       trace ring, NULL when not tracing
+ * flags:       AMF_ENC_*
+ * depth:       tables being written
+ * max_depth:   nesting that fails to encode, 0 for no limit
+ */
+typedef struct amf_enc {
+    amf_buf             *buf;
+    int                  ridx;
+    int                  sidx, oidx, tidx;
+    int                  kidx;
+    int                  warm;
+    int                  traits_base;
+    struct amf_slots    *slots;
+    struct amf_trace    *trace;
+    int                  flags;
+    int                  depth, max_depth;
+} amf_enc;
+
+/*
+ * without object references every table is written in full, so shared
+ * tables are copied and a cycle only ends at max_depth
+ */
+#define AMF_ENC_NO_OBJ_REFS     0x01
+#define AMF_ENC_NO_STR_REFS     0x02
+
+/* max_depth of an encoder without object references unless told */
+#define AMF_ENC_MAX_DEPTH       1024
+
+void amf_enc_init(amf_enc *e, amf_buf *buf);
+
+/*
+ * the reference tables at warm, the amf0 ones and then the amf3 string,
+ * object and traits ones, which a scope empties when done with them
+ */
+#define AMF_WARM_REFS           1
+#define AMF_WARM_STRS           2
+#define AMF_WARM_OBJS           3
+#define AMF_WARM_TRAITS         4
+
+/* encode with fresh reference tables, or the ones at warm emptied */
+void amf0_encode_scope(lua_State *L, amf_enc *e, int avmplus, int index);
+void amf3_encode_scope(lua_State *L, amf_enc *e, int index);
+
+/* empty the tables at warm after an encode that failed part way */
+void amf_enc_clear(lua_State *L, amf_enc *e);
+
+void amf0_encode(lua_State *L, amf_enc *e, int avmplus, int index);
 void amf0_decode(lua_State *L, amf_cursor *cur, int obj_ref_idx);
 
-void amf3_encode(lua_State *L, amf_buf *buf, int index, int sidx, int oidx, int tidx);
+/*
+ * reader for an externalizable class body, must push exactly one value or
+ * set the cursor error. the table at the stack top is what references to
+ * the object stand for, the last one of obj_ref_idx, a reader that fills
+ * and pushes it keeps the cycles through the object.
+ */
+typedef void (*amf3_ext_reader)(lua_State *L, amf_cursor *cur, const char *alias,
+                                int str_ref_idx, int obj_ref_idx, int traits_ref_idx);
+
+/*
+ * register a reader for an externalizable class alias with L, a NULL alias
+ * sets the reader used for classes without a registered one. the flex
+ * wrappers and small messages have their readers unless registered over.
+ */
+int amf3_register_externalizable(lua_State *L, const char *alias, amf3_ext_reader reader);
+
+void amf3_encode(lua_State *L, amf_enc *e, int index);
+void amf3_encode_external_traits(lua_State *L, amf_enc *e, int alias_idx);
+void amf3_encode_bytearray(lua_State *L, amf_enc *e, const char *b, size_t len);
 void amf3_decode(lua_State *L, amf_cursor *cur, int str_ref_idx, int obj_ref_idx, int traits_ref_idx);
 
+/* a string without marker, the names of sol entries */
+void amf3_decode_str(lua_State *L, amf_cursor *c, int sidx);
+
+/*
+ * walk past a value without decoding it. externalizable classes can only
+ * be skipped if they have a native reader.
+ */
+typedef struct amf3_skip_ctx amf3_skip_ctx;
+
+void amf0_skip(amf_cursor *cur);
+void amf3_skip(amf_cursor *cur);
+void amf3_skip_value(amf_cursor *cur, amf3_skip_ctx *ctx);
+
 #endif /* end of include guard: AMF_H */
@@ -0,0 +1,812 @@
+#include "amf_convert.h"
+#include "amf_reader.h"
+#include "amf_vec.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * where a referable input value went in the output: its bytes, end is 0
+ * while it is being written, and the reference slot it took, or -1 when
+ * it took none. slots counts the slots it and its members took, a copy
+ * of its bytes takes as many again.
+ */
+typedef struct cv_ref {
+    size_t              start, end;
+    long                idx;
+    uint32_t            first, slots;
+} cv_ref;
+
+/* the dynamic traits amf3 output gives the objects of amf0 input */
+typedef struct cv_alias {
+    amf_str             alias;
+    uint32_t            idx;
+} cv_alias;
+
+/*
+ * refs:                    the referable input values by their number in
+ *                          the reader, the tag of its traits is their
+ *                          index once written as amf3
+ *
+ * output tables
+ * nrefs:                   reference slots taken, amf0 objects and arrays
+ *                          or the amf3 object table
+ * ntraits, ostrs, aliases: amf3 traits count, strings by content, and
+ *                          the traits of amf0 objects by alias
+ */
+typedef struct cv_conv {
+    amf_cursor         *c;
+    amf_buf            *out;
+    int                 to;
+
+    amf_reader          r;
+    amf_vec             refs;
+
+    uint32_t            nrefs, ntraits;
+    amf_map             ostrs;
+    amf_vec             aliases;
+} cv_conv;
+
+static void cv_value(cv_conv *cv);
+
+static void
+cv_error(cv_conv *cv, const char *msg)
+{
+    cv->c->err = AMF_CUR_ERR_BADFMT;
+    cv->c->err_msg = msg;
+}
+
+static void
+cv_push(cv_conv *cv, amf_vec *v, const void *item, size_t size)
+{
+    if (amf_vec_push(v, item, size)) {
+        cv_error(cv, "out of memory");
+    }
+}
+
+/*
+ * writer, each value as amf0 or amf3 by cv->to
+ */
+
+/* an amf3 string, by reference when it was written before */
+static void
+cv_w3_str(cv_conv *cv, const char *p, size_t len)
+{
+    long ref;
+
+    if (len == 0) {
+        amf_buf_append_char(cv->out, 0x01);
+        return;
+    }
+
+    if (len > AMF3_MAX_STR_LEN) {
+        cv_error(cv, "string too long");
+        return;
+    }
+
+    ref = amf_map_find(&cv->ostrs, p, (uint32_t)len);
+    if (ref >= 0) {
+        amf_buf_append_u29(cv->out, (int)(ref << 1));
+        return;
+    }
+
+    if (amf_map_put(&cv->ostrs, p, (uint32_t)len)) {
+        cv_error(cv, "out of memory");
+        return;
+    }
+
+    amf_buf_append_u29(cv->out, (int)(len << 1 | 1));
+    amf_buf_append(cv->out, p, len);
+}
+
+static void
+cv_w0_key(cv_conv *cv, const char *p, size_t len)
+{
+    /* an empty name ends the members in amf0 */
+    if (len == 0 || len > UINT16_MAX) {
+        cv_error(cv, len ? "key too long" : "empty key");
+        return;
+    }
+
+    amf_buf_append_u16(cv->out, (uint16_t)len);
+    amf_buf_append(cv->out, p, len);
+}
+
+static void
+cv_w_undefined(cv_conv *cv)
+{
+    amf_buf_append_char(cv->out, cv->to == AMF_VER0 ? AMF0_UNDEFINED : AMF3_UNDEFINED);
+}
+
+static void
+cv_w_null(cv_conv *cv)
+{
+    amf_buf_append_char(cv->out, cv->to == AMF_VER0 ? AMF0_NULL : AMF3_NULL);
+}
+
+static void
+cv_w_bool(cv_conv *cv, int b)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_BOOLEAN);
+        amf_buf_append_char(cv->out, b != 0);
+    } else {
+        amf_buf_append_char(cv->out, b ? AMF3_TRUE : AMF3_FALSE);
+    }
+}
+
+static void
+cv_w_int(cv_conv *cv, int32_t i)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_NUMBER);
+        amf_buf_append_double(cv->out, i);
+    } else {
+        amf_buf_append_char(cv->out, AMF3_INTEGER);
+        amf_buf_append_u29(cv->out, i);
+    }
+}
+
+/* amf0 numbers in the amf3 integer range are written as integers, as encode does */
+static void
+cv_w_number(cv_conv *cv, double d, int is_double)
+{
+    if (cv->to == AMF_VER3 && !is_double
+        && floor(d) == d && d >= AMF3_MIN_INT && d <= AMF3_MAX_INT)
+    {
+        cv_w_int(cv, (int32_t)d);
+        return;
+    }
+
+    amf_buf_append_char(cv->out, cv->to == AMF_VER0 ? AMF0_NUMBER : AMF3_DOUBLE);
+    amf_buf_append_double(cv->out, d);
+}
+
+static void
+cv_w_string(cv_conv *cv, const char *p, size_t len)
+{
+    if (cv->to == AMF_VER3) {
+        amf_buf_append_char(cv->out, AMF3_STRING);
+        cv_w3_str(cv, p, len);
+        return;
+    }
+
+    if (len <= UINT16_MAX) {
+        amf_buf_append_char(cv->out, AMF0_STRING);
+        amf_buf_append_u16(cv->out, (uint16_t)len);
+    } else {
+        amf_buf_append_char(cv->out, AMF0_L_STRING);
+        amf_buf_append_u32(cv->out, (uint32_t)len);
+    }
+
+    amf_buf_append(cv->out, p, len);
+}
+
+/*
+ * xml, byte arrays and dates take a slot of the amf3 object table. amf0
+ * has no byte arrays, they are written behind the avmplus marker.
+ */
+static void
+cv_w_xml(cv_conv *cv, const char *p, size_t len, int marker)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_XML_DOC);
+        amf_buf_append_u32(cv->out, (uint32_t)len);
+        amf_buf_append(cv->out, p, len);
+        return;
+    }
+
+    if (len > AMF3_MAX_STR_LEN) {
+        cv_error(cv, "string too long");
+        return;
+    }
+
+    amf_buf_append_char(cv->out, (char)marker);
+    amf_buf_append_u29(cv->out, (int)(len << 1 | 1));
+    amf_buf_append(cv->out, p, len);
+    cv->nrefs++;
+}
+
+static void
+cv_w_bytes(cv_conv *cv, const char *p, size_t len)
+{
+    if (len > AMF3_MAX_STR_LEN) {
+        cv_error(cv, "byte array too long");
+        return;
+    }
+
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_AVMPLUS);
+    } else {
+        cv->nrefs++;
+    }
+
+    amf_buf_append_char(cv->out, AMF3_BYTEARRAY);
+    amf_buf_append_u29(cv->out, (int)(len << 1 | 1));
+    amf_buf_append(cv->out, p, len);
+}
+
+static void
+cv_w_date(cv_conv *cv, double d)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_DATE);
+        amf_buf_append_double(cv->out, d);
+        amf_buf_append_u16(cv->out, 0);
+        return;
+    }
+
+    amf_buf_append_char(cv->out, AMF3_DATE);
+    amf_buf_append_u29(cv->out, 1);
+    amf_buf_append_double(cv->out, d);
+    cv->nrefs++;
+}
+
+/* the traits ti of the amf3 input, inline the first time */
+static void
+cv_w3_traits(cv_conv *cv, long ti)
+{
+    amf_traits *t = amf_reader_traits(&cv->r, ti);
+    amf_str    *name;
+
+    if (t->tag >= 0) {
+        amf_buf_append_u29(cv->out, (int)(t->tag << 2 | 1));
+        return;
+    }
+
+    if (t->nmembers > AMF3_MAX_INT >> 4) {
+        cv_error(cv, "too many members");
+        return;
+    }
+
+    t->tag = cv->ntraits++;
+    amf_buf_append_u29(cv->out, (int)(t->nmembers << 4 | (t->dynamic ? 8 : 0) | 3));
+    cv_w3_str(cv, t->alias.p, t->alias.len);
+
+    for (uint32_t i = 0; i < t->nmembers; i++) {
+        name = amf_reader_member(&cv->r, t, i);
+        cv_w3_str(cv, name->p, name->len);
+    }
+}
+
+/* dynamic traits for the objects of an amf0 alias */
+static void
+cv_w3_alias(cv_conv *cv, const char *p, size_t len)
+{
+    cv_alias a;
+
+    for (uint32_t i = 0; i < cv->aliases.n; i++) {
+        a = amf_vec_at(&cv->aliases, cv_alias, i);
+
+        /* the alias of a plain object has no bytes */
+        if (a.alias.len == len && (len == 0 || memcmp(a.alias.p, p, len) == 0)) {
+            amf_buf_append_u29(cv->out, (int)(a.idx << 2 | 1));
+            return;
+        }
+    }
+
+    a.alias.p = p;
+    a.alias.len = len;
+    a.idx = cv->ntraits++;
+    cv_push(cv, &cv->aliases, &a, sizeof(a));
+
+    amf_buf_append_u29(cv->out, 0x0b);
+    cv_w3_str(cv, p, len);
+}
+
+/* ti indexes the traits of amf3 input, -1 for an amf0 object of alias */
+static void
+cv_w_object_begin(cv_conv *cv, const amf_str *alias, long ti)
+{
+    cv->nrefs++;
+
+    if (cv->to == AMF_VER3) {
+        amf_buf_append_char(cv->out, AMF3_OBJECT);
+
+        if (ti >= 0) {
+            cv_w3_traits(cv, ti);
+        } else {
+            cv_w3_alias(cv, alias->p, alias->len);
+        }
+        return;
+    }
+
+    if (alias->len > UINT16_MAX) {
+        cv_error(cv, "class alias too long");
+        return;
+    }
+
+    if (alias->len) {
+        amf_buf_append_char(cv->out, AMF0_TYPED_OBJECT);
+        amf_buf_append_u16(cv->out, (uint16_t)alias->len);
+        amf_buf_append(cv->out, alias->p, alias->len);
+    } else {
+        amf_buf_append_char(cv->out, AMF0_OBJECT);
+    }
+}
+
+/* the name of a sealed member, amf3 has them in the traits */
+static void
+cv_w_member(cv_conv *cv, const amf_str *name)
+{
+    if (cv->to == AMF_VER0) {
+        cv_w0_key(cv, name->p, name->len);
+    }
+}
+
+/* the name of a dynamic member or associative array key */
+static void
+cv_w_key(cv_conv *cv, const char *p, size_t len)
+{
+    if (cv->to == AMF_VER0) {
+        cv_w0_key(cv, p, len);
+    } else {
+        cv_w3_str(cv, p, len);
+    }
+}
+
+static void
+cv_w_object_end(cv_conv *cv, int dynamic)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_u16(cv->out, 0);
+        amf_buf_append_char(cv->out, AMF0_END_OF_OBJECT);
+    } else if (dynamic) {
+        amf_buf_append_char(cv->out, 0x01);
+    }
+}
+
+static void
+cv_w_array(cv_conv *cv, uint32_t len)
+{
+    cv->nrefs++;
+
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_STRICT_ARRAY);
+        amf_buf_append_u32(cv->out, len);
+        return;
+    }
+
+    if (len > AMF3_MAX_INT) {
+        cv_error(cv, "array too long");
+        return;
+    }
+
+    amf_buf_append_char(cv->out, AMF3_ARRAY);
+    amf_buf_append_u29(cv->out, (int)(len << 1 | 1));
+    amf_buf_append_char(cv->out, 0x01);
+}
+
+/*
+ * an array with named keys: an amf0 ecma array, whose count is patched at
+ * its end and whose dense part is keyed by index from 1 as in lua, or an amf3 array
+ * with an associative part. returns where the count goes.
+ */
+static size_t
+cv_w_ecma_begin(cv_conv *cv, uint32_t dense)
+{
+    size_t pos = cv->out->len + 1;
+
+    cv->nrefs++;
+
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_char(cv->out, AMF0_ECMA_ARRAY);
+        amf_buf_append_u32(cv->out, 0);
+        return pos;
+    }
+
+    amf_buf_append_char(cv->out, AMF3_ARRAY);
+    amf_buf_append_u29(cv->out, (int)(dense << 1 | 1));
+
+    return pos;
+}
+
+/* the named keys are done, the dense part follows */
+static void
+cv_w_ecma_dense(cv_conv *cv)
+{
+    if (cv->to == AMF_VER3) {
+        amf_buf_append_char(cv->out, 0x01);
+    }
+}
+
+static void
+cv_w_ecma_index(cv_conv *cv, uint32_t i)
+{
+    char key[16];
+
+    if (cv->to == AMF_VER0) {
+        cv_w0_key(cv, key, snprintf(key, sizeof(key), "%u", (unsigned)i + 1));
+    }
+}
+
+static void
+cv_w_ecma_end(cv_conv *cv, size_t pos, uint32_t count)
+{
+    if (cv->to == AMF_VER0) {
+        amf_buf_append_u16(cv->out, 0);
+        amf_buf_append_char(cv->out, AMF0_END_OF_OBJECT);
+        amf_buf_put_u32(cv->out, pos, count);
+    }
+}
+
+/* a referable input value about to be written, they come in the order of their numbers */
+static void
+cv_open_ref(cv_conv *cv)
+{
+    cv_ref r;
+
+    r.start = cv->out->len;
+    r.end = 0;
+    r.idx = cv->nrefs;
+    r.first = cv->nrefs;
+    r.slots = 0;
+
+    cv_push(cv, &cv->refs, &r, sizeof(r));
+}
+
+static void
+cv_close_ref(cv_conv *cv, uint32_t ref)
+{
+    cv_ref *r = &amf_vec_at(&cv->refs, cv_ref, ref);
+
+    r->end = cv->out->len;
+    r->slots = cv->nrefs - r->first;
+
+    /* nothing written took a slot, a flex wrapper of a reference or an amf0 date */
+    if (r->slots == 0) {
+        r->idx = -1;
+    }
+}
+
+/*
+ * a reference of the input: a reference of the output to its slot, the
+ * marker of an amf3 one is the first byte written for the value. values
+ * without a slot, or past the amf0 reference range, are copied.
+ */
+static void
+cv_w_ref(cv_conv *cv, const cv_ref *r)
+{
+    amf_buf *out = cv->out;
+
+    if (r->idx >= 0 && cv->to == AMF_VER0 && r->idx <= UINT16_MAX) {
+        amf_buf_append_char(out, AMF0_REFERENCE);
+        amf_buf_append_u16(out, (uint16_t)r->idx);
+        return;
+    }
+
+    if (r->idx >= 0 && cv->to == AMF_VER3 && r->idx <= AMF3_MAX_REFERENCES) {
+        amf_buf_append_char(out, out->b[r->start]);
+        amf_buf_append_u29(out, (int)(r->idx << 1));
+        return;
+    }
+
+    if (r->end == 0) {
+        cv_error(cv, "cyclic reference");
+        return;
+    }
+
+    /* copies of copies grow the output without bound but for the alloc limit */
+    amf_cursor_copy(cv->c, r->end - r->start);
+    amf_cursor_checkerr(cv->c);
+
+    amf_buf_reserve(out, r->end - r->start);
+    amf_buf_append(out, out->b + r->start, r->end - r->start);
+    cv->nrefs += r->slots;
+}
+
+/*
+ * reader
+ */
+
+/* the members of an object, or the items of a dense array, up to its end */
+static void
+cv_entries(cv_conv *cv)
+{
+    amf_cursor *c = cv->c;
+    amf_str     key;
+    int         next;
+
+    while ((next = amf_reader_next(&cv->r, &key)) != AMF_NEXT_END) {
+        if (next == AMF_NEXT_MEMBER) {
+            cv_w_member(cv, &key);
+        } else if (next == AMF_NEXT_KEY) {
+            cv_w_key(cv, key.p, key.len);
+        }
+
+        cv_value(cv);
+        amf_cursor_checkerr(c);
+    }
+}
+
+/*
+ * an array with named keys, an amf0 ecma array or an amf3 array with an
+ * associative part: the keys come first, then the dense part
+ */
+static void
+cv_mixed(cv_conv *cv, const amf_item *it)
+{
+    amf_cursor *c = cv->c;
+    amf_str     key;
+    uint32_t    n = 0, i = 0;
+    size_t      pos;
+    int         next;
+
+    pos = cv_w_ecma_begin(cv, it->len);
+    amf_cursor_checkerr(c);
+
+    while ((next = amf_reader_next(&cv->r, &key)) == AMF_NEXT_KEY) {
+        cv_w_key(cv, key.p, key.len);
+        cv_value(cv);
+        amf_cursor_checkerr(c);
+        n++;
+    }
+    amf_cursor_checkerr(c);
+
+    cv_w_ecma_dense(cv);
+
+    for (; next == AMF_NEXT_ITEM; next = amf_reader_next(&cv->r, &key)) {
+        cv_w_ecma_index(cv, i++);
+        cv_value(cv);
+        amf_cursor_checkerr(c);
+    }
+    amf_cursor_checkerr(c);
+
+    cv_w_ecma_end(cv, pos, n + i);
+}
+
+static void
+cv_value(cv_conv *cv)
+{
+    amf_cursor *c = cv->c;
+    amf_item    it;
+
+    amf_reader_value(&cv->r, &it);
+    amf_cursor_checkerr(c);
+
+    if (it.type == AMF_ITEM_REF) {
+        cv_w_ref(cv, &amf_vec_at(&cv->refs, cv_ref, it.ref));
+        return;
+    }
+
+    if (it.referable) {
+        cv_open_ref(cv);
+        amf_cursor_checkerr(c);
+    }
+
+    switch (it.type) {
+    case AMF_ITEM_UNDEFINED:
+        cv_w_undefined(cv);
+        break;
+
+    case AMF_ITEM_NULL:
+        cv_w_null(cv);
+        break;
+
+    case AMF_ITEM_BOOL:
+        cv_w_bool(cv, it.i);
+        break;
+
+    case AMF_ITEM_INT:
+        cv_w_int(cv, it.i);
+        break;
+
+    case AMF_ITEM_NUMBER:
+        /* amf0 has no integers, its numbers may become amf3 ones */
+        cv_w_number(cv, it.d, it.amf3);
+        break;
+
+    case AMF_ITEM_STRING:
+        cv_w_string(cv, it.s.p, it.s.len);
+        break;
+
+    case AMF_ITEM_XMLDOC:
+        cv_w_xml(cv, it.s.p, it.s.len, AMF3_XMLDOC);
+        break;
+
+    case AMF_ITEM_XML:
+        cv_w_xml(cv, it.s.p, it.s.len, AMF3_XML);
+        break;
+
+    case AMF_ITEM_BYTEARRAY:
+        cv_w_bytes(cv, it.s.p, it.s.len);
+        break;
+
+    case AMF_ITEM_DATE:
+        cv_w_date(cv, it.d);
+        break;
+
+    case AMF_ITEM_ARRAY:
+        if (it.mixed) {
+            cv_mixed(cv, &it);
+            break;
+        }
+
+        cv_w_array(cv, it.len);
+        amf_cursor_checkerr(c);
+        cv_entries(cv);
+        break;
+
+    case AMF_ITEM_OBJECT:
+        cv_w_object_begin(cv, &it.alias, it.traits);
+        amf_cursor_checkerr(c);
+        cv_entries(cv);
+        amf_cursor_checkerr(c);
+        cv_w_object_end(cv, it.dynamic);
+        break;
+
+    case AMF_ITEM_EXTERNAL:
+        /* the flex wrappers take the slot of the value they wrap */
+        cv_entries(cv);
+        break;
+    }
+    amf_cursor_checkerr(c);
+
+    if (it.referable) {
+        cv_close_ref(cv, it.ref);
+    }
+}
+
+static void
+cv_init(cv_conv *cv, amf_cursor *c, int from, int to, amf_buf *out)
+{
+    memset(cv, 0, sizeof(*cv));
+    cv->c = c;
+    cv->out = out;
+    cv->to = to;
+    cv->ostrs.str = 1;
+
+    amf_reader_init(&cv->r, c, from);
+    cv->r.max_depth = AMF_CONVERT_MAX_DEPTH;
+}
+
+/* drop the tables, every message value starts with empty ones */
+static void
+cv_clear(cv_conv *cv)
+{
+    amf_reader_reset(&cv->r);
+    cv->refs.n = 0;
+    amf_vec_free(&cv->aliases);
+    amf_map_free(&cv->ostrs);
+    cv->nrefs = cv->ntraits = 0;
+}
+
+static void
+cv_free(cv_conv *cv)
+{
+    cv_clear(cv);
+    amf_reader_free(&cv->r);
+    amf_vec_free(&cv->refs);
+}
+
+void
+amf_convert(amf_cursor *c, int from, int to, amf_buf *out)
+{
+    cv_conv cv;
+
+    cv_init(&cv, c, from, to, out);
+    cv_value(&cv);
+    cv_free(&cv);
+}
+
+/*
+ * messages
+ */
+
+static void
+cv_msg_str(cv_conv *cv)
+{
+    amf_cursor *c = cv->c;
+    uint16_t    len;
+
+    amf_cursor_read_u16(c, &len);
+    amf_cursor_checkerr(c);
+    amf_cursor_need(c, len);
+
+    amf_buf_append_u16(cv->out, len);
+    amf_buf_append(cv->out, c->p, len);
+    amf_cursor_consume(c, len);
+}
+
+/* a header or body value behind its content length, written with the new length */
+static void
+cv_msg_content(cv_conv *cv)
+{
+    amf_cursor *c = cv->c;
+    amf_buf    *out = cv->out;
+    const char *start;
+    size_t      left, pos;
+    uint32_t    len;
+
+    amf_cursor_read_u32(c, &len);
+    amf_cursor_checkerr(c);
+
+    pos = out->len;
+    amf_buf_append_u32(out, 0);
+
+    if (cv->to == AMF_VER3) {
+        amf_buf_append_char(out, AMF0_AVMPLUS);
+    }
+
+    if (len == AMF_MSG_UNKNOWN_LEN || len == 0) {
+        cv_value(cv);
+
+    } else {
+        amf_cursor_need(c, len);
+        start = c->p;
+        left = c->left;
+
+        /* the value may not read past its length */
+        c->left = len;
+        cv_value(cv);
+        amf_cursor_checkerr(c);
+
+        c->p = start + len;
+        c->left = left - len;
+    }
+
+    cv_clear(cv);
+    amf_buf_put_u32(out, pos, (uint32_t)(out->len - pos - 4));
+}
+
+void
+amf_convert_msg(amf_cursor *c, int to, amf_buf *out)
+{
+    cv_conv     cv;
+    uint16_t    version, n;
+    uint8_t     must_understand;
+
+    cv_init(&cv, c, AMF_VER0, to, out);
+
+    amf_cursor_read_u16(c, &version);
+    amf_cursor_read_u16(c, &n);
+    if (c->err) {
+        return;
+    }
+
+    amf_buf_append_u16(out, (uint16_t)to);
+    amf_buf_append_u16(out, n);
+
+    /* a header takes 8 bytes at least */
+    if ((size_t)n * 8 > c->left) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return;
+    }
+
+    for (unsigned int i = 0; i < n && !c->err; i++) {
+        cv_msg_str(&cv);
+        amf_cursor_read_u8(c, &must_understand);
+        if (!c->err) {
+            amf_buf_append_char(out, (char)must_understand);
+            cv_msg_content(&cv);
+        }
+    }
+
+    if (!c->err) {
+        amf_cursor_read_u16(c, &n);
+    }
+
+    /* and a body 9 */
+    if (!c->err && (size_t)n * 9 > c->left) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+    }
+
+    if (!c->err) {
+        amf_buf_append_u16(out, n);
+    }
+
+    for (unsigned int i = 0; i < n && !c->err; i++) {
+        cv_msg_str(&cv);
+        if (!c->err) {
+            cv_msg_str(&cv);
+        }
+        if (!c->err) {
+            cv_msg_content(&cv);
+        }
+    }
+
+    cv_free(&cv);
+}
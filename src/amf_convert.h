@@ -0,0 +1,32 @@
+#ifndef AMF_CONVERT_H
+
+#define AMF_CONVERT_H
+
+#include "amf_buf.h"
+#include "amf_cursor.h"
+#include "amf_types.h"
+
+/*
+ * amf0 to amf3 and back, byte to byte without lua or a document. values
+ * are written as they are read; references become references of the
+ * output where it has them and copies of the output already written
+ * where it does not. amf0 to amf0 writes avmplus values as plain amf0.
+ */
+
+/* nesting deeper than this fails */
+#define AMF_CONVERT_MAX_DEPTH   1024
+
+/*
+ * append the value of from at the cursor to out as to, the cursor ends
+ * behind the value or holds the error. the limits of the cursor hold for
+ * the input, and their alloc for the references copied too.
+ */
+void amf_convert(amf_cursor *c, int from, int to, amf_buf *out);
+
+/*
+ * the same for a remoting message: the values are written as amf0, or
+ * behind the avmplus marker for version 3
+ */
+void amf_convert_msg(amf_cursor *c, int to, amf_buf *out);
+
+#endif /* end of include guard: AMF_CONVERT_H */
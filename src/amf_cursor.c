@@ -12,6 +12,12 @@ amf_cursor_new(const char *p, size_t len)
     cur->left = len;
     cur->err = AMF_CUR_NO_ERR;
     cur->err_msg = NULL;
+    cur->base = p;
+    cur->trace = NULL;
+    cur->limits = NULL;
+    cur->depth = 0;
+    cur->elements = 0;
+    cur->alloc = 0;
 
     return cur;
 }
@@ -42,7 +48,7 @@ void
 amf_cursor_read_u32(amf_cursor *c, uint32_t *i)
 {
     amf_cursor_need(c, 4);
-    *i = (c->p[0] & 0xff) << 24
+    *i = (uint32_t)(c->p[0] & 0xff) << 24
           | ((c->p[1] & 0xff) << 16)
           | ((c->p[2] & 0xff) << 8)
           | ((c->p[3] & 0xff));
@@ -85,3 +91,113 @@ amf_cursor_read_str(amf_cursor *c, const char **s, size_t *len)
     amf_cursor_consume(c, slen);
     *len = slen;
 }
+
+static void
+amf_cursor_limit(amf_cursor *c, const char *msg)
+{
+    c->err = AMF_CUR_ERR_BADFMT;
+    c->err_msg = msg;
+}
+
+/* count n items against the elements limit */
+static void
+amf_cursor_elements(amf_cursor *c, size_t n)
+{
+    if (n > c->limits->elements - c->elements) {
+        amf_cursor_limit(c, "too many elements");
+        return;
+    }
+
+    c->elements += n;
+}
+
+/* count size bytes against the alloc limit */
+static void
+amf_cursor_alloc(amf_cursor *c, size_t size)
+{
+    if (size > c->limits->alloc - c->alloc) {
+        amf_cursor_limit(c, "allocation limit exceeded");
+        return;
+    }
+
+    c->alloc += size;
+}
+
+void
+amf_cursor_enter(amf_cursor *c, size_t n, size_t size)
+{
+    const amf_limits *l = c->limits;
+
+    if (c->depth >= (l && l->depth ? l->depth : AMF_CUR_MAX_DEPTH)) {
+        amf_cursor_limit(c, "nested too deep");
+        return;
+    }
+
+    if (n > c->left) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return;
+    }
+
+    if (l) {
+        if (l->elements) {
+            amf_cursor_elements(c, n);
+            amf_cursor_checkerr(c);
+        }
+
+        if (l->alloc) {
+            amf_cursor_alloc(c, size);
+            amf_cursor_checkerr(c);
+        }
+    }
+
+    c->depth++;
+}
+
+void
+amf_cursor_grow(amf_cursor *c, size_t size)
+{
+    const amf_limits *l = c->limits;
+
+    if (l == NULL) {
+        return;
+    }
+
+    if (l->elements) {
+        amf_cursor_elements(c, 1);
+        amf_cursor_checkerr(c);
+    }
+
+    if (l->alloc) {
+        amf_cursor_alloc(c, size);
+    }
+}
+
+void
+amf_cursor_string(amf_cursor *c, size_t len)
+{
+    const amf_limits *l = c->limits;
+
+    if (l == NULL) {
+        return;
+    }
+
+    if (l->string && len > l->string) {
+        amf_cursor_limit(c, "string too long");
+        return;
+    }
+
+    if (l->alloc) {
+        amf_cursor_alloc(c, AMF_CUR_STRING_SIZE + len);
+    }
+}
+
+void
+amf_cursor_copy(amf_cursor *c, size_t len)
+{
+    const amf_limits *l = c->limits;
+
+    if (l && l->alloc) {
+        amf_cursor_alloc(c, len);
+    }
+}
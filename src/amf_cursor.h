@@ -9,12 +9,56 @@
 #define AMF_CUR_ERR_EOF    1
 #define AMF_CUR_ERR_BADFMT 2
 
+/*
+ * containers inside each other a decode takes without limits. each takes
+ * up to 3 slots of the lua stack, which lua 5.1 caps at 8000 for a c call.
+ */
+#define AMF_CUR_MAX_DEPTH  2048
+
+/* the rough sizes the alloc limit counts, strings add their bytes */
+#define AMF_CUR_TABLE_SIZE  64
+#define AMF_CUR_SLOT_SIZE   32
+#define AMF_CUR_STRING_SIZE 32
+
+struct amf_trace;
+
+/*
+ * limits of a decode, 0 for none:
+ * depth:    containers inside each other, AMF_CUR_MAX_DEPTH for 0
+ * elements: items and properties of all containers together
+ * string:   bytes of one string
+ * alloc:    bytes of the strings and tables of the whole decode, and of
+ *           the references a transcoder writes again by copying
+ */
+typedef struct amf_limits {
+    uint32_t depth;
+    uint32_t elements;
+    size_t string;
+    size_t alloc;
+} amf_limits;
+
+/*
+ * base:   where offsets are counted from, p when the cursor is created
+ * trace:  trace ring of the decode, NULL when not tracing
+ * limits: limits of the decode, NULL for the defaults
+ * depth:  containers open at p
+ * elements: items counted against limits->elements so far
+ * alloc:  bytes counted against limits->alloc so far
+ */
 typedef struct amf_cursor {
     const char *p;
     size_t left;
 
     int err;
     const char *err_msg;
+
+    const char *base;
+    struct amf_trace *trace;
+
+    const amf_limits *limits;
+    uint32_t depth;
+    size_t elements;
+    size_t alloc;
 } amf_cursor;
 
 #define amf_cursor_consume(c, len) do { \
@@ -48,5 +92,22 @@ void amf_cursor_read_u32(amf_cursor *c, uint32_t *i);
 void amf_cursor_read_u29(amf_cursor *c, unsigned int *i);
 void amf_cursor_read_str(amf_cursor *c, const char **s, size_t *len);
 
+/*
+ * open a container of n items and size bytes, failing it when the items
+ * can not be in the input, at least a byte each, or a limit is broken.
+ * checked before anything is sized from n.
+ */
+void amf_cursor_enter(amf_cursor *c, size_t n, size_t size);
+#define amf_cursor_leave(c) ((c)->depth--)
+
+/* an open ended container grown by an item of size bytes */
+void amf_cursor_grow(amf_cursor *c, size_t size);
+
+/* a string of len bytes about to be made */
+void amf_cursor_string(amf_cursor *c, size_t len);
+
+/* len bytes of output a transcoder is about to copy for a reference */
+void amf_cursor_copy(amf_cursor *c, size_t len);
+
 
 #endif /* end of include guard: AMF_CURSOR_H */
@@ -0,0 +1,1260 @@
+#include "amf_dom.h"
+#include "amf_reader.h"
+#include "amf_vec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define AMF_ARENA_CHUNK     8192
+#define AMF_ARENA_MAX_CHUNK (1 << 20)
+
+amf_dom_traits amf_dom_anonymous = { { "", 0 }, NULL, 0, 1, 0 };
+
+struct amf_arena_chunk {
+    amf_arena_chunk    *next;
+    size_t              size, used;
+    union {
+        double          d;
+        void           *p;
+        uint64_t        u;
+    } data[];
+};
+
+void
+amf_arena_init(amf_arena *a)
+{
+    a->head = NULL;
+    a->total = 0;
+}
+
+void *
+amf_arena_alloc(amf_arena *a, size_t size)
+{
+    amf_arena_chunk *ch = a->head;
+    void            *p;
+
+    size = (size + sizeof(ch->data[0]) - 1) & ~(sizeof(ch->data[0]) - 1);
+
+    if (ch == NULL || ch->size - ch->used < size) {
+        size_t csize = ch ? ch->size * 2 : AMF_ARENA_CHUNK;
+
+        if (csize > AMF_ARENA_MAX_CHUNK) {
+            csize = AMF_ARENA_MAX_CHUNK;
+        }
+
+        if (csize < size) {
+            csize = size;
+        }
+
+        ch = malloc(sizeof(*ch) + csize);
+        if (ch == NULL) {
+            return NULL;
+        }
+
+        ch->size = csize;
+        ch->used = 0;
+        ch->next = a->head;
+        a->head = ch;
+        a->total += csize;
+    }
+
+    p = (char *)ch->data + ch->used;
+    ch->used += size;
+
+    return p;
+}
+
+/* keep the newest chunk, the largest one */
+void
+amf_arena_reset(amf_arena *a)
+{
+    amf_arena_chunk *ch = a->head;
+
+    if (ch == NULL) {
+        return;
+    }
+
+    a->head = ch->next;
+    amf_arena_free(a);
+
+    ch->next = NULL;
+    ch->used = 0;
+    a->head = ch;
+    a->total = ch->size;
+}
+
+void
+amf_arena_free(amf_arena *a)
+{
+    amf_arena_chunk *ch = a->head, *next;
+
+    for (; ch; ch = next) {
+        next = ch->next;
+        free(ch);
+    }
+
+    a->head = NULL;
+    a->total = 0;
+}
+
+void
+amf_doc_init(amf_doc *doc)
+{
+    memset(doc, 0, sizeof(*doc));
+    amf_arena_init(&doc->arena);
+}
+
+void
+amf_doc_reset(amf_doc *doc)
+{
+    amf_arena_reset(&doc->arena);
+
+    doc->root = NULL;
+    doc->msg = NULL;
+    doc->input = NULL;
+    doc->used = 0;
+    doc->err = AMF_CUR_NO_ERR;
+    doc->err_msg = NULL;
+    doc->err_offset = 0;
+}
+
+void
+amf_doc_free(amf_doc *doc)
+{
+    amf_arena_free(&doc->arena);
+    doc->root = NULL;
+    doc->msg = NULL;
+}
+
+/*
+ * decoder
+ *
+ * refs:            the values by the number the reader gives them
+ * traits:          document traits of the amf3 traits, by their tag
+ * aliases:         traits of the amf0 typed objects, one per class
+ * pairs:           properties of the objects being read, copied to the
+ *                  arena once an object is complete
+ */
+typedef struct dom_dec {
+    amf_doc            *doc;
+    amf_cursor          c;
+    amf_reader          r;
+
+    amf_vec             refs;
+    amf_vec             traits;
+    amf_vec             aliases;
+    amf_vec             pairs;
+} dom_dec;
+
+static void dom_value(dom_dec *d, amf_dom_value **out);
+
+static void
+dom_error(dom_dec *d, int err, const char *msg)
+{
+    if (d->c.err == AMF_CUR_NO_ERR) {
+        d->c.err = err;
+        d->c.err_msg = msg;
+    }
+}
+
+#define dom_badfmt(d, msg)  dom_error(d, AMF_CUR_ERR_BADFMT, msg)
+#define dom_oom(d)          dom_badfmt(d, "out of memory")
+
+static void *
+dom_alloc(dom_dec *d, size_t size)
+{
+    void *p = amf_arena_alloc(&d->doc->arena, size ? size : 1);
+
+    if (p == NULL) {
+        dom_oom(d);
+    }
+
+    return p;
+}
+
+static amf_dom_value *
+dom_new(dom_dec *d, int type, const char *at)
+{
+    amf_dom_value *v = dom_alloc(d, sizeof(*v));
+
+    if (v) {
+        size_t offset = at - d->c.base;
+
+        v->type = type;
+        v->offset = offset > UINT32_MAX ? UINT32_MAX : (uint32_t)offset;
+    }
+
+    return v;
+}
+
+static void
+dom_push(dom_dec *d, amf_vec *v, const void *item, size_t size)
+{
+    if (amf_vec_push(v, item, size)) {
+        dom_oom(d);
+    }
+}
+
+static void
+dom_str(amf_dom_str *s, const amf_str *from)
+{
+    s->p = from->p;
+    s->len = (uint32_t)from->len;
+}
+
+/* move the pairs read since start to the arena */
+static void
+dom_take_pairs(dom_dec *d, uint32_t start, amf_dom_pair **pairs, uint32_t *n)
+{
+    *n = d->pairs.n - start;
+    *pairs = dom_alloc(d, *n * sizeof(amf_dom_pair));
+
+    if (*pairs && *n) {
+        memcpy(*pairs, &amf_vec_at(&d->pairs, amf_dom_pair, start),
+               *n * sizeof(amf_dom_pair));
+    }
+
+    d->pairs.n = start;
+}
+
+/*
+ * the entries of the open container: sealed members into sealed, the
+ * items into items and the named ones to the arena
+ */
+static void
+dom_entries(dom_dec *d, amf_dom_value **sealed, amf_dom_value **items,
+            amf_dom_pair **pairs, uint32_t *n)
+{
+    amf_cursor     *c = &d->c;
+    uint32_t        start = d->pairs.n;
+    amf_dom_pair    pair;
+    amf_str         key;
+    int             next;
+
+    while ((next = amf_reader_next(&d->r, &key)) != AMF_NEXT_END) {
+        if (next == AMF_NEXT_MEMBER) {
+            dom_value(d, sealed++);
+
+        } else if (next == AMF_NEXT_ITEM) {
+            dom_value(d, items++);
+
+        } else {
+            dom_str(&pair.key, &key);
+            dom_value(d, &pair.value);
+            if (c->err == AMF_CUR_NO_ERR) {
+                dom_push(d, &d->pairs, &pair, sizeof(pair));
+            }
+        }
+
+        if (c->err) {
+            break;
+        }
+    }
+
+    if (c->err) {
+        d->pairs.n = start;
+        return;
+    }
+
+    if (pairs) {
+        dom_take_pairs(d, start, pairs, n);
+    }
+}
+
+/* the traits of an amf0 typed object class, the same for all its objects */
+static amf_dom_traits *
+dom_amf0_alias(dom_dec *d, const amf_str *alias)
+{
+    amf_dom_traits *t;
+
+    for (uint32_t i = 0; i < d->aliases.n; i++) {
+        t = amf_vec_at(&d->aliases, amf_dom_traits *, i);
+
+        if (t->alias.len == alias->len
+            && memcmp(t->alias.p, alias->p, alias->len) == 0)
+        {
+            return t;
+        }
+    }
+
+    t = dom_alloc(d, sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    memset(t, 0, sizeof(*t));
+    dom_str(&t->alias, alias);
+    t->dynamic = 1;
+
+    dom_push(d, &d->aliases, &t, sizeof(t));
+
+    return t;
+}
+
+/* the document traits of amf3 traits ti, made the first time they are used */
+static amf_dom_traits *
+dom_amf3_traits(dom_dec *d, long ti)
+{
+    amf_traits     *rt = amf_reader_traits(&d->r, ti);
+    amf_dom_traits *t;
+
+    if (rt->tag >= 0) {
+        return amf_vec_at(&d->traits, amf_dom_traits *, rt->tag);
+    }
+
+    if ((t = dom_alloc(d, sizeof(*t))) == NULL) {
+        return NULL;
+    }
+
+    t->members = dom_alloc(d, rt->nmembers * sizeof(amf_dom_str));
+    if (t->members == NULL) {
+        return NULL;
+    }
+
+    dom_str(&t->alias, &rt->alias);
+    t->nmembers = rt->nmembers;
+    t->dynamic = rt->dynamic;
+    t->external = rt->external;
+
+    for (uint32_t i = 0; i < rt->nmembers; i++) {
+        dom_str(&t->members[i], amf_reader_member(&d->r, rt, i));
+    }
+
+    rt->tag = d->traits.n;
+    dom_push(d, &d->traits, &t, sizeof(t));
+
+    return t;
+}
+
+/* a referable value is found by its number */
+static void
+dom_ref(dom_dec *d, const amf_item *it, amf_dom_value *v)
+{
+    if (it->referable) {
+        dom_push(d, &d->refs, &v, sizeof(v));
+    }
+}
+
+static void
+dom_object(dom_dec *d, const amf_item *it, amf_dom_value **out)
+{
+    amf_cursor     *c = &d->c;
+    amf_dom_value  *v;
+    amf_dom_traits *t;
+
+    if ((v = dom_new(d, AMF_DOM_OBJECT, it->at)) == NULL) {
+        return;
+    }
+
+    if (it->traits >= 0) {
+        t = dom_amf3_traits(d, it->traits);
+    } else if (it->alias.len) {
+        t = dom_amf0_alias(d, &it->alias);
+    } else {
+        t = &amf_dom_anonymous;
+    }
+
+    if (t == NULL) {
+        return;
+    }
+
+    v->u.object.traits = t;
+    v->u.object.sealed = dom_alloc(d, t->nmembers * sizeof(amf_dom_value *));
+    v->u.object.dynamic = NULL;
+    v->u.object.ndynamic = 0;
+    dom_ref(d, it, v);
+    amf_cursor_checkerr(c);
+
+    dom_entries(d, v->u.object.sealed, NULL,
+                t->dynamic ? &v->u.object.dynamic : NULL, &v->u.object.ndynamic);
+    amf_cursor_checkerr(c);
+
+    *out = v;
+}
+
+static void
+dom_array(dom_dec *d, const amf_item *it, amf_dom_value **out)
+{
+    amf_cursor     *c = &d->c;
+    amf_dom_value  *v;
+
+    if ((v = dom_new(d, AMF_DOM_ARRAY, it->at)) == NULL) {
+        return;
+    }
+
+    v->u.array.assoc = NULL;
+    v->u.array.nassoc = 0;
+    v->u.array.len = it->len;
+    v->u.array.items = dom_alloc(d, it->len * sizeof(amf_dom_value *));
+    dom_ref(d, it, v);
+    amf_cursor_checkerr(c);
+
+    dom_entries(d, NULL, v->u.array.items,
+                it->mixed ? &v->u.array.assoc : NULL, &v->u.array.nassoc);
+    amf_cursor_checkerr(c);
+
+    *out = v;
+}
+
+/*
+ * the flex wrappers are read as the value they wrap, which takes the
+ * wrapper's number. a reference to it while it is read is not found.
+ */
+static void
+dom_external(dom_dec *d, const amf_item *it, amf_dom_value **out)
+{
+    amf_cursor     *c = &d->c;
+    dom_ref(d, it, NULL);
+    amf_cursor_checkerr(c);
+
+    dom_entries(d, NULL, out, NULL, NULL);
+    amf_cursor_checkerr(c);
+
+    amf_vec_at(&d->refs, amf_dom_value *, it->ref) = *out;
+}
+
+/* the document types of the values that hold no others */
+static const uint8_t dom_types[] = {
+    [AMF_ITEM_UNDEFINED] = AMF_DOM_UNDEFINED,
+    [AMF_ITEM_NULL] = AMF_DOM_NULL,
+    [AMF_ITEM_INT] = AMF_DOM_INT,
+    [AMF_ITEM_NUMBER] = AMF_DOM_DOUBLE,
+    [AMF_ITEM_STRING] = AMF_DOM_STRING,
+    [AMF_ITEM_XMLDOC] = AMF_DOM_XMLDOC,
+    [AMF_ITEM_XML] = AMF_DOM_XML,
+    [AMF_ITEM_BYTEARRAY] = AMF_DOM_BYTEARRAY,
+    [AMF_ITEM_DATE] = AMF_DOM_DATE,
+};
+
+static void
+dom_value(dom_dec *d, amf_dom_value **out)
+{
+    amf_cursor     *c = &d->c;
+    amf_dom_value  *v;
+    amf_item        it;
+
+    amf_reader_value(&d->r, &it);
+    amf_cursor_checkerr(c);
+
+    switch (it.type) {
+    case AMF_ITEM_OBJECT:
+        dom_object(d, &it, out);
+        return;
+
+    case AMF_ITEM_ARRAY:
+        dom_array(d, &it, out);
+        return;
+
+    case AMF_ITEM_EXTERNAL:
+        dom_external(d, &it, out);
+        return;
+
+    case AMF_ITEM_REF:
+        if ((v = amf_vec_at(&d->refs, amf_dom_value *, it.ref)) == NULL) {
+            dom_badfmt(d, "reference not found");
+            return;
+        }
+        break;
+
+    case AMF_ITEM_BOOL:
+        v = dom_new(d, it.i ? AMF_DOM_TRUE : AMF_DOM_FALSE, it.at);
+        break;
+
+    default:
+        if ((v = dom_new(d, dom_types[it.type], it.at)) == NULL) {
+            return;
+        }
+
+        if (it.type == AMF_ITEM_INT) {
+            v->u.i = it.i;
+        } else if (it.type == AMF_ITEM_NUMBER || it.type == AMF_ITEM_DATE) {
+            v->u.d = it.d;
+        } else {
+            dom_str(&v->u.s, &it.s);
+        }
+
+        dom_ref(d, &it, v);
+    }
+
+    *out = v;
+}
+
+static void
+dom_dec_init(dom_dec *d, amf_doc *doc, int ver, const char *p, size_t len)
+{
+    amf_doc_reset(doc);
+    doc->input = p;
+
+    memset(d, 0, sizeof(*d));
+    d->doc = doc;
+    d->c.p = d->c.base = p;
+    d->c.left = len;
+
+    amf_reader_init(&d->r, &d->c, ver);
+    d->r.max_depth = AMF_DOM_MAX_DEPTH;
+}
+
+/* one value with reference tables of its own */
+static void
+dom_dec_value(dom_dec *d, amf_dom_value **out)
+{
+    amf_reader_reset(&d->r);
+    d->refs.n = d->traits.n = d->aliases.n = d->pairs.n = 0;
+
+    dom_value(d, out);
+}
+
+/* returns -1 with the error in the document */
+static int
+dom_dec_done(dom_dec *d)
+{
+    amf_doc *doc = d->doc;
+
+    amf_reader_free(&d->r);
+    amf_vec_free(&d->refs);
+    amf_vec_free(&d->traits);
+    amf_vec_free(&d->aliases);
+    amf_vec_free(&d->pairs);
+
+    doc->used = d->c.p - doc->input;
+
+    if (d->c.err) {
+        doc->err = d->c.err;
+        doc->err_msg = d->c.err_msg;
+        doc->err_offset = doc->used;
+        return -1;
+    }
+
+    return 0;
+}
+
+amf_dom_value *
+amf_dom_decode(amf_doc *doc, int ver, const char *p, size_t len)
+{
+    dom_dec         d;
+    amf_dom_value  *root = NULL;
+
+    dom_dec_init(&d, doc, ver, p, len);
+    dom_dec_value(&d, &root);
+
+    if (dom_dec_done(&d)) {
+        return NULL;
+    }
+
+    doc->root = root;
+
+    return root;
+}
+
+/* a message header or body value behind its content length */
+static void
+dom_msg_content(dom_dec *d, amf_dom_value **out)
+{
+    amf_cursor     *c = &d->c;
+    const char     *start;
+    size_t          left;
+    uint32_t        len;
+
+    amf_cursor_read_u32(c, &len);
+    amf_cursor_checkerr(c);
+
+    if (len == AMF_MSG_UNKNOWN_LEN || len == 0) {
+        dom_dec_value(d, out);
+        return;
+    }
+
+    amf_cursor_need(c, len);
+    start = c->p;
+    left = c->left;
+
+    /* the value may not read past its length */
+    c->left = len;
+    dom_dec_value(d, out);
+    amf_cursor_checkerr(c);
+
+    c->p = start + len;
+    c->left = left - len;
+}
+
+static void
+dom_msg_str(dom_dec *d, amf_dom_str *s)
+{
+    amf_cursor *c = &d->c;
+    uint16_t    len = 0;
+
+    amf_cursor_read_u16(c, &len);
+    amf_cursor_checkerr(c);
+    amf_cursor_need(c, len);
+    s->p = c->p;
+    s->len = len;
+    amf_cursor_consume(c, len);
+}
+
+static void
+dom_msg(dom_dec *d, amf_dom_msg *m)
+{
+    amf_cursor *c = &d->c;
+
+    amf_cursor_read_u16(c, &m->version);
+    amf_cursor_read_u16(c, &m->nheaders);
+    amf_cursor_checkerr(c);
+
+    /* a header takes 8 bytes at least */
+    if ((size_t)m->nheaders * 8 > c->left) {
+        dom_error(d, AMF_CUR_ERR_EOF, "eof");
+        return;
+    }
+
+    m->headers = dom_alloc(d, m->nheaders * sizeof(amf_dom_header));
+    amf_cursor_checkerr(c);
+
+    for (unsigned int i = 0; i < m->nheaders; i++) {
+        amf_dom_header *h = &m->headers[i];
+
+        dom_msg_str(d, &h->name);
+        amf_cursor_read_u8(c, &h->must_understand);
+        dom_msg_content(d, &h->value);
+        amf_cursor_checkerr(c);
+    }
+
+    amf_cursor_read_u16(c, &m->nbodies);
+    amf_cursor_checkerr(c);
+
+    /* and a body 9 */
+    if ((size_t)m->nbodies * 9 > c->left) {
+        dom_error(d, AMF_CUR_ERR_EOF, "eof");
+        return;
+    }
+
+    m->bodies = dom_alloc(d, m->nbodies * sizeof(amf_dom_body));
+    amf_cursor_checkerr(c);
+
+    for (unsigned int i = 0; i < m->nbodies; i++) {
+        amf_dom_body *b = &m->bodies[i];
+
+        dom_msg_str(d, &b->target);
+        dom_msg_str(d, &b->response);
+        dom_msg_content(d, &b->value);
+        amf_cursor_checkerr(c);
+    }
+}
+
+amf_dom_msg *
+amf_dom_decode_msg(amf_doc *doc, const char *p, size_t len)
+{
+    dom_dec         d;
+    amf_dom_msg    *m;
+
+    dom_dec_init(&d, doc, AMF_VER0, p, len);
+
+    if ((m = dom_alloc(&d, sizeof(*m)))) {
+        memset(m, 0, sizeof(*m));
+        dom_msg(&d, m);
+    }
+
+    if (dom_dec_done(&d)) {
+        return NULL;
+    }
+
+    doc->msg = m;
+
+    return m;
+}
+
+/*
+ * encoder, the references are found in hash maps keyed by value or traits
+ * address, or string content
+ */
+typedef struct dom_enc {
+    amf_buf            *buf;
+    int                 depth;
+    const char         *err_msg;
+
+    amf_map             refs0;
+    amf_map             strs, objs, traits;
+} dom_enc;
+
+static int dom_enc_amf0(dom_enc *e, const amf_dom_value *v);
+static int dom_enc_amf3(dom_enc *e, const amf_dom_value *v);
+
+static int
+dom_enc_error(dom_enc *e, const char *msg)
+{
+    e->err_msg = msg;
+    return -1;
+}
+
+static int
+dom_enc_put(dom_enc *e, amf_map *m, const void *key, uint32_t len)
+{
+    if (amf_map_put(m, key, len)) {
+        return dom_enc_error(e, "out of memory");
+    }
+
+    return 0;
+}
+
+static void
+dom_enc_amf0_str(dom_enc *e, const amf_dom_str *s)
+{
+    amf_buf_append_u16(e->buf, (uint16_t)s->len);
+    amf_buf_append(e->buf, s->p, s->len);
+}
+
+static int
+dom_enc_amf0_props(dom_enc *e, const amf_dom_str *keys, amf_dom_value *const *values,
+                   const amf_dom_pair *pairs, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        const amf_dom_str *key = keys ? &keys[i] : &pairs[i].key;
+
+        if (key->len > UINT16_MAX) {
+            return dom_enc_error(e, "property name too long");
+        }
+
+        dom_enc_amf0_str(e, key);
+
+        if (dom_enc_amf0(e, values ? values[i] : pairs[i].value)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* amf0 has no byte array, it is written as an amf3 value */
+static int
+dom_enc_avmplus(dom_enc *e, const amf_dom_value *v)
+{
+    amf_map strs = e->strs, objs = e->objs, traits = e->traits;
+    int     rc;
+
+    memset(&e->strs, 0, sizeof(amf_map));
+    memset(&e->objs, 0, sizeof(amf_map));
+    memset(&e->traits, 0, sizeof(amf_map));
+    e->strs.str = 1;
+
+    amf_buf_append_char(e->buf, AMF0_AVMPLUS);
+    rc = dom_enc_amf3(e, v);
+
+    amf_map_free(&e->strs);
+    amf_map_free(&e->objs);
+    amf_map_free(&e->traits);
+    e->strs = strs;
+    e->objs = objs;
+    e->traits = traits;
+
+    return rc;
+}
+
+static int
+dom_enc_amf0_value(dom_enc *e, const amf_dom_value *v)
+{
+    amf_buf        *buf = e->buf;
+    amf_dom_traits *t;
+    long            ref;
+    char            key[16];
+
+    switch (v->type) {
+    case AMF_DOM_UNDEFINED:
+        amf_buf_append_char(buf, AMF0_UNDEFINED);
+        break;
+
+    case AMF_DOM_NULL:
+        amf_buf_append_char(buf, AMF0_NULL);
+        break;
+
+    case AMF_DOM_FALSE:
+    case AMF_DOM_TRUE:
+        amf_buf_append_char(buf, AMF0_BOOLEAN);
+        amf_buf_append_char(buf, v->type == AMF_DOM_TRUE);
+        break;
+
+    case AMF_DOM_INT:
+        amf_buf_append_char(buf, AMF0_NUMBER);
+        amf_buf_append_double(buf, v->u.i);
+        break;
+
+    case AMF_DOM_DOUBLE:
+        amf_buf_append_char(buf, AMF0_NUMBER);
+        amf_buf_append_double(buf, v->u.d);
+        break;
+
+    case AMF_DOM_STRING:
+        if (v->u.s.len <= UINT16_MAX) {
+            amf_buf_append_char(buf, AMF0_STRING);
+            amf_buf_append_u16(buf, (uint16_t)v->u.s.len);
+        } else {
+            amf_buf_append_char(buf, AMF0_L_STRING);
+            amf_buf_append_u32(buf, v->u.s.len);
+        }
+        amf_buf_append(buf, v->u.s.p, v->u.s.len);
+        break;
+
+    case AMF_DOM_XMLDOC:
+    case AMF_DOM_XML:
+        amf_buf_append_char(buf, AMF0_XML_DOC);
+        amf_buf_append_u32(buf, v->u.s.len);
+        amf_buf_append(buf, v->u.s.p, v->u.s.len);
+        break;
+
+    case AMF_DOM_DATE:
+        amf_buf_append_char(buf, AMF0_DATE);
+        amf_buf_append_double(buf, v->u.d);
+        amf_buf_append_u16(buf, 0);
+        break;
+
+    case AMF_DOM_BYTEARRAY:
+        return dom_enc_avmplus(e, v);
+
+    case AMF_DOM_ARRAY:
+    case AMF_DOM_OBJECT:
+        ref = amf_map_find(&e->refs0, v, 0);
+        if (ref >= 0) {
+            amf_buf_append_char(buf, AMF0_REFERENCE);
+            amf_buf_append_u16(buf, (uint16_t)ref);
+            break;
+        }
+
+        /* past the u16 reference range, objects are written in full */
+        if (e->refs0.n <= UINT16_MAX && dom_enc_put(e, &e->refs0, v, 0)) {
+            return -1;
+        }
+
+        if (v->type == AMF_DOM_ARRAY && v->u.array.nassoc == 0) {
+            amf_buf_append_char(buf, AMF0_STRICT_ARRAY);
+            amf_buf_append_u32(buf, v->u.array.len);
+
+            for (uint32_t i = 0; i < v->u.array.len; i++) {
+                if (dom_enc_amf0(e, v->u.array.items[i])) {
+                    return -1;
+                }
+            }
+            break;
+        }
+
+        if (v->type == AMF_DOM_ARRAY) {
+            amf_buf_append_char(buf, AMF0_ECMA_ARRAY);
+            amf_buf_append_u32(buf, v->u.array.len + v->u.array.nassoc);
+
+            /* the dense part is keyed by index from 1 as in lua */
+            for (uint32_t i = 0; i < v->u.array.len; i++) {
+                amf_dom_str s = { key, (uint32_t)snprintf(key, sizeof(key), "%u", (unsigned)i + 1) };
+
+                dom_enc_amf0_str(e, &s);
+                if (dom_enc_amf0(e, v->u.array.items[i])) {
+                    return -1;
+                }
+            }
+
+            if (dom_enc_amf0_props(e, NULL, NULL, v->u.array.assoc, v->u.array.nassoc)) {
+                return -1;
+            }
+
+        } else {
+            t = v->u.object.traits;
+
+            if (t->alias.len) {
+                if (t->alias.len > UINT16_MAX) {
+                    return dom_enc_error(e, "class alias too long");
+                }
+                amf_buf_append_char(buf, AMF0_TYPED_OBJECT);
+                dom_enc_amf0_str(e, &t->alias);
+            } else {
+                amf_buf_append_char(buf, AMF0_OBJECT);
+            }
+
+            if (dom_enc_amf0_props(e, t->members, v->u.object.sealed, NULL, t->nmembers)
+                || dom_enc_amf0_props(e, NULL, NULL, v->u.object.dynamic,
+                                      v->u.object.ndynamic))
+            {
+                return -1;
+            }
+        }
+
+        amf_buf_append_u16(buf, 0);
+        amf_buf_append_char(buf, AMF0_END_OF_OBJECT);
+        break;
+
+    default:
+        return dom_enc_error(e, "unsupported type");
+    }
+
+    return 0;
+}
+
+static int
+dom_enc_amf0(dom_enc *e, const amf_dom_value *v)
+{
+    int rc;
+
+    if (e->depth == AMF_DOM_MAX_DEPTH) {
+        return dom_enc_error(e, "nested too deep");
+    }
+
+    e->depth++;
+    rc = dom_enc_amf0_value(e, v);
+    e->depth--;
+
+    return rc;
+}
+
+static int
+dom_enc_amf3_str(dom_enc *e, const amf_dom_str *s)
+{
+    long ref;
+
+    if (s->len == 0) {
+        amf_buf_append_u29(e->buf, 1);
+        return 0;
+    }
+
+    ref = amf_map_find(&e->strs, s->p, s->len);
+    if (ref >= 0) {
+        amf_buf_append_u29(e->buf, (int)(ref << 1));
+        return 0;
+    }
+
+    if (s->len > AMF3_MAX_STR_LEN) {
+        return dom_enc_error(e, "string too long");
+    }
+
+    if (e->strs.n <= AMF3_MAX_REFERENCES && dom_enc_put(e, &e->strs, s->p, s->len)) {
+        return -1;
+    }
+
+    amf_buf_append_u29(e->buf, (int)(s->len << 1 | 1));
+    amf_buf_append(e->buf, s->p, s->len);
+
+    return 0;
+}
+
+/*
+ * the reference of a value kept in the object table. returns 1 if it was
+ * written, 0 if the value is to be written in full, -1 on error.
+ */
+static int
+dom_enc_amf3_objref(dom_enc *e, const amf_dom_value *v)
+{
+    long ref = amf_map_find(&e->objs, v, 0);
+
+    if (ref >= 0) {
+        amf_buf_append_u29(e->buf, (int)(ref << 1));
+        return 1;
+    }
+
+    if (e->objs.n <= AMF3_MAX_REFERENCES && dom_enc_put(e, &e->objs, v, 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+dom_enc_amf3_pairs(dom_enc *e, const amf_dom_pair *pairs, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        if (pairs[i].key.len == 0) {
+            return dom_enc_error(e, "empty property name");
+        }
+
+        if (dom_enc_amf3_str(e, &pairs[i].key) || dom_enc_amf3(e, pairs[i].value)) {
+            return -1;
+        }
+    }
+
+    amf_buf_append_u29(e->buf, 1);
+
+    return 0;
+}
+
+static int
+dom_enc_amf3_traits(dom_enc *e, const amf_dom_traits *t)
+{
+    long ref = amf_map_find(&e->traits, t, 0);
+
+    if (ref >= 0) {
+        amf_buf_append_u29(e->buf, (int)(ref << 2 | 1));
+        return 0;
+    }
+
+    if (t->external) {
+        return dom_enc_error(e, "externalizable objects can not be encoded");
+    }
+
+    if (t->nmembers > AMF3_MAX_INT >> 4) {
+        return dom_enc_error(e, "too many members");
+    }
+
+    if (e->traits.n <= AMF3_MAX_REFERENCES && dom_enc_put(e, &e->traits, t, 0)) {
+        return -1;
+    }
+
+    amf_buf_append_u29(e->buf, (int)(t->nmembers << 4 | (t->dynamic ? 8 : 0) | 3));
+
+    if (dom_enc_amf3_str(e, &t->alias)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < t->nmembers; i++) {
+        if (dom_enc_amf3_str(e, &t->members[i])) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+dom_enc_amf3_value(dom_enc *e, const amf_dom_value *v)
+{
+    amf_buf        *buf = e->buf;
+    amf_dom_traits *t;
+    int             rc;
+
+    switch (v->type) {
+    case AMF_DOM_UNDEFINED:
+        amf_buf_append_char(buf, AMF3_UNDEFINED);
+        break;
+
+    case AMF_DOM_NULL:
+        amf_buf_append_char(buf, AMF3_NULL);
+        break;
+
+    case AMF_DOM_FALSE:
+        amf_buf_append_char(buf, AMF3_FALSE);
+        break;
+
+    case AMF_DOM_TRUE:
+        amf_buf_append_char(buf, AMF3_TRUE);
+        break;
+
+    case AMF_DOM_INT:
+        if (v->u.i >= AMF3_MIN_INT && v->u.i <= AMF3_MAX_INT) {
+            amf_buf_append_char(buf, AMF3_INTEGER);
+            amf_buf_append_u29(buf, v->u.i);
+        } else {
+            amf_buf_append_char(buf, AMF3_DOUBLE);
+            amf_buf_append_double(buf, v->u.i);
+        }
+        break;
+
+    case AMF_DOM_DOUBLE:
+        amf_buf_append_char(buf, AMF3_DOUBLE);
+        amf_buf_append_double(buf, v->u.d);
+        break;
+
+    case AMF_DOM_STRING:
+        amf_buf_append_char(buf, AMF3_STRING);
+        return dom_enc_amf3_str(e, &v->u.s);
+
+    case AMF_DOM_XMLDOC:
+    case AMF_DOM_XML:
+    case AMF_DOM_BYTEARRAY:
+        amf_buf_append_char(buf, v->type);
+
+        if ((rc = dom_enc_amf3_objref(e, v))) {
+            return rc < 0 ? -1 : 0;
+        }
+
+        if (v->u.s.len > AMF3_MAX_STR_LEN) {
+            return dom_enc_error(e, "string too long");
+        }
+
+        amf_buf_append_u29(buf, (int)(v->u.s.len << 1 | 1));
+        amf_buf_append(buf, v->u.s.p, v->u.s.len);
+        break;
+
+    case AMF_DOM_DATE:
+        amf_buf_append_char(buf, AMF3_DATE);
+
+        if ((rc = dom_enc_amf3_objref(e, v))) {
+            return rc < 0 ? -1 : 0;
+        }
+
+        amf_buf_append_u29(buf, 1);
+        amf_buf_append_double(buf, v->u.d);
+        break;
+
+    case AMF_DOM_ARRAY:
+        amf_buf_append_char(buf, AMF3_ARRAY);
+
+        if ((rc = dom_enc_amf3_objref(e, v))) {
+            return rc < 0 ? -1 : 0;
+        }
+
+        if (v->u.array.len > AMF3_MAX_INT) {
+            return dom_enc_error(e, "array too long");
+        }
+
+        amf_buf_append_u29(buf, (int)(v->u.array.len << 1 | 1));
+
+        if (dom_enc_amf3_pairs(e, v->u.array.assoc, v->u.array.nassoc)) {
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < v->u.array.len; i++) {
+            if (dom_enc_amf3(e, v->u.array.items[i])) {
+                return -1;
+            }
+        }
+        break;
+
+    case AMF_DOM_OBJECT:
+        amf_buf_append_char(buf, AMF3_OBJECT);
+
+        if ((rc = dom_enc_amf3_objref(e, v))) {
+            return rc < 0 ? -1 : 0;
+        }
+
+        t = v->u.object.traits;
+
+        if (dom_enc_amf3_traits(e, t)) {
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < t->nmembers; i++) {
+            if (dom_enc_amf3(e, v->u.object.sealed[i])) {
+                return -1;
+            }
+        }
+
+        if (t->dynamic) {
+            return dom_enc_amf3_pairs(e, v->u.object.dynamic, v->u.object.ndynamic);
+        }
+        break;
+
+    default:
+        return dom_enc_error(e, "unsupported type");
+    }
+
+    return 0;
+}
+
+static int
+dom_enc_amf3(dom_enc *e, const amf_dom_value *v)
+{
+    int rc;
+
+    if (e->depth == AMF_DOM_MAX_DEPTH) {
+        return dom_enc_error(e, "nested too deep");
+    }
+
+    e->depth++;
+    rc = dom_enc_amf3_value(e, v);
+    e->depth--;
+
+    return rc;
+}
+
+static void
+dom_enc_init(dom_enc *e, amf_buf *buf)
+{
+    memset(e, 0, sizeof(*e));
+    e->buf = buf;
+    e->strs.str = 1;
+}
+
+static void
+dom_enc_clear(dom_enc *e)
+{
+    amf_map_free(&e->refs0);
+    amf_map_free(&e->strs);
+    amf_map_free(&e->objs);
+    amf_map_free(&e->traits);
+    e->strs.str = 1;
+}
+
+int
+amf_dom_encode(amf_buf *buf, int ver, const amf_dom_value *v, const char **err_msg)
+{
+    dom_enc e;
+    int     rc;
+
+    dom_enc_init(&e, buf);
+
+    rc = ver == AMF_VER0 ? dom_enc_amf0(&e, v) : dom_enc_amf3(&e, v);
+
+    dom_enc_clear(&e);
+
+    if (rc && err_msg) {
+        *err_msg = e.err_msg;
+    }
+
+    return rc;
+}
+
+static int
+dom_enc_msg_str(dom_enc *e, const amf_dom_str *s)
+{
+    if (s->len > UINT16_MAX) {
+        return dom_enc_error(e, "message string too long");
+    }
+
+    dom_enc_amf0_str(e, s);
+
+    return 0;
+}
+
+/* a header or body value behind its content length */
+static int
+dom_enc_msg_content(dom_enc *e, int ver, const amf_dom_value *v)
+{
+    size_t  pos = e->buf->len;
+    int     rc;
+
+    amf_buf_append_u32(e->buf, 0);
+
+    rc = ver == AMF_VER0 ? dom_enc_amf0(e, v) : dom_enc_avmplus(e, v);
+    dom_enc_clear(e);
+
+    amf_buf_put_u32(e->buf, pos, (uint32_t)(e->buf->len - pos - 4));
+
+    return rc;
+}
+
+int
+amf_dom_encode_msg(amf_buf *buf, int ver, const amf_dom_msg *m, const char **err_msg)
+{
+    dom_enc e;
+    int     rc = 0;
+
+    dom_enc_init(&e, buf);
+
+    amf_buf_append_u16(buf, (uint16_t)ver);
+    amf_buf_append_u16(buf, m->nheaders);
+
+    for (unsigned int i = 0; i < m->nheaders && rc == 0; i++) {
+        const amf_dom_header *h = &m->headers[i];
+
+        rc = dom_enc_msg_str(&e, &h->name);
+        if (rc == 0) {
+            amf_buf_append_char(buf, (char)h->must_understand);
+            rc = dom_enc_msg_content(&e, ver, h->value);
+        }
+    }
+
+    if (rc == 0) {
+        amf_buf_append_u16(buf, m->nbodies);
+    }
+
+    for (unsigned int i = 0; i < m->nbodies && rc == 0; i++) {
+        const amf_dom_body *b = &m->bodies[i];
+
+        rc = dom_enc_msg_str(&e, &b->target);
+        if (rc == 0) {
+            rc = dom_enc_msg_str(&e, &b->response);
+        }
+        if (rc == 0) {
+            rc = dom_enc_msg_content(&e, ver, b->value);
+        }
+    }
+
+    dom_enc_clear(&e);
+
+    if (rc && err_msg) {
+        *err_msg = e.err_msg;
+    }
+
+    return rc;
+}
@@ -0,0 +1,165 @@
+#ifndef AMF_DOM_H
+
+#define AMF_DOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "amf_buf.h"
+#include "amf_types.h"
+
+/*
+ * a document model of amf values that does not need lua, the core of
+ * libamf.a.
+ *
+ * a document owns an arena all of its values live in, and is freed or
+ * reset at once. strings point into the decoded input, which has to stay
+ * around as long as the document. references are resolved: a value read
+ * twice is the same amf_dom_value, so the graph may share values or be
+ * cyclic, and the encoder writes such values as references again.
+ */
+#define AMF_DOM_UNDEFINED   0
+#define AMF_DOM_NULL        1
+#define AMF_DOM_FALSE       2
+#define AMF_DOM_TRUE        3
+#define AMF_DOM_INT         4   /* amf3 integer */
+#define AMF_DOM_DOUBLE      5
+#define AMF_DOM_STRING      6
+#define AMF_DOM_XMLDOC      7
+#define AMF_DOM_DATE        8   /* ms since the epoch in d */
+#define AMF_DOM_ARRAY       9
+#define AMF_DOM_OBJECT      10
+#define AMF_DOM_XML         11
+#define AMF_DOM_BYTEARRAY   12
+
+/* nesting deeper than this fails to decode or encode */
+#define AMF_DOM_MAX_DEPTH   1024
+
+typedef struct amf_dom_str {
+    const char         *p;
+    uint32_t            len;
+} amf_dom_str;
+
+/*
+ * class traits, shared by the objects of a class. amf0 objects have no
+ * sealed members, their properties are dynamic.
+ */
+typedef struct amf_dom_traits {
+    amf_dom_str         alias;      /* empty for anonymous objects */
+    amf_dom_str        *members;
+    uint32_t            nmembers;
+    uint8_t             dynamic, external;
+} amf_dom_traits;
+
+typedef struct amf_dom_value amf_dom_value;
+
+typedef struct amf_dom_pair {
+    amf_dom_str         key;
+    amf_dom_value      *value;
+} amf_dom_pair;
+
+struct amf_dom_value {
+    uint8_t             type;
+    uint32_t            offset;     /* of the type marker in the input */
+
+    union {
+        int32_t         i;
+        double          d;          /* DOUBLE, DATE */
+        amf_dom_str     s;          /* STRING, XMLDOC, XML, BYTEARRAY */
+
+        /* items are the dense part, assoc the named keys */
+        struct {
+            amf_dom_value     **items;
+            amf_dom_pair       *assoc;
+            uint32_t            len, nassoc;
+        } array;
+
+        /* sealed has one value by traits member */
+        struct {
+            amf_dom_traits     *traits;
+            amf_dom_value     **sealed;
+            amf_dom_pair       *dynamic;
+            uint32_t            ndynamic;
+        } object;
+    } u;
+};
+
+/* a remoting message, the values are amf0 or switch to amf3 on their own */
+typedef struct amf_dom_header {
+    amf_dom_str         name;
+    uint8_t             must_understand;
+    amf_dom_value      *value;
+} amf_dom_header;
+
+typedef struct amf_dom_body {
+    amf_dom_str         target, response;
+    amf_dom_value      *value;
+} amf_dom_body;
+
+typedef struct amf_dom_msg {
+    uint16_t            version;
+    uint16_t            nheaders, nbodies;
+    amf_dom_header     *headers;
+    amf_dom_body       *bodies;
+} amf_dom_msg;
+
+/* a bump allocator of chunks, reset keeps the largest chunk */
+typedef struct amf_arena_chunk amf_arena_chunk;
+
+typedef struct amf_arena {
+    amf_arena_chunk    *head;
+    size_t              total;      /* bytes of all chunks */
+} amf_arena;
+
+void  amf_arena_init(amf_arena *a);
+void *amf_arena_alloc(amf_arena *a, size_t size);
+void  amf_arena_reset(amf_arena *a);
+void  amf_arena_free(amf_arena *a);
+
+/*
+ * root:    the decoded value, NULL before a decode or after an error
+ * msg:     the decoded message, likewise
+ * used:    input bytes the value took
+ * err:     AMF_CUR_ERR_* of the decode, err_msg and err_offset tell more
+ */
+typedef struct amf_doc {
+    amf_arena           arena;
+    amf_dom_value      *root;
+    amf_dom_msg        *msg;
+    const char         *input;
+    size_t              used;
+
+    int                 err;
+    const char         *err_msg;
+    size_t              err_offset;
+} amf_doc;
+
+void amf_doc_init(amf_doc *doc);
+void amf_doc_reset(amf_doc *doc);
+void amf_doc_free(amf_doc *doc);
+
+/*
+ * decode one value of ver from p into the document, dropping what it held
+ * before. returns the root, or NULL with doc->err set.
+ */
+amf_dom_value *amf_dom_decode(amf_doc *doc, int ver, const char *p, size_t len);
+
+/*
+ * append v encoded as ver to buf, with reference tables of its own.
+ * returns 0, or -1 with *err_msg set when v can not be encoded.
+ */
+int amf_dom_encode(amf_buf *buf, int ver, const amf_dom_value *v, const char **err_msg);
+
+/* the same for a remoting message */
+amf_dom_msg *amf_dom_decode_msg(amf_doc *doc, const char *p, size_t len);
+
+/*
+ * append message m as version ver: amf0 values for 0, amf3 values behind
+ * the avmplus marker for 3
+ */
+int amf_dom_encode_msg(amf_buf *buf, int ver, const amf_dom_msg *m, const char **err_msg);
+
+/* the traits of the anonymous amf0 objects */
+extern amf_dom_traits amf_dom_anonymous;
+
+#endif /* end of include guard: AMF_DOM_H */
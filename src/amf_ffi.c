@@ -0,0 +1,171 @@
+#include "amf_ffi.h"
+#include "amf_codec.h"
+
+#include "endiness.h"
+
+#include <string.h>
+
+amf_buf *
+amf_ffi_buf_new(void)
+{
+    return amf_buf_init(NULL);
+}
+
+void
+amf_ffi_buf_free(amf_buf *b)
+{
+    if (b) {
+        amf_buf_free(b);
+    }
+}
+
+void
+amf_ffi_buf_reset(amf_buf *b)
+{
+    amf_buf_reset(b);
+}
+
+void
+amf_ffi_write_u8(amf_buf *b, uint8_t u)
+{
+    amf_buf_append_char(b, (char)u);
+}
+
+void
+amf_ffi_write_u16(amf_buf *b, uint16_t u)
+{
+    amf_buf_append_u16(b, u);
+}
+
+void
+amf_ffi_write_u32(amf_buf *b, uint32_t u)
+{
+    amf_buf_append_u32(b, u);
+}
+
+void
+amf_ffi_write_u29(amf_buf *b, int32_t i)
+{
+    amf_buf_append_u29(b, i);
+}
+
+void
+amf_ffi_write_double(amf_buf *b, double d)
+{
+    amf_buf_append_double(b, d);
+}
+
+void
+amf_ffi_write_bytes(amf_buf *b, const char *p, size_t len)
+{
+    amf_buf_append(b, p, len);
+}
+
+void
+amf_ffi_write_str(amf_buf *b, const char *p, size_t len)
+{
+    amf_buf_append_u16(b, (uint16_t)len);
+    amf_buf_append(b, p, len);
+}
+
+void
+amf_ffi_cursor_init(amf_cursor *c, const char *p, size_t len)
+{
+    memset(c, 0, sizeof(*c));
+    c->p = c->base = p;
+    c->left = len;
+}
+
+size_t
+amf_ffi_cursor_size(void)
+{
+    return sizeof(amf_cursor);
+}
+
+uint8_t
+amf_ffi_read_u8(amf_cursor *c)
+{
+    uint8_t u = 0;
+
+    amf_cursor_read_u8(c, &u);
+
+    return u;
+}
+
+uint16_t
+amf_ffi_read_u16(amf_cursor *c)
+{
+    uint16_t u = 0;
+
+    amf_cursor_read_u16(c, &u);
+
+    return u;
+}
+
+uint32_t
+amf_ffi_read_u32(amf_cursor *c)
+{
+    uint32_t u = 0;
+
+    amf_cursor_read_u32(c, &u);
+
+    return u;
+}
+
+uint32_t
+amf_ffi_read_u29(amf_cursor *c)
+{
+    unsigned int u = 0;
+
+    amf_cursor_read_u29(c, &u);
+
+    return c->err ? 0 : u;
+}
+
+double
+amf_ffi_read_double(amf_cursor *c)
+{
+    double d;
+
+    if (c->left < 8) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return 0;
+    }
+
+    memcpy(&d, c->p, 8);
+    reverse_if_little_endian(&d, 8);
+    amf_cursor_consume(c, 8);
+
+    return d;
+}
+
+const char *
+amf_ffi_read_bytes(amf_cursor *c, size_t len)
+{
+    const char *p = c->p;
+
+    if (c->left < len) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return NULL;
+    }
+
+    amf_cursor_consume(c, len);
+
+    return p;
+}
+
+size_t
+amf_ffi_skip(amf_cursor *c, int ver)
+{
+    size_t left = c->left;
+
+    if (ver == AMF_VER0) {
+        amf0_skip(c);
+    } else {
+        amf3_skip(c);
+    }
+
+    return c->err ? 0 : left - c->left;
+}
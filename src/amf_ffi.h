@@ -0,0 +1,47 @@
+#ifndef AMF_FFI_H
+
+#define AMF_FFI_H
+
+#include "amf_buf.h"
+#include "amf_cursor.h"
+
+#include <stdint.h>
+
+/*
+ * a flat abi for the luajit ffi, see amf_ffi.lua. values go in and out by
+ * value instead of through pointers, so ffi callers need no boxes, and a
+ * read that fails returns 0 with the error in the cursor. the structs are
+ * declared again in the cdef of amf_ffi.lua and have to stay in step.
+ */
+amf_buf    *amf_ffi_buf_new(void);
+void        amf_ffi_buf_free(amf_buf *b);
+void        amf_ffi_buf_reset(amf_buf *b);
+
+void        amf_ffi_write_u8(amf_buf *b, uint8_t u);
+void        amf_ffi_write_u16(amf_buf *b, uint16_t u);
+void        amf_ffi_write_u32(amf_buf *b, uint32_t u);
+void        amf_ffi_write_u29(amf_buf *b, int32_t i);
+void        amf_ffi_write_double(amf_buf *b, double d);
+void        amf_ffi_write_bytes(amf_buf *b, const char *p, size_t len);
+
+/* a u16 length and the bytes, the amf0 string without marker */
+void        amf_ffi_write_str(amf_buf *b, const char *p, size_t len);
+
+void        amf_ffi_cursor_init(amf_cursor *c, const char *p, size_t len);
+
+/* sizeof(amf_cursor), which the cdef is checked against */
+size_t      amf_ffi_cursor_size(void);
+
+uint8_t     amf_ffi_read_u8(amf_cursor *c);
+uint16_t    amf_ffi_read_u16(amf_cursor *c);
+uint32_t    amf_ffi_read_u32(amf_cursor *c);
+uint32_t    amf_ffi_read_u29(amf_cursor *c);
+double      amf_ffi_read_double(amf_cursor *c);
+
+/* len bytes where they lie, NULL when there are fewer */
+const char *amf_ffi_read_bytes(amf_cursor *c, size_t len);
+
+/* walk past a whole value of ver, returns its size */
+size_t      amf_ffi_skip(amf_cursor *c, int ver);
+
+#endif /* end of include guard: AMF_FFI_H */
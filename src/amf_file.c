@@ -0,0 +1,150 @@
+#define _DEFAULT_SOURCE
+
+#include "amf_file.h"
+#include "amf_cursor.h"
+#include "amf_types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define AMF_SOL_MAGIC   0x00bf
+
+/*
+ * the sol header:
+ * u16 0x00bf, u32 length of the rest, "TCSO", 00 04 00 00 00 00,
+ * u16 name length, name, u32 amf version
+ */
+static void
+amf_file_sol(amf_file *f, amf_cursor *c)
+{
+    uint16_t    u16;
+    uint32_t    u32;
+
+    amf_cursor_read_u16(c, &u16);
+    if (c->err || u16 != AMF_SOL_MAGIC) {
+        return;
+    }
+
+    amf_cursor_skip(c, 4);
+    amf_cursor_need(c, 10);
+    if (memcmp(c->p, "TCSO", 4) != 0) {
+        return;
+    }
+    amf_cursor_consume(c, 10);
+
+    /* a sol from here, a short header is broken */
+    amf_cursor_read_u16(c, &u16);
+    if (!c->err && c->left < u16) {
+        c->err = AMF_CUR_ERR_EOF;
+    }
+    if (!c->err) {
+        f->name = c->p;
+        f->name_len = u16;
+        amf_cursor_consume(c, u16);
+        amf_cursor_read_u32(c, &u32);
+    }
+
+    if (c->err) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "truncated sol header";
+        return;
+    }
+
+    if (u32 != AMF_VER0 && u32 != AMF_VER3) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported sol version";
+        return;
+    }
+
+    f->ver = u32;
+    f->data = f->size - c->left;
+}
+
+int
+amf_file_open(amf_file *f, const char *path, const char **err)
+{
+    struct stat     st;
+    amf_cursor      c;
+    void           *p = NULL;
+    int             fd, e;
+
+    memset(f, 0, sizeof(*f));
+    f->ver = -1;
+    *err = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        goto fail;
+    }
+
+    /* an empty file can not be mapped */
+    if (st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            goto fail;
+        }
+
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+
+    f->base = p;
+    f->size = st.st_size;
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = f->base;
+    c.left = f->size;
+
+    /* a file with the magic but no signature is any other file */
+    amf_file_sol(f, &c);
+
+    if (c.err == AMF_CUR_ERR_BADFMT) {
+        *err = c.err_msg;
+        amf_file_close(f);
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    e = errno;
+    close(fd);
+    errno = e;
+
+    return -1;
+}
+
+void
+amf_file_close(amf_file *f)
+{
+    if (f->base) {
+        munmap((void *)f->base, f->size);
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->ver = -1;
+}
+
+void
+amf_file_done(amf_file *f, size_t pos)
+{
+    size_t page = sysconf(_SC_PAGESIZE), end;
+
+    if (f->base == NULL || pos < f->dropped + AMF_FILE_DROP) {
+        return;
+    }
+
+    /* whole pages, the one pos is in is still read */
+    end = pos / page * page;
+    madvise((void *)(f->base + f->dropped), end - f->dropped, MADV_DONTNEED);
+    f->dropped = end;
+}
@@ -0,0 +1,42 @@
+#ifndef AMF_FILE_H
+
+#define AMF_FILE_H
+
+#include <stddef.h>
+
+/*
+ * a file of amf mapped read only: a flash local shared object (.sol) or
+ * values or messages one after another. cursors point into the mapping,
+ * which is read front to back and given back to the kernel behind the
+ * reader, so files larger than memory go at the speed of the disk.
+ */
+typedef struct amf_file {
+    const char         *base;
+    size_t              size;
+
+    /* sol: the amf version of the entries, -1 for other files */
+    int                 ver;
+    const char         *name;
+    size_t              name_len;
+
+    /* offset of the first value, behind the sol header */
+    size_t              data;
+
+    /* the mapping before this offset was given back */
+    size_t              dropped;
+} amf_file;
+
+/* pages given back at a time */
+#define AMF_FILE_DROP   (8 << 20)
+
+/*
+ * map path and read its sol header if it has one. returns 0, or -1 with
+ * errno set, or with err the reason of a broken sol header.
+ */
+int  amf_file_open(amf_file *f, const char *path, const char **err);
+void amf_file_close(amf_file *f);
+
+/* the reader is done with the file before pos */
+void amf_file_done(amf_file *f, size_t pos);
+
+#endif /* end of include guard: AMF_FILE_H */
@@ -0,0 +1,365 @@
+#include "amf_flex.h"
+#include "amf_codec.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include <lauxlib.h>
+
+#define FLEX_HAS_NEXT       0x80
+#define FLEX_MAX_FLAGS      8
+#define FLEX_MAX_FIELDS     7
+#define FLEX_UUID_LEN       16
+#define FLEX_UUID_STR_LEN   36
+
+/*
+ * a message property and the flags bits announcing it, each class level of
+ * a message writes its own flags bytes followed by the announced values
+ */
+typedef struct flex_field {
+    const char  *name;
+    uint8_t      byte, bit;             /* flag of the plain value */
+    uint8_t      uuid_byte, uuid_bit;   /* flag of the 16 bytes uuid form */
+    int          nonzero;               /* numbers are only sent when not 0 */
+} flex_field;
+
+typedef struct flex_level {
+    flex_field   fields[FLEX_MAX_FIELDS];
+    int          nfields;
+    int          reserved[2];           /* known bits of the first flags bytes */
+} flex_level;
+
+/* flex.messaging.messages.AbstractMessage */
+static const flex_level flex_abstract = {
+    {
+        { "body",        0, 0x01, 0, 0,    0 },
+        { "clientId",    0, 0x02, 1, 0x01, 0 },
+        { "destination", 0, 0x04, 0, 0,    0 },
+        { "headers",     0, 0x08, 0, 0,    0 },
+        { "messageId",   0, 0x10, 1, 0x02, 0 },
+        { "timestamp",   0, 0x20, 0, 0,    1 },
+        { "timeToLive",  0, 0x40, 0, 0,    1 },
+    },
+    7, { 7, 2 }
+};
+
+/* flex.messaging.messages.AsyncMessage */
+static const flex_level flex_async = {
+    {
+        { "correlationId", 0, 0x01, 0, 0x02, 0 },
+    },
+    1, { 2, 0 }
+};
+
+/* flex.messaging.messages.CommandMessage */
+static const flex_level flex_command = {
+    {
+        { "operation", 0, 0x01, 0, 0, 1 },
+    },
+    1, { 1, 0 }
+};
+
+/* flex.messaging.messages.AcknowledgeMessage */
+static const flex_level flex_acknowledge = { { { NULL, 0, 0, 0, 0, 0 } }, 0, { 0, 0 } };
+
+static const flex_level *flex_msg_levels[][4] = {
+    { NULL },
+    { &flex_abstract, &flex_async, &flex_acknowledge, NULL },
+    { &flex_abstract, &flex_async, NULL },
+    { &flex_abstract, &flex_async, &flex_command, NULL },
+};
+
+int
+amf_flex_small_msg_kind(const char *alias, size_t len)
+{
+    if (len != 3 || alias[0] != 'D' || alias[1] != 'S') {
+        return 0;
+    }
+
+    switch (alias[2]) {
+    case 'K': return AMF_FLEX_ACKNOWLEDGE;
+    case 'A': return AMF_FLEX_ASYNC;
+    case 'C': return AMF_FLEX_COMMAND;
+    }
+
+    return 0;
+}
+
+static const flex_field *
+flex_find_field(const flex_level *lv, int byte, int bit, int *uuid)
+{
+    for (int i = 0; i < lv->nfields; i++) {
+        const flex_field *f = &lv->fields[i];
+
+        if (f->byte == byte && f->bit == bit) {
+            *uuid = 0;
+            return f;
+        }
+
+        if (f->uuid_bit && f->uuid_byte == byte && f->uuid_bit == bit) {
+            *uuid = 1;
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+static const char hex[] = "0123456789ABCDEF";
+
+/* replace the 16 bytes at the stack top with their uuid string */
+static void
+flex_push_uuid(lua_State *L)
+{
+    char        s[FLEX_UUID_STR_LEN], *p = s;
+    size_t      len;
+    const char *b = lua_tolstring(L, -1, &len);
+
+    if (b == NULL || len != FLEX_UUID_LEN) {
+        return;
+    }
+
+    for (int i = 0; i < FLEX_UUID_LEN; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *p++ = '-';
+        }
+        *p++ = hex[(b[i] >> 4) & 0xf];
+        *p++ = hex[b[i] & 0xf];
+    }
+
+    lua_pop(L, 1);
+    lua_pushlstring(L, s, FLEX_UUID_STR_LEN);
+}
+
+static int
+flex_hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* the 16 bytes of a uuid in the 8-4-4-4-12 form, dashes where they belong only */
+static int
+flex_parse_uuid(const char *s, size_t len, char *b)
+{
+    if (len != FLEX_UUID_STR_LEN) {
+        return 0;
+    }
+
+    for (int i = 0; i < FLEX_UUID_LEN; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            if (*s != '-') return 0;
+            s++;
+        }
+
+        int hi = flex_hex_value(s[0]);
+        int lo = flex_hex_value(s[1]);
+        if (hi < 0 || lo < 0) return 0;
+
+        b[i] = (char)(hi << 4 | lo);
+        s += 2;
+    }
+
+    return 1;
+}
+
+static void
+flex_read_level(lua_State *L, amf_cursor *c, const flex_level *lv,
+                int sidx, int oidx, int tidx)
+{
+    uint8_t flags[FLEX_MAX_FLAGS];
+    int     nflags = 0;
+    uint8_t f;
+
+    do {
+        amf_cursor_read_u8(c, &f);
+        amf_cursor_checkerr(c);
+
+        if (nflags == FLEX_MAX_FLAGS) {
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "too many message flags";
+            return;
+        }
+
+        flags[nflags++] = f;
+    } while (f & FLEX_HAS_NEXT);
+
+    for (int i = 0; i < nflags; i++) {
+        int reserved = i < 2 ? lv->reserved[i] : 0;
+        int uuid = 0;
+
+        for (int b = 0; b < reserved; b++) {
+            if ((flags[i] & (1 << b)) == 0) {
+                continue;
+            }
+
+            const flex_field *fd = flex_find_field(lv, i, 1 << b, &uuid);
+
+            lua_pushstring(L, fd->name);
+            amf3_decode(L, c, sidx, oidx, tidx);
+            amf_cursor_checkerr(c);
+
+            if (uuid) {
+                flex_push_uuid(L);
+            }
+
+            lua_rawset(L, -3);
+        }
+
+        /* values announced by newer message versions are read and dropped */
+        for (int b = reserved; b < 6; b++) {
+            if ((flags[i] >> b) & 1) {
+                amf3_decode(L, c, sidx, oidx, tidx);
+                amf_cursor_checkerr(c);
+                lua_pop(L, 1);
+            }
+        }
+    }
+}
+
+void
+amf_flex_read_small_msg(lua_State *L, amf_cursor *c, const char *alias,
+                        int sidx, int oidx, int tidx)
+{
+    int kind = amf_flex_small_msg_kind(alias, strlen(alias));
+
+    /* the message is the table references to it stand for */
+    lua_pushvalue(L, -1);
+
+    lua_pushliteral(L, "__amf_alias__");
+    lua_pushstring(L, alias);
+    lua_rawset(L, -3);
+
+    for (const flex_level **lv = flex_msg_levels[kind]; *lv; lv++) {
+        flex_read_level(L, c, *lv, sidx, oidx, tidx);
+        amf_cursor_checkerr(c);
+    }
+}
+
+void
+amf_flex_skip_small_msg(amf_cursor *c, const char *alias, amf3_skip_ctx *ctx)
+{
+    int     kind = amf_flex_small_msg_kind(alias, strlen(alias));
+    uint8_t flags[FLEX_MAX_FLAGS];
+    int     nflags;
+    uint8_t f;
+
+    for (const flex_level **lv = flex_msg_levels[kind]; *lv; lv++) {
+        nflags = 0;
+
+        do {
+            amf_cursor_read_u8(c, &f);
+            amf_cursor_checkerr(c);
+
+            if (nflags == FLEX_MAX_FLAGS) {
+                c->err = AMF_CUR_ERR_BADFMT;
+                c->err_msg = "too many message flags";
+                return;
+            }
+
+            flags[nflags++] = f;
+        } while (f & FLEX_HAS_NEXT);
+
+        /* every announced value follows the flags, known or not */
+        for (int i = 0; i < nflags; i++) {
+            int nbits = i < 2 && (*lv)->reserved[i] > 6 ? (*lv)->reserved[i] : 6;
+
+            for (int b = 0; b < nbits; b++) {
+                if ((flags[i] >> b) & 1) {
+                    amf3_skip_value(c, ctx);
+                    amf_cursor_checkerr(c);
+                }
+            }
+        }
+    }
+}
+
+static void
+flex_write_level(lua_State *L, amf_enc *e, int idx, const flex_level *lv)
+{
+    uint8_t flags[2] = { 0, 0 };
+    char    uuids[FLEX_MAX_FIELDS][FLEX_UUID_LEN];
+    int     as_uuid[FLEX_MAX_FIELDS];
+    size_t  len;
+
+    /* announce the present properties first */
+    for (int i = 0; i < lv->nfields; i++) {
+        const flex_field *fd = &lv->fields[i];
+
+        as_uuid[i] = 0;
+
+        lua_getfield(L, idx, fd->name);
+
+        if (lua_isnil(L, -1)
+            || (fd->nonzero && lua_isnumber(L, -1) && lua_tonumber(L, -1) == 0))
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        if (fd->uuid_bit && lua_type(L, -1) == LUA_TSTRING) {
+            const char *s = lua_tolstring(L, -1, &len);
+            as_uuid[i] = flex_parse_uuid(s, len, uuids[i]);
+        }
+
+        if (as_uuid[i]) {
+            flags[fd->uuid_byte] |= fd->uuid_bit;
+        } else {
+            flags[fd->byte] |= fd->bit;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (flags[1]) {
+        amf_buf_append_char(e->buf, (char)(flags[0] | FLEX_HAS_NEXT));
+        amf_buf_append_char(e->buf, (char)flags[1]);
+    } else {
+        amf_buf_append_char(e->buf, (char)flags[0]);
+    }
+
+    /* then the values, in the order a reader walks the flags */
+    for (int byte = 0; byte < 2; byte++) {
+        for (int b = 0; b < 7; b++) {
+            int uuid = 0;
+
+            if ((flags[byte] & (1 << b)) == 0) {
+                continue;
+            }
+
+            const flex_field *fd = flex_find_field(lv, byte, 1 << b, &uuid);
+
+            if (uuid) {
+                amf3_encode_bytearray(L, e, uuids[fd - lv->fields], FLEX_UUID_LEN);
+            } else {
+                lua_getfield(L, idx, fd->name);
+                amf3_encode(L, e, -1);
+                lua_pop(L, 1);
+            }
+        }
+    }
+}
+
+/*
+ * encode a message table as its small externalizable form, the object
+ * marker and reference are already written
+ */
+void
+amf_flex_encode_small_msg(lua_State *L, amf_enc *e, int idx, int alias_idx)
+{
+    size_t      len;
+    const char *alias = lua_tolstring(L, alias_idx, &len);
+    int         kind = amf_flex_small_msg_kind(alias, len);
+
+    if (kind == 0) {
+        luaL_error(L, "not a small message alias: %s", alias);
+    }
+
+    amf3_encode_external_traits(L, e, alias_idx);
+
+    for (const flex_level **lv = flex_msg_levels[kind]; *lv; lv++) {
+        flex_write_level(L, e, idx, *lv);
+    }
+}
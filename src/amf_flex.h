@@ -0,0 +1,33 @@
+#ifndef AMF_FLEX_H
+
+#define AMF_FLEX_H
+
+#include <lua.h>
+
+#include "amf_buf.h"
+#include "amf_cursor.h"
+
+/*
+ * BlazeDS "small message" externalizable forms of the flex messages
+ */
+#define AMF_FLEX_ACKNOWLEDGE_EXT    "DSK"
+#define AMF_FLEX_ASYNC_EXT          "DSA"
+#define AMF_FLEX_COMMAND_EXT        "DSC"
+
+#define AMF_FLEX_ACKNOWLEDGE        1
+#define AMF_FLEX_ASYNC              2
+#define AMF_FLEX_COMMAND            3
+
+int amf_flex_small_msg_kind(const char *alias, size_t len);
+
+void amf_flex_read_small_msg(lua_State *L, amf_cursor *c, const char *alias,
+                             int sidx, int oidx, int tidx);
+
+struct amf_enc;
+struct amf3_skip_ctx;
+
+void amf_flex_skip_small_msg(amf_cursor *c, const char *alias, struct amf3_skip_ctx *ctx);
+
+void amf_flex_encode_small_msg(lua_State *L, struct amf_enc *e, int idx, int alias_idx);
+
+#endif /* end of include guard: AMF_FLEX_H */
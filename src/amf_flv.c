@@ -0,0 +1,246 @@
+#include "amf_flv.h"
+#include "amf_reader.h"
+#include "amf_types.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void
+flv_error(amf_cursor *c, const char *msg)
+{
+    c->err = AMF_CUR_ERR_BADFMT;
+    c->err_msg = msg;
+}
+
+static uint32_t
+flv_u24(const char *p)
+{
+    return (uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint8_t)p[2];
+}
+
+/* a big endian double, one load and a byte swap the compiler sees through */
+static double
+flv_double(const char *p)
+{
+    uint64_t    u = 0;
+    double      d;
+
+    for (int i = 0; i < 8; i++) {
+        u = u << 8 | (uint8_t)p[i];
+    }
+
+    memcpy(&d, &u, 8);
+
+    return d;
+}
+
+static void
+flv_put_double(char *p, double d)
+{
+    uint64_t u;
+
+    memcpy(&u, &d, 8);
+
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (char)(u & 0xff);
+        u >>= 8;
+    }
+}
+
+void
+amf_flv_header(amf_cursor *c)
+{
+    uint32_t size;
+
+    amf_cursor_need(c, 9);
+    if (memcmp(c->p, "FLV", 3) != 0) {
+        flv_error(c, "not an flv file");
+        return;
+    }
+
+    size = (uint32_t)(uint8_t)c->p[5] << 24 | flv_u24(c->p + 6);
+    if (size < 9) {
+        flv_error(c, "invalid flv header size");
+        return;
+    }
+
+    /* the header and the previous tag size before the first tag */
+    amf_cursor_skip(c, size);
+    amf_cursor_skip(c, 4);
+}
+
+int
+amf_flv_next(amf_cursor *c, amf_flv_tag *tag)
+{
+    if (c->left == 0 || c->err) {
+        return 0;
+    }
+
+    if (c->left < AMF_FLV_TAG_HEADER) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return 0;
+    }
+
+    tag->pos = c->p - c->base;
+    tag->type = c->p[0] & 0x1f;
+    tag->size = flv_u24(c->p + 1);
+    /* 24 bits and 8 more above them */
+    tag->timestamp = flv_u24(c->p + 4) | (uint32_t)(uint8_t)c->p[7] << 24;
+
+    if (c->left - AMF_FLV_TAG_HEADER < (size_t)tag->size + 4) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return 0;
+    }
+
+    tag->data = c->p + AMF_FLV_TAG_HEADER;
+    amf_cursor_consume(c, AMF_FLV_TAG_HEADER + tag->size + 4);
+
+    return 1;
+}
+
+/* the numbers of a strict array into a new array of doubles */
+static void
+flv_doubles(amf_reader *r, const amf_item *it, double **out, uint32_t *n)
+{
+    amf_cursor *c = r->c;
+    amf_item    num;
+    amf_str     key;
+    uint32_t    i = 0;
+
+    /* 9 bytes a number */
+    if (it->len > c->left / 9) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return;
+    }
+
+    free(*out);
+    *n = 0;
+    *out = malloc((it->len ? it->len : 1) * sizeof(double));
+    if (*out == NULL) {
+        flv_error(c, "out of memory");
+        return;
+    }
+
+    while (amf_reader_next(r, &key) != AMF_NEXT_END) {
+        amf_reader_value(r, &num);
+        amf_cursor_checkerr(c);
+
+        if (num.type != AMF_ITEM_NUMBER || num.amf3) {
+            flv_error(c, "keyframes must be numbers");
+            return;
+        }
+        (*out)[i++] = num.d;
+    }
+    amf_cursor_checkerr(c);
+
+    *n = i;
+}
+
+static int
+flv_key_is(const amf_str *key, const char *name)
+{
+    return key->len == strlen(name) && memcmp(key->p, name, key->len) == 0;
+}
+
+/*
+ * the properties of an open object or ecma array, keyframes taken out
+ * when in one. the rest is skipped by the reader, which knows every amf0
+ * value, avmplus ones included.
+ */
+static void
+flv_props(amf_reader *r, amf_flv_keyframes *kf, int in_keyframes)
+{
+    amf_cursor *c = r->c;
+    amf_item    it;
+    amf_str     key;
+    int         times, positions, keyframes;
+    uint8_t     marker;
+
+    while (amf_reader_next(r, &key) != AMF_NEXT_END) {
+        keyframes = !in_keyframes && flv_key_is(&key, "keyframes");
+        times = in_keyframes && flv_key_is(&key, "times");
+        positions = in_keyframes && flv_key_is(&key, "filepositions");
+
+        amf_cursor_need(c, 1);
+        marker = (uint8_t)c->p[0];
+
+        if (keyframes && (marker == AMF0_OBJECT || marker == AMF0_ECMA_ARRAY)) {
+            amf_reader_value(r, &it);
+            amf_cursor_checkerr(c);
+            flv_props(r, kf, 1);
+
+        } else if ((times || positions) && marker == AMF0_STRICT_ARRAY) {
+            if (positions) {
+                kf->positions_at = c->p - c->base;
+            }
+
+            amf_reader_value(r, &it);
+            amf_cursor_checkerr(c);
+
+            if (times) {
+                flv_doubles(r, &it, &kf->times, &kf->ntimes);
+            } else {
+                flv_doubles(r, &it, &kf->positions, &kf->npositions);
+            }
+
+        } else {
+            amf_reader_skip(r);
+        }
+
+        amf_cursor_checkerr(c);
+    }
+}
+
+void
+amf_flv_read_keyframes(amf_cursor *c, amf_flv_keyframes *kf)
+{
+    amf_reader  r;
+    amf_item    it;
+
+    memset(kf, 0, sizeof(*kf));
+
+    amf_cursor_need(c, 13);
+    if (c->p[0] != AMF0_STRING || memcmp(c->p + 1, "\0\12onMetaData", 12) != 0) {
+        flv_error(c, "not an onMetaData script tag");
+        return;
+    }
+    amf_cursor_consume(c, 13);
+
+    amf_cursor_need(c, 1);
+    if (c->p[0] != AMF0_ECMA_ARRAY && c->p[0] != AMF0_OBJECT) {
+        flv_error(c, "onMetaData must be an object");
+        return;
+    }
+
+    amf_reader_init(&r, c, AMF_VER0);
+    r.max_depth = AMF_FLV_MAX_DEPTH;
+
+    amf_reader_value(&r, &it);
+    if (c->err == AMF_CUR_NO_ERR) {
+        flv_props(&r, kf, 0);
+    }
+
+    amf_reader_free(&r);
+}
+
+void
+amf_flv_keyframes_free(amf_flv_keyframes *kf)
+{
+    free(kf->times);
+    free(kf->positions);
+    memset(kf, 0, sizeof(*kf));
+}
+
+void
+amf_flv_shift_positions(char *data, size_t positions_at, uint32_t n, double delta)
+{
+    /* the marker and count, then a marker and a double each */
+    char *p = data + positions_at + 5;
+
+    for (uint32_t i = 0; i < n; i++, p += 9) {
+        flv_put_double(p + 1, flv_double(p + 1) + delta);
+    }
+}
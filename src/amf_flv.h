@@ -0,0 +1,59 @@
+#ifndef AMF_FLV_H
+
+#define AMF_FLV_H
+
+#include "amf_cursor.h"
+
+#include <stdint.h>
+
+/*
+ * flv tags and the keyframe index of their onMetaData script tag, read
+ * straight into arrays of doubles without decoding the rest of it
+ */
+#define AMF_FLV_AUDIO           8
+#define AMF_FLV_VIDEO           9
+#define AMF_FLV_SCRIPT          18
+
+#define AMF_FLV_TAG_HEADER      11
+
+/* nesting of the script data deeper than this fails */
+#define AMF_FLV_MAX_DEPTH       1024
+
+typedef struct amf_flv_tag {
+    size_t              pos;
+    uint8_t             type;
+    uint32_t            size;
+    uint32_t            timestamp;
+    const char         *data;
+} amf_flv_tag;
+
+/*
+ * keyframes.times and keyframes.filepositions, positions_at is the offset
+ * in the script data of the filepositions array, 0 without one
+ */
+typedef struct amf_flv_keyframes {
+    double             *times, *positions;
+    uint32_t            ntimes, npositions;
+    size_t              positions_at;
+} amf_flv_keyframes;
+
+/* read the file header and the first previous tag size */
+void amf_flv_header(amf_cursor *c);
+
+/*
+ * read the tag at the cursor and the previous tag size behind it, returns
+ * 1, or 0 at the end of the input or with the error in the cursor
+ */
+int  amf_flv_next(amf_cursor *c, amf_flv_tag *tag);
+
+/*
+ * read the keyframes of script data at the cursor, which must be an
+ * onMetaData one. without a keyframes object the arrays stay empty.
+ */
+void amf_flv_read_keyframes(amf_cursor *c, amf_flv_keyframes *kf);
+void amf_flv_keyframes_free(amf_flv_keyframes *kf);
+
+/* add delta to the filepositions at positions_at of script data */
+void amf_flv_shift_positions(char *data, size_t positions_at, uint32_t n, double delta);
+
+#endif /* end of include guard: AMF_FLV_H */
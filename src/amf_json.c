@@ -0,0 +1,551 @@
+#include "amf_json.h"
+#include "amf_reader.h"
+#include "amf_vec.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * where the json of a referable value was written, end is 0 while the
+ * value is still being written, a reference to it then is a cycle
+ */
+typedef struct json_ref {
+    size_t              start, end;
+} json_ref;
+
+/* refs: the referable values by their number in the reader */
+typedef struct json_enc {
+    amf_cursor         *c;
+    amf_reader          r;
+    amf_buf            *out;
+    int                 flags;
+
+    amf_vec             refs;
+} json_enc;
+
+static void json_value(json_enc *j);
+
+static void
+json_error(json_enc *j, const char *msg)
+{
+    j->c->err = AMF_CUR_ERR_BADFMT;
+    j->c->err_msg = msg;
+}
+
+/* structural characters go straight into the buffer */
+#define json_putc(out, ch) do {                                         \
+    if ((out)->free < 1) amf_buf_reserve(out, 1);                       \
+    (out)->b[(out)->len++] = (ch);                                      \
+    (out)->free--;                                                      \
+} while(0)
+
+static const char json_hex[] = "0123456789abcdef";
+
+/* bytes a character takes in a json string, 1 for the unescaped ones */
+static const uint8_t json_esc_len[128] = {
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 2, 2, 6, 6, 2, 6, 6,
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+    1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+/* the length of the utf-8 sequence at s, 0 when it is not one */
+static size_t
+json_utf8_len(const unsigned char *s, size_t left)
+{
+    unsigned char   lo = 0x80, hi = 0xbf;
+    size_t          n;
+
+    if (s[0] < 0xc2 || s[0] > 0xf4) {
+        return 0;
+    }
+
+    n = s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : 4;
+
+    /* no overlong forms, surrogates or code points past 0x10ffff */
+    switch (s[0]) {
+    case 0xe0: lo = 0xa0; break;
+    case 0xed: hi = 0x9f; break;
+    case 0xf0: lo = 0x90; break;
+    case 0xf4: hi = 0x8f; break;
+    }
+
+    if (n > left || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+
+    for (size_t i = 2; i < n; i++) {
+        if (s[i] < 0x80 || s[i] > 0xbf) {
+            return 0;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * a json string of the bytes at p. utf-8 is copied, other bytes are
+ * written as \u00XX, all of those above 0x7f when raw. the escaped
+ * length is counted first so the string is written with a single
+ * reserve.
+ */
+static void
+json_string(json_enc *j, const char *p, size_t len, int raw)
+{
+    amf_buf                *out = j->out;
+    const unsigned char    *s = (const unsigned char *)p;
+    size_t                  size = len + 2, n;
+    char                   *q;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] < 0x80) {
+            size += json_esc_len[s[i]] - 1;
+        } else if (!raw && (n = json_utf8_len(s + i, len - i))) {
+            i += n - 1;
+        } else {
+            size += 5;
+        }
+    }
+
+    amf_buf_reserve(out, size);
+    q = out->b + out->len;
+    *q++ = '"';
+
+    if (size == len + 2) {
+        memcpy(q, p, len);
+        q += len;
+
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            unsigned char ch = s[i];
+
+            if (ch < 0x80 && json_esc_len[ch] == 1) {
+                *q++ = (char)ch;
+                continue;
+            }
+
+            if (ch >= 0x80 && !raw && (n = json_utf8_len(s + i, len - i))) {
+                memcpy(q, s + i, n);
+                q += n;
+                i += n - 1;
+                continue;
+            }
+
+            *q++ = '\\';
+
+            switch (ch) {
+            case '"':  *q++ = '"'; break;
+            case '\\': *q++ = '\\'; break;
+            case '\n': *q++ = 'n'; break;
+            case '\r': *q++ = 'r'; break;
+            case '\t': *q++ = 't'; break;
+            default:
+                *q++ = 'u';
+                *q++ = '0';
+                *q++ = '0';
+                *q++ = json_hex[ch >> 4];
+                *q++ = json_hex[ch & 0xf];
+            }
+        }
+    }
+
+    *q++ = '"';
+    out->len += size;
+    out->free -= size;
+}
+
+static const char json_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+json_base64(json_enc *j, const char *p, size_t len)
+{
+    const unsigned char    *s = (const unsigned char *)p;
+    char                    q[4];
+    size_t                  i;
+
+    json_putc(j->out, '"');
+
+    for (i = 0; i + 3 <= len; i += 3) {
+        q[0] = json_b64[s[i] >> 2];
+        q[1] = json_b64[(s[i] & 3) << 4 | s[i + 1] >> 4];
+        q[2] = json_b64[(s[i + 1] & 0xf) << 2 | s[i + 2] >> 6];
+        q[3] = json_b64[s[i + 2] & 0x3f];
+        amf_buf_append(j->out, q, 4);
+    }
+
+    if (i < len) {
+        q[0] = json_b64[s[i] >> 2];
+        if (i + 1 < len) {
+            q[1] = json_b64[(s[i] & 3) << 4 | s[i + 1] >> 4];
+            q[2] = json_b64[(s[i + 1] & 0xf) << 2];
+        } else {
+            q[1] = json_b64[(s[i] & 3) << 4];
+            q[2] = '=';
+        }
+        q[3] = '=';
+        amf_buf_append(j->out, q, 4);
+    }
+
+    json_putc(j->out, '"');
+}
+
+/* the decimal digits of u, written backwards from the end of s */
+static char *
+json_utoa(char *end, uint64_t u)
+{
+    do {
+        *--end = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+
+    return end;
+}
+
+static void
+json_integer(json_enc *j, int64_t i)
+{
+    char     s[24], *p;
+    uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i;
+
+    p = json_utoa(s + sizeof(s), u);
+    if (i < 0) {
+        *--p = '-';
+    }
+
+    amf_buf_append(j->out, p, s + sizeof(s) - p);
+}
+
+static const double json_pow10[] = {
+    1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17
+};
+
+/*
+ * integers exactly, other numbers with the fewest decimals k that give
+ * back d, found as an integer m with m / 10^k == d: both are exact
+ * doubles, so reading the k decimals rounds to d as well. the rest with
+ * the shortest of %.15g and %.17g that reads back the same. json has no
+ * nan or infinity.
+ */
+static void
+json_number(json_enc *j, double d)
+{
+    char    s[32], *p, *end = s + sizeof(s);
+    double  m;
+    int     n;
+
+    if (isnan(d) || isinf(d)) {
+        amf_buf_append(j->out, "null", 4);
+        return;
+    }
+
+    if (d == floor(d) && fabs(d) < 9007199254740992.0) {
+        json_integer(j, (int64_t)d);
+        return;
+    }
+
+    for (int k = 1; k < (int)(sizeof(json_pow10) / sizeof(json_pow10[0])); k++) {
+        m = fabs(d) * json_pow10[k];
+
+        if (m >= 9007199254740992.0) {
+            break;
+        }
+
+        if (m != floor(m) || m / json_pow10[k] != fabs(d)) {
+            continue;
+        }
+
+        /* the digits of m with a point before the last k */
+        p = json_utoa(end, (uint64_t)m);
+        while (end - p <= k) {
+            *--p = '0';
+        }
+
+        memmove(p - 1, p, end - p - k);
+        p--;
+        end[-k - 1] = '.';
+
+        if (d < 0) {
+            *--p = '-';
+        }
+
+        amf_buf_append(j->out, p, end - p);
+        return;
+    }
+
+    n = snprintf(s, sizeof(s), "%.15g", d);
+    if (strtod(s, NULL) != d) {
+        n = snprintf(s, sizeof(s), "%.17g", d);
+    }
+
+    amf_buf_append(j->out, s, n);
+}
+
+/* ms since the epoch as yyyy-mm-ddThh:mm:ss.mmmZ, in the proleptic gregorian calendar */
+static void
+json_date(json_enc *j, double d)
+{
+    long long   ms, days, rem, z, era, doe, yoe, y, doy, mp, day, mon;
+    char        s[48];
+    int         n;
+
+    if (!(j->flags & AMF_JSON_DATE_ISO)) {
+        json_number(j, d);
+        return;
+    }
+
+    if (isnan(d) || fabs(d) > 8.64e15) {
+        amf_buf_append(j->out, "null", 4);
+        return;
+    }
+
+    ms = (long long)floor(d);
+    days = ms / 86400000;
+    rem = ms % 86400000;
+    if (rem < 0) {
+        rem += 86400000;
+        days--;
+    }
+
+    z = days + 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    mon = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (mon <= 2);
+
+    n = snprintf(s, sizeof(s), "\"%04lld-%02lld-%02lldT%02lld:%02lld:%02lld.%03lldZ\"",
+                 y, mon, day, rem / 3600000, rem / 60000 % 60, rem / 1000 % 60, rem % 1000);
+
+    amf_buf_append(j->out, s, n);
+}
+
+/* a referable value is written again by copying its json */
+static void
+json_copy_ref(json_enc *j, uint32_t ref)
+{
+    amf_buf    *out = j->out;
+    json_ref    r = amf_vec_at(&j->refs, json_ref, ref);
+
+    if (r.end == 0) {
+        if (j->flags & AMF_JSON_CYCLE_ERROR) {
+            json_error(j, "cyclic reference");
+            return;
+        }
+        amf_buf_append(out, "null", 4);
+        return;
+    }
+
+    /* copies of copies grow the output without bound but for the alloc limit */
+    amf_cursor_copy(j->c, r.end - r.start);
+    amf_cursor_checkerr(j->c);
+
+    amf_buf_reserve(out, r.end - r.start);
+    amf_buf_append(out, out->b + r.start, r.end - r.start);
+}
+
+/* a referable value about to be written, they come in the order of their numbers */
+static void
+json_open_ref(json_enc *j)
+{
+    json_ref r = { j->out->len, 0 };
+
+    if (amf_vec_push(&j->refs, &r, sizeof(r))) {
+        json_error(j, "out of memory");
+    }
+}
+
+static void
+json_close_ref(json_enc *j, uint32_t ref)
+{
+    amf_vec_at(&j->refs, json_ref, ref).end = j->out->len;
+}
+
+static void
+json_key(json_enc *j, const char *p, size_t len, int *first)
+{
+    if (!*first) {
+        json_putc(j->out, ',');
+    }
+    *first = 0;
+
+    json_string(j, p, len, 0);
+    json_putc(j->out, ':');
+}
+
+static void
+json_alias(json_enc *j, const amf_str *alias, int *first)
+{
+    if ((j->flags & AMF_JSON_ALIAS) && alias->len) {
+        json_key(j, "__amf_alias__", 13, first);
+        json_string(j, alias->p, alias->len, 0);
+    }
+}
+
+/*
+ * an object, or an array with named keys, the dense part keyed by
+ * position from 1 as lua has it
+ */
+static void
+json_object(json_enc *j, const amf_item *it)
+{
+    amf_cursor *c = j->c;
+    amf_str     key;
+    uint32_t    i = 0;
+    int         first = 1, next;
+    char        num[16];
+
+    json_putc(j->out, '{');
+    json_alias(j, &it->alias, &first);
+
+    while ((next = amf_reader_next(&j->r, &key)) != AMF_NEXT_END) {
+        if (next == AMF_NEXT_ITEM) {
+            json_key(j, num, snprintf(num, sizeof(num), "%u", (unsigned)++i), &first);
+        } else {
+            json_key(j, key.p, key.len, &first);
+        }
+        json_value(j);
+        amf_cursor_checkerr(c);
+    }
+    amf_cursor_checkerr(c);
+
+    json_putc(j->out, '}');
+}
+
+/* a dense array is a json array, one with named keys an object */
+static void
+json_array(json_enc *j, const amf_item *it)
+{
+    amf_cursor *c = j->c;
+    amf_str     key;
+    uint32_t    i = 0;
+
+    if (it->mixed) {
+        json_object(j, it);
+        return;
+    }
+
+    json_putc(j->out, '[');
+    while (amf_reader_next(&j->r, &key) != AMF_NEXT_END) {
+        if (i++) {
+            json_putc(j->out, ',');
+        }
+        json_value(j);
+        amf_cursor_checkerr(c);
+    }
+    amf_cursor_checkerr(c);
+    json_putc(j->out, ']');
+}
+
+static void
+json_value(json_enc *j)
+{
+    amf_cursor *c = j->c;
+    amf_buf    *out = j->out;
+    amf_item    it;
+    amf_str     key;
+
+    amf_reader_value(&j->r, &it);
+    amf_cursor_checkerr(c);
+
+    if (it.type == AMF_ITEM_REF) {
+        json_copy_ref(j, it.ref);
+        return;
+    }
+
+    if (it.referable) {
+        json_open_ref(j);
+        amf_cursor_checkerr(c);
+    }
+
+    switch (it.type) {
+    case AMF_ITEM_UNDEFINED:
+    case AMF_ITEM_NULL:
+        amf_buf_append(out, "null", 4);
+        break;
+
+    case AMF_ITEM_BOOL:
+        if (it.i) {
+            amf_buf_append(out, "true", 4);
+        } else {
+            amf_buf_append(out, "false", 5);
+        }
+        break;
+
+    case AMF_ITEM_INT:
+        json_integer(j, it.i);
+        break;
+
+    case AMF_ITEM_NUMBER:
+        json_number(j, it.d);
+        break;
+
+    case AMF_ITEM_STRING:
+    case AMF_ITEM_XMLDOC:
+    case AMF_ITEM_XML:
+        json_string(j, it.s.p, it.s.len, 0);
+        break;
+
+    case AMF_ITEM_BYTEARRAY:
+        if (j->flags & AMF_JSON_BYTES_RAW) {
+            json_string(j, it.s.p, it.s.len, 1);
+        } else {
+            json_base64(j, it.s.p, it.s.len);
+        }
+        break;
+
+    case AMF_ITEM_DATE:
+        json_date(j, it.d);
+        break;
+
+    case AMF_ITEM_ARRAY:
+        json_array(j, &it);
+        break;
+
+    case AMF_ITEM_OBJECT:
+        json_object(j, &it);
+        break;
+
+    case AMF_ITEM_EXTERNAL:
+        /* the flex wrappers take the slot of the value they wrap */
+        while (amf_reader_next(&j->r, &key) != AMF_NEXT_END) {
+            json_value(j);
+            amf_cursor_checkerr(c);
+        }
+        break;
+    }
+    amf_cursor_checkerr(c);
+
+    if (it.referable) {
+        json_close_ref(j, it.ref);
+    }
+}
+
+void
+amf_json_encode(amf_cursor *c, int ver, int flags, amf_buf *out)
+{
+    json_enc j;
+
+    memset(&j, 0, sizeof(j));
+    j.c = c;
+    j.out = out;
+    j.flags = flags;
+
+    amf_reader_init(&j.r, c, ver);
+    j.r.max_depth = AMF_JSON_MAX_DEPTH;
+
+    json_value(&j);
+
+    amf_reader_free(&j.r);
+    amf_vec_free(&j.refs);
+}
@@ -0,0 +1,30 @@
+#ifndef AMF_JSON_H
+
+#define AMF_JSON_H
+
+#include "amf_buf.h"
+#include "amf_cursor.h"
+#include "amf_types.h"
+
+/*
+ * amf straight to json text, without lua tables or a document in between.
+ * string bytes that are not utf-8 are written as \u00XX.
+ * references are resolved by copying the json already written for the
+ * referenced value.
+ */
+#define AMF_JSON_DATE_ISO       0x01    /* dates as iso 8601 strings, not ms numbers */
+#define AMF_JSON_BYTES_RAW      0x02    /* byte arrays as strings, a \u00XX a byte, not base64 */
+#define AMF_JSON_CYCLE_ERROR    0x04    /* fail on a cycle, not write null */
+#define AMF_JSON_ALIAS          0x08    /* typed objects get "__amf_alias__" */
+
+/* nesting deeper than this fails */
+#define AMF_JSON_MAX_DEPTH      1024
+
+/*
+ * append the json of the value of ver at the cursor to out, the cursor
+ * ends behind the value or holds the error. the limits of the cursor
+ * hold for the input, and their alloc for the references copied too.
+ */
+void amf_json_encode(amf_cursor *c, int ver, int flags, amf_buf *out);
+
+#endif /* end of include guard: AMF_JSON_H */
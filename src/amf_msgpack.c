@@ -0,0 +1,1133 @@
+#include "amf_msgpack.h"
+#include "amf_reader.h"
+#include "amf_vec.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* messagepack type bytes, the fix types carry their value in the low bits */
+#define MP_FIXMAP       0x80
+#define MP_FIXARRAY     0x90
+#define MP_FIXSTR       0xa0
+#define MP_NIL          0xc0
+#define MP_FALSE        0xc2
+#define MP_TRUE         0xc3
+#define MP_BIN8         0xc4
+#define MP_BIN16        0xc5
+#define MP_BIN32        0xc6
+#define MP_EXT8         0xc7
+#define MP_EXT16        0xc8
+#define MP_EXT32        0xc9
+#define MP_FLOAT32      0xca
+#define MP_FLOAT64      0xcb
+#define MP_UINT8        0xcc
+#define MP_UINT16       0xcd
+#define MP_UINT32       0xce
+#define MP_UINT64       0xcf
+#define MP_INT8         0xd0
+#define MP_INT16        0xd1
+#define MP_INT32        0xd2
+#define MP_INT64        0xd3
+#define MP_FIXEXT1      0xd4
+#define MP_FIXEXT4      0xd6
+#define MP_FIXEXT8      0xd7
+#define MP_FIXEXT16     0xd8
+#define MP_STR8         0xd9
+#define MP_STR16        0xda
+#define MP_STR32        0xdb
+#define MP_ARRAY16      0xdc
+#define MP_ARRAY32      0xdd
+#define MP_MAP16        0xde
+#define MP_MAP32        0xdf
+
+#define MP_EXT_TIMESTAMP    -1
+
+#define MP_ALIAS_KEY        "__amf_alias__"
+#define MP_ALIAS_KEY_LEN    13
+
+static void
+mp_error(amf_cursor *c, const char *msg)
+{
+    c->err = AMF_CUR_ERR_BADFMT;
+    c->err_msg = msg;
+}
+
+/*
+ * amf to messagepack
+ */
+
+/* where the messagepack of a referable value was written, end is 0 while it is open */
+typedef struct mp_ref {
+    size_t              start, end;
+} mp_ref;
+
+typedef struct mp_str {
+    const char         *p;
+    size_t              len;
+} mp_str;
+
+/* refs: the referable values by their number in the reader */
+typedef struct mp_enc {
+    amf_cursor         *c;
+    amf_reader          r;
+    amf_buf            *out;
+    int                 flags;
+
+    amf_vec             refs;
+} mp_enc;
+
+static void mp_value(mp_enc *m);
+
+/* a type byte and the n low bytes of u, big endian, straight into the buffer */
+static void
+mp_put(amf_buf *out, int type, uint64_t u, int n)
+{
+    unsigned char *s;
+
+    if (out->free < 9) {
+        amf_buf_reserve(out, 9);
+    }
+
+    s = (unsigned char *)out->b + out->len;
+    s[0] = (unsigned char)type;
+    for (int i = n; i > 0; i--) {
+        s[i] = (unsigned char)u;
+        u >>= 8;
+    }
+
+    out->len += n + 1;
+    out->free -= n + 1;
+}
+
+static void
+mp_be(amf_buf *out, uint64_t u, int n)
+{
+    unsigned char s[8];
+
+    for (int i = n - 1; i >= 0; i--) {
+        s[i] = (unsigned char)u;
+        u >>= 8;
+    }
+
+    amf_buf_append(out, (char *)s, n);
+}
+
+/* the shortest header for len, fixn is 0 and t8 0 for the types without them */
+static void
+mp_head(amf_buf *out, size_t len, int fix, size_t fixn, int t8, int t16, int t32)
+{
+    if (len < fixn) {
+        mp_put(out, fix | (int)len, 0, 0);
+    } else if (t8 && len <= 0xff) {
+        mp_put(out, t8, len, 1);
+    } else if (len <= 0xffff) {
+        mp_put(out, t16, len, 2);
+    } else {
+        mp_put(out, t32, len, 4);
+    }
+}
+
+#define mp_str_head(out, len)   mp_head(out, len, MP_FIXSTR, 32, MP_STR8, MP_STR16, MP_STR32)
+#define mp_bin_head(out, len)   mp_head(out, len, 0, 0, MP_BIN8, MP_BIN16, MP_BIN32)
+#define mp_array_head(out, n)   mp_head(out, n, MP_FIXARRAY, 16, 0, MP_ARRAY16, MP_ARRAY32)
+#define mp_map_head(out, n)     mp_head(out, n, MP_FIXMAP, 16, 0, MP_MAP16, MP_MAP32)
+
+static void
+mp_string(amf_buf *out, const char *p, size_t len)
+{
+    mp_str_head(out, len);
+    amf_buf_append(out, p, len);
+}
+
+static void
+mp_int(amf_buf *out, int64_t i)
+{
+    uint64_t u = (uint64_t)i;
+
+    if (i >= 0) {
+        if (u < 0x80) {
+            mp_put(out, (int)u, 0, 0);
+        } else if (u <= 0xff) {
+            mp_put(out, MP_UINT8, u, 1);
+        } else if (u <= 0xffff) {
+            mp_put(out, MP_UINT16, u, 2);
+        } else if (u <= 0xffffffff) {
+            mp_put(out, MP_UINT32, u, 4);
+        } else {
+            mp_put(out, MP_UINT64, u, 8);
+        }
+
+    } else if (i >= -32) {
+        mp_put(out, (int)(u & 0xff), 0, 0);
+    } else if (i >= INT8_MIN) {
+        mp_put(out, MP_INT8, u, 1);
+    } else if (i >= INT16_MIN) {
+        mp_put(out, MP_INT16, u, 2);
+    } else if (i >= INT32_MIN) {
+        mp_put(out, MP_INT32, u, 4);
+    } else {
+        mp_put(out, MP_INT64, u, 8);
+    }
+}
+
+/* integral numbers as integers, amf0 has no others */
+static void
+mp_number(amf_buf *out, double d)
+{
+    uint64_t u;
+
+    if (d == floor(d) && fabs(d) < 9007199254740992.0) {
+        mp_int(out, (int64_t)d);
+        return;
+    }
+
+    memcpy(&u, &d, 8);
+    mp_put(out, MP_FLOAT64, u, 8);
+}
+
+/* the timestamp extension in its shortest form, or ms since the epoch */
+static void
+mp_date(mp_enc *m, double d)
+{
+    amf_buf    *out = m->out;
+    double      sec;
+    int64_t     s;
+    uint32_t    ns;
+
+    if (!(m->flags & AMF_MSGPACK_DATE_EXT)) {
+        mp_number(out, d);
+        return;
+    }
+
+    if (isnan(d) || fabs(d) > 8.64e15) {
+        mp_put(out, MP_NIL, 0, 0);
+        return;
+    }
+
+    sec = floor(d / 1000);
+    s = (int64_t)sec;
+    ns = (uint32_t)floor((d - sec * 1000) * 1e6);
+    if (ns > 999999999) {
+        ns = 999999999;
+    }
+
+    if (s >= 0 && s < (1LL << 34)) {
+        if (ns == 0 && s <= 0xffffffff) {
+            mp_put(out, MP_FIXEXT4, 0xff, 1);
+            mp_be(out, (uint64_t)s, 4);
+        } else {
+            mp_put(out, MP_FIXEXT8, 0xff, 1);
+            mp_be(out, (uint64_t)ns << 34 | (uint64_t)s, 8);
+        }
+        return;
+    }
+
+    mp_put(out, MP_EXT8, 12, 1);
+    mp_be(out, 0xff, 1);
+    mp_be(out, ns, 4);
+    mp_be(out, (uint64_t)s, 8);
+}
+
+/* a map whose size is known at its end, a map 32 header to patch */
+static size_t
+mp_open_map(amf_buf *out)
+{
+    size_t pos = out->len;
+
+    mp_put(out, MP_MAP32, 0, 4);
+
+    return pos;
+}
+
+static void
+mp_close_map(amf_buf *out, size_t pos, uint32_t n)
+{
+    amf_buf_put_u32(out, pos + 1, n);
+}
+
+/* a referable value is written again by copying it, a cycle fails */
+static void
+mp_copy_ref(mp_enc *m, uint32_t ref)
+{
+    amf_buf    *out = m->out;
+    mp_ref      r = amf_vec_at(&m->refs, mp_ref, ref);
+
+    if (r.end == 0) {
+        mp_error(m->c, "cyclic reference");
+        return;
+    }
+
+    /* copies of copies grow the output without bound but for the alloc limit */
+    amf_cursor_copy(m->c, r.end - r.start);
+    amf_cursor_checkerr(m->c);
+
+    amf_buf_reserve(out, r.end - r.start);
+    amf_buf_append(out, out->b + r.start, r.end - r.start);
+}
+
+/* a referable value about to be written, they come in the order of their numbers */
+static void
+mp_open_ref(mp_enc *m)
+{
+    mp_ref r = { m->out->len, 0 };
+
+    if (amf_vec_push(&m->refs, &r, sizeof(r))) {
+        mp_error(m->c, "out of memory");
+    }
+}
+
+static void
+mp_close_ref(mp_enc *m, uint32_t ref)
+{
+    amf_vec_at(&m->refs, mp_ref, ref).end = m->out->len;
+}
+
+static int
+mp_alias(mp_enc *m, const amf_str *alias)
+{
+    if ((m->flags & AMF_MSGPACK_ALIAS) && alias->len) {
+        mp_string(m->out, MP_ALIAS_KEY, MP_ALIAS_KEY_LEN);
+        mp_string(m->out, alias->p, alias->len);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * an object, or an array with named keys, the dense part keyed by
+ * position from 1 as lua has it. sealed objects know their size up
+ * front, the others are patched.
+ */
+static void
+mp_map(mp_enc *m, const amf_item *it)
+{
+    amf_cursor *c = m->c;
+    amf_str     key;
+    uint32_t    i = 0, n;
+    size_t      pos = 0;
+    int         sealed = it->type == AMF_ITEM_OBJECT && !it->dynamic, next;
+
+    if (sealed) {
+        mp_map_head(m->out, it->nmembers + ((m->flags & AMF_MSGPACK_ALIAS) && it->alias.len));
+    } else {
+        pos = mp_open_map(m->out);
+    }
+
+    n = mp_alias(m, &it->alias);
+
+    while ((next = amf_reader_next(&m->r, &key)) != AMF_NEXT_END) {
+        if (next == AMF_NEXT_ITEM) {
+            mp_int(m->out, (int64_t)++i);
+        } else {
+            mp_string(m->out, key.p, key.len);
+        }
+
+        mp_value(m);
+        amf_cursor_checkerr(c);
+        n++;
+    }
+    amf_cursor_checkerr(c);
+
+    if (!sealed) {
+        mp_close_map(m->out, pos, n);
+    }
+}
+
+static void
+mp_value(mp_enc *m)
+{
+    amf_cursor *c = m->c;
+    amf_buf    *out = m->out;
+    amf_item    it;
+    amf_str     key;
+
+    amf_reader_value(&m->r, &it);
+    amf_cursor_checkerr(c);
+
+    if (it.type == AMF_ITEM_REF) {
+        mp_copy_ref(m, it.ref);
+        return;
+    }
+
+    if (it.referable) {
+        mp_open_ref(m);
+        amf_cursor_checkerr(c);
+    }
+
+    switch (it.type) {
+    case AMF_ITEM_UNDEFINED:
+    case AMF_ITEM_NULL:
+        mp_put(out, MP_NIL, 0, 0);
+        break;
+
+    case AMF_ITEM_BOOL:
+        mp_put(out, it.i ? MP_TRUE : MP_FALSE, 0, 0);
+        break;
+
+    case AMF_ITEM_INT:
+        mp_int(out, it.i);
+        break;
+
+    case AMF_ITEM_NUMBER:
+        mp_number(out, it.d);
+        break;
+
+    case AMF_ITEM_STRING:
+    case AMF_ITEM_XMLDOC:
+    case AMF_ITEM_XML:
+        mp_string(out, it.s.p, it.s.len);
+        break;
+
+    case AMF_ITEM_BYTEARRAY:
+        mp_bin_head(out, it.s.len);
+        amf_buf_append(out, it.s.p, it.s.len);
+        break;
+
+    case AMF_ITEM_DATE:
+        mp_date(m, it.d);
+        break;
+
+    case AMF_ITEM_ARRAY:
+        if (it.mixed) {
+            mp_map(m, &it);
+            break;
+        }
+
+        mp_array_head(out, it.len);
+        while (amf_reader_next(&m->r, &key) != AMF_NEXT_END) {
+            mp_value(m);
+            amf_cursor_checkerr(c);
+        }
+        break;
+
+    case AMF_ITEM_OBJECT:
+        mp_map(m, &it);
+        break;
+
+    case AMF_ITEM_EXTERNAL:
+        /* the flex wrappers take the slot of the value they wrap */
+        while (amf_reader_next(&m->r, &key) != AMF_NEXT_END) {
+            mp_value(m);
+            amf_cursor_checkerr(c);
+        }
+        break;
+    }
+    amf_cursor_checkerr(c);
+
+    if (it.referable) {
+        mp_close_ref(m, it.ref);
+    }
+}
+
+void
+amf_msgpack_encode(amf_cursor *c, int ver, int flags, amf_buf *out)
+{
+    mp_enc m;
+
+    memset(&m, 0, sizeof(m));
+    m.c = c;
+    m.out = out;
+    m.flags = flags;
+
+    amf_reader_init(&m.r, c, ver);
+    m.r.max_depth = AMF_MSGPACK_MAX_DEPTH;
+
+    mp_value(&m);
+
+    amf_reader_free(&m.r);
+    amf_vec_free(&m.refs);
+}
+
+/*
+ * messagepack to amf
+ */
+
+enum {
+    MPT_NIL, MPT_BOOL, MPT_UINT, MPT_INT, MPT_FLOAT,
+    MPT_STR, MPT_BIN, MPT_ARRAY, MPT_MAP, MPT_EXT
+};
+
+/*
+ * a messagepack item: u for booleans and unsigned integers, p and len for
+ * the bytes of strings, binaries and extensions, len the count of arrays
+ * and maps, whose items follow
+ */
+typedef struct mp_item {
+    int                 type;
+    uint64_t            u;
+    int64_t             i;
+    double              d;
+    const char         *p;
+    uint32_t            len;
+    int                 ext;
+} mp_item;
+
+/*
+ * strs, traits:    the amf3 string and traits tables by content, amf3 is
+ *                  written with string and traits references
+ * keys:            the integer map keys the string table points to
+ */
+typedef struct mp_dec {
+    amf_cursor         *c;
+    amf_buf            *out;
+    int                 depth;
+
+    amf_map             strs, traits;
+    amf_vec             keys;
+} mp_dec;
+
+static void mp_dec_amf0(mp_dec *d);
+static void mp_dec_amf3(mp_dec *d);
+
+static void
+mp_read_be(amf_cursor *c, int n, uint64_t *u)
+{
+    amf_cursor_need(c, (size_t)n);
+
+    *u = 0;
+    for (int i = 0; i < n; i++) {
+        *u = *u << 8 | (uint8_t)c->p[i];
+    }
+
+    amf_cursor_consume(c, n);
+}
+
+static void
+mp_read_bytes(amf_cursor *c, mp_item *it, int type, uint64_t len)
+{
+    amf_cursor_need(c, len);
+
+    it->type = type;
+    it->p = c->p;
+    it->len = (uint32_t)len;
+    amf_cursor_consume(c, len);
+}
+
+static void
+mp_read_item(amf_cursor *c, mp_item *it)
+{
+    uint64_t    u;
+    uint8_t     b;
+    float       f;
+
+    amf_cursor_read_u8(c, &b);
+    amf_cursor_checkerr(c);
+
+    if (b < MP_FIXMAP) {
+        it->type = MPT_UINT;
+        it->u = b;
+        return;
+    }
+
+    if (b >= 0xe0) {
+        it->type = MPT_INT;
+        it->i = (int8_t)b;
+        return;
+    }
+
+    if (b < MP_FIXARRAY) {
+        it->type = MPT_MAP;
+        it->len = b & 0x0f;
+        return;
+    }
+
+    if (b < MP_FIXSTR) {
+        it->type = MPT_ARRAY;
+        it->len = b & 0x0f;
+        return;
+    }
+
+    if (b < MP_NIL) {
+        mp_read_bytes(c, it, MPT_STR, b & 0x1f);
+        return;
+    }
+
+    switch (b) {
+    case MP_NIL:
+        it->type = MPT_NIL;
+        break;
+
+    case MP_FALSE:
+    case MP_TRUE:
+        it->type = MPT_BOOL;
+        it->u = b == MP_TRUE;
+        break;
+
+    case MP_BIN8:
+    case MP_BIN16:
+    case MP_BIN32:
+        mp_read_be(c, 1 << (b - MP_BIN8), &u);
+        amf_cursor_checkerr(c);
+        mp_read_bytes(c, it, MPT_BIN, u);
+        break;
+
+    case MP_STR8:
+    case MP_STR16:
+    case MP_STR32:
+        mp_read_be(c, 1 << (b - MP_STR8), &u);
+        amf_cursor_checkerr(c);
+        mp_read_bytes(c, it, MPT_STR, u);
+        break;
+
+    case MP_EXT8:
+    case MP_EXT16:
+    case MP_EXT32:
+        mp_read_be(c, 1 << (b - MP_EXT8), &u);
+        amf_cursor_checkerr(c);
+        amf_cursor_read_u8(c, &b);
+        amf_cursor_checkerr(c);
+        it->ext = (int8_t)b;
+        mp_read_bytes(c, it, MPT_EXT, u);
+        break;
+
+    case MP_FIXEXT1:
+    case MP_FIXEXT1 + 1:
+    case MP_FIXEXT4:
+    case MP_FIXEXT8:
+    case MP_FIXEXT16:
+        u = 1 << (b - MP_FIXEXT1);
+        amf_cursor_read_u8(c, &b);
+        amf_cursor_checkerr(c);
+        it->ext = (int8_t)b;
+        mp_read_bytes(c, it, MPT_EXT, u);
+        break;
+
+    case MP_FLOAT32:
+        mp_read_be(c, 4, &u);
+        amf_cursor_checkerr(c);
+        {
+            uint32_t u32 = (uint32_t)u;
+            memcpy(&f, &u32, 4);
+        }
+        it->type = MPT_FLOAT;
+        it->d = f;
+        break;
+
+    case MP_FLOAT64:
+        mp_read_be(c, 8, &u);
+        amf_cursor_checkerr(c);
+        memcpy(&it->d, &u, 8);
+        it->type = MPT_FLOAT;
+        break;
+
+    case MP_UINT8:
+    case MP_UINT16:
+    case MP_UINT32:
+    case MP_UINT64:
+        mp_read_be(c, 1 << (b - MP_UINT8), &u);
+        amf_cursor_checkerr(c);
+        it->type = MPT_UINT;
+        it->u = u;
+        break;
+
+    case MP_INT8:
+    case MP_INT16:
+    case MP_INT32:
+    case MP_INT64: {
+        int bits = 64 - 8 * (1 << (b - MP_INT8));
+
+        mp_read_be(c, 1 << (b - MP_INT8), &u);
+        amf_cursor_checkerr(c);
+        /* sign extend */
+        it->type = MPT_INT;
+        it->i = (int64_t)(u << bits) >> bits;
+        break;
+    }
+
+    case MP_ARRAY16:
+    case MP_ARRAY32:
+    case MP_MAP16:
+    case MP_MAP32:
+        mp_read_be(c, b == MP_ARRAY16 || b == MP_MAP16 ? 2 : 4, &u);
+        amf_cursor_checkerr(c);
+        it->type = b < MP_MAP16 ? MPT_ARRAY : MPT_MAP;
+        it->len = (uint32_t)u;
+        break;
+
+    default:
+        mp_error(c, "unsupported messagepack type");
+    }
+}
+
+/* ms since the epoch of a timestamp extension */
+static void
+mp_read_timestamp(amf_cursor *c, const mp_item *it, double *ms)
+{
+    const unsigned char    *p = (const unsigned char *)it->p;
+    uint64_t                sec = 0, nsec = 0;
+
+    if (it->ext != MP_EXT_TIMESTAMP) {
+        mp_error(c, "unsupported extension");
+        return;
+    }
+
+    for (uint32_t i = 0; i < it->len; i++) {
+        if (it->len == 12 && i < 4) {
+            nsec = nsec << 8 | p[i];
+        } else {
+            sec = sec << 8 | p[i];
+        }
+    }
+
+    switch (it->len) {
+    case 4:
+        *ms = (double)sec * 1000;
+        break;
+    case 8:
+        nsec = sec >> 34;
+        *ms = (double)(sec & ((1ULL << 34) - 1)) * 1000 + (double)nsec / 1e6;
+        break;
+    case 12:
+        *ms = (double)(int64_t)sec * 1000 + (double)nsec / 1e6;
+        break;
+    default:
+        mp_error(c, "bad timestamp");
+    }
+}
+
+/*
+ * the value of a first key "__amf_alias__" that is a string, the cursor
+ * is left before the key when there is none
+ */
+static void
+mp_peek_alias(mp_dec *d, uint32_t *n, mp_str *alias)
+{
+    amf_cursor  save = *d->c;
+    mp_item     it;
+
+    alias->p = NULL;
+    alias->len = 0;
+
+    if (*n > 0) {
+        mp_read_item(d->c, &it);
+        if (!d->c->err && it.type == MPT_STR && it.len == MP_ALIAS_KEY_LEN
+            && memcmp(it.p, MP_ALIAS_KEY, MP_ALIAS_KEY_LEN) == 0)
+        {
+            mp_read_item(d->c, &it);
+            if (!d->c->err && it.type == MPT_STR) {
+                alias->p = it.p;
+                alias->len = it.len;
+                (*n)--;
+                return;
+            }
+        }
+    }
+
+    *d->c = save;
+}
+
+/* a map key as bytes, integers as decimals in num */
+static void
+mp_read_key(mp_dec *d, char *num, size_t size, mp_str *key)
+{
+    amf_cursor *c = d->c;
+    mp_item     it;
+
+    mp_read_item(c, &it);
+    amf_cursor_checkerr(c);
+
+    switch (it.type) {
+    case MPT_STR:
+    case MPT_BIN:
+        key->p = it.p;
+        key->len = it.len;
+        break;
+
+    case MPT_UINT:
+        key->p = num;
+        key->len = snprintf(num, size, "%llu", (unsigned long long)it.u);
+        break;
+
+    case MPT_INT:
+        key->p = num;
+        key->len = snprintf(num, size, "%lld", (long long)it.i);
+        break;
+
+    default:
+        mp_error(c, "unsupported map key");
+        return;
+    }
+
+    /* an empty name ends the members in amf */
+    if (key->len == 0) {
+        mp_error(c, "empty map key");
+    }
+}
+
+/* a map needs two bytes a pair, an array one an item */
+static int
+mp_check_count(amf_cursor *c, uint64_t n)
+{
+    if (n > c->left) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+mp_dec_amf0_string(mp_dec *d, const char *p, size_t len)
+{
+    if (len <= 0xffff) {
+        amf_buf_append_char(d->out, AMF0_STRING);
+        amf_buf_append_u16(d->out, (uint16_t)len);
+    } else {
+        amf_buf_append_char(d->out, AMF0_L_STRING);
+        amf_buf_append_u32(d->out, (uint32_t)len);
+    }
+
+    amf_buf_append(d->out, p, len);
+}
+
+static void
+mp_dec_amf0_value(mp_dec *d)
+{
+    amf_cursor *c = d->c;
+    amf_buf    *out = d->out;
+    mp_item     it;
+    mp_str      alias, key;
+    uint32_t    n;
+    double      ms;
+    char        num[24];
+
+    mp_read_item(c, &it);
+    amf_cursor_checkerr(c);
+
+    switch (it.type) {
+    case MPT_NIL:
+        amf_buf_append_char(out, AMF0_NULL);
+        break;
+
+    case MPT_BOOL:
+        amf_buf_append_char(out, AMF0_BOOLEAN);
+        amf_buf_append_char(out, it.u ? 1 : 0);
+        break;
+
+    case MPT_UINT:
+        amf_buf_append_char(out, AMF0_NUMBER);
+        amf_buf_append_double(out, (double)it.u);
+        break;
+
+    case MPT_INT:
+        amf_buf_append_char(out, AMF0_NUMBER);
+        amf_buf_append_double(out, (double)it.i);
+        break;
+
+    case MPT_FLOAT:
+        amf_buf_append_char(out, AMF0_NUMBER);
+        amf_buf_append_double(out, it.d);
+        break;
+
+    case MPT_STR:
+    case MPT_BIN:
+        mp_dec_amf0_string(d, it.p, it.len);
+        break;
+
+    case MPT_ARRAY:
+        if (mp_check_count(c, it.len)) {
+            return;
+        }
+
+        amf_buf_append_char(out, AMF0_STRICT_ARRAY);
+        amf_buf_append_u32(out, it.len);
+        for (uint32_t i = 0; i < it.len; i++) {
+            mp_dec_amf0(d);
+            amf_cursor_checkerr(c);
+        }
+        break;
+
+    case MPT_MAP:
+        n = it.len;
+        if (mp_check_count(c, (uint64_t)n * 2)) {
+            return;
+        }
+
+        mp_peek_alias(d, &n, &alias);
+
+        if (alias.len > 0xffff) {
+            mp_error(c, "alias too long");
+            return;
+        }
+
+        if (alias.p) {
+            amf_buf_append_char(out, AMF0_TYPED_OBJECT);
+            amf_buf_append_u16(out, (uint16_t)alias.len);
+            amf_buf_append(out, alias.p, alias.len);
+        } else {
+            amf_buf_append_char(out, AMF0_OBJECT);
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            mp_read_key(d, num, sizeof(num), &key);
+            amf_cursor_checkerr(c);
+
+            if (key.len > 0xffff) {
+                mp_error(c, "map key too long");
+                return;
+            }
+
+            amf_buf_append_u16(out, (uint16_t)key.len);
+            amf_buf_append(out, key.p, key.len);
+
+            mp_dec_amf0(d);
+            amf_cursor_checkerr(c);
+        }
+
+        amf_buf_append_u16(out, 0);
+        amf_buf_append_char(out, AMF0_END_OF_OBJECT);
+        break;
+
+    case MPT_EXT:
+        mp_read_timestamp(c, &it, &ms);
+        amf_cursor_checkerr(c);
+
+        amf_buf_append_char(out, AMF0_DATE);
+        amf_buf_append_double(out, ms);
+        amf_buf_append_u16(out, 0);
+        break;
+    }
+}
+
+static void
+mp_dec_amf0(mp_dec *d)
+{
+    if (d->depth == AMF_MSGPACK_MAX_DEPTH) {
+        mp_error(d->c, "nested too deep");
+        return;
+    }
+
+    d->depth++;
+    mp_dec_amf0_value(d);
+    d->depth--;
+}
+
+/*
+ * an amf3 string by reference when it was written before. tmp strings
+ * are copied before they go into the table.
+ */
+static void
+mp_dec_amf3_str(mp_dec *d, const char *p, size_t len, int tmp)
+{
+    amf_cursor *c = d->c;
+    long        ref;
+    char       *q;
+
+    if (len == 0) {
+        amf_buf_append_char(d->out, 0x01);
+        return;
+    }
+
+    if (len > AMF3_MAX_STR_LEN) {
+        mp_error(c, "string too long");
+        return;
+    }
+
+    ref = amf_map_find(&d->strs, p, (uint32_t)len);
+    if (ref >= 0) {
+        amf_buf_append_u29(d->out, (int)(ref << 1));
+        return;
+    }
+
+    if (tmp) {
+        if ((q = malloc(len)) == NULL || amf_vec_push(&d->keys, &q, sizeof(q))) {
+            free(q);
+            mp_error(c, "out of memory");
+            return;
+        }
+        memcpy(q, p, len);
+        p = q;
+    }
+
+    if (amf_map_put(&d->strs, p, (uint32_t)len)) {
+        mp_error(c, "out of memory");
+        return;
+    }
+
+    amf_buf_append_u29(d->out, (int)(len << 1 | 1));
+    amf_buf_append(d->out, p, len);
+}
+
+/* a dynamic object, the traits of each alias are written once */
+static void
+mp_dec_amf3_object(mp_dec *d, uint32_t n)
+{
+    static const char   anonymous[] = "";
+    amf_cursor         *c = d->c;
+    mp_str              alias, key;
+    long                ref;
+    char                num[24];
+
+    mp_peek_alias(d, &n, &alias);
+    if (alias.p == NULL) {
+        alias.p = anonymous;
+    }
+
+    amf_buf_append_char(d->out, AMF3_OBJECT);
+
+    ref = amf_map_find(&d->traits, alias.p, (uint32_t)alias.len);
+    if (ref >= 0) {
+        amf_buf_append_u29(d->out, (int)(ref << 2 | 1));
+
+    } else {
+        if (amf_map_put(&d->traits, alias.p, (uint32_t)alias.len)) {
+            mp_error(c, "out of memory");
+            return;
+        }
+
+        /* inline traits, dynamic, no sealed members */
+        amf_buf_append_u29(d->out, 0x0b);
+        mp_dec_amf3_str(d, alias.p, alias.len, 0);
+        amf_cursor_checkerr(c);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        mp_read_key(d, num, sizeof(num), &key);
+        amf_cursor_checkerr(c);
+
+        mp_dec_amf3_str(d, key.p, key.len, key.p == num);
+        amf_cursor_checkerr(c);
+
+        mp_dec_amf3(d);
+        amf_cursor_checkerr(c);
+    }
+
+    amf_buf_append_char(d->out, 0x01);
+}
+
+static void
+mp_dec_amf3_value(mp_dec *d)
+{
+    amf_cursor *c = d->c;
+    amf_buf    *out = d->out;
+    mp_item     it;
+    double      ms;
+
+    mp_read_item(c, &it);
+    amf_cursor_checkerr(c);
+
+    switch (it.type) {
+    case MPT_NIL:
+        amf_buf_append_char(out, AMF3_NULL);
+        break;
+
+    case MPT_BOOL:
+        amf_buf_append_char(out, it.u ? AMF3_TRUE : AMF3_FALSE);
+        break;
+
+    case MPT_UINT:
+        if (it.u <= AMF3_MAX_INT) {
+            amf_buf_append_char(out, AMF3_INTEGER);
+            amf_buf_append_u29(out, (int)it.u);
+        } else {
+            amf_buf_append_char(out, AMF3_DOUBLE);
+            amf_buf_append_double(out, (double)it.u);
+        }
+        break;
+
+    case MPT_INT:
+        if (it.i >= AMF3_MIN_INT && it.i <= AMF3_MAX_INT) {
+            amf_buf_append_char(out, AMF3_INTEGER);
+            amf_buf_append_u29(out, (int)it.i);
+        } else {
+            amf_buf_append_char(out, AMF3_DOUBLE);
+            amf_buf_append_double(out, (double)it.i);
+        }
+        break;
+
+    case MPT_FLOAT:
+        amf_buf_append_char(out, AMF3_DOUBLE);
+        amf_buf_append_double(out, it.d);
+        break;
+
+    case MPT_STR:
+        amf_buf_append_char(out, AMF3_STRING);
+        mp_dec_amf3_str(d, it.p, it.len, 0);
+        break;
+
+    case MPT_BIN:
+        if (it.len > AMF3_MAX_STR_LEN) {
+            mp_error(c, "binary too long");
+            return;
+        }
+
+        amf_buf_append_char(out, AMF3_BYTEARRAY);
+        amf_buf_append_u29(out, (int)(it.len << 1 | 1));
+        amf_buf_append(out, it.p, it.len);
+        break;
+
+    case MPT_ARRAY:
+        if (mp_check_count(c, it.len)) {
+            return;
+        }
+
+        amf_buf_append_char(out, AMF3_ARRAY);
+        amf_buf_append_u29(out, (int)(it.len << 1 | 1));
+        amf_buf_append_char(out, 0x01);
+        for (uint32_t i = 0; i < it.len; i++) {
+            mp_dec_amf3(d);
+            amf_cursor_checkerr(c);
+        }
+        break;
+
+    case MPT_MAP:
+        if (mp_check_count(c, (uint64_t)it.len * 2)) {
+            return;
+        }
+
+        mp_dec_amf3_object(d, it.len);
+        break;
+
+    case MPT_EXT:
+        mp_read_timestamp(c, &it, &ms);
+        amf_cursor_checkerr(c);
+
+        amf_buf_append_char(out, AMF3_DATE);
+        amf_buf_append_u29(out, 0x01);
+        amf_buf_append_double(out, ms);
+        break;
+    }
+}
+
+static void
+mp_dec_amf3(mp_dec *d)
+{
+    if (d->depth == AMF_MSGPACK_MAX_DEPTH) {
+        mp_error(d->c, "nested too deep");
+        return;
+    }
+
+    d->depth++;
+    mp_dec_amf3_value(d);
+    d->depth--;
+}
+
+void
+amf_msgpack_decode(amf_cursor *c, int ver, amf_buf *out)
+{
+    mp_dec d;
+
+    memset(&d, 0, sizeof(d));
+    d.c = c;
+    d.out = out;
+    d.strs.str = 1;
+    d.traits.str = 1;
+
+    if (ver == AMF_VER0) {
+        mp_dec_amf0(&d);
+    } else {
+        mp_dec_amf3(&d);
+    }
+
+    for (uint32_t i = 0; i < d.keys.n; i++) {
+        free(amf_vec_at(&d.keys, char *, i));
+    }
+
+    amf_map_free(&d.strs);
+    amf_map_free(&d.traits);
+    amf_vec_free(&d.keys);
+}
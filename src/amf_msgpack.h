@@ -0,0 +1,33 @@
+#ifndef AMF_MSGPACK_H
+
+#define AMF_MSGPACK_H
+
+#include "amf_buf.h"
+#include "amf_cursor.h"
+#include "amf_types.h"
+
+/*
+ * amf to messagepack and back, cursor to buffer without lua tables.
+ * references are expanded by copying what was written for the referenced
+ * value, a cycle fails. traits members become map keys.
+ */
+#define AMF_MSGPACK_DATE_EXT    0x01    /* dates as the timestamp extension, not ms doubles */
+#define AMF_MSGPACK_ALIAS       0x02    /* typed objects get "__amf_alias__" */
+
+/* nesting deeper than this fails */
+#define AMF_MSGPACK_MAX_DEPTH   1024
+
+/*
+ * append the messagepack of the amf value of ver at the cursor to out,
+ * the cursor ends behind the value or holds the error. the limits of the
+ * cursor hold for the input, and their alloc for the references copied too.
+ */
+void amf_msgpack_encode(amf_cursor *c, int ver, int flags, amf_buf *out);
+
+/*
+ * append the messagepack value at the cursor to out as amf of ver, the
+ * cursor ends behind the value or holds the error
+ */
+void amf_msgpack_decode(amf_cursor *c, int ver, amf_buf *out);
+
+#endif /* end of include guard: AMF_MSGPACK_H */
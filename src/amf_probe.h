@@ -0,0 +1,35 @@
+#ifndef AMF_PROBE_H
+
+#define AMF_PROBE_H
+
+/*
+ * static tracepoints at the entry and exit of the lua entry points, built
+ * with -DAMF_USDT (needs systemtap's sys/sdt.h). the probes are nops until
+ * a tracer attaches, e.g.
+ *
+ *   bpftrace -e 'usdt:./amf_codec.so:amf_codec:decode__done { @[arg1] = hist(arg0) }'
+ *
+ *   encode__start(ver)                 encode__done(bytes)
+ *   decode__start(ver, bytes)          decode__done(bytes, err)
+ *   decode_msg__start(bytes)           decode_msg__done(bytes, err)
+ *   encode_msg__start()                encode_msg__done(bytes)
+ *
+ * a call ending in a lua error fires no done probe.
+ */
+#ifdef AMF_USDT
+
+#include <sys/sdt.h>
+
+#define amf_probe0(name)            DTRACE_PROBE(amf_codec, name)
+#define amf_probe1(name, a)         DTRACE_PROBE1(amf_codec, name, a)
+#define amf_probe2(name, a, b)      DTRACE_PROBE2(amf_codec, name, a, b)
+
+#else
+
+#define amf_probe0(name)            ((void)0)
+#define amf_probe1(name, a)         ((void)0)
+#define amf_probe2(name, a, b)      ((void)0)
+
+#endif
+
+#endif /* end of include guard: AMF_PROBE_H */
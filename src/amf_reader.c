@@ -0,0 +1,675 @@
+#include "amf_reader.h"
+
+#include "endiness.h"
+
+#include <string.h>
+
+/*
+ * an open container
+ *
+ * state:   what comes next, RD_*
+ * amf3:    its values are amf3
+ * scope:   it is the avmplus value, whose amf3 tables go with it
+ * i, n:    sealed members or dense items read and to read
+ * members: the sealed member names of its traits
+ * key:     the first key of an amf3 array, read to tell it is mixed
+ */
+#define RD_PROPS    0   /* amf0 keys up to the end of object marker */
+#define RD_SEALED   1
+#define RD_DYNAMIC  2
+#define RD_ASSOC    3
+#define RD_DENSE    4
+
+typedef struct amf_reader_frame {
+    uint8_t             state, amf3, scope, dynamic;
+    uint32_t            i, n;
+    uint32_t            members;
+    amf_str             key;
+} amf_reader_frame;
+
+#define rd_top(r)   (&amf_vec_at(&(r)->frames, amf_reader_frame, (r)->frames.n - 1))
+
+static void
+rd_error(amf_reader *r, const char *msg)
+{
+    r->c->err = AMF_CUR_ERR_BADFMT;
+    r->c->err_msg = msg;
+}
+
+static void
+rd_push(amf_reader *r, amf_vec *v, const void *item, size_t size)
+{
+    if (amf_vec_push(v, item, size)) {
+        rd_error(r, "out of memory");
+    }
+}
+
+void
+amf_reader_init(amf_reader *r, amf_cursor *c, int ver)
+{
+    memset(r, 0, sizeof(*r));
+    r->c = c;
+    r->ver = ver;
+}
+
+void
+amf_reader_free(amf_reader *r)
+{
+    amf_vec_free(&r->frames);
+    amf_vec_free(&r->refs0);
+    amf_vec_free(&r->strs);
+    amf_vec_free(&r->objs);
+    amf_vec_free(&r->traits);
+    amf_vec_free(&r->members);
+}
+
+/* the amf3 tables of an avmplus value end with it */
+static void
+rd_scope_end(amf_reader *r)
+{
+    r->strs.n = r->objs.n = r->traits.n = r->members.n = 0;
+}
+
+void
+amf_reader_reset(amf_reader *r)
+{
+    rd_scope_end(r);
+    r->frames.n = r->refs0.n = 0;
+    r->nrefs = 0;
+}
+
+/* give the value the next number, kept in refs to be found by its index there */
+static void
+rd_referable(amf_reader *r, amf_item *it, amf_vec *refs)
+{
+    it->referable = 1;
+    it->ref = r->nrefs++;
+    rd_push(r, refs, &it->ref, sizeof(it->ref));
+}
+
+/* a container of n dense items opens */
+static void
+rd_open(amf_reader *r, amf_item *it, int state, uint32_t n)
+{
+    amf_cursor         *c = r->c;
+    amf_reader_frame    f;
+
+    if (r->max_depth && c->depth >= r->max_depth) {
+        rd_error(r, "nested too deep");
+        return;
+    }
+
+    amf_cursor_enter(c, state == RD_PROPS ? 0 : n, 0);
+    amf_cursor_checkerr(c);
+
+    memset(&f, 0, sizeof(f));
+    f.state = (uint8_t)state;
+    f.amf3 = it->amf3;
+    f.n = n;
+
+    rd_push(r, &r->frames, &f, sizeof(f));
+}
+
+static void
+rd_read_double(amf_cursor *c, double *d)
+{
+    amf_cursor_need(c, 8);
+    memcpy(d, c->p, 8);
+    reverse_if_little_endian(d, 8);
+    amf_cursor_consume(c, 8);
+}
+
+static void
+rd_read_bytes(amf_cursor *c, size_t len, amf_str *s)
+{
+    amf_cursor_need(c, len);
+    s->p = c->p;
+    s->len = len;
+    amf_cursor_consume(c, len);
+}
+
+/*
+ * amf0
+ */
+
+static void rd_amf3(amf_reader *r, amf_item *it);
+
+static void
+rd_amf0(amf_reader *r, amf_item *it)
+{
+    amf_cursor *c = r->c;
+    uint8_t     marker, b;
+    uint16_t    len16;
+    uint32_t    len;
+
+    amf_cursor_read_u8(c, &marker);
+    amf_cursor_checkerr(c);
+
+    switch (marker) {
+    case AMF0_NUMBER:
+        it->type = AMF_ITEM_NUMBER;
+        rd_read_double(c, &it->d);
+        break;
+
+    case AMF0_BOOLEAN:
+        amf_cursor_read_u8(c, &b);
+        it->type = AMF_ITEM_BOOL;
+        it->i = b != 0;
+        break;
+
+    case AMF0_STRING:
+        amf_cursor_read_u16(c, &len16);
+        amf_cursor_checkerr(c);
+        it->type = AMF_ITEM_STRING;
+        rd_read_bytes(c, len16, &it->s);
+        break;
+
+    case AMF0_L_STRING:
+    case AMF0_XML_DOC:
+        amf_cursor_read_u32(c, &len);
+        amf_cursor_checkerr(c);
+        it->type = marker == AMF0_XML_DOC ? AMF_ITEM_XMLDOC : AMF_ITEM_STRING;
+        rd_read_bytes(c, len, &it->s);
+        break;
+
+    case AMF0_NULL:
+        it->type = AMF_ITEM_NULL;
+        break;
+
+    case AMF0_UNDEFINED:
+    case AMF0_UNSUPPORTED:
+        it->type = AMF_ITEM_UNDEFINED;
+        break;
+
+    case AMF0_DATE:
+        it->type = AMF_ITEM_DATE;
+        rd_read_double(c, &it->d);
+        amf_cursor_checkerr(c);
+        amf_cursor_skip(c, 2); /* the time zone, always 0 */
+        break;
+
+    case AMF0_OBJECT:
+    case AMF0_TYPED_OBJECT:
+        if (marker == AMF0_TYPED_OBJECT) {
+            amf_cursor_read_u16(c, &len16);
+            amf_cursor_checkerr(c);
+            rd_read_bytes(c, len16, &it->alias);
+            amf_cursor_checkerr(c);
+        }
+
+        it->type = AMF_ITEM_OBJECT;
+        it->traits = -1;
+        it->dynamic = 1;
+        rd_referable(r, it, &r->refs0);
+        amf_cursor_checkerr(c);
+        rd_open(r, it, RD_PROPS, 0);
+        break;
+
+    case AMF0_ECMA_ARRAY:
+        amf_cursor_skip(c, 4); /* the property count, often 0 */
+
+        it->type = AMF_ITEM_ARRAY;
+        it->mixed = 1;
+        rd_referable(r, it, &r->refs0);
+        amf_cursor_checkerr(c);
+        rd_open(r, it, RD_PROPS, 0);
+        break;
+
+    case AMF0_STRICT_ARRAY:
+        amf_cursor_read_u32(c, &len);
+        amf_cursor_checkerr(c);
+
+        it->type = AMF_ITEM_ARRAY;
+        it->len = len;
+        rd_referable(r, it, &r->refs0);
+        amf_cursor_checkerr(c);
+        rd_open(r, it, RD_DENSE, len);
+        break;
+
+    case AMF0_REFERENCE:
+        amf_cursor_read_u16(c, &len16);
+        amf_cursor_checkerr(c);
+
+        if (len16 >= r->refs0.n) {
+            rd_error(r, "reference not found");
+            return;
+        }
+
+        it->type = AMF_ITEM_REF;
+        it->ref = amf_vec_at(&r->refs0, uint32_t, len16);
+        break;
+
+    case AMF0_AVMPLUS: {
+        uint32_t depth = r->frames.n;
+
+        it->at = c->p;
+        rd_amf3(r, it);
+        amf_cursor_checkerr(c);
+
+        if (r->frames.n > depth) {
+            rd_top(r)->scope = 1;
+        } else {
+            rd_scope_end(r);
+        }
+        break;
+    }
+
+    default:
+        rd_error(r, "unsupported type");
+    }
+}
+
+/*
+ * amf3
+ */
+
+/* an amf3 string, inline or by reference */
+static void
+rd_amf3_str(amf_reader *r, amf_str *s)
+{
+    amf_cursor     *c = r->c;
+    unsigned int    ref;
+
+    amf_cursor_read_u29(c, &ref);
+    amf_cursor_checkerr(c);
+
+    if (ref & 1) {
+        rd_read_bytes(c, ref >> 1, s);
+        amf_cursor_checkerr(c);
+
+        if (s->len > 0) {
+            rd_push(r, &r->strs, s, sizeof(*s));
+        }
+        return;
+    }
+
+    if ((ref >> 1) >= r->strs.n) {
+        rd_error(r, "string reference not found");
+        return;
+    }
+
+    *s = amf_vec_at(&r->strs, amf_str, ref >> 1);
+}
+
+/*
+ * the header of a value of the object table: returns 1 when it was a
+ * reference, now in it, or 0 with *len the inline length or count
+ */
+static int
+rd_amf3_objref(amf_reader *r, amf_item *it, uint32_t *len)
+{
+    amf_cursor     *c = r->c;
+    unsigned int    ref;
+
+    amf_cursor_read_u29(c, &ref);
+    if (c->err) {
+        return 1;
+    }
+
+    if (ref & 1) {
+        *len = ref >> 1;
+        return 0;
+    }
+
+    if ((ref >> 1) >= r->objs.n) {
+        rd_error(r, "reference not found");
+        return 1;
+    }
+
+    it->type = AMF_ITEM_REF;
+    it->ref = amf_vec_at(&r->objs, uint32_t, ref >> 1);
+
+    return 1;
+}
+
+/* the index of the traits of an object, read or referenced, -1 on error */
+static long
+rd_amf3_traits(amf_reader *r, uint32_t ref)
+{
+    amf_cursor *c = r->c;
+    amf_traits  t;
+    amf_str     name;
+
+    if ((ref & 3) == 1) {
+        if ((ref >> 2) >= r->traits.n) {
+            rd_error(r, "traits reference not found");
+            return -1;
+        }
+
+        return ref >> 2;
+    }
+
+    t.external = (ref & 4) == 4;
+    t.dynamic = (ref & 8) == 8;
+    /* externalizable traits carry no sealed members */
+    t.nmembers = t.external ? 0 : ref >> 4;
+    t.members = r->members.n;
+    t.tag = -1;
+
+    if (t.nmembers > c->left) {
+        c->err = AMF_CUR_ERR_EOF;
+        c->err_msg = "eof";
+        return -1;
+    }
+
+    rd_amf3_str(r, &t.alias);
+
+    for (uint32_t i = 0; i < t.nmembers && !c->err; i++) {
+        rd_amf3_str(r, &name);
+        if (!c->err) {
+            rd_push(r, &r->members, &name, sizeof(name));
+        }
+    }
+
+    if (!c->err) {
+        rd_push(r, &r->traits, &t, sizeof(t));
+    }
+
+    return c->err ? -1 : (long)r->traits.n - 1;
+}
+
+static int
+rd_alias_is(const amf_str *alias, const char *name)
+{
+    return alias->len == strlen(name) && memcmp(alias->p, name, alias->len) == 0;
+}
+
+static void
+rd_amf3_object(amf_reader *r, amf_item *it)
+{
+    amf_cursor         *c = r->c;
+    amf_traits         *t;
+    amf_reader_frame   *f;
+    uint32_t            ref;
+    long                ti;
+
+    if (rd_amf3_objref(r, it, &ref)) {
+        return;
+    }
+
+    rd_referable(r, it, &r->objs);
+    amf_cursor_checkerr(c);
+
+    if ((ti = rd_amf3_traits(r, ref << 1 | 1)) < 0) {
+        return;
+    }
+
+    t = amf_reader_traits(r, ti);
+    it->alias = t->alias;
+    it->traits = ti;
+
+    /* the flex wrappers take the slot of the value they wrap */
+    if (t->external) {
+        if (!rd_alias_is(&t->alias, AMF_FLEX_ARRAY_COLLECTION)
+            && !rd_alias_is(&t->alias, AMF_FLEX_ARRAY_LIST)
+            && !rd_alias_is(&t->alias, AMF_FLEX_OBJECT_PROXY))
+        {
+            rd_error(r, "unsupported externalizable class");
+            return;
+        }
+
+        it->type = AMF_ITEM_EXTERNAL;
+        rd_open(r, it, RD_DENSE, 1);
+        return;
+    }
+
+    it->type = AMF_ITEM_OBJECT;
+    it->nmembers = t->nmembers;
+    it->dynamic = t->dynamic;
+
+    rd_open(r, it, RD_SEALED, t->nmembers);
+    amf_cursor_checkerr(c);
+
+    f = rd_top(r);
+    f->members = t->members;
+    f->dynamic = t->dynamic;
+}
+
+static void
+rd_amf3_array(amf_reader *r, amf_item *it)
+{
+    amf_cursor         *c = r->c;
+    amf_str             key;
+    uint32_t            len;
+
+    if (rd_amf3_objref(r, it, &len)) {
+        return;
+    }
+
+    rd_referable(r, it, &r->objs);
+    amf_cursor_checkerr(c);
+
+    /* the associative part comes first, up to an empty key */
+    rd_amf3_str(r, &key);
+    amf_cursor_checkerr(c);
+
+    it->type = AMF_ITEM_ARRAY;
+    it->len = len;
+    it->mixed = key.len > 0;
+
+    rd_open(r, it, it->mixed ? RD_ASSOC : RD_DENSE, len);
+    amf_cursor_checkerr(c);
+
+    rd_top(r)->key = key;
+}
+
+static void
+rd_amf3(amf_reader *r, amf_item *it)
+{
+    amf_cursor     *c = r->c;
+    unsigned int    u;
+    uint32_t        len;
+    uint8_t         marker;
+
+    it->amf3 = 1;
+
+    amf_cursor_read_u8(c, &marker);
+    amf_cursor_checkerr(c);
+
+    switch (marker) {
+    case AMF3_UNDEFINED:
+        it->type = AMF_ITEM_UNDEFINED;
+        break;
+
+    case AMF3_NULL:
+        it->type = AMF_ITEM_NULL;
+        break;
+
+    case AMF3_FALSE:
+    case AMF3_TRUE:
+        it->type = AMF_ITEM_BOOL;
+        it->i = marker == AMF3_TRUE;
+        break;
+
+    case AMF3_INTEGER:
+        amf_cursor_read_u29(c, &u);
+        amf_cursor_checkerr(c);
+        it->type = AMF_ITEM_INT;
+        /* sign extend the 29 bits */
+        it->i = (int32_t)(u << 3) >> 3;
+        break;
+
+    case AMF3_DOUBLE:
+        it->type = AMF_ITEM_NUMBER;
+        rd_read_double(c, &it->d);
+        break;
+
+    case AMF3_STRING:
+        it->type = AMF_ITEM_STRING;
+        rd_amf3_str(r, &it->s);
+        break;
+
+    case AMF3_XMLDOC:
+    case AMF3_XML:
+    case AMF3_BYTEARRAY:
+        if (rd_amf3_objref(r, it, &len)) {
+            return;
+        }
+
+        it->type = marker == AMF3_XMLDOC ? AMF_ITEM_XMLDOC
+                   : marker == AMF3_XML ? AMF_ITEM_XML : AMF_ITEM_BYTEARRAY;
+        rd_read_bytes(c, len, &it->s);
+        amf_cursor_checkerr(c);
+        rd_referable(r, it, &r->objs);
+        break;
+
+    case AMF3_DATE:
+        if (rd_amf3_objref(r, it, &len)) {
+            return;
+        }
+
+        it->type = AMF_ITEM_DATE;
+        rd_read_double(c, &it->d);
+        amf_cursor_checkerr(c);
+        rd_referable(r, it, &r->objs);
+        break;
+
+    case AMF3_ARRAY:
+        rd_amf3_array(r, it);
+        break;
+
+    case AMF3_OBJECT:
+        rd_amf3_object(r, it);
+        break;
+
+    default:
+        rd_error(r, "unsupported type");
+    }
+}
+
+void
+amf_reader_value(amf_reader *r, amf_item *it)
+{
+    int amf3 = r->frames.n ? rd_top(r)->amf3 : r->ver == AMF_VER3;
+
+    memset(it, 0, sizeof(*it));
+    it->at = r->c->p;
+
+    if (amf3) {
+        rd_amf3(r, it);
+    } else {
+        rd_amf0(r, it);
+    }
+}
+
+/*
+ * containers
+ */
+
+static void
+rd_next(amf_reader *r, amf_reader_frame *f, amf_str *key, int *next)
+{
+    amf_cursor *c = r->c;
+    uint16_t    len;
+    uint8_t     marker;
+
+    switch (f->state) {
+    case RD_PROPS:
+        amf_cursor_read_u16(c, &len);
+        amf_cursor_checkerr(c);
+
+        if (len == 0) {
+            amf_cursor_read_u8(c, &marker);
+            amf_cursor_checkerr(c);
+            if (marker != AMF0_END_OF_OBJECT) {
+                rd_error(r, "object end marker expected");
+            }
+            return;
+        }
+
+        rd_read_bytes(c, len, key);
+        amf_cursor_checkerr(c);
+        *next = AMF_NEXT_KEY;
+        return;
+
+    case RD_SEALED:
+        if (f->i < f->n) {
+            *key = amf_vec_at(&r->members, amf_str, f->members + f->i++);
+            *next = AMF_NEXT_MEMBER;
+            return;
+        }
+
+        if (!f->dynamic) {
+            return;
+        }
+
+        f->state = RD_DYNAMIC;
+        /* fall through */
+
+    case RD_DYNAMIC:
+        rd_amf3_str(r, key);
+        amf_cursor_checkerr(c);
+
+        if (key->len > 0) {
+            *next = AMF_NEXT_KEY;
+        }
+        return;
+
+    case RD_ASSOC:
+        if (f->key.len > 0) {
+            *key = f->key;
+            f->key.len = 0;
+            *next = AMF_NEXT_KEY;
+            return;
+        }
+
+        rd_amf3_str(r, key);
+        amf_cursor_checkerr(c);
+
+        if (key->len > 0) {
+            *next = AMF_NEXT_KEY;
+            return;
+        }
+
+        f->state = RD_DENSE;
+        /* fall through */
+
+    case RD_DENSE:
+        if (f->i < f->n) {
+            f->i++;
+            *next = AMF_NEXT_ITEM;
+        }
+        return;
+    }
+}
+
+int
+amf_reader_next(amf_reader *r, amf_str *key)
+{
+    amf_reader_frame   *f;
+    int                 next = AMF_NEXT_END;
+
+    if (r->c->err || r->frames.n == 0) {
+        return AMF_NEXT_END;
+    }
+
+    f = rd_top(r);
+    rd_next(r, f, key, &next);
+
+    if (next == AMF_NEXT_END && !r->c->err) {
+        if (f->scope) {
+            rd_scope_end(r);
+        }
+
+        r->frames.n--;
+        amf_cursor_leave(r->c);
+    }
+
+    return next;
+}
+
+void
+amf_reader_skip(amf_reader *r)
+{
+    amf_item    it;
+    amf_str     key;
+    uint32_t    depth = r->frames.n;
+
+    amf_reader_value(r, &it);
+
+    while (!r->c->err && r->frames.n > depth) {
+        if (amf_reader_next(r, &key) != AMF_NEXT_END) {
+            amf_reader_value(r, &it);
+        }
+    }
+}
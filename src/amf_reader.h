@@ -0,0 +1,131 @@
+#ifndef AMF_READER_H
+
+#define AMF_READER_H
+
+#include "amf_cursor.h"
+#include "amf_types.h"
+#include "amf_vec.h"
+
+#include <stdint.h>
+
+/*
+ * a pull reader of amf0 and amf3 values that does not need lua, what the
+ * document model and the json, messagepack and version converters read
+ * their input with. it resolves string and traits references, follows
+ * avmplus values into amf3 with reference tables of their own, and holds
+ * the containers being read, so a value is read as
+ *
+ *      amf_reader_value(r, &it);
+ *      while (it is a container and amf_reader_next(r, &key))
+ *          amf_reader_value(r, &it);
+ *
+ * the referable values, objects and arrays of amf0 and what the object
+ * table of amf3 holds, are numbered in the order they are opened, and a
+ * reference to one is an item of AMF_ITEM_REF with that number.
+ */
+#define AMF_ITEM_UNDEFINED  0
+#define AMF_ITEM_NULL       1
+#define AMF_ITEM_BOOL       2   /* i */
+#define AMF_ITEM_INT        3   /* i, an amf3 integer */
+#define AMF_ITEM_NUMBER     4   /* d */
+#define AMF_ITEM_STRING     5   /* s */
+#define AMF_ITEM_XMLDOC     6   /* s */
+#define AMF_ITEM_XML        7   /* s */
+#define AMF_ITEM_BYTEARRAY  8   /* s */
+#define AMF_ITEM_DATE       9   /* d, ms since the epoch */
+#define AMF_ITEM_ARRAY      10  /* a container */
+#define AMF_ITEM_OBJECT     11  /* a container */
+#define AMF_ITEM_EXTERNAL   12  /* a flex wrapper, a container of the one value it wraps */
+#define AMF_ITEM_REF        13  /* ref */
+
+/* what amf_reader_next found in the open container */
+#define AMF_NEXT_END        0   /* the container is closed, or an error */
+#define AMF_NEXT_MEMBER     1   /* a sealed member, named by the traits */
+#define AMF_NEXT_KEY        2   /* a dynamic member or a named array key */
+#define AMF_NEXT_ITEM       3   /* an item of the dense part */
+
+typedef struct amf_str {
+    const char         *p;
+    size_t              len;
+} amf_str;
+
+/* traits of the amf3 input, tag is the user's and -1 when they are read */
+typedef struct amf_traits {
+    amf_str             alias;
+    uint32_t            members, nmembers;
+    uint8_t             dynamic, external;
+    long                tag;
+} amf_traits;
+
+/*
+ * at:          the type marker in the input
+ * amf3:        the value was amf3
+ * referable:   the value took the number ref
+ * len:         the dense items of an array
+ * mixed:       an array with named keys, an ecma array of amf0 or an amf3
+ *              one with an associative part, they come before the items
+ * alias, traits, nmembers, dynamic:
+ *              the class of an object, traits is -1 for amf0
+ */
+typedef struct amf_item {
+    int                 type;
+    const char         *at;
+    uint8_t             amf3, referable;
+    uint32_t            ref;
+
+    int32_t             i;
+    double              d;
+    amf_str             s;
+
+    uint32_t            len;
+    uint8_t             mixed, dynamic;
+    amf_str             alias;
+    long                traits;
+    uint32_t            nmembers;
+} amf_item;
+
+/*
+ * frames:                  the containers being read
+ * refs0:                   the numbers of the referable amf0 values
+ * strs, objs, traits:      the amf3 reference tables, objs by number
+ * members:                 sealed member names of all amf3 traits
+ * max_depth:               containers inside each other, 0 for the limit
+ *                          of the cursor
+ */
+typedef struct amf_reader {
+    amf_cursor         *c;
+    int                 ver;
+    uint32_t            max_depth;
+    uint32_t            nrefs;
+
+    amf_vec             frames;
+    amf_vec             refs0;
+    amf_vec             strs, objs, traits, members;
+} amf_reader;
+
+void amf_reader_init(amf_reader *r, amf_cursor *c, int ver);
+void amf_reader_free(amf_reader *r);
+
+/* drop the reference tables, the next value is numbered from 0 again */
+void amf_reader_reset(amf_reader *r);
+
+/*
+ * read the value at the cursor, in the open container or the top level.
+ * a container is open until amf_reader_next returns AMF_NEXT_END for it.
+ * errors are in the cursor.
+ */
+void amf_reader_value(amf_reader *r, amf_item *it);
+
+/*
+ * the next entry of the open container, with key set for members and
+ * keys, the value is read next. AMF_NEXT_END closes the container.
+ */
+int  amf_reader_next(amf_reader *r, amf_str *key);
+
+/* read a value whole, what it holds included */
+void amf_reader_skip(amf_reader *r);
+
+#define amf_reader_traits(r, ti)        (&amf_vec_at(&(r)->traits, amf_traits, ti))
+#define amf_reader_member(r, t, i)      (&amf_vec_at(&(r)->members, amf_str, (t)->members + (i)))
+
+#endif /* end of include guard: AMF_READER_H */
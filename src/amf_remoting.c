@@ -1,10 +1,81 @@
 #include "amf_remoting.h"
+#include "amf_template.h"
 
 #include <stdint.h>
 #include <lauxlib.h>
 
+/*
+ * decode a header or body value behind its content length, or only record
+ * where it is when lazy. senders not knowing the length write 0 or
+ * AMF_MSG_UNKNOWN_LEN, lazy values of unknown length are walked with the
+ * structural skip, or decoded if they hold classes only a lua reader knows.
+ */
 static void
-decode_hdr(lua_State *L, amf_cursor *c)
+decode_content(lua_State *L, amf_cursor *c, const char *base, int lazy)
+{
+    uint32_t    len;
+    const char *start;
+    size_t      left;
+
+    amf_cursor_read_u32(c, &len);
+    amf_cursor_checkerr(c);
+
+    start = c->p;
+    left = c->left;
+
+    if ((len == AMF_MSG_UNKNOWN_LEN || len == 0) && lazy) {
+        amf0_skip(c);
+
+        if (c->err == AMF_CUR_ERR_BADFMT) {
+            c->p = start;
+            c->left = left;
+            c->err = AMF_CUR_NO_ERR;
+            c->err_msg = NULL;
+
+            lua_newtable(L);
+            amf0_decode(L, c, lua_gettop(L));
+            amf_cursor_checkerr(c);
+            lua_pop(L, 2); /* value and ref table */
+        }
+        amf_cursor_checkerr(c);
+
+        len = (uint32_t)(left - c->left);
+
+    } else if (len == AMF_MSG_UNKNOWN_LEN || len == 0) {
+        lua_newtable(L);
+        amf0_decode(L, c, lua_gettop(L));
+        amf_cursor_checkerr(c);
+        lua_remove(L, -2); /* ref table */
+
+
+    } else if (lazy) {
+        amf_cursor_skip(c, len);
+
+    } else {
+        amf_cursor_need(c, len);
+
+        /* the value may not read past its length */
+        c->left = len;
+        lua_newtable(L);
+        amf0_decode(L, c, lua_gettop(L));
+        amf_cursor_checkerr(c);
+        lua_remove(L, -2); /* ref table */
+
+        c->p = start + len;
+        c->left = left - len;
+    }
+
+    if (lazy) {
+        lua_pushinteger(L, start - base);
+        lua_setfield(L, -2, "offset");
+        lua_pushinteger(L, len);
+        lua_setfield(L, -2, "length");
+        lua_pushnil(L);
+    }
+}
+
+static void
+decode_hdr(lua_State *L, amf_cursor *c, const char *base, int flags)
 {
     lua_createtable(L, 3, 0);
 
@@ -21,20 +92,13 @@ decode_hdr(lua_State *L, amf_cursor *c)
     lua_pushboolean(L, must_understand);
     lua_rawseti(L, -2, 2);
 
-    /* content length*/
-    amf_cursor_skip(c, 4);
-
-    lua_newtable(L);
-    amf0_decode(L, c, lua_gettop(L));
+    decode_content(L, c, base, flags & AMF_MSG_LAZY_HEADERS);
     amf_cursor_checkerr(c);
-    lua_rawseti(L, -3, 3);
-
-    /* ref table */
-    lua_pop(L, 1);
+    lua_rawseti(L, -2, 3);
 }
 
 static void
-decode_body(lua_State *L, amf_cursor *c)
+decode_body(lua_State *L, amf_cursor *c, const char *base, int flags)
 {
     lua_createtable(L, 3, 0);
 
@@ -53,20 +117,13 @@ decode_body(lua_State *L, amf_cursor *c)
     lua_pushlstring(L, uri, len);
     lua_rawseti(L, -2, 2);
 
-    /* content length*/
-    amf_cursor_skip(c, 4);
-
-    lua_newtable(L);
-    amf0_decode(L, c, lua_gettop(L));
+    decode_content(L, c, base, flags & AMF_MSG_LAZY_BODIES);
     amf_cursor_checkerr(c);
-    lua_rawseti(L, -3, 3);
-
-    /* ref table */
-    lua_pop(L, 1);
-
+    lua_rawseti(L, -2, 3);
 }
 
-void amf_decode_msg(lua_State *L, amf_cursor *c)
+void
+amf_decode_msg(lua_State *L, amf_cursor *c, const char *base, int flags)
 {
     uint16_t ver, hc, bc;
 
@@ -80,9 +137,10 @@ void amf_decode_msg(lua_State *L, amf_cursor *c)
 
     /* headers */
     amf_cursor_read_u16(c, &hc);
-    if (hc > 0) lua_createtable(L, hc, 0);
+    amf_cursor_checkerr(c);
+    lua_createtable(L, hc, 0);
     for (unsigned int i = 0; i < hc; i++) {
-        decode_hdr(L, c);
+        decode_hdr(L, c, base, flags);
         amf_cursor_checkerr(c);
         lua_rawseti(L, -2, i+1);
     }
@@ -90,9 +148,10 @@ void amf_decode_msg(lua_State *L, amf_cursor *c)
 
     /* bodies */
     amf_cursor_read_u16(c, &bc);
-    if (bc > 0) lua_createtable(L, bc, 0);
-    for (unsigned int i = 0; i < hc; i++) {
-        decode_body(L, c);
+    amf_cursor_checkerr(c);
+    lua_createtable(L, bc, 0);
+    for (unsigned int i = 0; i < bc; i++) {
+        decode_body(L, c, base, flags);
         amf_cursor_checkerr(c);
         lua_rawseti(L, -2, i+1);
     }
@@ -100,7 +159,42 @@ void amf_decode_msg(lua_State *L, amf_cursor *c)
 }
 
 static void
-encode_hdr(lua_State *L, amf_buf *buf, int ver)
+encode_uri(lua_State *L, amf_enc *e, int idx)
+{
+    size_t len;
+    const char *s;
+
+    if (amf_template_uri(L, e, idx)) {
+        return;
+    }
+
+    s = lua_tolstring(L, idx, &len);
+    if (s == NULL) {
+        len = 0;
+    }
+
+    amf_buf_append_u16(e->buf, (uint16_t)len);
+    if (len > 0)
+        amf_buf_append(e->buf, s, (uint16_t)len);
+}
+
+/* encode the value at the stack top behind its content length */
+static void
+encode_content(lua_State *L, amf_enc *e, int ver)
+{
+    size_t pos = e->buf->len;
+
+    amf_template_mark(L, e, AMF_SLOT_LENGTH);
+    amf_buf_append_u32(e->buf, (uint32_t)0);
+
+    amf0_encode_scope(L, e, (ver == 3), -1);
+
+    amf_buf_put_u32(e->buf, pos, (uint32_t)(e->buf->len - pos - 4));
+    amf_template_mark(L, e, AMF_SLOT_END);
+}
+
+static void
+encode_hdr(lua_State *L, amf_enc *e, int ver)
 {
     if(!lua_istable(L, -1)) {
         luaL_error(L, "invalid header structure, must be a dense table");
@@ -108,123 +202,99 @@ encode_hdr(lua_State *L, amf_buf *buf, int ver)
 
     /* name */
     lua_rawgeti(L, -1, 1);
-    size_t len;
-    const char *name = lua_tolstring(L, -1, &len);
-    amf_buf_append_u16(buf, (uint16_t)len);
-    if (len > 0)
-        amf_buf_append(buf, name, (uint16_t)len);
+    encode_uri(L, e, -1);
     lua_pop(L, 1);
 
     /* must understand */
     lua_rawgeti(L, -1, 2);
     int mu = lua_toboolean(L, -1);
-    amf_buf_append_char(buf, (char)mu);
+    amf_buf_append_char(e->buf, (char)mu);
     lua_pop(L, 1);
 
-    /* content length */
-    amf_buf_append_u32(buf, (uint32_t)0);
-
     lua_rawgeti(L, -1, 3);
-    lua_newtable(L);
-    amf0_encode(L, buf, (ver == 3), -2, lua_gettop(L));
-    lua_pop(L, 2); /* pops the obj and ref table */
+    encode_content(L, e, ver);
+    lua_pop(L, 1);
 }
 
 
 static void
-encode_body(lua_State *L, amf_buf *buf, int ver)
+encode_body(lua_State *L, amf_enc *e, int ver)
 {
     if(!lua_istable(L, -1)) {
         luaL_error(L, "invalid body structure, must be a dense table");
     }
 
-    size_t len;
-    const char *uri;
-
     /* target uri */
     lua_rawgeti(L, -1, 1);
-    uri = lua_tolstring(L, -1, &len);
-    amf_buf_append_u16(buf, (uint16_t)len);
-    if (len > 0) {
-        amf_buf_append(buf, uri, (uint16_t)len);
-    printf("target: %s\n", uri);
-    }
+    encode_uri(L, e, -1);
     lua_pop(L, 1);
 
     /* response uri */
     lua_rawgeti(L, -1, 2);
-    uri = lua_tolstring(L, -1, &len);
-    amf_buf_append_u16(buf, (uint16_t)len);
-    if (len > 0) {
-        amf_buf_append(buf, uri, (uint16_t)len);
-    printf("response: %s\n", uri);
-    }
+    encode_uri(L, e, -1);
     lua_pop(L, 1);
 
 
-    /* content length */
-    amf_buf_append_u32(buf, (uint32_t)0);
-
     lua_rawgeti(L, -1, 3);
-    lua_newtable(L);
-    amf0_encode(L, buf, (ver == 3), -2, lua_gettop(L));
-    lua_pop(L, 2); /* pops the obj and ref table */
+    encode_content(L, e, ver);
+    lua_pop(L, 1);
 }
 
+void
+amf_encode_msg_head(lua_State *L, amf_enc *e, int ver, int nbodies)
+{
+    amf_buf_append_u16(e->buf, ver);
+
+    /* headers */
+    if (lua_isnil(L, -1)) {
+        amf_buf_append_u16(e->buf, 0);
+    } else if (lua_istable(L, -1)) {
+        int hc = lua_objlen(L, -1);
+        amf_buf_append_u16(e->buf, hc);
+        for (int j = 1; j <= hc; j++) {
+            lua_rawgeti(L, -1, j);
+            encode_hdr(L, e, ver);
+            lua_pop(L, 1);
+        }
+    } else {
+        luaL_error(L, "invalid amf msg header container structure, must be a table or nil");
+    }
 
-void amf_encode_msg(lua_State *L, amf_buf *buf)
+    amf_buf_append_u16(e->buf, nbodies);
+}
+
+void
+amf_encode_msg_body(lua_State *L, amf_enc *e, int ver)
+{
+    encode_body(L, e, ver);
+}
+
+void amf_encode_msg(lua_State *L, amf_enc *e)
 {
     luaL_checktype(L, -1, LUA_TTABLE);
 
-    int i = 0, ver;
-    while(i++ < 3) {
-        lua_rawgeti(L, -1, i);
+    int ver, bc = 0;
 
-        switch (i) {
-        case 1: {
-            ver = lua_tonumber(L, -1);
-            amf_buf_append_u16(buf, ver);
-            break;
-        }
+    lua_rawgeti(L, -1, 1);
+    ver = lua_tonumber(L, -1);
+    lua_pop(L, 1);
 
-        case 2: {
-            /* headers */
-            if (lua_isnil(L, -1)) {
-                amf_buf_append_u16(buf, 0);
-            } else if (lua_istable(L, -1)) {
-                int hc = lua_objlen(L, -1);
-                amf_buf_append_u16(buf, hc);
-                for (int j = 1; j <= hc; j++) {
-                    lua_rawgeti(L, -1, j);
-                    encode_hdr(L, buf, ver);
-                    lua_pop(L, 1);
-                }
-            } else {
-                luaL_error(L, "invalid amf msg header container structure, must be a table or nil");
-            }
-            break;
-        }
+    lua_rawgeti(L, -1, 3);
+    if (lua_istable(L, -1)) {
+        bc = lua_objlen(L, -1);
+    } else if (!lua_isnil(L, -1)) {
+        luaL_error(L, "invalid amf msg body container structure, must be a table or nil");
+    }
 
-        case 3: {
-            if (lua_isnil(L, -1)) {
-                amf_buf_append_u16(buf, 0);
-            } else if (lua_istable(L, -1)) {
-                int bc = lua_objlen(L, -1);
-                amf_buf_append_u16(buf, bc);
-                for (int j = 1; j <= bc; j++) {
-                    lua_rawgeti(L, -1, j);
-                    encode_body(L, buf, ver);
-                    lua_pop(L, 1);
-                }
-            } else {
-                luaL_error(L, "invalid amf msg body container structure, must be a table or nil");
-            }
-            break;
-        }
-        }
+    lua_rawgeti(L, -2, 2);
+    amf_encode_msg_head(L, e, ver, bc);
+    lua_pop(L, 1);
 
+    for (int j = 1; j <= bc; j++) {
+        lua_rawgeti(L, -1, j);
+        encode_body(L, e, ver);
         lua_pop(L, 1);
     }
 
-
+    lua_pop(L, 1);
 }
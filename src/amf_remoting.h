@@ -6,8 +6,19 @@
 #include "amf_buf.h"
 #include "amf_cursor.h"
 
-void amf_decode_msg(lua_State *L, amf_cursor *c);
+/* leave the values undecoded, with their offset from base and length */
+#define AMF_MSG_LAZY_HEADERS    0x01
+#define AMF_MSG_LAZY_BODIES     0x02
 
-void amf_encode_msg(lua_State *L, amf_buf *buf);
+void amf_decode_msg(lua_State *L, amf_cursor *c, const char *base, int flags);
+
+void amf_encode_msg(lua_State *L, amf_enc *e);
+
+/*
+ * a message piece by piece: the version, the headers table (or nil) at the
+ * stack top and the body count first, then each body table at the stack top
+ */
+void amf_encode_msg_head(lua_State *L, amf_enc *e, int ver, int nbodies);
+void amf_encode_msg_body(lua_State *L, amf_enc *e, int ver);
 
 #endif /* end of include guard: AMF_REMOTING_H */
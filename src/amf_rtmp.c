@@ -0,0 +1,273 @@
+#include "amf_rtmp.h"
+
+#include <string.h>
+
+#define AMF_RTMP_EXT_TIMESTAMP  0xffffff
+
+void
+amf_rtmp_init(amf_rtmp *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->chunk_size = AMF_RTMP_CHUNK_SIZE;
+    r->max_message = AMF_RTMP_MAX_MESSAGE;
+}
+
+void
+amf_rtmp_free(amf_rtmp *r)
+{
+    for (uint32_t i = 0; i < r->streams.n; i++) {
+        free(amf_vec_at(&r->streams, amf_rtmp_stream, i).buf);
+    }
+
+    amf_vec_free(&r->streams);
+}
+
+static amf_rtmp_stream *
+rtmp_stream(amf_rtmp *r, uint32_t csid)
+{
+    amf_rtmp_stream s;
+
+    for (uint32_t i = 0; i < r->streams.n; i++) {
+        if (amf_vec_at(&r->streams, amf_rtmp_stream, i).csid == csid) {
+            return &amf_vec_at(&r->streams, amf_rtmp_stream, i);
+        }
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.csid = csid;
+
+    if (amf_vec_push(&r->streams, &s, sizeof(s))) {
+        return NULL;
+    }
+
+    return &amf_vec_at(&r->streams, amf_rtmp_stream, r->streams.n - 1);
+}
+
+/* room in the buffer of a stream for n more bytes of its message */
+static int
+rtmp_grow(amf_rtmp_stream *s, uint32_t n)
+{
+    uint32_t    cap;
+    char       *buf;
+
+    if (s->got + n <= s->cap) {
+        return 0;
+    }
+
+    cap = s->cap > s->len / 2 ? s->len : s->cap * 2;
+    if (cap < s->got + n) {
+        cap = s->got + n;
+    }
+
+    buf = realloc(s->buf, cap);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    s->buf = buf;
+    s->cap = cap;
+
+    return 0;
+}
+
+static void
+rtmp_read_u24(amf_cursor *c, uint32_t *u)
+{
+    amf_cursor_need(c, 3);
+    *u = (uint32_t)(uint8_t)c->p[0] << 16 | (uint32_t)(uint8_t)c->p[1] << 8 | (uint8_t)c->p[2];
+    amf_cursor_consume(c, 3);
+}
+
+/* the protocol control messages the demultiplexer itself obeys */
+static void
+rtmp_control(amf_rtmp *r, amf_cursor *c, const amf_rtmp_msg *msg)
+{
+    amf_rtmp_stream    *s;
+    uint32_t            u;
+
+    if (msg->len < 4 || (msg->type != AMF_RTMP_SET_CHUNK_SIZE && msg->type != AMF_RTMP_ABORT)) {
+        return;
+    }
+
+    u = (uint32_t)(uint8_t)msg->payload[0] << 24 | (uint32_t)(uint8_t)msg->payload[1] << 16
+        | (uint32_t)(uint8_t)msg->payload[2] << 8 | (uint8_t)msg->payload[3];
+
+    if (msg->type == AMF_RTMP_SET_CHUNK_SIZE) {
+        u &= AMF_RTMP_MAX_CHUNK_SIZE;
+        if (u == 0) {
+            c->err = AMF_CUR_ERR_BADFMT;
+            c->err_msg = "invalid chunk size";
+            return;
+        }
+        r->chunk_size = u;
+        return;
+    }
+
+    /* abort drops the message in progress on a chunk stream */
+    for (uint32_t i = 0; i < r->streams.n; i++) {
+        s = &amf_vec_at(&r->streams, amf_rtmp_stream, i);
+        if (s->csid == u) {
+            s->got = 0;
+        }
+    }
+}
+
+static void
+rtmp_chunk(amf_rtmp *r, amf_cursor *c, amf_rtmp_msg *msg, int *done)
+{
+    amf_rtmp_stream    *s, h;
+    uint8_t             b, fmt;
+    uint32_t            csid, ts = 0, u, n;
+
+    amf_cursor_read_u8(c, &b);
+    amf_cursor_checkerr(c);
+
+    fmt = b >> 6;
+    csid = b & 0x3f;
+
+    /* a one or two byte chunk stream id follows */
+    if (csid == 0) {
+        amf_cursor_read_u8(c, &b);
+        amf_cursor_checkerr(c);
+        csid = 64 + b;
+
+    } else if (csid == 1) {
+        amf_cursor_need(c, 2);
+        csid = 64 + (uint8_t)c->p[0] + ((uint32_t)(uint8_t)c->p[1] << 8);
+        amf_cursor_consume(c, 2);
+    }
+
+    s = rtmp_stream(r, csid);
+    if (s == NULL) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "out of memory";
+        return;
+    }
+
+    if (fmt < 3 && s->got > 0) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "message header inside a message";
+        return;
+    }
+
+    /* a chunk on a stream that never had a header */
+    if (fmt > 0 && s->type == 0) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "chunk stream without message header";
+        return;
+    }
+
+    /* the header goes to the stream once the whole chunk is in */
+    h = *s;
+
+    if (fmt < 3) {
+        rtmp_read_u24(c, &ts);
+        amf_cursor_checkerr(c);
+    }
+
+    if (fmt < 2) {
+        rtmp_read_u24(c, &h.len);
+        amf_cursor_read_u8(c, &h.type);
+        amf_cursor_checkerr(c);
+    }
+
+    if (fmt == 0) {
+        /* the message stream id is little endian */
+        amf_cursor_need(c, 4);
+        h.stream_id = (uint8_t)c->p[0] | (uint32_t)(uint8_t)c->p[1] << 8
+                      | (uint32_t)(uint8_t)c->p[2] << 16 | (uint32_t)(uint8_t)c->p[3] << 24;
+        amf_cursor_consume(c, 4);
+    }
+
+    if (h.len > r->max_message) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "message too large";
+        return;
+    }
+
+    if (fmt < 3) {
+        h.ext = ts == AMF_RTMP_EXT_TIMESTAMP;
+    }
+
+    /* an extended timestamp, fmt 3 chunks repeat the one of their header */
+    if (h.ext) {
+        amf_cursor_read_u32(c, &u);
+        amf_cursor_checkerr(c);
+        if (fmt < 3) {
+            ts = u;
+        }
+    }
+
+    if (fmt == 0) {
+        h.timestamp = ts;
+        h.delta = 0;
+
+    } else if (fmt < 3) {
+        h.delta = ts;
+        h.timestamp += ts;
+
+    } else if (h.got == 0) {
+        h.timestamp += h.delta;
+    }
+
+    n = h.len - h.got;
+    if (n > r->chunk_size) {
+        n = r->chunk_size;
+    }
+
+    amf_cursor_need(c, n);
+    *s = h;
+
+    msg->csid = csid;
+    msg->timestamp = s->timestamp;
+    msg->stream_id = s->stream_id;
+    msg->type = s->type;
+    msg->len = s->len;
+
+    /* in one chunk it is read where it lies */
+    if (s->got == 0 && n == s->len) {
+        msg->payload = c->p;
+        amf_cursor_consume(c, n);
+        *done = 1;
+        return;
+    }
+
+    if (rtmp_grow(s, n)) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "out of memory";
+        return;
+    }
+
+    memcpy(s->buf + s->got, c->p, n);
+    amf_cursor_consume(c, n);
+    s->got += n;
+
+    if (s->got == s->len) {
+        msg->payload = s->buf;
+        s->got = 0;
+        *done = 1;
+    }
+}
+
+int
+amf_rtmp_read(amf_rtmp *r, amf_cursor *c, amf_rtmp_msg *msg)
+{
+    const char *p = c->p;
+    size_t      left = c->left;
+    int         done = 0;
+
+    rtmp_chunk(r, c, msg, &done);
+
+    /* a chunk is read whole or not at all */
+    if (c->err == AMF_CUR_ERR_EOF) {
+        c->p = p;
+        c->left = left;
+        return 0;
+    }
+
+    if (done && msg->stream_id == 0 && !c->err) {
+        rtmp_control(r, c, msg);
+    }
+
+    return !c->err && done;
+}
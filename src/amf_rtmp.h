@@ -0,0 +1,68 @@
+#ifndef AMF_RTMP_H
+
+#define AMF_RTMP_H
+
+#include "amf_cursor.h"
+#include "amf_vec.h"
+
+#include <stdint.h>
+
+/*
+ * an rtmp chunk stream demultiplexer: chunks in, whole messages out. a
+ * message in one chunk is handed out where it lies in the input, a longer
+ * one is gathered in the buffer of its chunk stream, which grows with the
+ * chunks as they arrive and is kept for the next message. a message header
+ * longer than max_message is an error.
+ */
+
+/* message types */
+#define AMF_RTMP_SET_CHUNK_SIZE 1
+#define AMF_RTMP_ABORT          2
+#define AMF_RTMP_AMF3_DATA      15
+#define AMF_RTMP_AMF3_COMMAND   17
+#define AMF_RTMP_AMF0_DATA      18
+#define AMF_RTMP_AMF0_COMMAND   20
+
+#define AMF_RTMP_CHUNK_SIZE     128
+#define AMF_RTMP_MAX_CHUNK_SIZE 0x7fffffff
+#define AMF_RTMP_MAX_MESSAGE    (1 << 20)
+
+typedef struct amf_rtmp_msg {
+    uint32_t            csid;
+    uint32_t            timestamp;
+    uint32_t            stream_id;
+    uint8_t             type;
+    uint32_t            len;
+    const char         *payload;
+} amf_rtmp_msg;
+
+/* the state of a chunk stream, its last header and the message so far */
+typedef struct amf_rtmp_stream {
+    uint32_t            csid;
+    uint32_t            timestamp, delta;
+    uint32_t            stream_id;
+    uint8_t             type;
+    uint8_t             ext;
+    uint32_t            len, got;
+    uint32_t            cap;
+    char               *buf;
+} amf_rtmp_stream;
+
+typedef struct amf_rtmp {
+    uint32_t            chunk_size;
+    uint32_t            max_message;
+    amf_vec             streams;
+} amf_rtmp;
+
+void amf_rtmp_init(amf_rtmp *r);
+void amf_rtmp_free(amf_rtmp *r);
+
+/*
+ * read a chunk at the cursor. returns 1 when it completes a message, which
+ * is then in msg until the next read, or 0. a chunk not in the input yet
+ * leaves the cursor where it was with AMF_CUR_ERR_EOF. set chunk size and
+ * abort messages are applied as well as returned.
+ */
+int amf_rtmp_read(amf_rtmp *r, amf_cursor *c, amf_rtmp_msg *msg);
+
+#endif /* end of include guard: AMF_RTMP_H */
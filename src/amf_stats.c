@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "amf_stats.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifndef AMF_NO_STATS
+
+amf_stats amf_stats_g;
+int       amf_latency_on;
+
+void
+amf_stats_max(uint64_t *p, uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    while (v > cur
+           && !__atomic_compare_exchange_n(p, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        /* cur was reloaded */
+    }
+#else
+    if (v > *p) {
+        *p = v;
+    }
+#endif
+}
+
+/* take the empty slot for msg, or see what another thread put there first */
+static const char *
+amf_stats_claim(const char **slot, const char *msg)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    const char *cur = NULL;
+
+    if (__atomic_compare_exchange_n(slot, &cur, msg, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        amf_stats_atomic_add(&amf_stats_g.nerrors, 1);
+        return msg;
+    }
+
+    return cur;
+#else
+    *slot = msg;
+    amf_stats_g.nerrors++;
+
+    return msg;
+#endif
+}
+
+/*
+ * the messages are string literals, they are told apart by content. a
+ * slot once taken keeps its message, so threads agree on where one goes.
+ */
+void
+amf_stats_error(const char *msg)
+{
+    const char *cur;
+
+    if (msg == NULL) {
+        msg = "unknown";
+    }
+
+    for (int i = 0; i < AMF_STATS_ERRORS; i++) {
+        cur = amf_stats_load(&amf_stats_g.errors[i].msg);
+
+        if (cur == NULL) {
+            cur = amf_stats_claim(&amf_stats_g.errors[i].msg, msg);
+        }
+
+        if (cur == msg || strcmp(cur, msg) == 0) {
+            amf_stats_atomic_add(&amf_stats_g.errors[i].count, 1);
+            return;
+        }
+    }
+
+    amf_stats_inc(errors_other);
+}
+
+void
+amf_stats_reset(void)
+{
+    memset(&amf_stats_g, 0, sizeof(amf_stats_g));
+}
+
+uint64_t
+amf_stats_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void
+amf_stats_latency_add(int call, uint64_t start)
+{
+    amf_latency *lat = &amf_stats_g.latency[call];
+    uint64_t     ns = amf_stats_clock() - start;
+    int          i = 0;
+
+    while (i < AMF_LAT_BUCKETS - 1 && ns >> i) {
+        i++;
+    }
+
+    amf_stats_atomic_add(&lat->calls, 1);
+    amf_stats_atomic_add(&lat->total_ns, ns);
+    amf_stats_atomic_add(&lat->buckets[i], 1);
+    amf_stats_max(&lat->max_ns, ns);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef AMF_STATS_H
+
+#define AMF_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * process wide codec counters, compiled out with -DAMF_NO_STATS.
+ * the counters are relaxed atomics, the batch threads and lua states
+ * running in several threads add to them at once without losing any.
+ * compilers without the gnu atomic builtins get plain increments.
+ */
+#define AMF_STATS_MARKERS   32
+#define AMF_STATS_ERRORS    32
+
+/* entry points with a latency histogram */
+#define AMF_LAT_ENCODE      0
+#define AMF_LAT_DECODE      1
+#define AMF_LAT_DECODE_MSG  2
+#define AMF_LAT_ENCODE_MSG  3
+#define AMF_LAT_CALLS       4
+
+/* bucket i counts the calls taking less than 2^i ns, the last one the rest */
+#define AMF_LAT_BUCKETS     36
+
+typedef struct amf_ref_stats {
+    uint64_t    hits, misses;
+} amf_ref_stats;
+
+typedef struct amf_latency {
+    uint64_t    calls, total_ns, max_ns;
+    uint64_t    buckets[AMF_LAT_BUCKETS];
+} amf_latency;
+
+typedef struct amf_stats {
+    uint64_t        encode_calls, decode_calls;
+    uint64_t        bytes_in, bytes_out;
+
+    /* values by type marker, [0] is amf0, [1] is amf3 */
+    uint64_t        encoded[2][AMF_STATS_MARKERS];
+    uint64_t        decoded[2][AMF_STATS_MARKERS];
+
+    amf_ref_stats   obj_refs, str_refs, traits_refs;
+
+    uint64_t        buf_reallocs;
+    uint64_t        buf_peak;
+
+    /* the first messages seen, those that come when they are full are other */
+    struct {
+        const char *msg;
+        uint64_t    count;
+    } errors[AMF_STATS_ERRORS];
+    int             nerrors;
+    uint64_t        errors_other;
+
+    amf_latency     latency[AMF_LAT_CALLS];
+} amf_stats;
+
+#ifndef AMF_NO_STATS
+
+extern amf_stats amf_stats_g;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define amf_stats_atomic_add(p, n)      ((void)__atomic_fetch_add(p, n, __ATOMIC_RELAXED))
+#define amf_stats_load(p)               __atomic_load_n(p, __ATOMIC_RELAXED)
+#else
+#define amf_stats_atomic_add(p, n)      ((void)(*(p) += (n)))
+#define amf_stats_load(p)               (*(p))
+#endif
+
+#define amf_stats_inc(field)            amf_stats_atomic_add(&amf_stats_g.field, 1)
+#define amf_stats_add(field, n)         amf_stats_atomic_add(&amf_stats_g.field, (n))
+#define amf_stats_ref(kind, hit)                                        \
+    amf_stats_atomic_add((hit) ? &amf_stats_g.kind.hits : &amf_stats_g.kind.misses, 1)
+#define amf_stats_marker(dir, v, m) do {                                \
+    unsigned char __m = (unsigned char)(m);                             \
+    if (__m < AMF_STATS_MARKERS) amf_stats_inc(dir[v][__m]);            \
+} while(0)
+#define amf_stats_alloc(size) do {                                      \
+    amf_stats_inc(buf_reallocs);                                        \
+    if ((size) > amf_stats_load(&amf_stats_g.buf_peak))                 \
+        amf_stats_max(&amf_stats_g.buf_peak, (size));                   \
+} while(0)
+
+/* raise *p to v unless it is above already */
+void amf_stats_max(uint64_t *p, uint64_t v);
+void amf_stats_error(const char *msg);
+void amf_stats_reset(void);
+
+/*
+ * latency timing is switched on at run time, a call costs two clock reads
+ * when it is on and a branch when it is off
+ */
+extern int amf_latency_on;
+
+uint64_t amf_stats_clock(void);
+void amf_stats_latency_add(int call, uint64_t start);
+
+#define amf_stats_start()               (amf_latency_on ? amf_stats_clock() : 0)
+#define amf_stats_latency(call, start) do {                             \
+    if (start) amf_stats_latency_add(call, start);                      \
+} while(0)
+
+#else
+
+#define amf_stats_inc(field)            ((void)0)
+#define amf_stats_add(field, n)         ((void)(n))
+#define amf_stats_ref(kind, hit)        ((void)0)
+#define amf_stats_marker(dir, v, m)     ((void)0)
+#define amf_stats_alloc(size)           ((void)0)
+#define amf_stats_error(msg)            ((void)0)
+#define amf_stats_reset()               ((void)0)
+#define amf_stats_start()               ((uint64_t)0)
+#define amf_stats_latency(call, start)  ((void)(start))
+
+#endif
+
+#endif /* end of include guard: AMF_STATS_H */
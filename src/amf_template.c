@@ -0,0 +1,284 @@
+#include "amf_template.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include <lauxlib.h>
+
+#define AMF_SLOTS_MIN   8
+
+void
+amf_slots_init(amf_slots *s, int names_idx)
+{
+    memset(s, 0, sizeof(*s));
+    s->names_idx = names_idx;
+}
+
+void
+amf_slots_free(amf_slots *s)
+{
+    free(s->recs);
+    s->recs = NULL;
+    s->nrecs = s->cap = 0;
+}
+
+void
+amf_template_scope(amf_slots *s, int ver)
+{
+    int v = amf_ver_slot(ver);
+
+    s->scope[v]++;
+    s->frozen[v] = 0;
+
+    if (ver == AMF_VER3) {
+        s->unstored_traits = 0;
+    }
+}
+
+static amf_slot *
+amf_test_slot(lua_State *L, int idx)
+{
+    void *p = lua_touserdata(L, idx);
+    int   match;
+
+    if (p == NULL || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_slot");
+    match = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return match ? p : NULL;
+}
+
+/* a table the encode options turned off, ridx 0, holds nothing */
+static int
+ref_count(lua_State *L, int ridx)
+{
+    int n;
+
+    if (ridx == 0) {
+        return 0;
+    }
+
+    lua_rawgeti(L, ridx, 1);
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    return n;
+}
+
+static void
+set_ref_count(lua_State *L, int ridx, int n)
+{
+    if (ridx == 0) {
+        return;
+    }
+
+    lua_pushinteger(L, n);
+    lua_rawseti(L, ridx, 1);
+}
+
+static amf_slot_rec *
+amf_slots_add(lua_State *L, amf_slots *s, amf_slot *slot)
+{
+    amf_slot_rec *rec;
+
+    if (s->nrecs == s->cap) {
+        int cap = s->cap ? s->cap * 2 : AMF_SLOTS_MIN;
+
+        rec = realloc(s->recs, cap * sizeof(*rec));
+        if (rec == NULL) {
+            luaL_error(L, "out of memory");
+        }
+
+        s->recs = rec;
+        s->cap = cap;
+    }
+
+    rec = &s->recs[s->nrecs++];
+    memset(rec, 0, sizeof(*rec));
+
+    if (slot) {
+        lua_pushlstring(L, slot->name, slot->len);
+    } else {
+        lua_pushboolean(L, 0);
+    }
+    lua_rawseti(L, s->names_idx, s->nrecs);
+
+    return rec;
+}
+
+int
+amf_template_slot(lua_State *L, amf_enc *e, int idx, int ver, int avmplus)
+{
+    amf_slot      *slot = amf_test_slot(L, idx);
+    amf_slot_rec  *rec;
+
+    if (slot == NULL) {
+        return 0;
+    }
+
+    if (e->slots == NULL) {
+        luaL_error(L, "amf slot '%s' used outside of a template", slot->name);
+    }
+
+    rec = amf_slots_add(L, e->slots, slot);
+    rec->offset = e->buf->len;
+    rec->kind = AMF_SLOT_VALUE;
+    rec->ver = ver;
+    rec->avmplus = avmplus;
+    rec->scope = e->slots->scope[amf_ver_slot(ver)];
+
+    if (ver == AMF_VER0) {
+        rec->nref = ref_count(L, e->ridx);
+
+    } else {
+        rec->nstr = ref_count(L, e->sidx);
+        rec->nobj = ref_count(L, e->oidx);
+        rec->ntraits = e->traits_base + lua_objlen(L, e->tidx)
+                       + e->slots->unstored_traits;
+    }
+
+    e->slots->frozen[amf_ver_slot(ver)] = 1;
+
+    return 1;
+}
+
+int
+amf_template_uri(lua_State *L, amf_enc *e, int idx)
+{
+    amf_slot      *slot = amf_test_slot(L, idx);
+    amf_slot_rec  *rec;
+
+    if (slot == NULL) {
+        return 0;
+    }
+
+    if (e->slots == NULL) {
+        luaL_error(L, "amf slot '%s' used outside of a template", slot->name);
+    }
+
+    rec = amf_slots_add(L, e->slots, slot);
+    rec->offset = e->buf->len;
+    rec->kind = AMF_SLOT_URI;
+
+    return 1;
+}
+
+void
+amf_template_mark(lua_State *L, amf_enc *e, int kind)
+{
+    amf_slot_rec *rec;
+
+    if (e->slots == NULL) {
+        return;
+    }
+
+    rec = amf_slots_add(L, e->slots, NULL);
+    rec->offset = e->buf->len;
+    rec->kind = kind;
+}
+
+static void
+render_uri(lua_State *L, amf_buf *out, const char *name)
+{
+    size_t      len = 0;
+    const char *s = lua_tolstring(L, -1, &len);
+
+    if (s == NULL) {
+        luaL_error(L, "template slot '%s' must be a string", name);
+    }
+
+    if (len > UINT16_MAX) {
+        luaL_error(L, "template slot '%s' is too long", name);
+    }
+
+    amf_buf_append_u16(out, (uint16_t)len);
+    amf_buf_append(out, s, len);
+}
+
+void
+amf_template_render(lua_State *L, amf_template *t, int names_idx,
+                    int values_idx, amf_buf *out)
+{
+    amf_enc     e;
+    size_t      pos = 0;
+    int         scope[2] = { 0, 0 };
+    int         xref = 0, xstr = 0, xobj = 0, xtraits = 0;
+    size_t      length_pos = 0;
+
+    amf_enc_init(&e, out);
+
+    for (int i = 0; i < t->slots.nrecs; i++) {
+        amf_slot_rec *rec = &t->slots.recs[i];
+        int           v = amf_ver_slot(rec->ver);
+
+        amf_buf_append(out, t->buf.b + pos, rec->offset - pos);
+        pos = rec->offset;
+
+        if (rec->kind == AMF_SLOT_LENGTH) {
+            length_pos = out->len;
+            continue;
+        }
+
+        if (rec->kind == AMF_SLOT_END) {
+            amf_buf_put_u32(out, length_pos, out->len - length_pos - 4);
+            continue;
+        }
+
+        lua_rawgeti(L, names_idx, i + 1);
+        lua_pushvalue(L, -1);
+        lua_gettable(L, values_idx);
+
+        if (rec->kind == AMF_SLOT_URI) {
+            render_uri(L, out, lua_tostring(L, -2));
+            lua_pop(L, 2);
+            continue;
+        }
+
+        /* slots of the same scope shift each other's references */
+        if (scope[v] != rec->scope) {
+            scope[v] = rec->scope;
+            if (v) {
+                xstr = xobj = xtraits = 0;
+            } else {
+                xref = 0;
+            }
+        }
+
+        if (rec->ver == AMF_VER0) {
+            lua_newtable(L);
+            e.ridx = lua_gettop(L);
+            set_ref_count(L, e.ridx, rec->nref + xref);
+
+            amf0_encode(L, &e, rec->avmplus, -2);
+
+            xref = ref_count(L, e.ridx) - rec->nref;
+            lua_pop(L, 1);
+
+        } else {
+            lua_newtable(L);
+            lua_newtable(L);
+            lua_newtable(L);
+            e.tidx = lua_gettop(L);
+            e.oidx = e.tidx - 1;
+            e.sidx = e.tidx - 2;
+            e.traits_base = rec->ntraits + xtraits;
+            set_ref_count(L, e.sidx, rec->nstr + xstr);
+            set_ref_count(L, e.oidx, rec->nobj + xobj);
+
+            amf3_encode(L, &e, -4);
+
+            xstr = ref_count(L, e.sidx) - rec->nstr;
+            xobj = ref_count(L, e.oidx) - rec->nobj;
+            xtraits += lua_objlen(L, e.tidx);
+            lua_pop(L, 3);
+        }
+
+        lua_pop(L, 2); /* name and value */
+    }
+
+    amf_buf_append(out, t->buf.b + pos, t->buf.len - pos);
+}
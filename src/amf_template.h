@@ -0,0 +1,75 @@
+#ifndef AMF_TEMPLATE_H
+
+#define AMF_TEMPLATE_H
+
+#include <lua.h>
+
+#include "amf_buf.h"
+#include "amf_codec.h"
+
+/*
+ * pre-encoded templates: the static bytes of a value or message are encoded
+ * once, the slots in it are recorded with the reference counters at their
+ * offset so a render only encodes the slot values.
+ *
+ * references can not cross a slot: once a slot is written, the rest of its
+ * reference scope is encoded without remembering new objects, strings or
+ * traits, and slot values are encoded with reference tables of their own.
+ */
+#define AMF_SLOT_VALUE      0   /* an encoded value */
+#define AMF_SLOT_URI        1   /* u16 length prefixed header name or body uri */
+#define AMF_SLOT_LENGTH     2   /* content length of a header or body value */
+#define AMF_SLOT_END        3   /* end of the value of the last length */
+
+/* payload of an "amf_slot" userdata */
+typedef struct amf_slot {
+    size_t   len;
+    char     name[1];
+} amf_slot;
+
+typedef struct amf_slot_rec {
+    size_t   offset;                /* in the static bytes */
+    int      kind, ver, avmplus;
+    int      scope;                 /* reference scope of ver */
+    int      nref;                  /* amf0 references before the slot */
+    int      nstr, nobj, ntraits;   /* amf3 references before the slot */
+} amf_slot_rec;
+
+typedef struct amf_slots {
+    amf_slot_rec    *recs;
+    int              nrecs, cap;
+    int              names_idx;     /* slot names by record, on the stack */
+    int              scope[2];
+    int              frozen[2];
+    int              unstored_traits;
+} amf_slots;
+
+typedef struct amf_template {
+    amf_buf          buf;
+    amf_slots        slots;
+} amf_template;
+
+#define amf_ver_slot(ver)           ((ver) == AMF_VER3)
+#define amf_enc_frozen(e, ver)      ((e)->slots && (e)->slots->frozen[amf_ver_slot(ver)])
+
+void amf_slots_init(amf_slots *s, int names_idx);
+void amf_slots_free(amf_slots *s);
+
+/* a new reference scope of ver starts */
+void amf_template_scope(amf_slots *s, int ver);
+
+/*
+ * record the slot at idx, return 0 if the value is not a slot. raises an
+ * error for slots used outside a template.
+ */
+int amf_template_slot(lua_State *L, amf_enc *e, int idx, int ver, int avmplus);
+int amf_template_uri(lua_State *L, amf_enc *e, int idx);
+
+/* record a content length field or the end of its value at the buf end */
+void amf_template_mark(lua_State *L, amf_enc *e, int kind);
+
+/* render the template with the values table at values_idx into out */
+void amf_template_render(lua_State *L, amf_template *t, int names_idx,
+                         int values_idx, amf_buf *out);
+
+#endif /* end of include guard: AMF_TEMPLATE_H */
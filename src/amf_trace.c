@@ -0,0 +1,36 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "amf_trace.h"
+
+#include <time.h>
+
+uint32_t
+amf_trace_ring_size(long n)
+{
+    uint32_t size = AMF_TRACE_MIN_SIZE;
+
+    while (size < n && size < AMF_TRACE_MAX_SIZE) {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+#ifndef AMF_NO_TRACE
+
+void
+amf_trace_record(amf_trace *t, int flags, int marker, size_t offset, size_t len)
+{
+    struct timespec     now;
+    amf_trace_event    *ev = &t->events[t->count++ & (t->size - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ev->ts = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    ev->offset = offset > UINT32_MAX ? UINT32_MAX : (uint32_t)offset;
+    ev->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    ev->marker = (uint8_t)marker;
+    ev->flags = (uint8_t)flags;
+}
+
+#endif
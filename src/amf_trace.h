@@ -0,0 +1,57 @@
+#ifndef AMF_TRACE_H
+
+#define AMF_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * encode/decode trace: a fixed size ring of compact events, one per value,
+ * kept per lua state and switched on at runtime. compiled out with
+ * -DAMF_NO_TRACE.
+ *
+ * a value's event is written once the value is done, so nested values come
+ * before the value holding them, and a failing value is the last event.
+ */
+#define AMF_TRACE_ENCODE    0x01    /* else decode */
+#define AMF_TRACE_AMF3      0x02    /* else amf0 */
+#define AMF_TRACE_REF       0x04    /* written or read as a reference */
+#define AMF_TRACE_ERROR     0x08    /* the value failed to decode */
+
+#define AMF_TRACE_MIN_SIZE  16
+#define AMF_TRACE_MAX_SIZE  (1 << 20)
+
+typedef struct amf_trace_event {
+    uint64_t    ts;         /* monotonic clock, ns */
+    uint32_t    offset;     /* of the value in the input or output */
+    uint32_t    len;
+    uint8_t     marker;
+    uint8_t     flags;
+} amf_trace_event;
+
+typedef struct amf_trace {
+    int                 enabled;
+    uint32_t            size;       /* power of 2 */
+    uint64_t            count;      /* events written so far */
+    amf_trace_event     events[1];
+} amf_trace;
+
+#define amf_trace_size(n)   (sizeof(amf_trace) + ((n) - 1) * sizeof(amf_trace_event))
+
+#ifndef AMF_NO_TRACE
+
+#define amf_trace_on(t)     ((t) != NULL && (t)->enabled)
+
+void amf_trace_record(amf_trace *t, int flags, int marker, size_t offset, size_t len);
+
+#else
+
+#define amf_trace_on(t)     0
+#define amf_trace_record(t, flags, marker, offset, len) ((void)0)
+
+#endif
+
+/* round a requested ring size to a power of 2 within the limits */
+uint32_t amf_trace_ring_size(long n);
+
+#endif /* end of include guard: AMF_TRACE_H */
@@ -0,0 +1,132 @@
+#include "amf_vec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+amf_vec_push(amf_vec *v, const void *item, size_t size)
+{
+    if (v->n == v->cap) {
+        uint32_t  cap = v->cap ? v->cap * 2 : 16;
+        void     *items = realloc(v->items, cap * size);
+
+        if (items == NULL) {
+            return -1;
+        }
+
+        v->items = items;
+        v->cap = cap;
+    }
+
+    memcpy((char *)v->items + v->n * size, item, size);
+    v->n++;
+
+    return 0;
+}
+
+void
+amf_vec_free(amf_vec *v)
+{
+    free(v->items);
+    v->items = NULL;
+    v->n = v->cap = 0;
+}
+
+static uint32_t
+amf_map_hash(amf_map *m, const void *key, uint32_t len)
+{
+    uint64_t h;
+
+    if (m->str) {
+        const unsigned char *p = key;
+
+        h = 2166136261u;
+        for (uint32_t i = 0; i < len; i++) {
+            h = (h ^ p[i]) * 16777619u;
+        }
+        return (uint32_t)h;
+    }
+
+    h = (uint64_t)(uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (uint32_t)h;
+}
+
+static amf_map_entry *
+amf_map_slot(amf_map *m, const void *key, uint32_t len)
+{
+    uint32_t mask = m->cap - 1;
+    uint32_t i = amf_map_hash(m, key, len) & mask;
+
+    for (;; i = (i + 1) & mask) {
+        amf_map_entry *e = &m->e[i];
+
+        if (e->key == NULL) {
+            return e;
+        }
+
+        if (m->str ? e->len == len && memcmp(e->key, key, len) == 0
+                   : e->key == key)
+        {
+            return e;
+        }
+    }
+}
+
+long
+amf_map_find(amf_map *m, const void *key, uint32_t len)
+{
+    amf_map_entry *e;
+
+    if (m->n == 0) {
+        return -1;
+    }
+
+    e = amf_map_slot(m, key, len);
+
+    return e->key ? (long)e->idx : -1;
+}
+
+int
+amf_map_put(amf_map *m, const void *key, uint32_t len)
+{
+    amf_map_entry *e;
+
+    if ((m->n + 1) * 2 > m->cap) {
+        amf_map         old = *m;
+        uint32_t        cap = m->cap ? m->cap * 2 : 64;
+
+        m->e = calloc(cap, sizeof(amf_map_entry));
+        if (m->e == NULL) {
+            *m = old;
+            return -1;
+        }
+        m->cap = cap;
+
+        for (uint32_t i = 0; i < old.cap; i++) {
+            if (old.e[i].key) {
+                *amf_map_slot(m, old.e[i].key, old.e[i].len) = old.e[i];
+            }
+        }
+
+        free(old.e);
+    }
+
+    e = amf_map_slot(m, key, len);
+    e->key = key;
+    e->len = len;
+    e->idx = m->n++;
+
+    return 0;
+}
+
+void
+amf_map_free(amf_map *m)
+{
+    free(m->e);
+    m->e = NULL;
+    m->n = m->cap = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef AMF_VEC_H
+
+#define AMF_VEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * a growable array of fixed size items, the scratch tables of the codecs
+ * that work without lua
+ */
+typedef struct amf_vec {
+    void               *items;
+    uint32_t            n, cap;
+} amf_vec;
+
+#define amf_vec_at(v, type, i)  (((type *)(v)->items)[i])
+
+/* returns 0, or -1 when out of memory */
+int  amf_vec_push(amf_vec *v, const void *item, size_t size);
+void amf_vec_free(amf_vec *v);
+
+/*
+ * an open addressing hash map to indexes, keyed by address, or by the
+ * content of len bytes when str is set. the keys are not copied.
+ */
+typedef struct amf_map_entry {
+    const void         *key;
+    uint32_t            len;
+    uint32_t            idx;
+} amf_map_entry;
+
+typedef struct amf_map {
+    amf_map_entry      *e;
+    uint32_t            n, cap;
+    int                 str;
+} amf_map;
+
+/* the index of key, or -1 */
+long amf_map_find(amf_map *m, const void *key, uint32_t len);
+
+/* add key with the next index n, returns 0, or -1 when out of memory */
+int  amf_map_put(amf_map *m, const void *key, uint32_t len);
+void amf_map_free(amf_map *m);
+
+#endif /* end of include guard: AMF_VEC_H */
@@ -1,13 +1,28 @@
 
 #include "amf_codec.h"
+#include "amf_batch.h"
+#include "amf_convert.h"
+#include "amf_dom.h"
+#include "amf_file.h"
+#include "amf_flv.h"
+#include "amf_json.h"
+#include "amf_msgpack.h"
 #include "amf_remoting.h"
+#include "amf_rtmp.h"
+#include "amf_template.h"
+#include "amf_stats.h"
+#include "amf_trace.h"
+#include "amf_probe.h"
 
 #include "endiness.h"
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include <errno.h>
+#include <math.h>
 #include <stdint.h>
+#include <string.h>
 
 
 
@@ -22,51 +37,156 @@
 } while(0)
 
 
+/* the trace ring of this lua state, NULL when tracing is off */
+static amf_trace *
+current_trace(lua_State *L)
+{
+#ifndef AMF_NO_TRACE
+    amf_trace *t;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_trace");
+    t = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return amf_trace_on(t) ? t : NULL;
+#else
+    (void)L;
+    return NULL;
+#endif
+}
+
+/* an amf_buffer on the stack, freed by the lua state also when encoding raises */
+static amf_buf *
+push_buf(lua_State *L)
+{
+    amf_buf *b = lua_newuserdata(L, sizeof(struct amf_buf));
+
+    amf_buf_init(b);
+
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    return b;
+}
+
+/*
+ * encode options at idx: object_refs = false writes every table in full,
+ * string_refs = false every amf3 string, max_depth fails tables nested
+ * deeper, which is AMF_ENC_MAX_DEPTH without object references. the
+ * table is walked once, so the option names are not made into lua
+ * strings on each call.
+ */
+static void
+encode_opts(lua_State *L, int idx, amf_enc *e)
+{
+    const char *key;
+    int         max_depth = -1;
+
+    if (lua_isnoneornil(L, idx)) {
+        return;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            continue;
+        }
+
+        key = lua_tostring(L, -2);
+
+        if (strcmp(key, "object_refs") == 0) {
+            if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+                e->flags |= AMF_ENC_NO_OBJ_REFS;
+            }
+
+        } else if (strcmp(key, "string_refs") == 0) {
+            if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+                e->flags |= AMF_ENC_NO_STR_REFS;
+            }
+
+        } else if (strcmp(key, "max_depth") == 0) {
+            max_depth = lua_tointeger(L, -1);
+            luaL_argcheck(L, max_depth >= 0, idx, "max_depth may not be negative");
+        }
+    }
+
+    if (max_depth >= 0) {
+        e->max_depth = max_depth;
+    } else if (e->flags & AMF_ENC_NO_OBJ_REFS) {
+        e->max_depth = AMF_ENC_MAX_DEPTH;
+    }
+}
+
+/* the value at vidx appended to e->buf */
+static void
+encode_value(lua_State *L, amf_enc *e, int ver, int vidx)
+{
+    amf_buf *buf = e->buf;
+
+    e->trace = current_trace(L);
+
+    size_t start = buf->len;
+    uint64_t t0 = amf_stats_start();
+    amf_probe1(encode__start, ver);
+    amf_stats_inc(encode_calls);
+
+    if (ver == AMF_VER0) {
+        amf0_encode_scope(L, e, 0, vidx);
+
+    } else {
+        amf3_encode_scope(L, e, vidx);
+
+    }
+
+    amf_stats_add(bytes_out, buf->len - start);
+    amf_probe1(encode__done, buf->len - start);
+    amf_stats_latency(AMF_LAT_ENCODE, t0);
+}
+
+/*
+ * encode(ver, v, opts) returns v encoded, encode(buf, ver, v, opts)
+ * appends it to an amf_buffer
+ */
 int
 lua_amf_encode(lua_State *L)
 {
-    int ver, freebuf = 1;
+    int ver, vidx, freebuf = 1;
     amf_buf *buf;
+    amf_enc e;
 
     if (lua_isnumber(L, 1)) {
         ver = luaL_checkint(L, 1);
         check_amf_ver(ver, 1);
         luaL_checkany(L, 2);
-
-        buf = amf_buf_init(NULL);
+        vidx = 2;
 
     } else {
         buf = luaL_checkudata(L, 1, "amf_buffer");
         ver = luaL_checkint(L, 2);
         check_amf_ver(ver, 2);
         luaL_checkany(L, 3);
+        vidx = 3;
         freebuf = 0;
 
     }
 
+    lua_settop(L, vidx + 1);
 
-    if (buf == NULL) {
-        lua_pushnil(L);
-        return 1;
-    }
-
-    int base = lua_gettop(L);
-
-    if (ver == AMF_VER0) {
-        lua_newtable(L);
-        amf0_encode(L, buf, 0, base, base+1);
-
-    } else {
-        lua_newtable(L);
-        lua_newtable(L);
-        lua_newtable(L);
-        amf3_encode(L, buf, base, base+1, base+2, base+3);
+    amf_enc_init(&e, NULL);
+    encode_opts(L, vidx + 1, &e);
 
+    if (freebuf) {
+        buf = push_buf(L);
     }
 
+    e.buf = buf;
+    encode_value(L, &e, ver, vidx);
+
     if (freebuf) {
         lua_pushlstring(L, buf->b, buf->len);
-        amf_buf_free(buf);
+        free(buf->b);
+        buf->b = NULL;
         return 1;
 
     } else {
@@ -75,7 +195,74 @@ lua_amf_encode(lua_State *L)
     }
 }
 
+/*
+ * decode limits at idx, an amf_limits from amf_codec.limits or a table of
+ * the same fields read into tmp, NULL for none
+ */
+static const amf_limits *
+check_limits(lua_State *L, int idx, amf_limits *tmp)
+{
+    static const char *const fields[] = { "depth", "elements", "string", "alloc" };
+    lua_Number n[4];
+
+    if (lua_isnoneornil(L, idx)) {
+        return NULL;
+    }
+
+    if (lua_isuserdata(L, idx)) {
+        return luaL_checkudata(L, idx, "amf_limits");
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    for (int i = 0; i < 4; i++) {
+        lua_getfield(L, idx, fields[i]);
+        n[i] = lua_tonumber(L, -1);
+        luaL_argcheck(L, n[i] >= 0, idx, "limits may not be negative");
+        lua_pop(L, 1);
+    }
+
+    tmp->depth = (uint32_t)n[0];
+    tmp->elements = (uint32_t)n[1];
+    tmp->string = (size_t)n[2];
+    tmp->alloc = (size_t)n[3];
+
+    return tmp;
+}
+
+/* limits{depth, elements, string, alloc} to pass to the decoders again */
+static int
+lua_amf_limits(lua_State *L)
+{
+    amf_limits   tmp;
+    amf_limits  *lim;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    check_limits(L, 1, &tmp);
+
+    lim = lua_newuserdata(L, sizeof(*lim));
+    *lim = tmp;
+
+    luaL_getmetatable(L, "amf_limits");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int
+lua_amf_limits_tostring(lua_State *L)
+{
+    amf_limits *lim = luaL_checkudata(L, 1, "amf_limits");
+
+    lua_pushfstring(L, "<amf limits: depth %f, elements %f, string %f, alloc %f>",
+                    (lua_Number)lim->depth, (lua_Number)lim->elements,
+                    (lua_Number)lim->string, (lua_Number)lim->alloc);
+
+    return 1;
+}
+
 #define min(x,y) ((x)>(y) ? (y) : (x))
+/* decode(ver, buf, pos, end, limits) */
 int
 lua_amf_decode(lua_State *L)
 {
@@ -85,6 +272,8 @@ lua_amf_decode(lua_State *L)
     size_t       buf_size;
     const char  *buf;
     amf_cursor  *cur;
+    amf_limits   limits;
+    const amf_limits *lim;
 
     ver = luaL_checkint(L, 1);
     check_amf_ver(ver, 1);
@@ -98,8 +287,19 @@ lua_amf_decode(lua_State *L)
     buf_size = min(luaL_optint(L, 4, buf_size), (int)buf_size);
     luaL_argcheck(L, buf_size >= pos, 4, "input buf overflow");
 
+    lim = check_limits(L, 5, &limits);
+
+    uint64_t t0 = amf_stats_start();
+    amf_probe2(decode__start, ver, buf_size - pos);
+
     top = lua_gettop(L);
-    cur = amf_cursor_new(buf, buf_size);
+    cur = amf_cursor_new(buf + pos, buf_size - pos);
+    if (cur == NULL) {
+        return luaL_error(L, "cursor creation failed");
+    }
+    cur->base = buf;
+    cur->trace = current_trace(L);
+    cur->limits = lim;
 
     if (ver == AMF_VER0) {
         lua_newtable(L);
@@ -113,7 +313,13 @@ lua_amf_decode(lua_State *L)
 
     }
 
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, buf_size - pos - cur->left);
+    amf_probe2(decode__done, buf_size - pos - cur->left, cur->err);
+    amf_stats_latency(AMF_LAT_DECODE, t0);
+
     if (cur->err) {
+        amf_stats_error(cur->err_msg);
         lua_pushnil(L);
         lua_pushstring(L, cur->err_msg);
 
@@ -128,167 +334,2608 @@ lua_amf_decode(lua_State *L)
     return 3;
 }
 
-int
-lua_amf_decode_msg(lua_State *L)
+/* decode_msg(buf, offset, len, opts), opts.limits as the limits of decode */
+static int
+decode_msg(lua_State *L, int flags)
 {
+    amf_limits limits;
+    const amf_limits *lim = NULL;
     size_t len;
     const char *buf = luaL_checklstring(L, 1, &len);
 
     size_t offset = luaL_optint(L, 2, 0);
     luaL_argcheck(L, offset >= 0 && offset < len, 2, "invalid buffer offset");
 
-    size_t actual_len = luaL_optint(L, 3, len);
-    luaL_argcheck(L, actual_len > 0 && offset + actual_len <= len, 2, "invalid buffer length");
+    size_t actual_len = luaL_optint(L, 3, len - offset);
+    luaL_argcheck(L, actual_len > 0 && offset + actual_len <= len, 3, "invalid buffer length");
+
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "limits");
+        lua_replace(L, 4);
+        lim = check_limits(L, 4, &limits);
+    }
+
+    uint64_t t0 = amf_stats_start();
+    amf_probe1(decode_msg__start, actual_len);
 
     amf_cursor *c = amf_cursor_new(buf + offset, actual_len);
     if (c == NULL) {
         luaL_error(L, "cursor creation failed");
     }
+    c->base = buf;
+    c->trace = current_trace(L);
+    c->limits = lim;
 
-    amf_decode_msg(L, c);
+    amf_decode_msg(L, c, buf, flags);
+
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, actual_len - c->left);
+    amf_probe2(decode_msg__done, actual_len - c->left, c->err);
+    amf_stats_latency(AMF_LAT_DECODE_MSG, t0);
 
     if (c->err) {
+        amf_stats_error(c->err_msg);
         lua_pushnil(L);
-        lua_pushstring(L, c->err_msg);
+        lua_pushstring(L, c->err_msg ? c->err_msg : "invalid amf message");
+        amf_cursor_free(c);
         return 2;
     }
 
+    amf_cursor_free(c);
+
     return 1;
 }
 
+int
+lua_amf_decode_msg(lua_State *L)
+{
+    /* options: lazy_headers, lazy_bodies */
+    int flags = 0;
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+
+        lua_getfield(L, 4, "lazy_headers");
+        if (lua_toboolean(L, -1)) flags |= AMF_MSG_LAZY_HEADERS;
+        lua_getfield(L, 4, "lazy_bodies");
+        if (lua_toboolean(L, -1)) flags |= AMF_MSG_LAZY_BODIES;
+        lua_pop(L, 2);
+    }
+
+    return decode_msg(L, flags);
+}
+
+/*
+ * headers in full, bodies with their target and response uris, offset and
+ * length only. opts.limits as in decode_msg
+ */
+int
+lua_amf_peek_msg(lua_State *L)
+{
+    return decode_msg(L, AMF_MSG_LAZY_BODIES);
+}
+
+/* the message at idx written to e->buf */
+static void
+encode_msg(lua_State *L, amf_enc *e, int idx)
+{
+    amf_buf *buf = e->buf;
+
+    e->trace = current_trace(L);
+
+    /* the message on top again for the encoder */
+    lua_pushvalue(L, idx);
+
+    uint64_t t0 = amf_stats_start();
+    amf_probe0(encode_msg__start);
+
+    amf_stats_inc(encode_calls);
+    amf_encode_msg(L, e);
+    amf_stats_add(bytes_out, buf->len);
+
+    amf_probe1(encode_msg__done, buf->len);
+    amf_stats_latency(AMF_LAT_ENCODE_MSG, t0);
+}
+
 int
 lua_amf_encode_msg(lua_State *L)
 {
+    amf_buf *buf;
+    amf_enc e;
+
     luaL_checktype(L, 1, LUA_TTABLE);
-    amf_buf *buf = amf_buf_init(NULL);
+    lua_settop(L, 2);
 
-    amf_encode_msg(L, buf);
+    amf_enc_init(&e, NULL);
+    encode_opts(L, 2, &e);
+
+    buf = push_buf(L);
+    e.buf = buf;
+    encode_msg(L, &e, 1);
 
     lua_pushlstring(L, buf->b, buf->len);
+    free(buf->b);
+    buf->b = NULL;
 
     return 1;
 }
 
-static int
-lua_amf_new_buffer(lua_State *L)
+/*
+ * amf_codec.stats() returns a snapshot of the process wide counters,
+ * amf_codec.reset_stats() zeroes them
+ */
+#ifndef AMF_NO_STATS
+static void
+push_markers(lua_State *L, const uint64_t *counts)
 {
-    amf_buf *b = lua_newuserdata(L, sizeof(struct amf_buf));
-    if (b == NULL) return 0;
+    lua_newtable(L);
+    for (int m = 0; m < AMF_STATS_MARKERS; m++) {
+        if (counts[m]) {
+            lua_pushnumber(L, (lua_Number)counts[m]);
+            lua_rawseti(L, -2, m);
+        }
+    }
+}
 
-    amf_buf_init(b);
+static void
+push_refs(lua_State *L, const char *name, const amf_ref_stats *r)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, (lua_Number)r->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, (lua_Number)r->misses);
+    lua_setfield(L, -2, "misses");
+    lua_setfield(L, -2, name);
+}
 
-    luaL_getmetatable(L, "amf_buffer");
-    lua_setmetatable(L, -2);
+/* buckets are keyed by their upper bound in ns, empty ones are left out */
+static void
+push_latency(lua_State *L, const char *name, const amf_latency *lat)
+{
+    lua_createtable(L, 0, 4);
+
+    lua_pushnumber(L, (lua_Number)lat->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, (lua_Number)lat->total_ns);
+    lua_setfield(L, -2, "total_ns");
+    lua_pushnumber(L, (lua_Number)lat->max_ns);
+    lua_setfield(L, -2, "max_ns");
+
+    lua_newtable(L);
+    for (int i = 0; i < AMF_LAT_BUCKETS; i++) {
+        if (lat->buckets[i] == 0) {
+            continue;
+        }
+
+        if (i == AMF_LAT_BUCKETS - 1) {
+            lua_pushnumber(L, HUGE_VAL);
+        } else {
+            lua_pushnumber(L, (lua_Number)((uint64_t)1 << i));
+        }
+        lua_pushnumber(L, (lua_Number)lat->buckets[i]);
+        lua_rawset(L, -3);
+    }
+    lua_setfield(L, -2, "buckets");
 
-    return 1;
+    lua_setfield(L, -2, name);
 }
+#endif
+
+#define set_counter(L, name, v) do {                                \
+    lua_pushnumber(L, (lua_Number)(v));                             \
+    lua_setfield(L, -2, name);                                      \
+} while(0)
 
 static int
-lua_amf_buffer_free(lua_State *L)
+lua_amf_stats(lua_State *L)
 {
-    amf_buf *b = lua_newuserdata(L, sizeof(struct amf_buf));
-    if (b != NULL) {
-        amf_buf_free(b);
+    lua_newtable(L);
+
+#ifdef AMF_NO_STATS
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "enabled");
+#else
+    amf_stats *st = &amf_stats_g;
+
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "enabled");
+
+    set_counter(L, "encode_calls", st->encode_calls);
+    set_counter(L, "decode_calls", st->decode_calls);
+    set_counter(L, "bytes_in", st->bytes_in);
+    set_counter(L, "bytes_out", st->bytes_out);
+    set_counter(L, "buf_reallocs", st->buf_reallocs);
+    set_counter(L, "buf_peak", st->buf_peak);
+
+    /* values by type marker */
+    lua_createtable(L, 0, 2);
+    push_markers(L, st->encoded[0]);
+    lua_setfield(L, -2, "amf0");
+    push_markers(L, st->encoded[1]);
+    lua_setfield(L, -2, "amf3");
+    lua_setfield(L, -2, "encoded");
+
+    lua_createtable(L, 0, 2);
+    push_markers(L, st->decoded[0]);
+    lua_setfield(L, -2, "amf0");
+    push_markers(L, st->decoded[1]);
+    lua_setfield(L, -2, "amf3");
+    lua_setfield(L, -2, "decoded");
+
+    /* encoder reference lookups */
+    lua_createtable(L, 0, 3);
+    push_refs(L, "object", &st->obj_refs);
+    push_refs(L, "string", &st->str_refs);
+    push_refs(L, "traits", &st->traits_refs);
+    lua_setfield(L, -2, "refs");
+
+    lua_createtable(L, 0, amf_stats_load(&st->nerrors) + 1);
+    for (int i = 0; i < AMF_STATS_ERRORS; i++) {
+        const char *msg = amf_stats_load(&st->errors[i].msg);
+
+        if (msg == NULL) {
+            break;
+        }
+        set_counter(L, msg, st->errors[i].count);
     }
+    if (st->errors_other) {
+        set_counter(L, "other", st->errors_other);
+    }
+    lua_setfield(L, -2, "errors");
 
-    return 0;
+    lua_createtable(L, 0, AMF_LAT_CALLS);
+    push_latency(L, "encode", &st->latency[AMF_LAT_ENCODE]);
+    push_latency(L, "decode", &st->latency[AMF_LAT_DECODE]);
+    push_latency(L, "decode_msg", &st->latency[AMF_LAT_DECODE_MSG]);
+    push_latency(L, "encode_msg", &st->latency[AMF_LAT_ENCODE_MSG]);
+    lua_setfield(L, -2, "latency");
+#endif
+
+    return 1;
 }
 
 static int
-lua_amf_buffer_write_ushort(lua_State *L)
+lua_amf_reset_stats(lua_State *L)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    unsigned short s = (unsigned short)luaL_checkint(L, 2);
-
-    amf_buf_append_u16(b, s);
+    (void)L;
+    amf_stats_reset();
 
     return 0;
 }
 
+/*
+ * amf_codec.latency(on) switches the latency histograms of the entry points
+ * on or off, they are part of amf_codec.stats()
+ */
 static int
-lua_amf_buffer_raw_string(lua_State *L)
+lua_amf_latency(lua_State *L)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    lua_pushlstring(L, b->b, b->len);
+#ifndef AMF_NO_STATS
+    amf_latency_on = lua_toboolean(L, 1);
+    lua_pushboolean(L, amf_latency_on);
+#else
+    lua_pushboolean(L, 0);
+#endif
+
     return 1;
 }
 
+/*
+ * amf_codec.trace(on, size) switches tracing of this lua state on or off,
+ * amf_codec.trace_dump() returns the events in the ring, oldest first
+ */
 static int
-lua_amf_buffer_tostring(lua_State *L)
+lua_amf_trace(lua_State *L)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    lua_pushfstring(L, "<buffer len:%d free:%d>", (int)b->len, (int)b->free);
+#ifndef AMF_NO_TRACE
+    int on = lua_toboolean(L, 1);
+    uint32_t size = amf_trace_ring_size(luaL_optlong(L, 2, 256));
+    amf_trace *t;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_trace");
+    t = lua_touserdata(L, -1);
+
+    if (on && (t == NULL || (!lua_isnoneornil(L, 2) && t->size != size))) {
+        t = lua_newuserdata(L, amf_trace_size(size));
+        t->size = size;
+        t->count = 0;
+        lua_setfield(L, LUA_REGISTRYINDEX, "amf_trace");
+    }
+
+    if (t) {
+        t->enabled = on;
+    }
+
+    lua_pushboolean(L, on);
+#else
+    lua_pushboolean(L, 0);
+#endif
 
     return 1;
 }
 
 static int
-lua_amf_buffer_write_int32(lua_State *L)
+lua_amf_trace_dump(lua_State *L)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    int32_t i = luaL_checkint(L, 2);
+    amf_trace *t;
+    uint64_t   first = 0;
 
-    amf_buf_append_u32(b, i);
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_trace");
+    t = lua_touserdata(L, -1);
+    if (t == NULL) {
+        lua_newtable(L);
+        return 1;
+    }
 
-    return 0;
+    if (t->count > t->size) {
+        first = t->count - t->size;
+    }
+
+    lua_createtable(L, (int)(t->count - first), 0);
+
+    for (uint64_t i = first; i < t->count; i++) {
+        amf_trace_event *ev = &t->events[i & (t->size - 1)];
+
+        lua_createtable(L, 0, 8);
+
+        lua_pushstring(L, ev->flags & AMF_TRACE_ENCODE ? "encode" : "decode");
+        lua_setfield(L, -2, "op");
+        lua_pushinteger(L, ev->flags & AMF_TRACE_AMF3 ? AMF_VER3 : AMF_VER0);
+        lua_setfield(L, -2, "ver");
+        lua_pushinteger(L, ev->marker);
+        lua_setfield(L, -2, "marker");
+        lua_pushnumber(L, ev->offset);
+        lua_setfield(L, -2, "offset");
+        lua_pushnumber(L, ev->len);
+        lua_setfield(L, -2, "len");
+        lua_pushboolean(L, ev->flags & AMF_TRACE_REF);
+        lua_setfield(L, -2, "ref");
+        lua_pushboolean(L, ev->flags & AMF_TRACE_ERROR);
+        lua_setfield(L, -2, "err");
+        lua_pushnumber(L, (lua_Number)ev->ts);
+        lua_setfield(L, -2, "ts");
+
+        lua_rawseti(L, -2, (int)(i - first + 1));
+    }
+
+    if (lua_toboolean(L, 1)) {
+        t->count = 0;
+    }
+
+    return 1;
 }
 
+/*
+ * streaming message writer: w:begin(ver, headers, nbodies) writes the
+ * envelope up to the body count, each w:body(target, response, value)
+ * writes one body. every piece goes to the sink function given to
+ * amf_codec.msg_writer(sink), or is returned when there is no sink.
+ */
+typedef struct amf_msg_writer {
+    amf_buf     buf;
+    int         ver;
+    int         nbodies, written;
+    int         begun;
+} amf_msg_writer;
+
 static int
-lua_amf_buffer_write_str(lua_State *L)
+msg_writer_emit(lua_State *L, amf_msg_writer *w)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    size_t len;
-    const char *str = luaL_checklstring(L, 2, &len);
+    amf_stats_inc(encode_calls);
+    amf_stats_add(bytes_out, w->buf.len);
 
-    printf("string len: %d\n", (uint16_t)len);
-    amf_buf_append_u16(b, (uint16_t)len);
-    amf_buf_append(b, str, len);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 1);
+
+    if (lua_isnil(L, -1)) {
+        lua_pushlstring(L, w->buf.b, w->buf.len);
+        amf_buf_reset(&w->buf);
+        return 1;
+    }
+
+    lua_pushlstring(L, w->buf.b, w->buf.len);
+    amf_buf_reset(&w->buf);
+    lua_call(L, 1, 0);
 
     return 0;
 }
 
 static int
-lua_amf_buffer_write_uchar(lua_State *L)
+lua_amf_msg_writer(lua_State *L)
 {
-    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
-    unsigned char c = (unsigned char)luaL_checkint(L, 2);
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+    }
+    lua_settop(L, 1);
 
-    amf_buf_append_char(b, c);
+    amf_msg_writer *w = lua_newuserdata(L, sizeof(*w));
+    amf_buf_init(&w->buf);
+    w->ver = AMF_VER0;
+    w->nbodies = w->written = w->begun = 0;
 
-    return 0;
+    luaL_getmetatable(L, "amf_msg_writer");
+    lua_setmetatable(L, -2);
+
+    /* the sink */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    return 1;
 }
 
-#define lib_func(name) { #name, lua_amf_##name }
+static int
+lua_amf_msg_writer_begin(lua_State *L)
+{
+    amf_msg_writer *w = luaL_checkudata(L, 1, "amf_msg_writer");
+    int ver = luaL_checkint(L, 2);
+    check_amf_ver(ver, 2);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    int nbodies = luaL_checkint(L, 4);
+    luaL_argcheck(L, nbodies >= 0 && nbodies <= UINT16_MAX, 4, "invalid body count");
+    lua_settop(L, 3);
 
-const struct luaL_Reg amf_lib[] = {
-    lib_func(encode),
-    lib_func(decode),
-    lib_func(decode_msg),
-    lib_func(encode_msg),
-    lib_func(new_buffer),
-    { NULL, NULL }
-};
+    if (w->begun) {
+        return luaL_error(L, "amf message already begun");
+    }
 
-const struct luaL_Reg amf_buf_lib[] = {
-    { "write_uchar",  lua_amf_buffer_write_uchar },
-    { "write_ushort", lua_amf_buffer_write_ushort },
-    { "write_int32",  lua_amf_buffer_write_int32 },
-    { "write_str",    lua_amf_buffer_write_str },
-    { "raw_string",   lua_amf_buffer_raw_string },
-    { "__tostring",   lua_amf_buffer_tostring },
-    { "__gc",         lua_amf_buffer_free },
-    { NULL, NULL}
-};
+    amf_enc e;
+    amf_enc_init(&e, &w->buf);
+    e.trace = current_trace(L);
+    amf_encode_msg_head(L, &e, ver, nbodies);
 
+    w->ver = ver;
+    w->nbodies = nbodies;
+    w->begun = 1;
 
-LUALIB_API int
-luaopen_amf_codec(lua_State* L)
+    return msg_writer_emit(L, w);
+}
+
+static int
+lua_amf_msg_writer_body(lua_State *L)
 {
-    luaL_newmetatable(L, "amf_buffer");
-    lua_pushstring(L, "__index");
-    lua_pushvalue(L, -2);
-    lua_settable(L, -3);
-    luaL_openlib(L, NULL, amf_buf_lib, 0);
+    amf_msg_writer *w = luaL_checkudata(L, 1, "amf_msg_writer");
+    luaL_checkstring(L, 2);
+    luaL_checkstring(L, 3);
+    luaL_checkany(L, 4);
+    lua_settop(L, 4);
+
+    if (!w->begun) {
+        return luaL_error(L, "amf message not begun");
+    }
+
+    if (w->written == w->nbodies) {
+        return luaL_error(L, "amf message has only %d bodies", w->nbodies);
+    }
+
+    /* the body structure encode_msg takes */
+    lua_createtable(L, 3, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 2);
+    lua_pushvalue(L, 4);
+    lua_rawseti(L, -2, 3);
+
+    amf_enc e;
+    amf_enc_init(&e, &w->buf);
+    e.trace = current_trace(L);
+    amf_encode_msg_body(L, &e, w->ver);
+    lua_pop(L, 1);
+
+    w->written++;
+
+    return msg_writer_emit(L, w);
+}
+
+/* true once every announced body is written */
+static int
+lua_amf_msg_writer_done(lua_State *L)
+{
+    amf_msg_writer *w = luaL_checkudata(L, 1, "amf_msg_writer");
+    lua_pushboolean(L, w->begun && w->written == w->nbodies);
+
+    return 1;
+}
+
+static int
+lua_amf_msg_writer_free(lua_State *L)
+{
+    amf_msg_writer *w = luaL_checkudata(L, 1, "amf_msg_writer");
+
+    free(w->buf.b);
+    w->buf.b = NULL;
+
+    return 0;
+}
+
+/*
+ * encoder session: amf_codec.encoder(opts) takes the options of encode and
+ * the version, 3 unless told. enc:encode(v) and enc:encode_msg(msg) reuse
+ * its output buffer and reference tables, which are emptied after each
+ * value instead of made again and left to the collector.
+ */
+typedef struct amf_encoder {
+    amf_buf     buf;
+    int         ver;
+    int         flags, max_depth;
+    int         dirty;
+} amf_encoder;
+
+static int
+lua_amf_encoder(lua_State *L)
+{
+    amf_enc e;
+    int ver = AMF_VER3;
+
+    lua_settop(L, 1);
+
+    amf_enc_init(&e, NULL);
+    encode_opts(L, 1, &e);
+
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "version");
+        if (!lua_isnil(L, -1)) {
+            ver = lua_tointeger(L, -1);
+            check_amf_ver(ver, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    amf_encoder *s = lua_newuserdata(L, sizeof(*s));
+    amf_buf_init(&s->buf);
+    s->ver = ver;
+    s->flags = e.flags;
+    s->max_depth = e.max_depth;
+    s->dirty = 0;
+
+    luaL_getmetatable(L, "amf_encoder");
+    lua_setmetatable(L, -2);
+
+    /* the reference tables, see AMF_WARM_REFS, those the options turn off are not made */
+    lua_createtable(L, AMF_WARM_TRAITS, 0);
+    for (int n = AMF_WARM_REFS; n <= AMF_WARM_TRAITS; n++) {
+        if ((n == AMF_WARM_REFS || n == AMF_WARM_OBJS) && (e.flags & AMF_ENC_NO_OBJ_REFS)) {
+            continue;
+        }
+        if (n == AMF_WARM_STRS && (e.flags & AMF_ENC_NO_STR_REFS)) {
+            continue;
+        }
+        lua_newtable(L);
+        lua_rawseti(L, -2, n);
+    }
+    lua_setfenv(L, -2);
+
+    return 1;
+}
+
+/* an encoder over the session at 1, with its tables pushed */
+static amf_encoder *
+encoder_begin(lua_State *L, amf_enc *e)
+{
+    amf_encoder *s = luaL_checkudata(L, 1, "amf_encoder");
+
+    lua_getfenv(L, 1);
+
+    amf_buf_reset(&s->buf);
+    amf_enc_init(e, &s->buf);
+    e->flags = s->flags;
+    e->max_depth = s->max_depth;
+    e->warm = lua_gettop(L);
+
+    /* an error left references behind */
+    if (s->dirty) {
+        amf_enc_clear(L, e);
+    }
+    s->dirty = 1;
+
+    return s;
+}
+
+static int
+encoder_done(lua_State *L, amf_encoder *s)
+{
+    s->dirty = 0;
+    lua_pushlstring(L, s->buf.b, s->buf.len);
+
+    return 1;
+}
+
+static int
+lua_amf_encoder_encode(lua_State *L)
+{
+    amf_encoder *s;
+    amf_enc e;
+
+    luaL_checkany(L, 2);
+    lua_settop(L, 2);
+
+    s = encoder_begin(L, &e);
+    encode_value(L, &e, s->ver, 2);
+
+    return encoder_done(L, s);
+}
+
+static int
+lua_amf_encoder_encode_msg(lua_State *L)
+{
+    amf_encoder *s;
+    amf_enc e;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    s = encoder_begin(L, &e);
+    encode_msg(L, &e, 2);
+
+    return encoder_done(L, s);
+}
+
+static int
+lua_amf_encoder_free(lua_State *L)
+{
+    amf_encoder *s = luaL_checkudata(L, 1, "amf_encoder");
+
+    free(s->buf.b);
+    s->buf.b = NULL;
+
+    return 0;
+}
+
+/*
+ * templates: amf_codec.slot(name) marks a variable part of a value or
+ * message, amf_codec.template(ver, obj) and amf_codec.template_msg(msg)
+ * encode everything else once, tpl:render(values) fills in the slots.
+ * the slot names of a template are kept in its environment table.
+ */
+static int
+lua_amf_slot(lua_State *L)
+{
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+
+    amf_slot *slot = lua_newuserdata(L, sizeof(amf_slot) + len);
+    slot->len = len;
+    memcpy(slot->name, name, len);
+    slot->name[len] = '\0';
+
+    luaL_getmetatable(L, "amf_slot");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int
+lua_amf_slot_tostring(lua_State *L)
+{
+    amf_slot *slot = luaL_checkudata(L, 1, "amf_slot");
+    lua_pushfstring(L, "<amf slot: %s>", slot->name);
+
+    return 1;
+}
+
+static amf_template *
+new_template(lua_State *L, amf_enc *e)
+{
+    amf_template *t = lua_newuserdata(L, sizeof(*t));
+
+    amf_buf_init(&t->buf);
+    amf_slots_init(&t->slots, 0);
+
+    luaL_getmetatable(L, "amf_template");
+    lua_setmetatable(L, -2);
+
+    lua_newtable(L);
+    t->slots.names_idx = lua_gettop(L);
+
+    amf_enc_init(e, &t->buf);
+    e->slots = &t->slots;
+
+    return t;
+}
+
+static int
+lua_amf_template(lua_State *L)
+{
+    int ver = luaL_checkint(L, 1);
+    check_amf_ver(ver, 1);
+    luaL_checkany(L, 2);
+    lua_settop(L, 2);
+
+    amf_enc e;
+    amf_template *t = new_template(L, &e);
+
+    if (ver == AMF_VER0) {
+        amf0_encode_scope(L, &e, 0, 2);
+
+    } else {
+        amf3_encode_scope(L, &e, 2);
+
+    }
+
+    (void)t;
+    lua_setfenv(L, -2); /* the names table */
+
+    return 1;
+}
+
+static int
+lua_amf_template_msg(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    amf_enc e;
+    amf_template *t = new_template(L, &e);
+
+    lua_pushvalue(L, 1);
+    amf_encode_msg(L, &e);
+    lua_pop(L, 1);
+
+    (void)t;
+    lua_setfenv(L, -2); /* the names table */
+
+    return 1;
+}
+
+static int
+lua_amf_template_render(lua_State *L)
+{
+    amf_template *t = luaL_checkudata(L, 1, "amf_template");
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+
+    /* a buffer userdata is collected even if a slot value raises */
+    amf_buf *out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_stats_inc(encode_calls);
+    amf_template_render(L, t, 3, 2, out);
+    amf_stats_add(bytes_out, out->len);
+
+    lua_pushlstring(L, out->b, out->len);
+
+    return 1;
+}
+
+static int
+lua_amf_template_free(lua_State *L)
+{
+    amf_template *t = luaL_checkudata(L, 1, "amf_template");
+
+    free(t->buf.b);
+    t->buf.b = NULL;
+    amf_slots_free(&t->slots);
+
+    return 0;
+}
+
+static int
+lua_amf_template_tostring(lua_State *L)
+{
+    amf_template *t = luaL_checkudata(L, 1, "amf_template");
+    lua_pushfstring(L, "<amf template len:%d slots:%d>",
+                    (int)t->buf.len, t->slots.nrecs);
+
+    return 1;
+}
+
+/*
+ * the result of a transcode into out, a buffer userdata at the stack top:
+ * out, nil, pos or nil, err, pos
+ */
+static int
+amf_push_transcoded(lua_State *L, amf_cursor *c, size_t buf_size, amf_buf *out)
+{
+    amf_stats_add(bytes_in, buf_size - c->left);
+
+    if (c->err) {
+        amf_stats_error(c->err_msg);
+        lua_pushnil(L);
+        lua_pushstring(L, c->err_msg);
+
+    } else {
+        amf_stats_add(bytes_out, out->len);
+        lua_pushlstring(L, out->b, out->len);
+        lua_pushnil(L);
+    }
+
+    lua_pushinteger(L, buf_size - c->left);
+
+    return 3;
+}
+
+/*
+ * to_json(ver, buf, opts) writes json straight from the amf input.
+ * options: dates = 'ms' or 'iso', bytes = 'base64' or 'raw',
+ * cycles = 'null' or 'error', alias = true for "__amf_alias__",
+ * limits as in decode
+ */
+static int
+lua_amf_to_json(lua_State *L)
+{
+    int          ver, flags = 0;
+    size_t       buf_size;
+    const char  *buf, *s;
+    amf_cursor   c;
+    amf_buf     *out;
+    amf_limits   limits;
+    const amf_limits *lim = NULL;
+
+    ver = luaL_checkint(L, 1);
+    check_amf_ver(ver, 1);
+
+    buf = luaL_checklstring(L, 2, &buf_size);
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "dates");
+        s = lua_tostring(L, -1);
+        if (s && strcmp(s, "iso") == 0) flags |= AMF_JSON_DATE_ISO;
+        lua_getfield(L, 3, "bytes");
+        s = lua_tostring(L, -1);
+        if (s && strcmp(s, "raw") == 0) flags |= AMF_JSON_BYTES_RAW;
+        lua_getfield(L, 3, "cycles");
+        s = lua_tostring(L, -1);
+        if (s && strcmp(s, "error") == 0) flags |= AMF_JSON_CYCLE_ERROR;
+        lua_getfield(L, 3, "alias");
+        if (lua_toboolean(L, -1)) flags |= AMF_JSON_ALIAS;
+        lua_getfield(L, 3, "limits");
+        lim = check_limits(L, lua_gettop(L), &limits);
+        lua_pop(L, 5);
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = buf_size;
+    c.limits = lim;
+
+    /* a buffer userdata is collected even if pushing the result raises */
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_json_encode(&c, ver, flags, out);
+    amf_stats_inc(decode_calls);
+
+    return amf_push_transcoded(L, &c, buf_size, out);
+}
+
+/*
+ * to_msgpack(ver, buf, opts) writes messagepack straight from the amf input.
+ * options: dates = 'ms' or 'ext' for the timestamp extension, alias = true
+ * for "__amf_alias__", limits as in decode
+ */
+static int
+lua_amf_to_msgpack(lua_State *L)
+{
+    int          ver, flags = 0;
+    size_t       buf_size;
+    const char  *buf, *s;
+    amf_cursor   c;
+    amf_buf     *out;
+    amf_limits   limits;
+    const amf_limits *lim = NULL;
+
+    ver = luaL_checkint(L, 1);
+    check_amf_ver(ver, 1);
+
+    buf = luaL_checklstring(L, 2, &buf_size);
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "dates");
+        s = lua_tostring(L, -1);
+        if (s && strcmp(s, "ext") == 0) flags |= AMF_MSGPACK_DATE_EXT;
+        lua_getfield(L, 3, "alias");
+        if (lua_toboolean(L, -1)) flags |= AMF_MSGPACK_ALIAS;
+        lua_getfield(L, 3, "limits");
+        lim = check_limits(L, lua_gettop(L), &limits);
+        lua_pop(L, 3);
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = buf_size;
+    c.limits = lim;
+
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_msgpack_encode(&c, ver, flags, out);
+    amf_stats_inc(decode_calls);
+
+    return amf_push_transcoded(L, &c, buf_size, out);
+}
+
+/* from_msgpack(ver, buf) writes the messagepack value at the start of buf as amf */
+static int
+lua_amf_from_msgpack(lua_State *L)
+{
+    int          ver;
+    size_t       buf_size;
+    const char  *buf;
+    amf_cursor   c;
+    amf_buf     *out;
+
+    ver = luaL_checkint(L, 1);
+    check_amf_ver(ver, 1);
+
+    buf = luaL_checklstring(L, 2, &buf_size);
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = buf_size;
+
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_msgpack_decode(&c, ver, out);
+    amf_stats_inc(encode_calls);
+
+    return amf_push_transcoded(L, &c, buf_size, out);
+}
+
+/* opts.limits of the convert options at idx, as in decode */
+static const amf_limits *
+convert_limits(lua_State *L, int idx, amf_limits *tmp)
+{
+    const amf_limits *lim;
+
+    if (lua_isnoneornil(L, idx)) {
+        return NULL;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    lua_getfield(L, idx, "limits");
+    lim = check_limits(L, lua_gettop(L), tmp);
+    lua_pop(L, 1);
+
+    return lim;
+}
+
+/*
+ * convert(from, to, buf, opts) rewrites the amf value of from at the start
+ * of buf as to, opts.limits as in decode
+ */
+static int
+lua_amf_convert(lua_State *L)
+{
+    int          from, to;
+    size_t       buf_size;
+    const char  *buf;
+    amf_cursor   c;
+    amf_buf     *out;
+    amf_limits   limits;
+
+    from = luaL_checkint(L, 1);
+    check_amf_ver(from, 1);
+    to = luaL_checkint(L, 2);
+    check_amf_ver(to, 2);
+
+    buf = luaL_checklstring(L, 3, &buf_size);
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = buf_size;
+    c.limits = convert_limits(L, 4, &limits);
+
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_convert(&c, from, to, out);
+    amf_stats_inc(decode_calls);
+
+    return amf_push_transcoded(L, &c, buf_size, out);
+}
+
+/*
+ * convert_msg(buf, to, opts) rewrites a remoting message with values of
+ * version to, opts.limits as in decode
+ */
+static int
+lua_amf_convert_msg(lua_State *L)
+{
+    int          to;
+    size_t       buf_size;
+    const char  *buf;
+    amf_cursor   c;
+    amf_buf     *out;
+    amf_limits   limits;
+
+    buf = luaL_checklstring(L, 1, &buf_size);
+
+    to = luaL_checkint(L, 2);
+    check_amf_ver(to, 2);
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = buf_size;
+    c.limits = convert_limits(L, 3, &limits);
+
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_convert_msg(&c, to, out);
+    amf_stats_inc(decode_calls);
+
+    return amf_push_transcoded(L, &c, buf_size, out);
+}
+
+/*
+ * open(path) maps an amf file: a sol, or values or remoting messages one
+ * after another. returns the file, or nil and the error.
+ */
+static int
+lua_amf_open(lua_State *L)
+{
+    const char  *path = luaL_checkstring(L, 1);
+    const char  *err;
+    amf_file    *f;
+
+    f = lua_newuserdata(L, sizeof(*f));
+    memset(f, 0, sizeof(*f));
+    luaL_getmetatable(L, "amf_file");
+    lua_setmetatable(L, -2);
+
+    if (amf_file_open(f, path, &err)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, err ? err : strerror(errno));
+        return 2;
+    }
+
+    return 1;
+}
+
+/* a closed file reads as an empty one */
+#define check_file(L) ((amf_file *)luaL_checkudata(L, 1, "amf_file"))
+
+/* sol() returns the name and amf version of a sol, nil for other files */
+static int
+lua_amf_file_sol(lua_State *L)
+{
+    amf_file *f = check_file(L);
+
+    if (f->ver < 0) {
+        return 0;
+    }
+
+    lua_pushlstring(L, f->name, f->name_len);
+    lua_pushinteger(L, f->ver);
+
+    return 2;
+}
+
+/* read(pos, len) returns the bytes at offset pos */
+static int
+lua_amf_file_read(lua_State *L)
+{
+    amf_file   *f = check_file(L);
+    lua_Integer pos = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_optinteger(L, 3, (lua_Integer)f->size);
+
+    luaL_argcheck(L, pos >= 0 && (size_t)pos <= f->size, 2, "invalid file offset");
+    luaL_argcheck(L, len >= 0, 3, "length may not be negative");
+
+    lua_pushlstring(L, f->base + pos, min((size_t)len, f->size - (size_t)pos));
+
+    return 1;
+}
+
+/*
+ * the iterator of values(): pos, value and for a sol the name of the
+ * entry. upvalues: the file, the amf version, the offset and the
+ * reference tables a sol keeps over all its entries.
+ */
+static int
+file_next_value(lua_State *L)
+{
+    amf_file   *f = lua_touserdata(L, lua_upvalueindex(1));
+    int         ver = lua_tointeger(L, lua_upvalueindex(2));
+    size_t      pos = lua_tonumber(L, lua_upvalueindex(3));
+    int         sol = f->ver >= 0;
+    int         refs = 2;
+    uint8_t     pad;
+    amf_cursor  c;
+
+    if (pos >= f->size) {
+        return 0;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.base = f->base;
+    c.p = f->base + pos;
+    c.left = f->size - pos;
+    c.trace = current_trace(L);
+
+    lua_settop(L, 0);
+    lua_pushnumber(L, pos);
+
+    /* the tables of a sol are shared, other values get their own */
+    for (int i = 0; i < (ver == AMF_VER0 ? 1 : 3); i++) {
+        if (sol) {
+            lua_pushvalue(L, lua_upvalueindex(4 + i));
+        } else {
+            lua_newtable(L);
+        }
+    }
+
+    if (sol) {
+        if (ver == AMF_VER0) {
+            const char *name;
+            size_t      len;
+
+            amf_cursor_read_str(&c, &name, &len);
+            if (!c.err) {
+                lua_pushlstring(L, name, len);
+            }
+        } else {
+            amf3_decode_str(L, &c, refs);
+        }
+    }
+
+    if (!c.err) {
+        if (ver == AMF_VER0) {
+            amf0_decode(L, &c, refs);
+        } else {
+            amf3_decode(L, &c, refs, refs + 1, refs + 2);
+        }
+    }
+
+    /* an entry ends in a pad byte */
+    if (sol && !c.err) {
+        amf_cursor_read_u8(&c, &pad);
+    }
+
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, f->size - pos - c.left);
+
+    if (c.err) {
+        amf_stats_error(c.err_msg);
+        return luaL_error(L, "%s at %f", c.err_msg, (double)pos);
+    }
+
+    pos = f->size - c.left;
+    lua_pushnumber(L, pos);
+    lua_replace(L, lua_upvalueindex(3));
+    amf_file_done(f, pos);
+
+    /* pos, value, name */
+    lua_pushvalue(L, 1);
+    if (sol) {
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -4);
+    } else {
+        lua_pushvalue(L, -2);
+    }
+
+    return sol ? 3 : 2;
+}
+
+/* values(ver) iterates the values of the file, of the version of a sol */
+static int
+lua_amf_file_values(lua_State *L)
+{
+    amf_file   *f = check_file(L);
+    int         ver = f->ver;
+
+    if (ver < 0) {
+        ver = luaL_checkint(L, 2);
+        check_amf_ver(ver, 2);
+    }
+
+    lua_settop(L, 1);
+    lua_pushinteger(L, ver);
+    lua_pushnumber(L, f->data);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushcclosure(L, file_next_value, 6);
+
+    return 1;
+}
+
+/* the iterator of messages(): pos and message, upvalues the file and the offset */
+static int
+file_next_msg(lua_State *L)
+{
+    amf_file   *f = lua_touserdata(L, lua_upvalueindex(1));
+    size_t      pos = lua_tonumber(L, lua_upvalueindex(2));
+    amf_cursor  c;
+
+    if (pos >= f->size) {
+        return 0;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.base = f->base;
+    c.p = f->base + pos;
+    c.left = f->size - pos;
+    c.trace = current_trace(L);
+
+    lua_settop(L, 0);
+    lua_pushnumber(L, pos);
+
+    amf_decode_msg(L, &c, f->base, 0);
+
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, f->size - pos - c.left);
+
+    if (c.err) {
+        amf_stats_error(c.err_msg);
+        return luaL_error(L, "%s at %f", c.err_msg ? c.err_msg : "invalid amf message", (double)pos);
+    }
+
+    pos = f->size - c.left;
+    lua_pushnumber(L, pos);
+    lua_replace(L, lua_upvalueindex(2));
+    amf_file_done(f, pos);
+
+    return 2;
+}
+
+/* messages() iterates the remoting messages of the file */
+static int
+lua_amf_file_messages(lua_State *L)
+{
+    amf_file *f = check_file(L);
+
+    lua_settop(L, 1);
+    lua_pushnumber(L, f->data);
+    lua_pushcclosure(L, file_next_msg, 2);
+
+    return 1;
+}
+
+static int
+lua_amf_file_close(lua_State *L)
+{
+    amf_file_close(check_file(L));
+
+    return 0;
+}
+
+static int
+lua_amf_file_len(lua_State *L)
+{
+    lua_pushnumber(L, check_file(L)->size);
+
+    return 1;
+}
+
+static int
+lua_amf_file_tostring(lua_State *L)
+{
+    amf_file *f = check_file(L);
+    lua_pushfstring(L, "<amf file len:%f sol:%d>", (double)f->size, f->ver);
+
+    return 1;
+}
+
+/* an rtmp demultiplexer and the tail of a chunk cut short by the input */
+typedef struct rtmp_demux {
+    amf_rtmp            r;
+    amf_buf             pending;
+} rtmp_demux;
+
+/* rtmp(opts) makes a chunk stream demultiplexer, options: chunk_size, max_message */
+static int
+lua_amf_rtmp(lua_State *L)
+{
+    rtmp_demux *d;
+    int         chunk_size = AMF_RTMP_CHUNK_SIZE;
+    lua_Number  max_message = AMF_RTMP_MAX_MESSAGE;
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+
+        lua_getfield(L, 1, "chunk_size");
+        chunk_size = luaL_optint(L, -1, AMF_RTMP_CHUNK_SIZE);
+        luaL_argcheck(L, chunk_size > 0, 1, "chunk_size must be positive");
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "max_message");
+        max_message = luaL_optnumber(L, -1, AMF_RTMP_MAX_MESSAGE);
+        luaL_argcheck(L, max_message >= 0 && max_message <= 0xffffff, 1,
+                      "max_message must be between 0 and 0xffffff");
+        lua_pop(L, 1);
+    }
+
+    d = lua_newuserdata(L, sizeof(*d));
+    amf_rtmp_init(&d->r);
+    amf_buf_init(&d->pending);
+    d->r.chunk_size = chunk_size;
+    d->r.max_message = (uint32_t)max_message;
+    luaL_getmetatable(L, "amf_rtmp");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/*
+ * a message as a table: type, csid, stream, timestamp and the decoded
+ * values of a command or data message, or the payload of any other. the
+ * amf3 flavours start with a format byte and go on in amf0.
+ */
+static void
+push_rtmp_msg(lua_State *L, const amf_rtmp_msg *msg, amf_trace *trace)
+{
+    amf_cursor  c;
+    int         values, n = 0;
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, msg->type);
+    lua_setfield(L, -2, "type");
+    lua_pushinteger(L, msg->csid);
+    lua_setfield(L, -2, "csid");
+    lua_pushnumber(L, msg->stream_id);
+    lua_setfield(L, -2, "stream");
+    lua_pushnumber(L, msg->timestamp);
+    lua_setfield(L, -2, "timestamp");
+
+    if (msg->type != AMF_RTMP_AMF0_COMMAND && msg->type != AMF_RTMP_AMF0_DATA
+        && msg->type != AMF_RTMP_AMF3_COMMAND && msg->type != AMF_RTMP_AMF3_DATA)
+    {
+        lua_pushlstring(L, msg->payload, msg->len);
+        lua_setfield(L, -2, "payload");
+        return;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = msg->payload;
+    c.left = msg->len;
+    c.trace = trace;
+
+    if ((msg->type == AMF_RTMP_AMF3_COMMAND || msg->type == AMF_RTMP_AMF3_DATA)
+        && c.left > 0 && c.p[0] == 0)
+    {
+        amf_cursor_consume((&c), 1);
+    }
+
+    /* the values of a message share their reference table */
+    values = lua_gettop(L) + 1;
+    lua_newtable(L);
+    lua_newtable(L);
+
+    while (c.left > 0) {
+        amf0_decode(L, &c, values + 1);
+        if (c.err) {
+            amf_stats_error(c.err_msg);
+            lua_settop(L, values + 1);
+            lua_pushstring(L, c.err_msg);
+            lua_setfield(L, values - 1, "err");
+            break;
+        }
+        lua_rawseti(L, values, ++n);
+    }
+
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, msg->len - c.left);
+
+    lua_settop(L, values);
+    lua_setfield(L, values - 1, "values");
+}
+
+/*
+ * feed(data) reads the chunks of data, returns the messages they complete
+ * and nil, or the error that stopped the connection. a chunk cut short is
+ * kept for the next feed.
+ */
+static int
+lua_amf_rtmp_feed(lua_State *L)
+{
+    rtmp_demux     *d = luaL_checkudata(L, 1, "amf_rtmp");
+    amf_trace      *trace = current_trace(L);
+    amf_rtmp_msg    msg;
+    amf_cursor      c;
+    size_t          len;
+    const char     *data = luaL_checklstring(L, 2, &len);
+    int             n = 0;
+
+    /* the input is read in place unless a chunk was cut short before */
+    if (d->pending.len > 0) {
+        amf_buf_append(&d->pending, data, len);
+        data = d->pending.b;
+        len = d->pending.len;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = data;
+    c.left = len;
+
+    lua_settop(L, 2);
+    lua_newtable(L);
+
+    while (c.left > 0) {
+        if (amf_rtmp_read(&d->r, &c, &msg)) {
+            push_rtmp_msg(L, &msg, trace);
+            lua_rawseti(L, 3, ++n);
+        }
+
+        if (c.err) {
+            break;
+        }
+    }
+
+    if (c.err == AMF_CUR_ERR_BADFMT) {
+        amf_stats_error(c.err_msg);
+        lua_pushstring(L, c.err_msg);
+        return 2;
+    }
+
+    if (data == d->pending.b) {
+        memmove(d->pending.b, c.p, c.left);
+        amf_buf_reset(&d->pending);
+        d->pending.len = c.left;
+        d->pending.free -= c.left;
+
+    } else {
+        amf_buf_append(&d->pending, c.p, c.left);
+    }
+
+    lua_pushnil(L);
+
+    return 2;
+}
+
+/* chunk_size(n) sets the incoming chunk size, returns the one in use */
+static int
+lua_amf_rtmp_chunk_size(lua_State *L)
+{
+    rtmp_demux *d = luaL_checkudata(L, 1, "amf_rtmp");
+
+    if (!lua_isnoneornil(L, 2)) {
+        int n = luaL_checkint(L, 2);
+        luaL_argcheck(L, n > 0, 2, "chunk size must be positive");
+        d->r.chunk_size = n;
+    }
+
+    lua_pushinteger(L, d->r.chunk_size);
+
+    return 1;
+}
+
+/* pending() returns how many bytes wait for the rest of their chunk */
+static int
+lua_amf_rtmp_pending(lua_State *L)
+{
+    rtmp_demux *d = luaL_checkudata(L, 1, "amf_rtmp");
+
+    lua_pushinteger(L, d->pending.len);
+
+    return 1;
+}
+
+static int
+lua_amf_rtmp_free(lua_State *L)
+{
+    rtmp_demux *d = luaL_checkudata(L, 1, "amf_rtmp");
+
+    amf_rtmp_free(&d->r);
+    free(d->pending.b);
+    amf_rtmp_init(&d->r);
+    amf_buf_init(&d->pending);
+
+    return 0;
+}
+
+/* packed doubles, the keyframe arrays of an flv */
+typedef struct amf_doubles {
+    uint32_t            n;
+    double              d[];
+} amf_doubles;
+
+static void
+push_doubles(lua_State *L, const double *d, uint32_t n)
+{
+    amf_doubles *a = lua_newuserdata(L, sizeof(*a) + n * sizeof(double));
+
+    a->n = n;
+    memcpy(a->d, d, n * sizeof(double));
+    luaL_getmetatable(L, "amf_doubles");
+    lua_setmetatable(L, -2);
+}
+
+/* a[i] for 1 <= i <= #a, or a method */
+static int
+lua_amf_doubles_index(lua_State *L)
+{
+    amf_doubles *a = luaL_checkudata(L, 1, "amf_doubles");
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = lua_tointeger(L, 2);
+
+        if (i < 1 || i > a->n) {
+            return 0;
+        }
+
+        lua_pushnumber(L, a->d[i - 1]);
+        return 1;
+    }
+
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+
+    return 1;
+}
+
+static int
+lua_amf_doubles_len(lua_State *L)
+{
+    lua_pushinteger(L, ((amf_doubles *)luaL_checkudata(L, 1, "amf_doubles"))->n);
+
+    return 1;
+}
+
+/* find(v) returns the last index whose value is at most v, 0 for none */
+static int
+lua_amf_doubles_find(lua_State *L)
+{
+    amf_doubles    *a = luaL_checkudata(L, 1, "amf_doubles");
+    double          v = luaL_checknumber(L, 2);
+    uint32_t        lo = 0, hi = a->n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (a->d[mid] <= v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    lua_pushinteger(L, lo);
+
+    return 1;
+}
+
+/* ptr() returns the address of the doubles, for ffi.cast("double *", ...) */
+static int
+lua_amf_doubles_ptr(lua_State *L)
+{
+    lua_pushlightuserdata(L, ((amf_doubles *)luaL_checkudata(L, 1, "amf_doubles"))->d);
+
+    return 1;
+}
+
+/* the next tag of an flv, upvalues the buffer and the offset, 0 before the header */
+static int
+flv_next_tag(lua_State *L)
+{
+    size_t          len, pos = lua_tonumber(L, lua_upvalueindex(2));
+    const char     *buf = lua_tolstring(L, lua_upvalueindex(1), &len);
+    amf_flv_tag     tag;
+    amf_cursor      c;
+
+    memset(&c, 0, sizeof(c));
+    c.base = buf;
+    c.p = buf + pos;
+    c.left = len - pos;
+
+    if (pos == 0) {
+        amf_flv_header(&c);
+    }
+
+    if (!amf_flv_next(&c, &tag)) {
+        if (c.err) {
+            return luaL_error(L, "%s at %f", c.err_msg, (double)(len - c.left));
+        }
+        return 0;
+    }
+
+    lua_pushnumber(L, len - c.left);
+    lua_replace(L, lua_upvalueindex(2));
+
+    lua_pushnumber(L, tag.pos);
+    lua_pushinteger(L, tag.type);
+    lua_pushnumber(L, tag.size);
+    lua_pushnumber(L, tag.timestamp);
+
+    return 4;
+}
+
+/*
+ * flv_tags(buf) iterates the tags of an flv: offset, type, data size and
+ * timestamp. the data is at offset + 11.
+ */
+static int
+lua_amf_flv_tags(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+
+    lua_settop(L, 1);
+    lua_pushnumber(L, 0);
+    lua_pushcclosure(L, flv_next_tag, 2);
+
+    return 1;
+}
+
+/* the onMetaData tag of an flv, 0 or the error in the cursor */
+static int
+flv_find_metadata(amf_cursor *c, amf_flv_tag *tag)
+{
+    amf_flv_header(c);
+
+    while (amf_flv_next(c, tag)) {
+        if (tag->type == AMF_FLV_SCRIPT && tag->size >= 13
+            && memcmp(tag->data, "\2\0\12onMetaData", 13) == 0)
+        {
+            return 1;
+        }
+    }
+
+    if (!c->err) {
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "no onMetaData tag";
+    }
+
+    return 0;
+}
+
+/*
+ * flv_keyframes(buf) returns keyframes.times and keyframes.filepositions of
+ * the onMetaData tag as packed doubles and the offset of the tag, or nil
+ * and the error
+ */
+static int
+lua_amf_flv_keyframes(lua_State *L)
+{
+    size_t              len;
+    const char         *buf = luaL_checklstring(L, 1, &len);
+    amf_flv_keyframes   kf;
+    amf_flv_tag         tag;
+    amf_cursor          c;
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = len;
+
+    memset(&kf, 0, sizeof(kf));
+
+    if (flv_find_metadata(&c, &tag)) {
+        memset(&c, 0, sizeof(c));
+        c.p = c.base = tag.data;
+        c.left = tag.size;
+
+        amf_flv_read_keyframes(&c, &kf);
+    }
+
+    amf_stats_inc(decode_calls);
+
+    if (c.err) {
+        amf_stats_error(c.err_msg);
+        amf_flv_keyframes_free(&kf);
+        lua_pushnil(L);
+        lua_pushstring(L, c.err_msg);
+        return 2;
+    }
+
+    amf_stats_add(bytes_in, tag.size);
+
+    push_doubles(L, kf.times, kf.ntimes);
+    push_doubles(L, kf.positions, kf.npositions);
+    lua_pushnumber(L, tag.pos);
+    amf_flv_keyframes_free(&kf);
+
+    return 3;
+}
+
+/*
+ * flv_rewrite(buf, meta) returns the flv with meta as its onMetaData. the
+ * keyframes.filepositions of meta are moved by the change in size of the
+ * tag, as they point behind it.
+ */
+static int
+lua_amf_flv_rewrite(lua_State *L)
+{
+    size_t              len;
+    const char         *buf = luaL_checklstring(L, 1, &len);
+    amf_flv_keyframes   kf;
+    amf_flv_tag         tag;
+    amf_cursor          c;
+    amf_enc             e;
+    amf_buf            *out;
+    size_t              data, size, end;
+    double              delta;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    memset(&c, 0, sizeof(c));
+    c.p = c.base = buf;
+    c.left = len;
+
+    if (!flv_find_metadata(&c, &tag)) {
+        lua_pushnil(L);
+        lua_pushstring(L, c.err_msg);
+        return 2;
+    }
+
+    lua_settop(L, 2);
+
+    /* a buffer userdata is collected when encoding meta raises */
+    out = lua_newuserdata(L, sizeof(*out));
+    amf_buf_init(out);
+    luaL_getmetatable(L, "amf_buffer");
+    lua_setmetatable(L, -2);
+
+    amf_buf_reserve(out, len + 64);
+    amf_buf_append(out, buf, tag.pos + AMF_FLV_TAG_HEADER);
+
+    data = out->len;
+
+    lua_pushliteral(L, "onMetaData");
+    amf_enc_init(&e, out);
+    amf0_encode_scope(L, &e, 0, 4);
+    amf0_encode_scope(L, &e, 0, 2);
+
+    size = out->len - data;
+    if (size > 0xffffff) {
+        return luaL_error(L, "onMetaData too long");
+    }
+
+    /* the new data size and previous tag size */
+    out->b[tag.pos + 1] = (char)(size >> 16);
+    out->b[tag.pos + 2] = (char)(size >> 8);
+    out->b[tag.pos + 3] = (char)size;
+    amf_buf_append_u32(out, (uint32_t)(size + AMF_FLV_TAG_HEADER));
+
+    delta = (double)size - tag.size;
+
+    if (delta != 0) {
+        memset(&c, 0, sizeof(c));
+        c.p = c.base = out->b + data;
+        c.left = size;
+
+        amf_flv_read_keyframes(&c, &kf);
+        if (!c.err && kf.positions_at) {
+            amf_flv_shift_positions(out->b + data, kf.positions_at, kf.npositions, delta);
+        }
+        amf_flv_keyframes_free(&kf);
+    }
+
+    end = tag.pos + AMF_FLV_TAG_HEADER + tag.size + 4;
+    amf_buf_append(out, buf + end, len - end);
+
+    amf_stats_inc(encode_calls);
+    amf_stats_add(bytes_out, out->len);
+
+    lua_pushlstring(L, out->b, out->len);
+
+    return 1;
+}
+
+/*
+ * batch(bufs, opts) re-encodes every string of bufs on a thread pool,
+ * returns the results in order, false for the failed ones, and a table of
+ * their errors. options: threads, from, to, msg
+ */
+static int
+lua_amf_batch(lua_State *L)
+{
+    amf_batch_opts  opts;
+    amf_batch_item *items;
+    size_t          n, failed, bytes_in = 0, bytes_out = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.from = AMF_VER3;
+
+    if (!lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "threads");
+        opts.threads = lua_tointeger(L, -1);
+        lua_getfield(L, 2, "msg");
+        if (lua_toboolean(L, -1)) opts.flags |= AMF_BATCH_MSG;
+        lua_getfield(L, 2, "from");
+        if (!lua_isnil(L, -1)) opts.from = lua_tointeger(L, -1);
+        lua_getfield(L, 2, "to");
+        opts.to = lua_isnil(L, -1) ? opts.from : lua_tointeger(L, -1);
+        lua_pop(L, 4);
+
+    } else {
+        opts.to = opts.from;
+    }
+
+    check_amf_ver(opts.from, 0);
+    check_amf_ver(opts.to, 0);
+
+    /* a userdata, collected if an input is not a string */
+    n = lua_objlen(L, 1);
+    items = lua_newuserdata(L, (n ? n : 1) * sizeof(*items));
+
+    for (size_t i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "batch input %d is not a string", (int)i + 1);
+        }
+        items[i].in = lua_tolstring(L, -1, &items[i].len);
+        bytes_in += items[i].len;
+        lua_pop(L, 1);
+    }
+
+    /* the inputs stay referenced by bufs while the threads read them */
+    failed = amf_batch_run(items, n, &opts);
+
+    lua_createtable(L, n, 0);
+    lua_createtable(L, 0, failed);
+
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].err_msg) {
+            lua_pushstring(L, items[i].err_msg);
+            lua_rawseti(L, -2, i + 1);
+            lua_pushboolean(L, 0);
+
+        } else {
+            lua_pushlstring(L, items[i].out, items[i].out_len);
+            bytes_out += items[i].out_len;
+            free(items[i].out);
+            items[i].out = NULL;
+        }
+
+        lua_rawseti(L, -3, i + 1);
+    }
+
+    amf_stats_add(decode_calls, n);
+    amf_stats_add(encode_calls, n - failed);
+    amf_stats_add(bytes_in, bytes_in);
+    amf_stats_add(bytes_out, bytes_out);
+
+    return 2;
+}
+
+/* parse(ver, buf, pos, end), the document keeps buf in its env */
+static int
+lua_amf_parse(lua_State *L)
+{
+    int          ver;
+    lua_Integer  pos, end;
+    size_t       buf_size;
+    const char  *buf;
+    amf_doc     *doc;
+
+    ver = luaL_checkint(L, 1);
+    check_amf_ver(ver, 1);
+
+    buf = luaL_checklstring(L, 2, &buf_size);
+
+    pos = luaL_optinteger(L, 3, 0);
+    luaL_argcheck(L, pos >= 0, 3,
+                  "input offset may not be negative");
+
+    end = luaL_optinteger(L, 4, (lua_Integer)buf_size);
+    luaL_argcheck(L, end >= pos && (size_t)pos <= buf_size, 4, "input buf overflow");
+
+    if ((size_t)end < buf_size) {
+        buf_size = (size_t)end;
+    }
+
+    doc = lua_newuserdata(L, sizeof(*doc));
+    amf_doc_init(doc);
+    luaL_getmetatable(L, "amf_doc");
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    amf_dom_decode(doc, ver, buf + pos, buf_size - pos);
+
+    amf_stats_inc(decode_calls);
+    amf_stats_add(bytes_in, doc->used);
+
+    if (doc->err) {
+        amf_stats_error(doc->err_msg);
+        lua_pushnil(L);
+        lua_pushstring(L, doc->err_msg);
+
+    } else {
+        lua_pushnil(L);
+    }
+
+    lua_pushinteger(L, pos + doc->used);
+
+    return 3;
+}
+
+static void push_dom_value(lua_State *L, const amf_dom_value *v, int memo);
+
+static void
+push_dom_pairs(lua_State *L, const amf_dom_pair *pairs, uint32_t n, int memo)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        lua_pushlstring(L, pairs[i].key.p, pairs[i].key.len);
+        push_dom_value(L, pairs[i].value, memo);
+        lua_rawset(L, -3);
+    }
+}
+
+/*
+ * the same tables decode builds. the memo table maps values already
+ * pushed to their table, for shared and cyclic values.
+ */
+static void
+push_dom_value(lua_State *L, const amf_dom_value *v, int memo)
+{
+    const amf_dom_traits *t;
+
+    switch (v->type) {
+    case AMF_DOM_UNDEFINED:
+    case AMF_DOM_NULL:
+        lua_pushnil(L);
+        return;
+
+    case AMF_DOM_FALSE:
+    case AMF_DOM_TRUE:
+        lua_pushboolean(L, v->type == AMF_DOM_TRUE);
+        return;
+
+    case AMF_DOM_INT:
+        lua_pushinteger(L, v->u.i);
+        return;
+
+    case AMF_DOM_DOUBLE:
+    case AMF_DOM_DATE:
+        lua_pushnumber(L, v->u.d);
+        return;
+
+    case AMF_DOM_STRING:
+    case AMF_DOM_XMLDOC:
+    case AMF_DOM_XML:
+    case AMF_DOM_BYTEARRAY:
+        lua_pushlstring(L, v->u.s.p, v->u.s.len);
+        return;
+    }
+
+    lua_pushlightuserdata(L, (void *)v);
+    lua_rawget(L, memo);
+    if (!lua_isnil(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+
+    luaL_checkstack(L, 6, "nested too deep");
+
+    if (v->type == AMF_DOM_ARRAY) {
+        lua_createtable(L, v->u.array.len, v->u.array.nassoc);
+
+    } else {
+        lua_createtable(L, 0, v->u.object.traits->nmembers + v->u.object.ndynamic);
+    }
+
+    lua_pushlightuserdata(L, (void *)v);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, memo);
+
+    if (v->type == AMF_DOM_ARRAY) {
+        for (uint32_t i = 0; i < v->u.array.len; i++) {
+            push_dom_value(L, v->u.array.items[i], memo);
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        push_dom_pairs(L, v->u.array.assoc, v->u.array.nassoc, memo);
+        return;
+    }
+
+    t = v->u.object.traits;
+
+    if (t->alias.len) {
+        lua_pushliteral(L, "__amf_alias__");
+        lua_pushlstring(L, t->alias.p, t->alias.len);
+        lua_rawset(L, -3);
+    }
+
+    for (uint32_t i = 0; i < t->nmembers; i++) {
+        lua_pushlstring(L, t->members[i].p, t->members[i].len);
+        push_dom_value(L, v->u.object.sealed[i], memo);
+        lua_rawset(L, -3);
+    }
+
+    push_dom_pairs(L, v->u.object.dynamic, v->u.object.ndynamic, memo);
+}
+
+static amf_doc *
+check_doc(lua_State *L)
+{
+    amf_doc *doc = luaL_checkudata(L, 1, "amf_doc");
+
+    if (doc->root == NULL) {
+        luaL_error(L, "document holds no value");
+    }
+
+    return doc;
+}
+
+static int
+lua_amf_doc_value(lua_State *L)
+{
+    amf_doc *doc = check_doc(L);
+
+    lua_settop(L, 1);
+    lua_newtable(L);
+    push_dom_value(L, doc->root, 2);
+
+    return 1;
+}
+
+static int
+lua_amf_doc_encode(lua_State *L)
+{
+    amf_doc    *doc = check_doc(L);
+    int         ver = luaL_checkint(L, 2);
+    const char *err_msg = NULL;
+    amf_buf     buf;
+
+    check_amf_ver(ver, 2);
+
+    amf_buf_init(&buf);
+
+    if (amf_dom_encode(&buf, ver, doc->root, &err_msg)) {
+        free(buf.b);
+        return luaL_error(L, "%s", err_msg);
+    }
+
+    amf_stats_inc(encode_calls);
+    amf_stats_add(bytes_out, buf.len);
+
+    lua_pushlstring(L, buf.b, buf.len);
+    free(buf.b);
+
+    return 1;
+}
+
+static int
+lua_amf_doc_free(lua_State *L)
+{
+    amf_doc *doc = luaL_checkudata(L, 1, "amf_doc");
+
+    amf_doc_free(doc);
+
+    return 0;
+}
+
+static int
+lua_amf_doc_tostring(lua_State *L)
+{
+    amf_doc *doc = luaL_checkudata(L, 1, "amf_doc");
+    lua_pushfstring(L, "<amf doc len:%d arena:%d>",
+                    (int)doc->used, (int)doc->arena.total);
+
+    return 1;
+}
+
+static int
+lua_amf_new_buffer(lua_State *L)
+{
+    push_buf(L);
+
+    return 1;
+}
+
+static int
+lua_amf_buffer_free(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+
+    /* the amf_buf itself is the userdata block */
+    free(b->b);
+    b->b = NULL;
+
+    return 0;
+}
+
+static int
+lua_amf_buffer_write_ushort(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    unsigned short s = (unsigned short)luaL_checkint(L, 2);
+
+    amf_buf_append_u16(b, s);
+
+    return 0;
+}
+
+static int
+lua_amf_buffer_raw_string(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    lua_pushlstring(L, b->b, b->len);
+    return 1;
+}
+
+static int
+lua_amf_buffer_tostring(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    lua_pushfstring(L, "<buffer len:%d free:%d>", (int)b->len, (int)b->free);
+
+    return 1;
+}
+
+static int
+lua_amf_buffer_write_int32(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    int32_t i = luaL_checkint(L, 2);
+
+    amf_buf_append_u32(b, i);
+
+    return 0;
+}
+
+static int
+lua_amf_buffer_write_str(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    size_t len;
+    const char *str = luaL_checklstring(L, 2, &len);
+
+    printf("string len: %d\n", (uint16_t)len);
+    amf_buf_append_u16(b, (uint16_t)len);
+    amf_buf_append(b, str, len);
+
+    return 0;
+}
+
+static int
+lua_amf_buffer_write_uchar(lua_State *L)
+{
+    amf_buf *b = luaL_checkudata(L, 1, "amf_buffer");
+    unsigned char c = (unsigned char)luaL_checkint(L, 2);
+
+    amf_buf_append_char(b, c);
+
+    return 0;
+}
+
+/*
+ * externalizable classes without a native reader are handed to the lua
+ * function registered for their alias, which reads the class body from an
+ * input object valid only during the call
+ */
+typedef struct amf_ext_input {
+    amf_cursor *c;
+} amf_ext_input;
+
+static amf_ext_input *
+check_ext_input(lua_State *L)
+{
+    amf_ext_input *in = luaL_checkudata(L, 1, "amf_ext_input");
+    if (in->c == NULL) {
+        luaL_error(L, "externalizable input used outside of its reader");
+    }
+
+    return in;
+}
+
+#define ext_input_need(L, c, len) do {                                  \
+    if ((c)->left < (len)) {                                            \
+        (c)->err = AMF_CUR_ERR_EOF;                                     \
+        (c)->err_msg = "eof";                                           \
+        return luaL_error(L, "eof");                                    \
+    }                                                                   \
+} while(0)
+
+static int
+lua_amf_ext_input_read_object(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+
+    /* the ref tables of the decode in progress */
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_rawgeti(L, -3, 3);
+
+    int top = lua_gettop(L);
+    amf3_decode(L, in->c, top - 2, top - 1, top);
+    if (in->c->err) {
+        return luaL_error(L, "%s", in->c->err_msg);
+    }
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_uchar(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    ext_input_need(L, in->c, 1);
+
+    lua_pushinteger(L, in->c->p[0] & 0xff);
+    amf_cursor_consume(in->c, 1);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_ushort(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    uint16_t u;
+    ext_input_need(L, in->c, 2);
+
+    amf_cursor_read_u16(in->c, &u);
+    lua_pushinteger(L, u);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_int32(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    uint32_t u;
+    ext_input_need(L, in->c, 4);
+
+    amf_cursor_read_u32(in->c, &u);
+    lua_pushnumber(L, (int32_t)u);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_uint32(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    uint32_t u;
+    ext_input_need(L, in->c, 4);
+
+    amf_cursor_read_u32(in->c, &u);
+    lua_pushnumber(L, u);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_double(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    double d;
+    ext_input_need(L, in->c, 8);
+
+    memcpy(&d, in->c->p, 8);
+    reverse_if_little_endian(&d, 8);
+    amf_cursor_consume(in->c, 8);
+    lua_pushnumber(L, d);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_float(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    float f;
+    ext_input_need(L, in->c, 4);
+
+    memcpy(&f, in->c->p, 4);
+    reverse_if_little_endian(&f, 4);
+    amf_cursor_consume(in->c, 4);
+    lua_pushnumber(L, f);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_str(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    const char *s;
+    size_t len;
+
+    amf_cursor_read_str(in->c, &s, &len);
+    if (in->c->err) {
+        return luaL_error(L, "%s", in->c->err_msg);
+    }
+    lua_pushlstring(L, s, len);
+
+    return 1;
+}
+
+static int
+lua_amf_ext_input_read_bytes(lua_State *L)
+{
+    amf_ext_input *in = check_ext_input(L);
+    size_t len = (size_t)luaL_checkint(L, 2);
+    ext_input_need(L, in->c, len);
+
+    lua_pushlstring(L, in->c->p, len);
+    amf_cursor_consume(in->c, len);
+
+    return 1;
+}
+
+static void
+lua_amf_read_external(lua_State *L, amf_cursor *c, const char *alias,
+                      int sidx, int oidx, int tidx)
+{
+    amf_ext_input *in;
+    int            obj = lua_gettop(L);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_externalizable");
+    lua_getfield(L, -1, alias);
+    lua_remove(L, -2);
+
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        c->err = AMF_CUR_ERR_BADFMT;
+        c->err_msg = "unsupported externalizable class";
+        return;
+    }
+
+    in = lua_newuserdata(L, sizeof(*in));
+    in->c = c;
+    luaL_getmetatable(L, "amf_ext_input");
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 3, 0);
+    lua_pushvalue(L, sidx);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, oidx);
+    lua_rawseti(L, -2, 2);
+    lua_pushvalue(L, tidx);
+    lua_rawseti(L, -2, 3);
+    lua_setfenv(L, -2);
+
+    /* handler(input, alias, obj) */
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    lua_pushstring(L, alias);
+    lua_pushvalue(L, obj);
+
+    int rc = lua_pcall(L, 3, 1, 0);
+
+    /* the input may outlive the call, make it unusable */
+    in->c = NULL;
+    lua_remove(L, -2);
+
+    if (rc != 0) {
+        if (c->err) {
+            lua_pop(L, 1);
+            return;
+        }
+        lua_error(L);
+    }
+}
+
+static int
+lua_amf_register_externalizable(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    }
+    lua_settop(L, 2);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "amf_externalizable");
+    lua_insert(L, 1);
+    lua_rawset(L, 1);
+
+    return 0;
+}
+
+#define lib_func(name) { #name, lua_amf_##name }
+
+const struct luaL_Reg amf_lib[] = {
+    lib_func(encode),
+    lib_func(decode),
+    lib_func(decode_msg),
+    lib_func(peek_msg),
+    lib_func(msg_writer),
+    lib_func(encoder),
+    lib_func(stats),
+    lib_func(reset_stats),
+    lib_func(latency),
+    lib_func(trace),
+    lib_func(trace_dump),
+    lib_func(encode_msg),
+    lib_func(new_buffer),
+    lib_func(register_externalizable),
+    lib_func(slot),
+    lib_func(template),
+    lib_func(template_msg),
+    lib_func(parse),
+    lib_func(batch),
+    lib_func(to_json),
+    lib_func(to_msgpack),
+    lib_func(from_msgpack),
+    lib_func(convert),
+    lib_func(convert_msg),
+    lib_func(open),
+    lib_func(rtmp),
+    lib_func(flv_tags),
+    lib_func(flv_keyframes),
+    lib_func(flv_rewrite),
+    lib_func(limits),
+    { NULL, NULL }
+};
+
+const struct luaL_Reg amf_buf_lib[] = {
+    { "write_uchar",  lua_amf_buffer_write_uchar },
+    { "write_ushort", lua_amf_buffer_write_ushort },
+    { "write_int32",  lua_amf_buffer_write_int32 },
+    { "write_str",    lua_amf_buffer_write_str },
+    { "raw_string",   lua_amf_buffer_raw_string },
+    { "__tostring",   lua_amf_buffer_tostring },
+    { "__gc",         lua_amf_buffer_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_msg_writer_lib[] = {
+    { "begin",        lua_amf_msg_writer_begin },
+    { "body",         lua_amf_msg_writer_body },
+    { "done",         lua_amf_msg_writer_done },
+    { "__gc",         lua_amf_msg_writer_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_encoder_lib[] = {
+    { "encode",       lua_amf_encoder_encode },
+    { "encode_msg",   lua_amf_encoder_encode_msg },
+    { "__gc",         lua_amf_encoder_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_limits_lib[] = {
+    { "__tostring",   lua_amf_limits_tostring },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_slot_lib[] = {
+    { "__tostring",   lua_amf_slot_tostring },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_template_lib[] = {
+    { "render",       lua_amf_template_render },
+    { "__tostring",   lua_amf_template_tostring },
+    { "__gc",         lua_amf_template_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_doc_lib[] = {
+    { "value",        lua_amf_doc_value },
+    { "encode",       lua_amf_doc_encode },
+    { "__tostring",   lua_amf_doc_tostring },
+    { "__gc",         lua_amf_doc_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_file_lib[] = {
+    { "sol",          lua_amf_file_sol },
+    { "values",       lua_amf_file_values },
+    { "messages",     lua_amf_file_messages },
+    { "read",         lua_amf_file_read },
+    { "close",        lua_amf_file_close },
+    { "__len",        lua_amf_file_len },
+    { "__tostring",   lua_amf_file_tostring },
+    { "__gc",         lua_amf_file_close },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_rtmp_lib[] = {
+    { "feed",         lua_amf_rtmp_feed },
+    { "chunk_size",   lua_amf_rtmp_chunk_size },
+    { "pending",      lua_amf_rtmp_pending },
+    { "__gc",         lua_amf_rtmp_free },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_doubles_lib[] = {
+    { "find",         lua_amf_doubles_find },
+    { "ptr",          lua_amf_doubles_ptr },
+    { "__index",      lua_amf_doubles_index },
+    { "__len",        lua_amf_doubles_len },
+    { NULL, NULL}
+};
+
+const struct luaL_Reg amf_ext_input_lib[] = {
+    { "read_object",  lua_amf_ext_input_read_object },
+    { "read_uchar",   lua_amf_ext_input_read_uchar },
+    { "read_ushort",  lua_amf_ext_input_read_ushort },
+    { "read_int32",   lua_amf_ext_input_read_int32 },
+    { "read_uint32",  lua_amf_ext_input_read_uint32 },
+    { "read_double",  lua_amf_ext_input_read_double },
+    { "read_float",   lua_amf_ext_input_read_float },
+    { "read_str",     lua_amf_ext_input_read_str },
+    { "read_bytes",   lua_amf_ext_input_read_bytes },
+    { NULL, NULL}
+};
+
+
+LUALIB_API int
+luaopen_amf_codec(lua_State* L)
+{
+    luaL_newmetatable(L, "amf_buffer");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_buf_lib, 0);
+
+    luaL_newmetatable(L, "amf_msg_writer");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_msg_writer_lib, 0);
+
+    luaL_newmetatable(L, "amf_encoder");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_encoder_lib, 0);
+
+    luaL_newmetatable(L, "amf_limits");
+    luaL_openlib(L, NULL, amf_limits_lib, 0);
+
+    luaL_newmetatable(L, "amf_slot");
+    luaL_openlib(L, NULL, amf_slot_lib, 0);
+
+    luaL_newmetatable(L, "amf_template");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_template_lib, 0);
+
+    luaL_newmetatable(L, "amf_doc");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_doc_lib, 0);
+
+    luaL_newmetatable(L, "amf_file");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_file_lib, 0);
+
+    luaL_newmetatable(L, "amf_rtmp");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_rtmp_lib, 0);
+
+    luaL_newmetatable(L, "amf_doubles");
+    luaL_openlib(L, NULL, amf_doubles_lib, 0);
+
+    luaL_newmetatable(L, "amf_ext_input");
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, amf_ext_input_lib, 0);
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "amf_externalizable");
+    amf3_register_externalizable(L, NULL, lua_amf_read_external);
+
+    /* the strings of integer keys, kept for the amf3 encoder */
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "amf_key_strings");
 
     luaL_register(L, "amf_codec", amf_lib);
 
@@ -25,6 +25,15 @@ local function assert_decoded(ver, bin, obj)
     assert.equals(#fixture, pos)
 end
 
+-- n objects that each hold the one before twice, small with references and 2^n large without
+local function shared_chain(ver, n)
+    local v = {x=1}
+    for _ = 1, n do
+        v = {a=v, b=v}
+    end
+    return amf.encode(ver, v)
+end
+
 ---- boolean
 describe('amf0', function()
     it('should decode boolean', function() 
@@ -62,6 +71,17 @@ describe('amf0', function()
         assert_decoded(0, 'amf0-strict-array.bin', {'a','b', 'c','d'})
     end)
 
+    ---- lengths with the high bit set in a byte
+    it('should decode long strings and arrays', function()
+        local gen = require 'bench.gen'
+        local arr = gen.value('array', 1, 200)
+        local str = string.rep('x', 0x80ff)
+        local ret, err = decode_amf(0, amf.encode(0, {str, arr}))
+        assert.equals(nil, err)
+        assert.equals(#str, #ret[1])
+        assert_eql(arr, ret[2])
+    end)
+
     ---- anonymous objects
     it('should decode orinal array', function()
         assert_decoded(0, 'amf0-object.bin', {foo='baz'; bar=3.14})
@@ -180,6 +200,54 @@ describe('amf3', function()
         assert_decoded(3, 'amf3-byte-array-ref.bin', {'ASDF', 'ASDF'})
     end)
 
+    it("should unwrap flex array collections", function()
+        assert_decoded(3, 'amf3-array-collection.bin', {'foo', 'bar'})
+
+        local ret, err = decode_amf(3, object_fixture('amf3-complex-array-collection.bin'))
+        assert.equals(nil, err)
+        local objs = {{foo='bar'}, {foo='asdf'}}
+        assert_eql({{'foo', 'bar'}, objs, objs}, ret)
+        assert.equals(ret[2], ret[3])
+    end)
+
+    it("should read externalizable classes with a registered reader", function()
+        local ret, err = decode_amf(3, object_fixture('amf3-externalizable.bin'))
+        assert.equals(nil, ret)
+        assert.equals('unsupported externalizable class', err)
+
+        amf.register_externalizable('ExternalizableTest', function(input, alias)
+            return {input:read_double(), input:read_double()}
+        end)
+        assert_decoded(3, 'amf3-externalizable.bin', {{5, 7}, {13, 5}})
+        amf.register_externalizable('ExternalizableTest', nil)
+    end)
+
+    it("should keep the cycles through externalizable objects", function()
+        local ac = '\10\7\67flex.messaging.io.ArrayCollection'
+        local ret = decode_amf(3, ac .. '\9\3\1\10\0')
+        assert.equals(ret, ret[1])
+
+        amf.register_externalizable('Ext', function(input, alias, obj)
+            obj.self = input:read_object()
+            return obj
+        end)
+        ret = decode_amf(3, '\10\7\7Ext\10\0')
+        assert.equals(ret, ret.self)
+        amf.register_externalizable('Ext', nil)
+    end)
+
+    it("should read blazeds small messages", function()
+        -- the body value of the remoting response starts at byte 27
+        local ret, err = decode_amf(0, request_fixture('blaze-response.bin'):sub(27))
+        assert.equals(nil, err)
+        assert.equals('DSK', ret.__amf_alias__)
+        assert.equals('8817EEF6-BE0D-8462-17F1-38B6A43414DE', ret.messageId)
+        assert.equals('8814A067-FE0D-3A9C-A274-4AAED9BD7B0B', ret.clientId)
+        assert.equals('7BB01BC0-C836-8F4D-7B47-241543357109', ret.correlationId)
+        assert.equals(1306275431838, ret.timestamp)
+        assert.equals("<env:Envelope", ret.body:sub(1, 13))
+    end)
+
     it("should deserialize a deep object graph with circular references", function() 
         local output, err, pos = amf.decode(3, object_fixture('amf3-graph-member.bin'))
         assert.equals(output, output.children[1].parent)
@@ -187,3 +255,716 @@ describe('amf3', function()
         assert.equals(2, #output.children)
     end)
 end)
+
+describe('remoting', function()
+    it('should decode messages', function()
+        local msg, err = amf.decode_msg(request_fixture('commandMessage.bin'))
+        assert.equals(nil, err)
+        assert.equals(3, msg[1])
+        assert.equals(0, #msg[2])
+        assert.equals(1, #msg[3])
+        assert.equals('null', msg[3][1][1])
+        assert.equals('/1', msg[3][1][2])
+        assert.equals(5, msg[3][1][3][1].operation)
+
+        msg, err = amf.decode_msg(request_fixture('multiple-simple-request.bin'))
+        assert.equals(nil, err)
+        assert.equals(2, #msg[3])
+        assert.equals('/2', msg[3][2][2])
+    end)
+
+    it('should leave lazy bodies undecoded', function()
+        for _, bin in ipairs({'commandMessage.bin', 'multiple-simple-request.bin'}) do
+            local buf = request_fixture(bin)
+            local full = amf.decode_msg(buf)
+            local msg, err = amf.decode_msg(buf, 0, #buf, {lazy_bodies=true})
+            assert.equals(nil, err)
+
+            for i, body in ipairs(msg[3]) do
+                assert.equals(nil, body[3])
+                assert.equals(full[3][i][1], body[1])
+
+                local value, err, pos = amf.decode(0, buf, body.offset, body.offset + body.length)
+                assert.equals(nil, err)
+                assert.equals(body.offset + body.length, pos)
+                assert.same(full[3][i][3], value)
+            end
+        end
+    end)
+
+    it('should hold the decode limits when walking past bodies', function()
+        -- a body of unknown length is walked past value by value
+        local function unsized(body)
+            return amf.encode_msg({0, {}, {{'t', 'r', 0}}}):sub(1, 12) .. '\255\255\255\255' .. body
+        end
+
+        local buf = unsized(amf.encode(0, {s=('x'):rep(100)}))
+        for _, opts in ipairs({{lazy_bodies=true}, {}}) do
+            opts.limits = {string=10}
+            local f = opts.lazy_bodies and amf.decode_msg or amf.peek_msg
+            local msg, err = f(buf, 0, #buf, opts)
+            assert.equals(nil, msg)
+            assert.equals('string too long', err)
+        end
+
+        -- the walk recurses, it stops at the default depth whatever the limits say
+        buf = unsized(('\10\0\0\0\1'):rep(3000) .. '\5')
+        local msg, err = amf.peek_msg(buf, 0, #buf, {limits={depth=5000}})
+        assert.equals(nil, msg)
+        assert.equals('nested too deep', err)
+    end)
+end)
+
+describe('peek', function()
+    it('should locate bodies without decoding them', function()
+        for _, bin in ipairs({'commandMessage.bin', 'flex-request.bin', 'remotingMessage.bin',
+                              'blaze-response.bin', 'acknowledge-response.bin',
+                              'multiple-simple-request.bin', 'amf0-error-response.bin'}) do
+            local buf = request_fixture(bin)
+            local full = amf.decode_msg(buf)
+            local msg, err = amf.peek_msg(buf)
+            assert.equals(nil, err)
+            assert.equals(full[1], msg[1])
+            assert.equals(#full[3], #msg[3])
+
+            local last = msg[3][#msg[3]]
+            assert.equals(#buf, last.offset + last.length)
+
+            for i, body in ipairs(msg[3]) do
+                assert.equals(full[3][i][1], body[1])
+                assert.equals(full[3][i][2], body[2])
+                assert.equals(nil, body[3])
+
+                local value = amf.decode(0, buf, body.offset, body.offset + body.length)
+                assert.same(full[3][i][3], value)
+            end
+        end
+    end)
+end)
+
+describe('parse', function()
+    it('should build the values decode does', function()
+        for _, bin in ipairs({'amf0-object.bin', 'amf0-ref-test.bin', 'amf0-strict-array.bin',
+                              'amf0-ecma-ordinal-array.bin', 'amf3-string-ref.bin',
+                              'amf3-object-ref.bin', 'amf3-trait-ref.bin', 'amf3-array-ref.bin',
+                              'amf3-byte-array-ref.bin', 'amf3-typed-object.bin',
+                              'amf3-complex-array-collection.bin', 'amf3-dynamic-object.bin'}) do
+            local ver = bin:find('amf0') and 0 or 3
+            local buf = object_fixture(bin)
+            local doc, err, pos = amf.parse(ver, buf)
+            assert.equals(nil, err)
+            assert.equals(#buf, pos)
+            assert_eql(doc:value(), decode_amf(ver, buf))
+        end
+    end)
+
+    it('should read what decode does not', function()
+        local doc = amf.parse(0, object_fixture('amf0-xml-doc.bin'))
+        assert.equals('<parent><child prop="test" /></parent>', doc:value())
+
+        doc = amf.parse(3, object_fixture('amf3-associative-array.bin'))
+        assert.equals('bar', doc:value().foo)
+    end)
+
+    it('should encode back with the references', function()
+        local buf = object_fixture('amf3-graph-member.bin')
+        local doc = amf.parse(3, buf)
+        assert.equals(buf, doc:encode(3))
+
+        local output = amf.parse(0, doc:encode(0)):value()
+        assert.equals(output, output.children[1].parent)
+        assert.equals(2, #output.children)
+    end)
+
+    it('should fail on a truncated input', function()
+        local buf = object_fixture('amf3-dynamic-object.bin')
+        local doc, err, pos = amf.parse(3, buf, 0, #buf - 1)
+        assert.equals(nil, doc)
+        assert.equals('eof', err)
+    end)
+
+    it('should reject offsets outside the input', function()
+        local buf = object_fixture('amf3-dynamic-object.bin')
+        assert.equals(false, pcall(amf.parse, 3, buf, -1))
+        assert.equals(false, pcall(amf.parse, 3, buf, #buf + 1))
+        assert.equals(false, pcall(amf.parse, 3, buf, 2, 1))
+        assert.equals(false, pcall(amf.parse, 3, buf, 0, -1))
+    end)
+end)
+
+describe('to_json', function()
+    it('should write references out again', function()
+        local json, err, pos = amf.to_json(3, object_fixture('amf3-object-ref.bin'))
+        assert.equals(nil, err)
+        assert.equals('[[{"foo":"bar"},{"foo":"bar"}],"bar",[{"foo":"bar"},{"foo":"bar"}]]', json)
+    end)
+
+    it('should break cycles', function()
+        local buf = object_fixture('amf3-graph-member.bin')
+        assert.equals('{"children":[{"parent":null},{"parent":null}]}', amf.to_json(3, buf))
+
+        local ret, err = amf.to_json(3, buf, {cycles='error'})
+        assert.equals(nil, ret)
+        assert.equals('cyclic reference', err)
+    end)
+
+    it('should take the options', function()
+        assert.equals('["1970-01-01T00:00:00.000Z","1970-01-01T00:00:00.000Z"]',
+                      amf.to_json(3, object_fixture('amf3-date-ref.bin'), {dates='iso'}))
+
+        local buf = object_fixture('amf3-byte-array-ref.bin')
+        assert.equals('["QVNERg==","QVNERg=="]', amf.to_json(3, buf))
+        assert.equals('["ASDF","ASDF"]', amf.to_json(3, buf, {bytes='raw'}))
+
+        assert.equals('{"__amf_alias__":"org.amf.ASClass","baz":null,"foo":"bar"}',
+                      amf.to_json(0, object_fixture('amf0-typed-object.bin'), {alias=true}))
+    end)
+
+    it('should escape what is not utf-8', function()
+        assert.equals('"\195\169\\u00ff\\u00e9"', amf.to_json(0, '\2\0\4\195\169\255\233'))
+        assert.equals('"\\u00c3\\u00a9"', amf.to_json(3, '\12\5\195\169', {bytes='raw'}))
+    end)
+
+    it('should stop copies at the alloc limit', function()
+        local buf = shared_chain(3, 40)
+        local ret, err = amf.to_json(3, buf, {limits={alloc=65536}})
+        assert.equals(nil, ret)
+        assert.equals('allocation limit exceeded', err)
+        assert.equals(true, #amf.to_json(3, shared_chain(3, 8), {limits={alloc=65536}}) > 0)
+    end)
+end)
+
+describe('msgpack', function()
+    it('should transcode values both ways', function()
+        for _, bin in ipairs({'amf0-object.bin', 'amf0-ref-test.bin', 'amf0-strict-array.bin',
+                              'amf3-string-ref.bin', 'amf3-object-ref.bin', 'amf3-trait-ref.bin',
+                              'amf3-array-ref.bin', 'amf3-typed-object.bin', 'amf3-dynamic-object.bin',
+                              'amf3-complex-array-collection.bin', 'amf3-large-min.bin'}) do
+            local ver = bin:find('amf0') and 0 or 3
+            local buf = object_fixture(bin)
+            local mp, err, pos = amf.to_msgpack(ver, buf)
+            assert.equals(nil, err)
+            assert.equals(#buf, pos)
+
+            local back
+            back, err, pos = amf.from_msgpack(ver, mp)
+            assert.equals(nil, err)
+            assert.equals(#mp, pos)
+            assert_eql(decode_amf(ver, back), decode_amf(ver, buf))
+        end
+    end)
+
+    it('should write messagepack', function()
+        assert.equals('\146\145\129\163foo\163bar\163bar',
+                      amf.to_msgpack(3, amf.encode(3, {{{foo='bar'}}, 'bar'})))
+        assert.equals('\146\214\255\0\0\0\0\214\255\0\0\0\0',
+                      amf.to_msgpack(3, object_fixture('amf3-date-ref.bin'), {dates='ext'}))
+        assert.equals('\146\196\4ASDF\196\4ASDF', amf.to_msgpack(3, object_fixture('amf3-byte-array-ref.bin')))
+
+        local ret, err = amf.to_msgpack(3, object_fixture('amf3-graph-member.bin'))
+        assert.equals(nil, ret)
+        assert.equals('cyclic reference', err)
+    end)
+
+    it('should read messagepack', function()
+        -- {"__amf_alias__": "org.amf.ASClass", "foo": "bar", 1: 2}
+        local mp = '\131\173__amf_alias__\175org.amf.ASClass\163foo\163bar\1\2'
+        local output = decode_amf(0, (amf.from_msgpack(0, mp)))
+        assert.equals('org.amf.ASClass', output.__amf_alias__)
+        assert.equals('bar', output.foo)
+        assert.equals(2, output['1'])
+
+        -- a uint 64 and a float 32 in an array 16
+        output = decode_amf(3, (amf.from_msgpack(3, '\220\0\2\207\0\0\0\1\0\0\0\0\202\63\192\0\0')))
+        assert.same({4294967296, 1.5}, output)
+
+        local ret, err = amf.from_msgpack(3, '\129\192\1')
+        assert.equals(nil, ret)
+        assert.equals('unsupported map key', err)
+    end)
+
+    it('should stop copies at the alloc limit', function()
+        for _, ver in ipairs({0, 3}) do
+            local ret, err = amf.to_msgpack(ver, shared_chain(ver, 40), {limits={alloc=65536}})
+            assert.equals(nil, ret)
+            assert.equals('allocation limit exceeded', err)
+        end
+    end)
+end)
+
+describe('convert', function()
+    it('should convert values both ways', function()
+        for _, bin in ipairs({'amf0-object.bin', 'amf0-ref-test.bin', 'amf0-strict-array.bin',
+                              'amf3-string-ref.bin', 'amf3-object-ref.bin', 'amf3-trait-ref.bin',
+                              'amf3-array-ref.bin', 'amf3-typed-object.bin', 'amf3-dynamic-object.bin',
+                              'amf3-complex-array-collection.bin', 'amf3-large-min.bin'}) do
+            local ver = bin:find('amf0') and 0 or 3
+            local buf = object_fixture(bin)
+            local out, err, pos = amf.convert(ver, 3 - ver, buf)
+            assert.equals(nil, err)
+            assert.equals(#buf, pos)
+            assert.equals(amf.to_json(ver, buf), amf.to_json(3 - ver, out))
+
+            local back
+            back, err, pos = amf.convert(3 - ver, ver, out)
+            assert.equals(nil, err)
+            assert.equals(#out, pos)
+            assert.equals(amf.to_json(ver, buf), amf.to_json(ver, back))
+        end
+    end)
+
+    it('should keep references', function()
+        -- amf3 references are the same bytes again
+        for _, bin in ipairs({'amf3-graph-member.bin', 'amf3-object-ref.bin', 'amf3-trait-ref.bin'}) do
+            assert.equals(object_fixture(bin), amf.convert(3, 3, object_fixture(bin)))
+        end
+
+        -- the cycle is an amf0 reference to the first object
+        local graph = decode_amf(0, (amf.convert(3, 0, object_fixture('amf3-graph-member.bin'))))
+        assert.equals(graph, graph.children[1].parent)
+        assert.equals(graph, graph.children[2].parent)
+
+        -- and back the same amf3 object
+        local t = {}
+        t.self = t
+        graph = decode_amf(3, (amf.convert(0, 3, amf.encode(0, {t, t}))))
+        assert.equals(graph[1], graph[2])
+        assert.equals(graph[1], graph[1].self)
+
+        local ret, err = amf.convert(3, 0, object_fixture('amf3-externalizable.bin'))
+        assert.equals(nil, ret)
+        assert.equals('unsupported externalizable class', err)
+    end)
+
+    it('should convert messages', function()
+        for _, bin in ipairs({'simple-request.bin', 'remotingMessage.bin', 'commandMessage.bin',
+                              'amf0-error-response.bin'}) do
+            local buf = request_fixture(bin)
+            local msg = amf.decode_msg(buf)
+            for _, ver in ipairs({0, 3}) do
+                local out, err, pos = amf.convert_msg(buf, ver)
+                assert.equals(nil, err)
+                assert.equals(#buf, pos)
+
+                local converted = amf.decode_msg(out)
+                assert.equals(ver, converted[1])
+                converted[1] = msg[1]
+                -- amf0 decodes the class aliases that amf3 drops
+                if ver == 0 then
+                    assert_eql(converted, msg)
+                else
+                    assert_eql(msg, converted)
+                end
+            end
+        end
+    end)
+
+    it('should stop copies at the alloc limit', function()
+        -- references past the amf0 range are copies, and copies of copies
+        local pad = {}
+        for i = 1, 70000 do
+            pad[i] = {x=1}
+        end
+
+        local opts = {limits=amf.limits{alloc=16 * 2^20}}
+        local buf = amf.encode(3, {pad, decode_amf(3, shared_chain(3, 40))})
+        local ret, err = amf.convert(3, 0, buf, opts)
+        assert.equals(nil, ret)
+        assert.equals('allocation limit exceeded', err)
+
+        buf = amf.encode(3, {pad, decode_amf(3, shared_chain(3, 3))})
+        assert.equals('string', type(amf.convert(3, 0, buf, opts)))
+    end)
+end)
+
+describe('open', function()
+    it('should read sol files', function()
+        for _, bin in ipairs({'amf0-shared-object.sol', 'amf3-shared-object.sol'}) do
+            local f = assert(amf.open('test/fixtures/objects/' .. bin))
+            local name, ver = f:sol()
+            assert.equals('settings', name)
+            assert.equals(bin:find('amf0') and 0 or 3, ver)
+
+            local entries = {}
+            for pos, value, key in f:values() do
+                entries[#entries + 1] = {pos, key, value}
+            end
+            assert.equals(3, #entries)
+            assert.equals(30, entries[1][1])
+            assert.equals(#f - 7, entries[3][1])
+            assert.same(ver == 0 and {'a', 'b', 'c'} or {'foo', 'bar', 'baz'},
+                        {entries[1][2], entries[2][2], entries[3][2]})
+
+            -- references reach over entries
+            assert.equals(entries[2][3], entries[3][3])
+            f:close()
+            assert.equals(0, #f)
+        end
+    end)
+
+    it('should iterate values and messages', function()
+        local f = amf.open('test/fixtures/objects/amf3-object-ref.bin')
+        for pos, value in f:values(3) do
+            assert.equals(0, pos)
+            assert_eql(decode_amf(3, object_fixture('amf3-object-ref.bin')), value)
+        end
+
+        local path = os.tmpname()
+        local out = io.open(path, 'wb')
+        out:write(request_fixture('simple-request.bin'), request_fixture('multiple-simple-request.bin'))
+        out:close()
+
+        local positions = {}
+        for pos, msg in amf.open(path):messages() do
+            positions[#positions + 1] = pos
+            assert.equals('TestController.test', msg[3][1][1])
+        end
+        os.remove(path)
+        assert.same({0, #request_fixture('simple-request.bin')}, positions)
+
+        local ret, err = amf.open('test/fixtures/objects/none.bin')
+        assert.equals(nil, ret)
+        assert.equals('test/fixtures/objects/none.bin: No such file or directory', err)
+    end)
+
+    it('should refuse negative read offsets and lengths', function()
+        local f = amf.open('test/fixtures/objects/amf3-object-ref.bin')
+        assert.equals(object_fixture('amf3-object-ref.bin'):sub(3, 4), f:read(2, 2))
+        assert.has_error(function() f:read(-1) end)
+        assert.has_error(function() f:read(0, -1) end)
+        f:close()
+    end)
+end)
+
+describe('rtmp', function()
+    local function u24(n)
+        return string.char(math.floor(n / 65536) % 256, math.floor(n / 256) % 256, n % 256)
+    end
+
+    -- a message with a type 0 header, in chunks of size, control messages on stream 0
+    local function chunks(csid, ts, typ, payload, size)
+        local out = {string.char(csid) .. u24(ts) .. u24(#payload) .. string.char(typ, csid == 2 and 0 or 1, 0, 0, 0)}
+        for i = 1, #payload, size do
+            if i > 1 then out[#out + 1] = string.char(0xc0 + csid) end
+            out[#out + 1] = payload:sub(i, i + size - 1)
+        end
+        return table.concat(out)
+    end
+
+    local connect = amf.encode(0, 'connect') .. amf.encode(0, 1) .. amf.encode(0, {app=('live'):rep(50)})
+    local stream = chunks(3, 0, 20, connect, 128) .. chunks(2, 0, 1, '\0\0\16\0', 128)
+                   .. chunks(4, 40, 17, '\0' .. amf.encode(0, 'publish') .. amf.encode(0, 'cam'), 4096)
+                   .. chunks(5, 80, 9, 'video', 4096)
+
+    it('should demultiplex messages', function()
+        for _, step in ipairs({1, 5, #stream}) do
+            local d, msgs = amf.rtmp(), {}
+            for i = 1, #stream, step do
+                local got, err = d:feed(stream:sub(i, i + step - 1))
+                assert.equals(nil, err)
+                for _, msg in ipairs(got) do
+                    msgs[#msgs + 1] = msg
+                end
+            end
+            assert.equals(0, d:pending())
+            assert.equals(4096, d:chunk_size())
+
+            assert.equals(4, #msgs)
+            assert.same({'connect', 1, {app=('live'):rep(50)}}, msgs[1].values)
+            assert.equals(3, msgs[1].csid)
+            assert.equals('\0\0\16\0', msgs[2].payload)
+            assert.same({'publish', 'cam'}, msgs[3].values)
+            assert.equals(40, msgs[3].timestamp)
+            assert.equals(1, msgs[3].stream)
+            assert.equals('video', msgs[4].payload)
+        end
+    end)
+
+    it('should fail on a chunk without header', function()
+        local got, err = amf.rtmp():feed('\195abc')
+        assert.same({}, got)
+        assert.equals('chunk stream without message header', err)
+    end)
+
+    it('should limit the message size', function()
+        local payload = ('x'):rep(1000)
+        local got, err = amf.rtmp({max_message=999}):feed(chunks(5, 0, 9, payload, 128))
+        assert.same({}, got)
+        assert.equals('message too large', err)
+
+        local d = amf.rtmp({max_message=1000})
+        for _ = 1, 2 do
+            got, err = d:feed(chunks(5, 0, 9, payload, 128))
+            assert.equals(nil, err)
+            assert.equals(payload, got[1].payload)
+        end
+    end)
+end)
+
+describe('flv', function()
+    local function u24(n)
+        return string.char(math.floor(n / 65536) % 256, math.floor(n / 256) % 256, n % 256)
+    end
+
+    local function tag(typ, ts, data)
+        return string.char(typ) .. u24(#data) .. u24(ts) .. '\0\0\0\0' .. data .. '\0' .. u24(#data + 11)
+    end
+
+    local times, positions = {}, {}
+    for i = 1, 100 do
+        times[i] = (i - 1) * 2
+        positions[i] = 1000 + i * 100
+    end
+
+    local meta = {duration=200, width=640, keyframes={times=times, filepositions=positions}}
+    local flv = 'FLV\1\5\0\0\0\9\0\0\0\0' .. tag(18, 0, amf.encode(0, 'onMetaData') .. amf.encode(0, meta))
+                .. tag(9, 0, 'video') .. tag(8, 40, 'audio')
+
+    it('should read tags and keyframes', function()
+        local tags = {}
+        for pos, typ, size, ts in amf.flv_tags(flv) do
+            tags[#tags + 1] = {typ, size, ts}
+        end
+        assert.same({18, 9, 8}, {tags[1][1], tags[2][1], tags[3][1]})
+        assert.same({5, 40}, {tags[3][2], tags[3][3]})
+
+        local t, fp = amf.flv_keyframes(flv)
+        assert.equals(100, #t)
+        assert.equals(198, t[100])
+        assert.equals(11000, fp[100])
+        assert.equals(4, t:find(7))
+        assert.equals(0, t:find(-1))
+    end)
+
+    it('should skip avmplus values', function()
+        local body = amf.encode(0, meta)
+        local skip = body:byte(1) == 8 and 5 or 1
+        body = body:sub(1, skip) .. '\0\5extra\17\10\11\1\3a\6\7abc\1' .. body:sub(skip + 1)
+
+        local t, fp = amf.flv_keyframes('FLV\1\5\0\0\0\9\0\0\0\0' .. tag(18, 0, amf.encode(0, 'onMetaData') .. body))
+        assert.equals(100, #t)
+        assert.equals(11000, fp[100])
+    end)
+
+    it('should rewrite onMetaData and move filepositions', function()
+        meta.title = ('x'):rep(100)
+        local out = amf.flv_rewrite(flv, meta)
+        local delta = #out - #flv
+
+        local t, fp = amf.flv_keyframes(out)
+        assert.equals(100, #t)
+        assert.equals(1100 + delta, fp[1])
+
+        local n = 0
+        for pos, typ, size in amf.flv_tags(out) do
+            n = n + 1
+        end
+        assert.equals(3, n)
+        assert.equals(meta.title, amf.decode(0, out, 24 + 13).title)
+    end)
+
+    it('should fail on meta that does not encode', function()
+        local deep = {}
+        for _ = 1, 10000 do
+            deep = {deep}
+        end
+
+        local ok, err = pcall(amf.flv_rewrite, flv, {deep=deep})
+        assert.equals(false, ok)
+        assert.equals(true, err:find('nested too deep') ~= nil)
+        collectgarbage()
+    end)
+end)
+
+describe('ffi', function()
+    local amf_ffi = require 'amf_ffi'
+
+    it('should write and read back frames', function()
+        local b = amf_ffi.buffer()
+        b:write_uchar(3)
+        b:write_str('id')
+        b:write_u29(300000)
+        b:write_u29(0x1fffffff)
+        b:write_double(1.5)
+        b:write_int32(-559038737)
+        b:write_ushort(513)
+        b:encode(0, {x=1})
+
+        local s = b:raw_string()
+        assert.equals('\3\0\2id\146\167\96\255\255\255\255\63\248\0\0\0\0\0\0\222\173\190\239\2\1', s:sub(1, 26))
+        assert.equals(#s, b:length())
+
+        local c = amf_ffi.cursor(s)
+        assert.same({3, 'id', 300000, 0x1fffffff, 1.5, -559038737, 513},
+                    {c:read_uchar(), c:read_str(), c:read_u29(), c:read_u29(), c:read_double(), c:read_int32(), c:read_ushort()})
+        assert.same({x=1}, c:decode(0))
+        assert.equals(0, c:left())
+    end)
+
+    it('should skip values and stop at eof', function()
+        local s = amf.encode(3, {1, 2, 3}) .. amf.encode(3, 'abc')
+        local c = amf_ffi.cursor(s)
+        assert.equals(#amf.encode(3, {1, 2, 3}), c:skip(3))
+        assert.equals('abc', c:decode(3))
+
+        local v, err = c:read_uint32()
+        assert.equals(nil, v)
+        assert.equals('eof', err)
+        assert.equals(#s, c:pos())
+    end)
+
+    -- plain lua runs the fallback, the cdef only loads under luajit
+    if not amf_ffi.ffi then
+        pending('the cdef of amf_cursor needs luajit')
+        return
+    end
+
+    it('should lay out amf_cursor like the library', function()
+        local ffi = require 'ffi'
+        local C = ffi.load(package.searchpath('amf_codec', package.cpath))
+        assert.equals(tonumber(C.amf_ffi_cursor_size()), ffi.sizeof('amf_cursor'))
+
+        local s = object_fixture('amf3-complex-array-collection.bin')
+        local c = ffi.new('amf_cursor')
+        C.amf_ffi_cursor_init(c, s, #s)
+        assert.equals(#s, tonumber(C.amf_ffi_skip(c, 3)))
+        assert.equals(0, c.err)
+    end)
+end)
+
+describe('limits', function()
+    it('should stop hostile headers and deep nesting', function()
+        local v, err = amf.decode(3, '\9\255\255\255\255\1')
+        assert.equals(nil, v)
+        assert.equals('eof', err)
+
+        v, err = amf.decode(3, string.rep('\9\3\1', 2100) .. '\1')
+        assert.equals(nil, v)
+        assert.equals('nested too deep', err)
+    end)
+
+    it('should enforce the limits given', function()
+        local function err_of(v, err) return v == nil and err end
+        local arr = {}
+        for i = 1, 100 do arr[i] = i end
+
+        local nested = {{{{1}}}}
+        assert.same(nested, amf.decode(3, amf.encode(3, nested), 0, nil, {depth=4}))
+        assert.equals('nested too deep', err_of(amf.decode(3, amf.encode(3, nested), 0, nil, {depth=3})))
+        assert.equals('too many elements', err_of(amf.decode(0, amf.encode(0, arr), 0, nil, {elements=50})))
+        local rows = {}
+        for i = 1, 10 do rows[i] = {i, i} end
+        assert.equals('too many elements', err_of(amf.decode(3, amf.encode(3, rows), 0, nil, {elements=15})))
+        assert.same(rows, amf.decode(3, amf.encode(3, rows), 0, nil, {elements=30}))
+        assert.equals('string too long', err_of(amf.decode(3, amf.encode(3, string.rep('x', 100)), 0, nil, {string=10})))
+
+        local lim = amf.limits{alloc=1000}
+        assert.equals('allocation limit exceeded', err_of(amf.decode(3, amf.encode(3, arr), 0, nil, lim)))
+        assert.same({1, 2}, amf.decode(3, amf.encode(3, {1, 2}), 0, nil, lim))
+    end)
+end)
+
+describe('nesting', function()
+    local function chain(n, last)
+        local t = last
+        for _ = 1, n do t = {c = t} end
+        return t
+    end
+
+    local function depth(t)
+        local n = 0
+        while type(t) == 'table' do t, n = t.c, n + 1 end
+        return n
+    end
+
+    it('should round trip values 2000 tables deep', function()
+        local t = chain(2000, 1)
+        for _, ver in ipairs{0, 3} do
+            local v, err = amf.decode(ver, amf.encode(ver, t))
+            assert.equals(nil, err)
+            assert.equals(2000, depth(v))
+        end
+    end)
+
+    it('should fail deeper values without a crash', function()
+        local ok, err = pcall(amf.encode, 3, chain(5000, 1))
+        assert.equals(false, ok)
+        assert.equals(1, select(2, err:gsub('nested too deep', '')))
+
+        local v, derr = amf.decode(3, string.rep('\9\3\1', 3000) .. '\1')
+        assert.equals(nil, v)
+        assert.equals('nested too deep', derr)
+    end)
+end)
+
+describe('batch', function()
+    it('should re-encode values in input order', function()
+        local bufs = {}
+        for i, bin in ipairs({'amf3-graph-member.bin', 'amf3-trait-ref.bin', 'amf3-string-ref.bin',
+                              'amf3-object-ref.bin', 'amf3-mixed-array.bin'}) do
+            bufs[i] = object_fixture(bin)
+        end
+        bufs[#bufs + 1] = 'garbage'
+
+        local out, errs = amf.batch(bufs, {threads=3})
+        for i = 1, #bufs - 1 do
+            assert.equals(bufs[i], out[i])
+            assert.equals(nil, errs[i])
+        end
+        assert.equals(false, out[#bufs])
+        assert.equals('unsupported type', errs[#bufs])
+    end)
+
+    it('should key mixed arrays from 1 like convert', function()
+        local a3 = amf.encode(3, {10, 20, x=1})
+        local out = amf.batch({a3}, {from=3, to=0})
+        local ret = decode_amf(0, out[1])
+        assert.same({['1']=10, ['2']=20, x=1}, ret)
+        assert.same(decode_amf(0, (amf.convert(3, 0, a3))), ret)
+        assert.same(decode_amf(0, amf.parse(3, a3, 0, #a3):encode(0)), ret)
+    end)
+
+    it('should transcode messages', function()
+        local bufs = {request_fixture('commandMessage.bin'), request_fixture('multiple-simple-request.bin')}
+        for _, ver in ipairs({0, 3}) do
+            local out, errs = amf.batch(bufs, {msg=true, to=ver})
+            assert.equals(nil, next(errs))
+
+            for i, buf in ipairs(bufs) do
+                local msg, full = amf.decode_msg(out[i]), amf.decode_msg(buf)
+                assert.equals(ver, msg[1])
+                assert.equals(#full[3], #msg[3])
+                -- amf0 typed objects come back with their alias
+                if ver == 3 then
+                    assert.same(full[3], msg[3])
+                end
+            end
+        end
+    end)
+end)
+
+describe('trace', function()
+    it('should record the values of a failing decode', function()
+        if not amf.trace(true, 16) then return end
+
+        local buf = amf.encode(3, {'foo', 'foo', 1})
+        amf.trace_dump(true)
+
+        local ret, err = amf.decode(3, buf:sub(1, -2))
+        amf.trace(false)
+        assert.equals('eof', err)
+
+        local events = amf.trace_dump(true)
+        assert.equals(4, #events)
+        -- the first 'foo', its reference, the truncated integer and array
+        assert.equals(6, events[1].marker)
+        assert.equals(false, events[1].ref)
+        assert.equals(true, events[2].ref)
+        assert.equals(4, events[3].marker)
+        assert.equals(true, events[3].err)
+        assert.equals(9, events[4].marker)
+        assert.equals(true, events[4].err)
+        assert.equals(0, events[4].offset)
+        assert.equals(#buf - 1, events[4].len)
+    end)
+end)
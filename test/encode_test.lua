@@ -132,6 +132,27 @@ describe('amf3', function()
         assert_encoded(3, {a, b, a, b}, 'amf3-array-ref.bin')
     end)
 
+    it('should serialize blazeds small messages', function()
+        local body = request_fixture('blaze-response.bin'):sub(28)
+        local msg = amf.decode(3, body)
+        assert.equals(body, amf.encode(3, msg))
+
+        local cmd = {__amf_alias__='DSC', operation=5, correlationId='abc', headers={DSId='nil'}}
+        local ret = amf.decode(3, amf.encode(3, {cmd, cmd}))
+        assert.equals(ret[1], ret[2])
+        assert.equals(5, ret[1].operation)
+        assert.equals('abc', ret[1].correlationId)
+        assert.equals('nil', ret[1].headers.DSId)
+    end)
+
+    it('should write malformed uuids of small messages as strings', function()
+        for _, id in ipairs({'0123456789ABCDEF0123456789ABCDEF0123', '01234567-89AB-CDEF-0123-456789ABCDE-',
+                             '0123456-789AB-CDEF-0123-456789ABCDEF'}) do
+            local ret = amf.decode(3, amf.encode(3, {__amf_alias__='DSK', messageId=id}))
+            assert.equals(id, ret.messageId)
+        end
+    end)
+
     it('should serialize a deep object graph with circular references', function() 
         local c1 = {}
         local c2 = {}
@@ -145,3 +166,250 @@ describe('amf3', function()
     end)
 end)
 
+
+describe('remoting', function()
+    local function u32(s, i)
+        local a, b, c, d = s:byte(i, i + 3)
+        return ((a * 256 + b) * 256 + c) * 256 + d
+    end
+
+    it('should write the content length of bodies', function()
+        local value = {'foo', {bar=1}}
+        local buf = amf.encode_msg({3, nil, {{'/1/onResult', 'null', value}}})
+
+        -- version, counts, target and response uris come first
+        local len = u32(buf, 26)
+        assert.equals(#buf - 29, len)
+        assert.equals('\17' .. amf.encode(3, value), buf:sub(30))
+    end)
+end)
+
+describe('options', function()
+    it('should write shared tables in full without object references', function()
+        local a = {1, 2, 3}
+        local b = {'a', 'b', 'c'}
+
+        for _, ver in ipairs({0, 3}) do
+            local buf = amf.encode(ver, {a, b, a, b}, {object_refs=false})
+            local ret = amf.decode(ver, buf)
+            assert.same({a, b, a, b}, ret)
+            assert.equals(false, ret[1] == ret[3])
+        end
+
+        local pair = {1, 2}
+        assert.equals('\9\5\1' .. ('\9\5\1\4\1\4\2'):rep(2),
+                      amf.encode(3, {pair, pair}, {object_refs=false}))
+
+        local msg = {__amf_alias__='DSK', body='x', messageId='01234567-89AB-CDEF-0123-456789ABCDEF'}
+        local ret = amf.decode(3, amf.encode(3, {msg, msg}, {object_refs=false}))
+        assert.equals(msg.messageId, ret[2].messageId)
+    end)
+
+    it('should write strings in full without string references', function()
+        local buf = amf.encode(3, {'foo', 'foo', {foo='foo'}}, {string_refs=false})
+        local _, n = buf:gsub('foo', '')
+        assert.equals(4, n)
+        assert.same({'foo', 'foo', {foo='foo'}}, amf.decode(3, buf))
+    end)
+
+    it('should fail on cycles at max_depth', function()
+        local cycle = {}
+        cycle.self = cycle
+
+        for _, ver in ipairs({0, 3}) do
+            local ok, err = pcall(amf.encode, ver, cycle, {object_refs=false})
+            assert.equals(false, ok)
+            assert.equals(true, err:find('nested too deep') ~= nil)
+            assert.equals(false, pcall(amf.encode, ver, {{{}}}, {max_depth=2}))
+        end
+    end)
+end)
+
+describe('mixed array', function()
+    it('should write extra keys as the associative part of an amf3 array', function()
+        assert.equals('\9\7\11total\4\6\1\4\1\4\2\4\3',
+                      amf.encode(3, {1, 2, 3, total=6}))
+
+        local rows = {}
+        for i = 1, 100 do
+            rows[i] = {id=i}
+        end
+        rows.total = 100
+        rows[1000] = 'far'
+
+        local ret = amf.decode(3, amf.encode(3, rows))
+        assert.equals(100, #ret)
+        assert.equals(100, ret.total)
+        assert.equals('far', ret['1000'])
+        assert.same({id=100}, ret[100])
+    end)
+
+    it('should read the associative part of an amf3 array', function()
+        local ret = amf.decode(3, object_fixture('amf3-associative-array.bin'))
+        assert.same({'bar1', 'bar2', 'bar3', asdf='fdsa', foo='bar', ['42']='bar'}, ret)
+    end)
+
+    it('should keep tables with holes or an alias as objects', function()
+        assert.equals(10, amf.encode(3, {1, nil, 3}):byte(1))
+        assert.equals(10, amf.encode(3, {1, 2, __amf_alias__='Pair'}):byte(1))
+    end)
+end)
+
+describe('encoder', function()
+    it('should encode like encode and encode_msg on every call', function()
+        local shared = {x='foo'}
+        local v = {shared, 'foo', shared}
+        local msg = {3, {{'h', false, {1, 'foo'}}}, {{'t', 'r', v}, {'t2', 'r2', 'foo'}}}
+
+        for _, ver in ipairs({0, 3}) do
+            local enc = amf.encoder({version=ver})
+            for _ = 1, 3 do
+                assert.equals(amf.encode(ver, v), enc:encode(v))
+                assert.equals(amf.encode_msg(msg), enc:encode_msg(msg))
+            end
+        end
+
+        local enc = amf.encoder({object_refs=false, string_refs=false})
+        assert.equals(amf.encode(3, v, {object_refs=false, string_refs=false}), enc:encode(v))
+    end)
+
+    it('should start over after an encode that failed', function()
+        local enc = amf.encoder({max_depth=3})
+        local shared = {x='foo'}
+
+        assert.equals(false, pcall(enc.encode, enc, {shared, 'foo', {{{{1}}}}}))
+        assert.equals(amf.encode(3, {shared, 'foo', shared}), enc:encode({shared, 'foo', shared}))
+    end)
+end)
+
+describe('template', function()
+    local slot = amf.slot
+
+    it('should render the static parts unchanged', function()
+        local tpl = amf.template(3, {'foo', 1, 'bar'})
+        assert.equals(amf.encode(3, {'foo', 1, 'bar'}), tpl:render({}))
+    end)
+
+    it('should render slot values', function()
+        local tpl = amf.template(3, {'foo', slot('v'), 3.5})
+        assert.equals(amf.encode(3, {'foo', 'bar', 3.5}), tpl:render({v='bar'}))
+        assert.equals(amf.encode(3, {'foo', 42, 3.5}), tpl:render({v=42}))
+
+        tpl = amf.template(0, {'foo', slot('v')})
+        assert.equals(amf.encode(0, {'foo', 'bar'}), tpl:render({v='bar'}))
+    end)
+
+    it('should keep references valid around slots', function()
+        local o = {id=1}
+        local tpl = amf.template(3, {'foo', o, slot('a'), 'foo', o, {id=2}, slot('b'), 'bar', 'bar', {id=3}})
+        local ret = amf.decode(3, tpl:render({a={'bar', {id=4}}, b={id=5, name='foo'}}))
+
+        assert.same({'foo', {id=1}, {'bar', {id=4}}, 'foo', {id=1}, {id=2},
+                     {id=5, name='foo'}, 'bar', 'bar', {id=3}}, ret)
+        assert.equals(ret[2], ret[5])
+    end)
+
+    it('should render remoting messages', function()
+        local ack = {__amf_alias__='DSK', correlationId=slot('cid'), timestamp=slot('ts'), body=slot('body')}
+        local tpl = amf.template_msg({3, nil, {{slot('target'), 'null', ack}}})
+
+        local buf = tpl:render({target='/1/onResult', cid='abc', ts=1306275431838, body={'ok'}})
+        local msg = amf.decode_msg(buf, 0, #buf, {lazy_bodies=true})
+        assert.equals(#buf, msg[3][1].offset + msg[3][1].length)
+
+        msg = amf.decode_msg(buf)
+        local body = msg[3][1]
+
+        assert.equals('/1/onResult', body[1])
+        assert.equals('null', body[2])
+        assert.equals('DSK', body[3].__amf_alias__)
+        assert.equals('abc', body[3].correlationId)
+        assert.equals(1306275431838, body[3].timestamp)
+        assert.same({'ok'}, body[3].body)
+    end)
+
+    it('should refuse slots outside of templates', function()
+        assert.has_error(function() amf.encode(3, {slot('v')}) end)
+    end)
+end)
+
+describe('msg_writer', function()
+    local bodies = {
+        {'/1/onResult', 'null', {'foo', {bar=1}}},
+        {'/2/onResult', 'null', 'baz'},
+    }
+
+    it('should stream the same bytes as encode_msg', function()
+        local chunks = {}
+        local w = amf.msg_writer(function(chunk) chunks[#chunks + 1] = chunk end)
+
+        w:begin(3, nil, #bodies)
+        for _, b in ipairs(bodies) do
+            assert.is_false(w:done())
+            w:body(b[1], b[2], b[3])
+        end
+        assert.is_true(w:done())
+
+        assert.equals(3, #chunks)
+        assert.equals(amf.encode_msg({3, nil, bodies}), table.concat(chunks))
+    end)
+
+    it('should return the pieces without a sink', function()
+        local w = amf.msg_writer()
+        local buf = w:begin(0, {{'h', false, 1}}, 1) .. w:body('/1', 'null', 'baz')
+        assert.equals(amf.encode_msg({0, {{'h', false, 1}}, {{'/1', 'null', 'baz'}}}), buf)
+        assert.has_error(function() w:body('/2', 'null', 'baz') end)
+    end)
+end)
+
+describe('stats', function()
+    it('should count calls, bytes, markers and references', function()
+        amf.reset_stats()
+        local st = amf.stats()
+        if not st.enabled then return end
+        assert.equals(0, st.encode_calls)
+
+        local buf = amf.encode(3, {'foo', 'foo', {a=1}})
+        amf.decode(3, buf)
+        amf.decode(3, '\255')
+
+        st = amf.stats()
+        assert.equals(1, st.encode_calls)
+        assert.equals(2, st.decode_calls)
+        assert.equals(#buf, st.bytes_out)
+        assert.equals(#buf, st.bytes_in)
+        assert.equals(2, st.encoded.amf3[6])    -- strings
+        assert.equals(1, st.decoded.amf3[10])   -- objects
+        assert.equals(1, st.refs.string.hits)
+        assert.equals(1, st.errors['unsupported type'])
+        assert.equals(true, st.buf_reallocs > 0)
+
+        amf.reset_stats()
+        assert.equals(0, amf.stats().encode_calls)
+    end)
+
+    it('should keep latency histograms when switched on', function()
+        amf.reset_stats()
+        if not amf.latency(true) then return end
+
+        local buf = amf.encode(0, {1, 2, 3})
+        amf.decode(0, buf)
+        amf.decode(0, buf)
+        amf.encode_msg({version = 3, headers = {}, bodies = {}})
+        amf.latency(false)
+        amf.encode(0, 1)
+
+        local lat = amf.stats().latency
+        assert.equals(1, lat.encode.calls)
+        assert.equals(2, lat.decode.calls)
+        assert.equals(1, lat.encode_msg.calls)
+        assert.equals(0, lat.decode_msg.calls)
+
+        local n, top = 0, 0
+        for le, count in pairs(lat.decode.buckets) do
+            n, top = n + count, math.max(top, le)
+        end
+        assert.equals(2, n)
+        assert.equals(true, top > lat.decode.max_ns)
+    end)
+end)